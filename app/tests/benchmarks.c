@@ -31,6 +31,7 @@
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/timer.h>
 #include <platform.h>
 
 const size_t BUFSIZE = (1024*1024);
@@ -153,6 +154,46 @@ __NO_INLINE static void bench_memcpy(void)
     free(buf);
 }
 
+#define TIMER_BENCH_COUNT 100000
+
+static enum handler_return bench_timer_callback(struct timer *t, lk_time_t now, void *arg)
+{
+    return INT_NO_RESCHEDULE;
+}
+
+__NO_INLINE static void bench_timers(void)
+{
+    timer_t *timers = malloc(sizeof(timer_t) * TIMER_BENCH_COUNT);
+    if (!timers) {
+        printf("failed to allocate timers\n");
+        return;
+    }
+
+    for (uint i = 0; i < TIMER_BENCH_COUNT; i++)
+        timer_initialize(&timers[i]);
+
+    /* spread the deadlines out over a minute, far enough out to not fire during the test */
+    uint count = arch_cycle_count();
+    for (uint i = 0; i < TIMER_BENCH_COUNT; i++) {
+        timer_set_oneshot(&timers[i], 1000 + rand() % 60000, &bench_timer_callback, NULL);
+    }
+    count = arch_cycle_count() - count;
+
+    printf("took %u cycles to arm %u timers, %u cycles per timer\n",
+           count, TIMER_BENCH_COUNT, count / TIMER_BENCH_COUNT);
+
+    count = arch_cycle_count();
+    for (uint i = 0; i < TIMER_BENCH_COUNT; i++) {
+        timer_cancel(&timers[i]);
+    }
+    count = arch_cycle_count() - count;
+
+    printf("took %u cycles to cancel %u timers, %u cycles per timer\n",
+           count, TIMER_BENCH_COUNT, count / TIMER_BENCH_COUNT);
+
+    free(timers);
+}
+
 #if ARCH_ARM
 __NO_INLINE static void arm_bench_cset_stm(void)
 {
@@ -259,6 +300,8 @@ void benchmarks(void)
     bench_cset_uint64_t();
     bench_cset_wide();
 
+    bench_timers();
+
 #if ARCH_ARM
     arm_bench_cset_stm();
 
@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2026 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <rand.h>
+#include <lib/console.h>
+#include <platform.h>
+#include <debug.h>
+
+#if WITH_LIB_FS_EXT2
+#include <lib/bio.h>
+#include <lib/fs.h>
+
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+
+/*
+ * Builds an ext4 image in memory, the way mkfs.ext4 would lay out a small
+ * flex_bg/64bit filesystem, exposes it as a membdev and reads a large file
+ * back through the ext2 driver. The file is split into several extents
+ * under an index node, with one uninitialized extent and a gap on disk
+ * between each of them.
+ */
+#define EXT4_TEST_BLOCK_SIZE    4096
+#define EXT4_TEST_GROUP_BLOCKS  1024 // 4MB groups, so small images span several
+#define EXT4_TEST_GROUP_INODES  16
+#define EXT4_TEST_INODE_SIZE    256
+#define EXT4_TEST_EXTENT_BLOCKS 256  // 1MB per extent
+#define EXT4_TEST_FILE_INODE    12
+#define EXT4_TEST_TAIL          100  // file ends this far short of a block
+#define EXT4_TEST_SEED          0x4e78a5c1
+#define EXT4_TEST_CHUNK         (64 * 1024)
+#define EXT4_TEST_RANDOM_READS  256
+#define EXT4_TEST_DEFAULT_MB    8    // spans several block groups and extents
+
+static void put16(uint8_t *p, uint16_t val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t val)
+{
+    put16(p, val);
+    put16(p + 2, val >> 16);
+}
+
+/* the expected contents of a file word, zero inside the uninitialized extent */
+static uint32_t ext4_test_word(uint64_t offset)
+{
+    uint32_t file_block = offset / EXT4_TEST_BLOCK_SIZE;
+    if (file_block / EXT4_TEST_EXTENT_BLOCKS == 1)
+        return 0;
+    return (uint32_t)(offset / 4) ^ EXT4_TEST_SEED;
+}
+
+static uint8_t *ext4_test_inode(uint8_t *image, uint ino)
+{
+    uint group = (ino - 1) / EXT4_TEST_GROUP_INODES;
+    uint index = (ino - 1) % EXT4_TEST_GROUP_INODES;
+
+    /* flex_bg: every group's inode table sits in group 0, starting at block 2 */
+    return image + (2 + group) * EXT4_TEST_BLOCK_SIZE + index * EXT4_TEST_INODE_SIZE;
+}
+
+static void ext4_test_extent_header(uint8_t *p, uint entries, uint max, uint depth)
+{
+    put16(p + 0, 0xf30a);
+    put16(p + 2, entries);
+    put16(p + 4, max);
+    put16(p + 6, depth);
+    put32(p + 8, 0);
+}
+
+static size_t ext4_test_image_size(uint file_blocks, uint *groups)
+{
+    uint extents = DIV_ROUND_UP(file_blocks, EXT4_TEST_EXTENT_BLOCKS);
+
+    /* superblock, descriptors, root dir, extent leaf, data and gaps, plus an
+     * inode table per group, which may push the image into another group */
+    uint blocks;
+    uint count = 1;
+    do {
+        *groups = count;
+        blocks = 4 + file_blocks + extents + *groups;
+        count = DIV_ROUND_UP(blocks, EXT4_TEST_GROUP_BLOCKS);
+    } while (count != *groups);
+
+    return (size_t)blocks * EXT4_TEST_BLOCK_SIZE;
+}
+
+static void ext4_test_build(uint8_t *image, size_t image_size, uint groups, uint file_blocks, uint64_t file_size)
+{
+    uint blocks = image_size / EXT4_TEST_BLOCK_SIZE;
+    uint root_block = 2 + groups;
+    uint leaf_block = root_block + 1;
+    uint data_block = leaf_block + 1;
+
+    memset(image, 0, data_block * EXT4_TEST_BLOCK_SIZE);
+
+    /* superblock */
+    uint8_t *sb = image + 1024;
+    put32(sb + 0x00, groups * EXT4_TEST_GROUP_INODES);  // s_inodes_count
+    put32(sb + 0x04, blocks);                           // s_blocks_count
+    put32(sb + 0x14, 0);                                // s_first_data_block
+    put32(sb + 0x18, 2);                                // s_log_block_size
+    put32(sb + 0x1c, 2);                                // s_log_frag_size
+    put32(sb + 0x20, EXT4_TEST_GROUP_BLOCKS);           // s_blocks_per_group
+    put32(sb + 0x24, EXT4_TEST_GROUP_BLOCKS);           // s_frags_per_group
+    put32(sb + 0x28, EXT4_TEST_GROUP_INODES);           // s_inodes_per_group
+    put16(sb + 0x38, 0xef53);                           // s_magic
+    put16(sb + 0x3a, 1);                                // s_state
+    put32(sb + 0x4c, 1);                                // s_rev_level
+    put32(sb + 0x54, 11);                               // s_first_ino
+    put16(sb + 0x58, EXT4_TEST_INODE_SIZE);             // s_inode_size
+    put32(sb + 0x60, 0x02c2);                           // filetype, extents, 64bit, flex_bg
+    put32(sb + 0x64, 0x0003);                           // sparse_super, large_file
+    put16(sb + 0xfe, 64);                               // s_desc_size
+    sb[0x174] = 4;                                      // s_log_groups_per_flex
+
+    /* 64 byte group descriptors */
+    for (uint i = 0; i < groups; i++) {
+        uint8_t *gd = image + EXT4_TEST_BLOCK_SIZE + i * 64;
+        put32(gd + 0x08, 2 + i);                        // bg_inode_table
+    }
+
+    /* root directory, a single extent */
+    uint8_t *inode = ext4_test_inode(image, 2);
+    put16(inode + 0x00, 0040755);
+    put32(inode + 0x04, EXT4_TEST_BLOCK_SIZE);
+    put16(inode + 0x1a, 2);
+    put32(inode + 0x20, 0x80000);                       // EXT4_EXTENTS_FL
+    ext4_test_extent_header(inode + 0x28, 1, 4, 0);
+    put32(inode + 0x34, 0);
+    put16(inode + 0x38, 1);
+    put32(inode + 0x3c, root_block);
+
+    uint8_t *dir = image + root_block * EXT4_TEST_BLOCK_SIZE;
+    put32(dir + 0, 2);
+    put16(dir + 4, 12);
+    dir[6] = 1;
+    dir[7] = 2;
+    memcpy(dir + 8, ".", 1);
+    put32(dir + 12, 2);
+    put16(dir + 16, 12);
+    dir[18] = 2;
+    dir[19] = 2;
+    memcpy(dir + 20, "..", 2);
+    put32(dir + 24, EXT4_TEST_FILE_INODE);
+    put16(dir + 28, EXT4_TEST_BLOCK_SIZE - 24);
+    dir[30] = 3;
+    dir[31] = 1;
+    memcpy(dir + 32, "big", 3);
+
+    /* the big file, a depth 1 tree pointing at one leaf */
+    inode = ext4_test_inode(image, EXT4_TEST_FILE_INODE);
+    put16(inode + 0x00, 0100644);
+    put32(inode + 0x04, (uint32_t)file_size);
+    put16(inode + 0x1a, 1);
+    put32(inode + 0x20, 0x80000);
+    ext4_test_extent_header(inode + 0x28, 1, 4, 1);
+    put32(inode + 0x34, 0);
+    put32(inode + 0x38, leaf_block);
+    put32(inode + 0x6c, (uint32_t)(file_size >> 32));   // i_size_high
+
+    uint extents = DIV_ROUND_UP(file_blocks, EXT4_TEST_EXTENT_BLOCKS);
+    uint8_t *leaf = image + leaf_block * EXT4_TEST_BLOCK_SIZE;
+    ext4_test_extent_header(leaf, extents, (EXT4_TEST_BLOCK_SIZE - 12) / 12, 0);
+
+    uint phys = data_block;
+    for (uint i = 0; i < extents; i++) {
+        uint first = i * EXT4_TEST_EXTENT_BLOCKS;
+        uint len = MIN(EXT4_TEST_EXTENT_BLOCKS, file_blocks - first);
+        uint8_t *ex = leaf + 12 + i * 12;
+
+        put32(ex + 0, first);
+        put16(ex + 4, (i == 1) ? len + 32768 : len);    // the second one is uninitialized
+        put16(ex + 6, 0);
+        put32(ex + 8, phys);
+
+        /* fill the data, garbage in the uninitialized extent */
+        for (uint b = 0; b < len; b++) {
+            uint32_t *data = (uint32_t *)(image + (size_t)(phys + b) * EXT4_TEST_BLOCK_SIZE);
+            uint64_t offset = (uint64_t)(first + b) * EXT4_TEST_BLOCK_SIZE;
+            for (uint w = 0; w < EXT4_TEST_BLOCK_SIZE / 4; w++)
+                data[w] = (i == 1) ? 0xdeadbeef : ext4_test_word(offset + w * 4);
+        }
+
+        /* leave a block free so extents are never physically adjacent */
+        memset(image + (size_t)(phys + len) * EXT4_TEST_BLOCK_SIZE, 0xff, EXT4_TEST_BLOCK_SIZE);
+        phys += len + 1;
+    }
+}
+
+static bool ext4_test_verify(const uint8_t *buf, uint64_t offset, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        uint64_t pos = offset + i;
+        uint8_t expected = ext4_test_word(pos & ~3ULL) >> ((pos & 3) * 8);
+        if (buf[i] != expected) {
+            printf("mismatch at file offset %llu: 0x%02x, expected 0x%02x\n", pos, buf[i], expected);
+            return false;
+        }
+    }
+    return true;
+}
+
+static int ext4_tests(int argc, const cmd_args *argv)
+{
+    uint size_mb = (argc >= 2) ? argv[1].u : EXT4_TEST_DEFAULT_MB;
+    uint file_blocks = size_mb * (1024 * 1024 / EXT4_TEST_BLOCK_SIZE);
+    uint64_t file_size = (uint64_t)file_blocks * EXT4_TEST_BLOCK_SIZE - EXT4_TEST_TAIL;
+    uint groups;
+    int err;
+
+    if (file_blocks == 0) {
+        printf("usage: %s [file size in MB]\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    size_t image_size = ext4_test_image_size(file_blocks, &groups);
+    if (groups > EXT4_TEST_BLOCK_SIZE / 64) {
+        printf("file too large for a single descriptor block\n");
+        return ERR_TOO_BIG;
+    }
+    if (DIV_ROUND_UP(file_blocks, EXT4_TEST_EXTENT_BLOCKS) > (EXT4_TEST_BLOCK_SIZE - 12) / 12) {
+        printf("file too large for a single extent leaf\n");
+        return ERR_TOO_BIG;
+    }
+
+    printf("ext4 test: %u MB file, %zu byte image, %u groups\n", size_mb, image_size, groups);
+
+    uint8_t *image;
+#if WITH_KERNEL_VM
+    err = vmm_alloc(vmm_get_kernel_aspace(), "ext4 test", image_size, (void **)&image, PAGE_SIZE_SHIFT,
+                    0, ARCH_MMU_FLAG_PERM_NO_EXECUTE);
+    if (err < 0)
+        image = NULL;
+#else
+    image = malloc(image_size);
+#endif
+    uint8_t *buf = malloc(EXT4_TEST_CHUNK);
+    if (!image || !buf) {
+        printf("error allocating %zu byte image\n", image_size);
+        err = ERR_NO_MEMORY;
+        goto out_free;
+    }
+
+    ext4_test_build(image, image_size, groups, file_blocks, file_size);
+
+    create_membdev("ext4test", image, image_size);
+    err = fs_mount("/ext4test", "ext2", "ext4test");
+    if (err < 0) {
+        printf("error %d mounting image\n", err);
+        goto out_dev;
+    }
+
+    filehandle *handle;
+    err = fs_open_file("/ext4test/big", &handle);
+    if (err < 0) {
+        printf("error %d opening file\n", err);
+        goto out_unmount;
+    }
+
+    struct file_stat stat;
+    fs_stat_file(handle, &stat);
+    if (stat.size != file_size) {
+        printf("file size %llu, expected %llu\n", stat.size, file_size);
+        err = ERR_GENERIC;
+        goto out_close;
+    }
+
+    /* stream the whole thing, timing just the reads */
+    lk_bigtime_t t = 0;
+    for (uint64_t offset = 0; offset < file_size; offset += EXT4_TEST_CHUNK) {
+        size_t len = MIN(EXT4_TEST_CHUNK, file_size - offset);
+        lk_bigtime_t start = current_time_hires();
+        ssize_t read = fs_read_file(handle, buf, offset, EXT4_TEST_CHUNK);
+        t += current_time_hires() - start;
+        if (read != (ssize_t)len) {
+            printf("read at %llu returned %ld, expected %zu\n", offset, read, len);
+            err = ERR_IO;
+            goto out_close;
+        }
+        if (!ext4_test_verify(buf, offset, len)) {
+            err = ERR_GENERIC;
+            goto out_close;
+        }
+    }
+    printf("read %llu bytes in %llu us, %llu KB/s\n", file_size, t,
+           t ? file_size * 1000000 / 1024 / t : 0);
+
+    /* unaligned reads, some straddling extent boundaries */
+    for (uint i = 0; i < EXT4_TEST_RANDOM_READS; i++) {
+        uint64_t offset = ((uint64_t)rand() * EXT4_TEST_BLOCK_SIZE + rand()) % file_size;
+        if (i % 4 == 0) {
+            uint64_t boundary = (uint64_t)(rand() % DIV_ROUND_UP(file_blocks, EXT4_TEST_EXTENT_BLOCKS)) *
+                                EXT4_TEST_EXTENT_BLOCKS * EXT4_TEST_BLOCK_SIZE;
+            offset = (boundary >= 5000) ? boundary - 5000 + rand() % 10000 : (uint64_t)rand() % 10000;
+            offset %= file_size;
+        }
+        size_t len = rand() % (3 * EXT4_TEST_BLOCK_SIZE);
+        ssize_t read = fs_read_file(handle, buf, offset, len);
+        size_t expected = MIN(len, file_size - offset);
+        if (read != (ssize_t)expected || !ext4_test_verify(buf, offset, expected)) {
+            printf("random read %u at %llu len %zu failed (%ld)\n", i, offset, len, read);
+            err = ERR_GENERIC;
+            goto out_close;
+        }
+    }
+
+    err = NO_ERROR;
+
+out_close:
+    fs_close_file(handle);
+out_unmount:
+    fs_unmount("/ext4test");
+out_dev: {
+        bdev_t *dev = bio_open("ext4test");
+        if (dev) {
+            bio_unregister_device(dev);
+            bio_close(dev);
+        }
+    }
+out_free:
+#if WITH_KERNEL_VM
+    if (image)
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)image);
+#else
+    free(image);
+#endif
+    free(buf);
+
+    printf("ext4 test: %s\n", (err < 0) ? "FAILED" : "PASSED");
+    return err;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("ext4_tests", "read a large file from an in memory ext4 image", &ext4_tests)
+STATIC_COMMAND_END(fs_tests);
+
+#endif // WITH_LIB_FS_EXT2
@@ -25,11 +25,18 @@
 
 #include <lib/console.h>
 
+int aspace_bench(int argc, const cmd_args *argv);
 int cbuf_tests(int argc, const cmd_args *argv);
 int fibo(int argc, const cmd_args *argv);
+int heap_bench(int argc, const cmd_args *argv);
+int mutex_bench(int argc, const cmd_args *argv);
+int port_bench(int argc, const cmd_args *argv);
 int port_tests(void);
+int sched_bench(int argc, const cmd_args *argv);
+int spinlock_bench(int argc, const cmd_args *argv);
 int spinner(int argc, const cmd_args *argv);
 int thread_tests(void);
+int unmap_bench(int argc, const cmd_args *argv);
 void benchmarks(void);
 void clock_tests(void);
 void printf_tests(void);
@@ -237,6 +237,116 @@ usage:
     return 0;
 }
 
+#if WITH_KERNEL_VM
+#define VM_STRESS_REGIONS 10000
+#define VM_STRESS_MAX_PAGES 4
+
+/* create, look up and free lots of small regions in the kernel address space */
+static int vm_stress(int argc, const cmd_args *argv)
+{
+    vmm_aspace_t *aspace = vmm_get_kernel_aspace();
+    uint count = (argc >= 2) ? argv[1].u : VM_STRESS_REGIONS;
+    uint errors = 0;
+    status_t err;
+
+    vaddr_t *base = calloc(count, sizeof(vaddr_t));
+    size_t *size = calloc(count, sizeof(size_t));
+    if (!base || !size) {
+        printf("error allocating region table\n");
+        free(base);
+        free(size);
+        return ERR_NO_MEMORY;
+    }
+
+    /* every region maps the start of the same physical buffer */
+    void *buf;
+    err = vmm_alloc_contiguous(aspace, "vm stress buffer", VM_STRESS_MAX_PAGES * PAGE_SIZE,
+                               &buf, 0, 0, ARCH_MMU_FLAG_PERM_NO_EXECUTE);
+    if (err < 0) {
+        printf("error %d allocating buffer\n", err);
+        free(base);
+        free(size);
+        return err;
+    }
+    paddr_t pa = vaddr_to_paddr(buf);
+    *(volatile uint32_t *)buf = 0x5a5a5a5a;
+
+    printf("vm stress: %u regions\n", count);
+
+    /* fill the address space, letting the vmm pick each spot */
+    lk_time_t t = current_time();
+    for (uint i = 0; i < count; i++) {
+        void *ptr;
+        size[i] = (1 + rand() % VM_STRESS_MAX_PAGES) * PAGE_SIZE;
+        err = vmm_alloc_physical(aspace, "vm stress", size[i], &ptr, 0, pa, 0,
+                                 ARCH_MMU_FLAG_PERM_NO_EXECUTE);
+        if (err < 0) {
+            printf("error %d allocating region %u\n", err, i);
+            count = i;
+            errors++;
+            break;
+        }
+        base[i] = (vaddr_t)ptr;
+        if (*(volatile uint32_t *)ptr != 0x5a5a5a5a) {
+            printf("region %u at %p maps the wrong page\n", i, ptr);
+            errors++;
+        }
+    }
+    printf("allocated %u regions in %u ms\n", count, current_time() - t);
+
+    /* free every other region by an address in its last page */
+    t = current_time();
+    for (uint i = 1; i < count; i += 2) {
+        err = vmm_free_region(aspace, base[i] + size[i] - 1);
+        if (err < 0) {
+            printf("error %d freeing region %u at 0x%lx\n", err, i, base[i]);
+            errors++;
+        }
+    }
+    printf("freed %u regions in %u ms\n", count / 2, current_time() - t);
+
+    /* the holes can be reserved again at the same spot, live regions can't */
+    t = current_time();
+    for (uint i = 1; i < count; i += 2) {
+        if (vmm_reserve_space(aspace, "vm stress", PAGE_SIZE, base[i - 1]) >= 0) {
+            printf("reserved over live region %u at 0x%lx\n", i - 1, base[i - 1]);
+            errors++;
+        }
+        err = vmm_reserve_space(aspace, "vm stress", size[i], base[i]);
+        if (err < 0) {
+            printf("error %d reserving hole %u at 0x%lx\n", err, i, base[i]);
+            errors++;
+        }
+    }
+    printf("reserved %u holes in %u ms\n", count / 2, current_time() - t);
+
+    /* free everything by exact match, after which none of them can be found */
+    t = current_time();
+    for (uint i = 0; i < count; i++) {
+        err = vmm_free_region_etc(aspace, base[i], size[i], 0);
+        if (err < 0) {
+            printf("error %d freeing region %u at 0x%lx\n", err, i, base[i]);
+            errors++;
+        }
+        if (vmm_free_region(aspace, base[i]) != ERR_NOT_FOUND) {
+            printf("region %u at 0x%lx still present\n", i, base[i]);
+            errors++;
+        }
+    }
+    printf("freed %u regions in %u ms\n", count, current_time() - t);
+
+    vmm_free_region(aspace, (vaddr_t)buf);
+    free(base);
+    free(size);
+
+    printf("vm stress: %s, %u errors\n", errors ? "FAILED" : "PASSED", errors);
+    return errors ? ERR_GENERIC : NO_ERROR;
+}
+#endif
+
 STATIC_COMMAND_START
 STATIC_COMMAND("mem_test", "test memory", &mem_test)
+#if WITH_KERNEL_VM
+STATIC_COMMAND("vm_stress", "create and free lots of vmm regions", &vm_stress)
+#endif
 STATIC_COMMAND_END(mem_tests);
@@ -21,9 +21,11 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <app/tests.h>
 #include <debug.h>
 #include <err.h>
 #include <rand.h>
+#include <stdlib.h>
 #include <string.h>
 #include <trace.h>
 
@@ -729,6 +731,64 @@ int group_waiting(void)
     return 0;
 }
 
+/* Reference ports hand over malloc()ed buffers and refuse plain packets.
+ */
+int ref_basic(void)
+{
+    port_t w_port, r_port;
+    status_t st = port_create("ref_port", PORT_MODE_UNICAST | PORT_MODE_REF, &w_port);
+    if (st < 0)
+        return __LINE__;
+
+    port_packet_t pkt = { { 0 } };
+    st = port_write(w_port, &pkt, 1);
+    if (st != ERR_NOT_VALID)
+        return __LINE__;
+
+    st = port_open("ref_port", context1, &r_port);
+    if (st < 0)
+        return __LINE__;
+
+    port_result_t rslt;
+    st = port_read(r_port, 0, &rslt);
+    if (st != ERR_NOT_VALID)
+        return __LINE__;
+
+    for (int ix = 0; ix != 3; ix++) {
+        char *buf = malloc(16);
+        if (!buf)
+            return __LINE__;
+        buf[0] = ix;
+        st = port_write_ref(w_port, buf, 16);
+        if (st < 0)
+            return __LINE__;
+    }
+
+    // the reader gets the same buffers back, in order.
+    for (int ix = 0; ix != 2; ix++) {
+        port_ref_result_t ref;
+        st = port_read_ref(r_port, 0, &ref);
+        if (st < 0)
+            return __LINE__;
+        if (ref.ctx != context1 || ref.ref.len != 16 || ((char *)ref.ref.buf)[0] != ix)
+            return __LINE__;
+        free(ref.ref.buf);
+    }
+
+    // the last buffer is still queued and goes away with the port.
+    st = port_close(w_port);
+    if (st < 0)
+        return __LINE__;
+    st = port_close(r_port);
+    if (st < 0)
+        return __LINE__;
+    st = port_destroy(w_port);
+    if (st < 0)
+        return __LINE__;
+
+    return 0;
+}
+
 #define RUN_TEST(t)  result = t(); if (result) goto fail
 
 int port_tests(void)
@@ -740,6 +800,7 @@ int port_tests(void)
         RUN_TEST(two_threads_basic);
         RUN_TEST(group_basic);
         RUN_TEST(group_dynamic);
+        RUN_TEST(ref_basic);
     }
 
     printf("all tests passed\n");
@@ -750,3 +811,103 @@ fail:
 }
 
 #undef RUN_TEST
+
+/* port throughput, a reader thread drains the port while we write flat out */
+#define PORT_BENCH_MESSAGES 100000
+#define PORT_BENCH_REF_SIZE 4096
+
+struct port_bench_args {
+    port_t r_port;
+    bool refs;
+};
+
+static int port_bench_reader(void *arg)
+{
+    struct port_bench_args *args = (struct port_bench_args *)arg;
+    port_result_t pr;
+    port_ref_result_t ref;
+
+    for (uint i = 0; i < PORT_BENCH_MESSAGES; ) {
+        status_t st;
+        if (args->refs) {
+            st = port_read_ref(args->r_port, INFINITE_TIME, &ref);
+            if (st == NO_ERROR)
+                free(ref.ref.buf);
+        } else {
+            st = port_read(args->r_port, INFINITE_TIME, &pr);
+        }
+        if (st < 0)
+            return st;
+        i++;
+    }
+
+    return 0;
+}
+
+static void port_bench_run(const char *name, port_mode_t mode, size_t batch)
+{
+    port_t w_port;
+    struct port_bench_args args = { .refs = mode & PORT_MODE_REF };
+    port_packet_t packets[8] = { { { 0 } } };
+    size_t msg_size = args.refs ? PORT_BENCH_REF_SIZE : sizeof(port_packet_t);
+
+    if (port_create("port_bench", mode, &w_port) < 0 ||
+        port_open("port_bench", NULL, &args.r_port) < 0) {
+        printf("%s: could not set up port\n", name);
+        return;
+    }
+
+    thread_t *t = thread_create("port bench reader", &port_bench_reader, &args,
+                                DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+
+    lk_bigtime_t start = current_time_hires();
+    thread_resume(t);
+
+    for (uint sent = 0; sent < PORT_BENCH_MESSAGES; ) {
+        status_t st;
+        if (args.refs) {
+            void *buf = malloc(PORT_BENCH_REF_SIZE);
+            if (!buf)
+                break;
+            while ((st = port_write_ref(w_port, buf, PORT_BENCH_REF_SIZE)) == ERR_PARTIAL_WRITE)
+                thread_yield();
+            if (st < 0)
+                free(buf);
+        } else {
+            // all or nothing, retry the whole batch while the buffer is full.
+            while ((st = port_write(w_port, packets, batch)) == ERR_PARTIAL_WRITE)
+                thread_yield();
+        }
+        if (st < 0) {
+            printf("%s: write failed, status = %d\n", name, st);
+            break;
+        }
+        sent += args.refs ? 1 : batch;
+    }
+
+    int ret;
+    thread_join(t, &ret, INFINITE_TIME);
+    lk_bigtime_t elapsed = MAX(current_time_hires() - start, 1ULL);
+
+    if (ret < 0) {
+        printf("%s: read failed, status = %d\n", name, ret);
+    } else {
+        printf("%s: %u messages in %llu us, %llu messages/sec, %llu MB/sec\n",
+               name, PORT_BENCH_MESSAGES, elapsed,
+               PORT_BENCH_MESSAGES * 1000000ULL / elapsed,
+               PORT_BENCH_MESSAGES * (unsigned long long)msg_size / elapsed);
+    }
+
+    port_close(w_port);
+    port_close(args.r_port);
+    port_destroy(w_port);
+}
+
+int port_bench(int argc, const cmd_args *argv)
+{
+    port_bench_run("packets", PORT_MODE_UNICAST | PORT_MODE_BIG_BUFFER, 1);
+    port_bench_run("packets x8", PORT_MODE_UNICAST | PORT_MODE_BIG_BUFFER, 8);
+    port_bench_run("4k references", PORT_MODE_UNICAST | PORT_MODE_BIG_BUFFER | PORT_MODE_REF, 1);
+
+    return 0;
+}
@@ -8,6 +8,7 @@ MODULE_SRCS += \
     $(LOCAL_DIR)/cbuf_tests.c \
     $(LOCAL_DIR)/clock_tests.c \
     $(LOCAL_DIR)/fibo.c \
+    $(LOCAL_DIR)/fs_tests.c \
     $(LOCAL_DIR)/float.c \
     $(LOCAL_DIR)/float_instructions.S \
     $(LOCAL_DIR)/float_test_vec.c \
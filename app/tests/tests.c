@@ -32,7 +32,16 @@ STATIC_COMMAND_START
 STATIC_COMMAND("printf_tests", "test printf", (console_cmd)&printf_tests)
 STATIC_COMMAND("printf_tests_float", "test printf with floating point", (console_cmd)&printf_tests_float)
 STATIC_COMMAND("thread_tests", "test the scheduler", (console_cmd)&thread_tests)
+STATIC_COMMAND("sched_bench", "scheduler stress benchmark", &sched_bench)
+STATIC_COMMAND("heap_bench", "malloc/free throughput benchmark", &heap_bench)
+STATIC_COMMAND("mutex_bench", "mutex contention benchmark", &mutex_bench)
+STATIC_COMMAND("spinlock_bench", "spinlock contention benchmark", &spinlock_bench)
+#if WITH_KERNEL_VM
+STATIC_COMMAND("unmap_bench", "unmap and tlb shootdown benchmark", &unmap_bench)
+STATIC_COMMAND("aspace_bench", "address space context switch benchmark", &aspace_bench)
+#endif
 STATIC_COMMAND("port_tests", "test the ports", (console_cmd)&port_tests)
+STATIC_COMMAND("port_bench", "port throughput benchmark", &port_bench)
 STATIC_COMMAND("clock_tests", "test clocks", (console_cmd)&clock_tests)
 STATIC_COMMAND("bench", "miscellaneous benchmarks", (console_cmd)&benchmarks)
 STATIC_COMMAND("fibo", "threaded fibonacci", (console_cmd)&fibo)
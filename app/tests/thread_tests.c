@@ -26,11 +26,18 @@
 #include <err.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <app/tests.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/spinlock.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 #include <platform.h>
 
 static int sleep_thread(void *arg)
@@ -635,6 +642,540 @@ int thread_tests(void)
     return 0;
 }
 
+/* scheduler stress benchmark */
+#define SCHED_BENCH_DURATION 1000
+
+static volatile bool sched_bench_done;
+
+struct sched_bench_pair {
+    semaphore_t ping;
+    semaphore_t pong;
+    ulong count;
+};
+
+static int sched_bench_yield_thread(void *arg)
+{
+    ulong *count = (ulong *)arg;
+
+    while (!sched_bench_done) {
+        thread_yield();
+        (*count)++;
+    }
+
+    return 0;
+}
+
+static int sched_bench_ping_thread(void *arg)
+{
+    struct sched_bench_pair *pair = (struct sched_bench_pair *)arg;
+
+    while (!sched_bench_done) {
+        sem_post(&pair->ping, false);
+        sem_wait(&pair->pong);
+        pair->count++;
+    }
+
+    /* kick the pong thread out of its wait */
+    sem_post(&pair->ping, false);
+
+    return 0;
+}
+
+static int sched_bench_pong_thread(void *arg)
+{
+    struct sched_bench_pair *pair = (struct sched_bench_pair *)arg;
+
+    for (;;) {
+        sem_wait(&pair->ping);
+        if (sched_bench_done) {
+            /* ping may be waiting on the round trip it started */
+            sem_post(&pair->pong, false);
+            break;
+        }
+        sem_post(&pair->pong, false);
+    }
+
+    return 0;
+}
+
+/* let the threads run for a while, stop them and return the elapsed time */
+static lk_time_t sched_bench_run(thread_t **threads, uint count)
+{
+    sched_bench_done = false;
+
+    lk_time_t t = current_time();
+    for (uint i = 0; i < count; i++)
+        thread_resume(threads[i]);
+
+    thread_sleep(SCHED_BENCH_DURATION);
+    sched_bench_done = true;
+
+    for (uint i = 0; i < count; i++)
+        thread_join(threads[i], NULL, INFINITE_TIME);
+
+    return current_time() - t;
+}
+
+static uint active_cpu_count(void)
+{
+    uint active_cpus = 0;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (mp_is_cpu_active(i))
+            active_cpus++;
+    }
+
+    return active_cpus;
+}
+
+/* call step for 1, 2, 4... cpus, always finishing with the full set */
+static void bench_for_each_cpu_count(void (*step)(uint ncpus))
+{
+    uint active_cpus = active_cpu_count();
+
+    for (uint ncpus = 1; ; ncpus = MIN(ncpus * 2, active_cpus)) {
+        step(ncpus);
+        if (ncpus >= active_cpus)
+            break;
+    }
+}
+
+struct bench_result {
+    lk_time_t elapsed;
+    ulong total;
+    ulong min;
+    ulong max;
+};
+
+/*
+ * Run nthreads copies of worker, each passed a ulong of its own to count in.
+ * Thread i is pinned to cpu i % ncpus, or left unpinned if ncpus is 0.
+ */
+static void bench_run_workers(thread_start_routine worker, uint nthreads, uint ncpus,
+                              struct bench_result *res)
+{
+    thread_t *threads[SMP_MAX_CPUS * 2];
+    ulong count[SMP_MAX_CPUS * 2];
+
+    DEBUG_ASSERT(nthreads <= countof(threads));
+
+    for (uint i = 0; i < nthreads; i++) {
+        count[i] = 0;
+        threads[i] = thread_create("bench worker", worker,
+                                   &count[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (ncpus)
+            thread_set_pinned_cpu(threads[i], i % ncpus);
+    }
+    res->elapsed = sched_bench_run(threads, nthreads);
+
+    res->total = 0;
+    res->min = ULONG_MAX;
+    res->max = 0;
+    for (uint i = 0; i < nthreads; i++) {
+        res->total += count[i];
+        res->min = MIN(res->min, count[i]);
+        res->max = MAX(res->max, count[i]);
+    }
+}
+
+static void bench_print(uint ncpus, const char *name, const char *unit,
+                        const struct bench_result *res)
+{
+    printf("%u cpu(s): %s: %lu %s in %u ms, %lu per second\n",
+           ncpus, name, res->total, unit, res->elapsed,
+           res->total * 1000 / MAX(res->elapsed, 1U));
+}
+
+static void sched_bench_cpus(uint ncpus)
+{
+    thread_t *threads[SMP_MAX_CPUS * 2];
+    struct sched_bench_pair pairs[SMP_MAX_CPUS];
+    struct bench_result res;
+
+    /* two yielding threads pinned to each cpu */
+    bench_run_workers(&sched_bench_yield_thread, ncpus * 2, ncpus, &res);
+    bench_print(ncpus, "yield", "context switches", &res);
+
+    /* one unpinned ping-pong pair per cpu, every round trip is two wakeups */
+    for (uint i = 0; i < ncpus; i++) {
+        sem_init(&pairs[i].ping, 0);
+        sem_init(&pairs[i].pong, 0);
+        pairs[i].count = 0;
+        threads[i * 2] = thread_create("sched bench ping", &sched_bench_ping_thread,
+                                       &pairs[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        threads[i * 2 + 1] = thread_create("sched bench pong", &sched_bench_pong_thread,
+                                           &pairs[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    }
+    res.elapsed = sched_bench_run(threads, ncpus * 2);
+
+    res.total = 0;
+    for (uint i = 0; i < ncpus; i++) {
+        res.total += pairs[i].count * 2;
+        sem_destroy(&pairs[i].ping);
+        sem_destroy(&pairs[i].pong);
+    }
+
+    bench_print(ncpus, "ping-pong", "context switches", &res);
+}
+
+/*
+ * Measure reschedule latency on cpu 1 while N lower priority threads pinned
+ * to cpu 1 sit runnable in the same run queue. A higher priority spinner holds
+ * the cpu while they are queued, then steps aside for the yielder, which keeps
+ * it until done. The cost per yield should not depend on N.
+ */
+#define SCHED_BENCH_PINNED_ITER 10000
+
+static volatile bool sched_bench_pinned_spin;
+
+static int sched_bench_pinned_spinner(void *arg)
+{
+    while (sched_bench_pinned_spin)
+        ;
+
+    return 0;
+}
+
+static int sched_bench_pinned_nop(void *arg)
+{
+    return 0;
+}
+
+static int sched_bench_pinned_yielder(void *arg)
+{
+    uint count = arch_cycle_count();
+    for (uint i = 0; i < SCHED_BENCH_PINNED_ITER; i++)
+        thread_yield();
+    count = arch_cycle_count() - count;
+
+    printf("%lu pinned threads queued: %u cycles per reschedule\n",
+           (ulong)arg, count / SCHED_BENCH_PINNED_ITER);
+
+    return 0;
+}
+
+static void sched_bench_pinned(void)
+{
+    static const uint counts[] = { 0, 16, 64, 256 };
+
+    if (!mp_is_cpu_active(1)) {
+        printf("pinned thread benchmark needs a second cpu, skipping\n");
+        return;
+    }
+
+    for (uint c = 0; c < countof(counts); c++) {
+        uint n = counts[c];
+        thread_t **queued = calloc(MAX(n, 1U), sizeof(thread_t *));
+        if (!queued) {
+            printf("failed to allocate thread array\n");
+            return;
+        }
+
+        /* occupy cpu 1 so that threads pinned there stay queued until the yielder is ready */
+        sched_bench_pinned_spin = true;
+        thread_t *spinner = thread_create("sched bench spinner", &sched_bench_pinned_spinner,
+                                          NULL, HIGH_PRIORITY + 1, DEFAULT_STACK_SIZE);
+        thread_set_pinned_cpu(spinner, 1);
+        thread_set_real_time(spinner);
+        thread_resume(spinner);
+        thread_sleep(10);
+
+        uint created = 0;
+        for (uint i = 0; i < n; i++) {
+            queued[i] = thread_create("sched bench queued", &sched_bench_pinned_nop,
+                                      NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+            if (!queued[i])
+                break;
+            thread_set_pinned_cpu(queued[i], 1);
+            thread_resume(queued[i]);
+            created++;
+        }
+
+        thread_t *yielder = thread_create("sched bench yielder", &sched_bench_pinned_yielder,
+                                          (void *)(ulong)created, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_set_pinned_cpu(yielder, 1);
+        thread_resume(yielder);
+
+        /* let the yielder have cpu 1, the queued threads run once it exits */
+        sched_bench_pinned_spin = false;
+        thread_join(spinner, NULL, INFINITE_TIME);
+        thread_join(yielder, NULL, INFINITE_TIME);
+        for (uint i = 0; i < created; i++)
+            thread_join(queued[i], NULL, INFINITE_TIME);
+
+        free(queued);
+    }
+}
+
+int sched_bench(int argc, const cmd_args *argv)
+{
+    printf("scheduler benchmark, %u active cpu(s)\n", active_cpu_count());
+
+    bench_for_each_cpu_count(&sched_bench_cpus);
+
+    sched_bench_pinned();
+
+#if THREAD_STATS
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!mp_is_cpu_active(i))
+            continue;
+        printf("cpu %u: context switches %lu, reschedules %lu\n", i,
+               thread_stats[i].context_switches, thread_stats[i].reschedules);
+    }
+#endif
+
+    return 0;
+}
+
+/* small object malloc/free throughput, each thread churns its own working set */
+#define HEAP_BENCH_OBJECTS 32
+
+static int heap_bench_thread(void *arg)
+{
+    ulong *count = (ulong *)arg;
+    void *ptr[HEAP_BENCH_OBJECTS];
+    static const size_t sizes[] = { 16, 32, 64, 128, 200, 256 };
+
+    while (!sched_bench_done) {
+        for (uint i = 0; i < HEAP_BENCH_OBJECTS; i++)
+            ptr[i] = malloc(sizes[i % countof(sizes)]);
+        for (uint i = 0; i < HEAP_BENCH_OBJECTS; i++)
+            free(ptr[i]);
+        *count += HEAP_BENCH_OBJECTS * 2;
+    }
+
+    return 0;
+}
+
+static void heap_bench_cpus(uint ncpus)
+{
+    struct bench_result res;
+
+    bench_run_workers(&heap_bench_thread, ncpus, ncpus, &res);
+    bench_print(ncpus, "malloc", "allocs+frees", &res);
+}
+
+int heap_bench(int argc, const cmd_args *argv)
+{
+    printf("heap benchmark, %u active cpu(s)\n", active_cpu_count());
+
+    bench_for_each_cpu_count(&heap_bench_cpus);
+
+    return 0;
+}
+
+/* mutex acquire/release cost, alone and with every thread fighting over one lock */
+#define MUTEX_BENCH_ITER 100000
+
+static mutex_t mutex_bench_lock = MUTEX_INITIAL_VALUE(mutex_bench_lock);
+static ulong mutex_bench_shared;
+
+static int mutex_bench_thread(void *arg)
+{
+    ulong *count = (ulong *)arg;
+
+    while (!sched_bench_done) {
+        mutex_acquire(&mutex_bench_lock);
+        mutex_bench_shared++;
+        mutex_release(&mutex_bench_lock);
+        (*count)++;
+    }
+
+    return 0;
+}
+
+static void mutex_bench_threads(uint ncpus, uint nthreads, bool pinned)
+{
+    struct bench_result res;
+
+    mutex_bench_shared = 0;
+    bench_run_workers(&mutex_bench_thread, nthreads, pinned ? ncpus : 0, &res);
+    bench_print(ncpus, pinned ? "one pinned thread per cpu" : "two unpinned threads per cpu",
+                "acquire+release", &res);
+
+    if (mutex_bench_shared != res.total)
+        printf("error: shared counter %lu, expected %lu\n", mutex_bench_shared, res.total);
+}
+
+static void mutex_bench_cpus(uint ncpus)
+{
+    mutex_bench_threads(ncpus, ncpus, true);
+}
+
+int mutex_bench(int argc, const cmd_args *argv)
+{
+    uint active_cpus = active_cpu_count();
+
+    printf("mutex benchmark, %u active cpu(s)\n", active_cpus);
+
+    uint count = arch_cycle_count();
+    for (uint i = 0; i < MUTEX_BENCH_ITER; i++) {
+        mutex_acquire(&mutex_bench_lock);
+        mutex_release(&mutex_bench_lock);
+    }
+    count = arch_cycle_count() - count;
+
+    printf("uncontended: %u cycles per acquire+release\n", count / MUTEX_BENCH_ITER);
+
+    /* one thread pinned per cpu, so holders are always running and waiters spin */
+    bench_for_each_cpu_count(&mutex_bench_cpus);
+
+    /* more threads than cpus, so some holders get preempted and waiters block */
+    mutex_bench_threads(active_cpus, active_cpus * 2, false);
+
+    return 0;
+}
+
+/* spinlock throughput with one pinned thread per cpu hammering a single lock */
+static spin_lock_t spinlock_bench_lock = SPIN_LOCK_INITIAL_VALUE;
+static ulong spinlock_bench_shared;
+
+static int spinlock_bench_thread(void *arg)
+{
+    ulong *count = (ulong *)arg;
+    spin_lock_saved_state_t state;
+
+    while (!sched_bench_done) {
+        spin_lock_irqsave(&spinlock_bench_lock, state);
+        spinlock_bench_shared++;
+        spin_unlock_irqrestore(&spinlock_bench_lock, state);
+        (*count)++;
+    }
+
+    return 0;
+}
+
+static void spinlock_bench_cpus(uint ncpus)
+{
+    struct bench_result res;
+
+    spinlock_bench_shared = 0;
+    bench_run_workers(&spinlock_bench_thread, ncpus, ncpus, &res);
+    bench_print(ncpus, "spinlock", "lock+unlock", &res);
+
+    /* a fair lock keeps the slowest and fastest cpu close together */
+    printf("%u cpu(s): per cpu min %lu max %lu\n", ncpus, res.min, res.max);
+
+    if (spinlock_bench_shared != res.total)
+        printf("error: shared counter %lu, expected %lu\n", spinlock_bench_shared, res.total);
+}
+
+int spinlock_bench(int argc, const cmd_args *argv)
+{
+    printf("spinlock benchmark, %u active cpu(s)\n", active_cpu_count());
+
+    bench_for_each_cpu_count(&spinlock_bench_cpus);
+
+    return 0;
+}
+
+#if WITH_KERNEL_VM
+/* map and unmap throughput, every unmap has to reach every active cpu's tlb */
+static uint unmap_bench_pages;
+
+static int unmap_bench_thread(void *arg)
+{
+    ulong *count = (ulong *)arg;
+    uint pages = unmap_bench_pages;
+    void *ptr;
+
+    while (!sched_bench_done) {
+        status_t err = vmm_alloc(vmm_get_kernel_aspace(), "unmap bench",
+                                 pages * PAGE_SIZE, &ptr, 0, 0,
+                                 ARCH_MMU_FLAG_PERM_NO_EXECUTE);
+        if (err < 0)
+            return err;
+
+        /* fault in a tlb entry for every page before tearing them down */
+        for (uint i = 0; i < pages; i++)
+            ((volatile uint8_t *)ptr)[i * PAGE_SIZE] = 0;
+
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ptr);
+        *count += pages;
+    }
+
+    return 0;
+}
+
+static void unmap_bench_cpus(uint ncpus)
+{
+    /* small unmaps flush page by page, large ones in one go */
+    static const uint sizes[] = { 1, 16, 256 };
+    struct bench_result res;
+    char name[32];
+
+    for (uint i = 0; i < countof(sizes); i++) {
+        unmap_bench_pages = sizes[i];
+        bench_run_workers(&unmap_bench_thread, ncpus, ncpus, &res);
+
+        snprintf(name, sizeof(name), "%u page unmaps", sizes[i]);
+        bench_print(ncpus, name, "pages", &res);
+    }
+}
+
+int unmap_bench(int argc, const cmd_args *argv)
+{
+    printf("unmap benchmark, %u active cpu(s)\n", active_cpu_count());
+
+    bench_for_each_cpu_count(&unmap_bench_cpus);
+
+#if THREAD_STATS && WITH_SMP
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!mp_is_cpu_active(i))
+            continue;
+        printf("cpu %u: generic ipis %lu\n", i, thread_stats[i].generic_ipis);
+    }
+#endif
+
+    return 0;
+}
+
+/* context switches between threads in different address spaces */
+static void aspace_bench_run(const char *name, vmm_aspace_t *aspace0, vmm_aspace_t *aspace1)
+{
+    thread_t *threads[2];
+    ulong yield_count[2] = { 0, 0 };
+    vmm_aspace_t *aspaces[2] = { aspace0, aspace1 };
+
+    for (uint i = 0; i < 2; i++) {
+        threads[i] = thread_create("aspace bench", &sched_bench_yield_thread,
+                                   &yield_count[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        threads[i]->aspace = aspaces[i];
+        thread_set_pinned_cpu(threads[i], 0);
+    }
+    lk_time_t elapsed = sched_bench_run(threads, 2);
+
+    ulong total = yield_count[0] + yield_count[1];
+    printf("%s: %lu context switches in %u ms, %lu per second\n",
+           name, total, elapsed, total * 1000 / MAX(elapsed, 1U));
+}
+
+int aspace_bench(int argc, const cmd_args *argv)
+{
+    vmm_aspace_t *aspaces[2];
+    status_t err;
+
+    for (uint i = 0; i < 2; i++) {
+        err = vmm_create_aspace(&aspaces[i], "aspace bench", 0);
+        if (err < 0) {
+            printf("error %d creating aspace\n", err);
+            if (i > 0)
+                vmm_free_aspace(aspaces[0]);
+            return err;
+        }
+    }
+
+    aspace_bench_run("kernel only", NULL, NULL);
+    aspace_bench_run("same aspace", aspaces[0], aspaces[0]);
+    aspace_bench_run("two aspaces", aspaces[0], aspaces[1]);
+
+    for (uint i = 0; i < 2; i++)
+        vmm_free_aspace(aspaces[i]);
+
+    return 0;
+}
+#endif
+
 static int spinner_thread(void *arg)
 {
     for (;;)
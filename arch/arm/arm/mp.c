@@ -73,7 +73,7 @@ enum handler_return arm_ipi_generic_handler(void *arg)
 {
     LTRACEF("cpu %u, arg %p\n", arch_curr_cpu_num(), arg);
 
-    return INT_NO_RESCHEDULE;
+    return mp_mbx_generic_irq();
 }
 
 enum handler_return arm_ipi_reschedule_handler(void *arg)
@@ -22,9 +22,13 @@
  */
 #include <stdio.h>
 #include <debug.h>
+#include <err.h>
 #include <bits.h>
 #include <arch/arch_ops.h>
 #include <arch/arm64.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 #define SHUTDOWN_ON_FATAL 1
 
@@ -51,6 +55,32 @@ static void dump_iframe(const struct arm64_iframe_long *iframe)
     printf("spsr 0x%16llx\n", iframe->spsr);
 }
 
+#if WITH_KERNEL_VM
+/* translation faults may be the first touch of a demand committed page */
+static bool arm64_page_fault(struct arm64_iframe_long *iframe, uint32_t ec, uint32_t iss)
+{
+    /* the vmm can block, so only try if the faulting code was preemptible */
+    if (BITS_SHIFT(iss, 5, 2) != 0b0001 || (iframe->spsr & (1 << 7)))
+        return false;
+
+    uint64_t far = ARM64_READ_SYSREG(far_el1);
+    uint pf_flags = 0;
+
+    if (ec == 0b100000 || ec == 0b100100)
+        pf_flags |= VMM_PF_FLAG_USER;
+    if (ec == 0b100000 || ec == 0b100001)
+        pf_flags |= VMM_PF_FLAG_INSTRUCTION;
+    else if (BIT(iss, 6)) /* WnR */
+        pf_flags |= VMM_PF_FLAG_WRITE;
+
+    arch_enable_ints();
+    status_t err = vmm_page_fault_handler(far, pf_flags);
+    arch_disable_ints();
+
+    return err == NO_ERROR;
+}
+#endif
+
 __WEAK void arm64_syscall(struct arm64_iframe_long *iframe, bool is_64bit)
 {
     panic("unhandled syscall vector\n");
@@ -81,10 +111,18 @@ void arm64_sync_exception(struct arm64_iframe_long *iframe)
 #endif
         case 0b100000: /* instruction abort from lower level */
         case 0b100001: /* instruction abort from same level */
+#if WITH_KERNEL_VM
+            if (arm64_page_fault(iframe, ec, iss))
+                return;
+#endif
             printf("instruction abort: PC at 0x%llx\n", iframe->elr);
             break;
         case 0b100100: /* data abort from lower level */
         case 0b100101: { /* data abort from same level */
+#if WITH_KERNEL_VM
+            if (arm64_page_fault(iframe, ec, iss))
+                return;
+#endif
             for (fault_handler = __fault_handler_table_start;
                     fault_handler < __fault_handler_table_end;
                     fault_handler++) {
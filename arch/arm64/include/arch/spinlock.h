@@ -60,7 +60,13 @@ static inline void arch_spin_lock_init(spin_lock_t *lock)
 
 static inline bool arch_spin_lock_held(spin_lock_t *lock)
 {
+#if WITH_SMP && ARM64_TICKET_SPINLOCKS
+    /* held while the ticket being served lags the next one handed out */
+    uint32_t val = *(volatile spin_lock_t *)lock;
+    return (val & 0xffff) != (val >> 16);
+#else
     return *lock != 0;
+#endif
 }
 
 enum {
@@ -318,10 +318,65 @@ static bool page_table_is_clear(pte_t *page_table, uint page_size_shift)
     return true;
 }
 
+/*
+ * Unmaps larger than this skip the per page broadcast tlbi and invalidate the
+ * whole asid (or all global entries) once at the end instead.
+ */
+#define ARM64_TLBI_MAX_PAGES 64
+
+/*
+ * Page tables emptied by an unmap. Other cpus may still be walking them or
+ * hold them in their walk caches until the broadcast invalidate completes,
+ * so they are only handed back to the pmm after that.
+ */
+#define ARM64_PT_FREE_BATCH 16
+
+struct arm64_pt_free_list {
+    uint count;
+    uint page_size_shift;
+    uint asid;
+    struct {
+        void *vaddr;
+        paddr_t paddr;
+    } table[ARM64_PT_FREE_BATCH];
+};
+
+static void arm64_tlbi_asid(uint asid)
+{
+    if (asid == MMU_ARM64_GLOBAL_ASID)
+        ARM64_TLBI_NOADDR(vmalle1is);
+    else
+        ARM64_TLBI(aside1is, (vaddr_t)asid << 48);
+}
+
+/* invalidate the asid, or all global entries, then free the queued tables */
+static void arm64_pt_free_flush(struct arm64_pt_free_list *freed)
+{
+    /* make the cleared entries visible before the broadcast flush */
+    __asm__ volatile("dsb ishst" ::: "memory");
+    arm64_tlbi_asid(freed->asid);
+    DSB;
+
+    for (uint i = 0; i < freed->count; i++)
+        free_page_table(freed->table[i].vaddr, freed->table[i].paddr, freed->page_size_shift);
+    freed->count = 0;
+}
+
+static void arm64_pt_free_queue(struct arm64_pt_free_list *freed, void *vaddr, paddr_t paddr)
+{
+    if (freed->count == ARM64_PT_FREE_BATCH)
+        arm64_pt_free_flush(freed);
+
+    freed->table[freed->count].vaddr = vaddr;
+    freed->table[freed->count].paddr = paddr;
+    freed->count++;
+}
+
 static void arm64_mmu_unmap_pt(vaddr_t vaddr, vaddr_t vaddr_rel,
                                size_t size,
                                uint index_shift, uint page_size_shift,
-                               pte_t *page_table, uint asid)
+                               pte_t *page_table, uint asid, bool tlbi_pages,
+                               struct arm64_pt_free_list *freed)
 {
     pte_t *next_page_table;
     vaddr_t index;
@@ -351,22 +406,24 @@ static void arm64_mmu_unmap_pt(vaddr_t vaddr, vaddr_t vaddr_rel,
             arm64_mmu_unmap_pt(vaddr, vaddr_rem, chunk_size,
                                index_shift - (page_size_shift - 3),
                                page_size_shift,
-                               next_page_table, asid);
+                               next_page_table, asid, tlbi_pages, freed);
             if (chunk_size == block_size ||
                     page_table_is_clear(next_page_table, page_size_shift)) {
                 LTRACEF("pte %p[0x%lx] = 0 (was page table)\n", page_table, index);
                 page_table[index] = MMU_PTE_DESCRIPTOR_INVALID;
                 __asm__ volatile("dmb ishst" ::: "memory");
-                free_page_table(next_page_table, page_table_paddr, page_size_shift);
+                arm64_pt_free_queue(freed, next_page_table, page_table_paddr);
             }
         } else if (pte) {
             LTRACEF("pte %p[0x%lx] = 0\n", page_table, index);
             page_table[index] = MMU_PTE_DESCRIPTOR_INVALID;
             CF;
-            if (asid == MMU_ARM64_GLOBAL_ASID)
-                ARM64_TLBI(vaae1is, vaddr >> 12);
-            else
-                ARM64_TLBI(vae1is, vaddr >> 12 | (vaddr_t)asid << 48);
+            if (tlbi_pages) {
+                if (asid == MMU_ARM64_GLOBAL_ASID)
+                    ARM64_TLBI(vaae1is, vaddr >> 12);
+                else
+                    ARM64_TLBI(vae1is, vaddr >> 12 | (vaddr_t)asid << 48);
+            }
         } else {
             LTRACEF("pte %p[0x%lx] already clear\n", page_table, index);
         }
@@ -449,10 +506,15 @@ static int arm64_mmu_map_pt(vaddr_t vaddr_in, vaddr_t vaddr_rel_in,
 
     return 0;
 
-err:
-    arm64_mmu_unmap_pt(vaddr_in, vaddr_rel_in, size_in - size,
-                       index_shift, page_size_shift, page_table, asid);
-    DSB;
+err: {
+        struct arm64_pt_free_list freed = { .page_size_shift = page_size_shift, .asid = asid };
+
+        arm64_mmu_unmap_pt(vaddr_in, vaddr_rel_in, size_in - size,
+                           index_shift, page_size_shift, page_table, asid, true, &freed);
+        if (freed.count)
+            arm64_pt_free_flush(&freed);
+        DSB;
+    }
     return ERR_GENERIC;
 }
 
@@ -506,9 +568,20 @@ int arm64_mmu_unmap(vaddr_t vaddr, size_t size,
         return ERR_INVALID_ARGS;
     }
 
+    bool tlbi_pages = (size >> page_size_shift) <= ARM64_TLBI_MAX_PAGES;
+    struct arm64_pt_free_list freed = { .page_size_shift = page_size_shift, .asid = asid };
+
     arm64_mmu_unmap_pt(vaddr, vaddr_rel, size,
-                       top_index_shift, page_size_shift, top_page_table, asid);
-    DSB;
+                       top_index_shift, page_size_shift, top_page_table, asid,
+                       tlbi_pages, &freed);
+
+    /* the per page tlbis don't cover walks cached through a freed table for
+     * addresses outside the range, so freeing any takes the full flush too */
+    if (!tlbi_pages || freed.count) {
+        arm64_pt_free_flush(&freed);
+    } else {
+        DSB;
+    }
     return 0;
 }
 
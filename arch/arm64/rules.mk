@@ -40,6 +40,13 @@ GLOBAL_DEFINES += \
     SMP_CPU_CLUSTER_SHIFT=$(SMP_CPU_CLUSTER_SHIFT) \
     SMP_CPU_ID_BITS=$(SMP_CPU_ID_BITS)
 
+# fair ticket spinlocks, set to false for the plain test-and-set lock
+ARM64_TICKET_SPINLOCKS ?= true
+ifeq (true,$(call TOBOOL,$(ARM64_TICKET_SPINLOCKS)))
+GLOBAL_DEFINES += \
+    ARM64_TICKET_SPINLOCKS=1
+endif
+
 MODULE_SRCS += \
     $(LOCAL_DIR)/mp.c
 else
@@ -408,7 +408,8 @@ clean:
  * @brief  x86 MMU unmap an entry in the page tables recursively and clear out tables
  *
  */
-static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, map_addr_t table_entry)
+static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, map_addr_t table_entry,
+                                struct list_node *freed_tables)
 {
     uint32_t offset = 0, next_level_offset = 0;
     map_addr_t *table, *next_table_addr, value;
@@ -444,7 +445,7 @@ static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, map_addr_t table_entry
     }
 
     level -= 1;
-    x86_mmu_unmap_entry(vaddr, level, (map_addr_t)next_table_addr);
+    x86_mmu_unmap_entry(vaddr, level, (map_addr_t)next_table_addr, freed_tables);
     level += 1;
 
     next_table_addr = (map_addr_t *)((map_addr_t)(X86_VIRT_TO_PHYS(next_table_addr)) & X86_PG_FRAME);
@@ -454,7 +455,12 @@ static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, map_addr_t table_entry
             if ((next_table_addr[next_level_offset] & X86_MMU_PG_P) != 0)
                 return; /* There is an entry in the next level table */
         }
-        free(next_table_addr);
+        /*
+         * Freed once the tlb shootdown is done. Until then the empty table
+         * links itself into the list, the pointers it holds are aligned so
+         * the entries they land in still read as not present.
+         */
+        list_add_tail(freed_tables, (struct list_node *)next_table_addr);
     }
     /* All present bits for all entries in next level table for this address are 0 */
     if ((X86_PHYS_TO_VIRT(table[offset]) & X86_MMU_PG_P) != 0) {
@@ -466,7 +472,7 @@ static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, map_addr_t table_entry
     }
 }
 
-status_t x86_mmu_unmap(map_addr_t init_table, vaddr_t vaddr, uint count)
+status_t x86_mmu_unmap(map_addr_t init_table, vaddr_t vaddr, uint count, struct list_node *freed_tables)
 {
     vaddr_t next_aligned_v_addr;
 
@@ -480,9 +486,9 @@ status_t x86_mmu_unmap(map_addr_t init_table, vaddr_t vaddr, uint count)
     next_aligned_v_addr = vaddr;
     while (count > 0) {
 #ifdef PAE_MODE_ENABLED
-        x86_mmu_unmap_entry(next_aligned_v_addr, X86_PAE_PAGING_LEVELS, init_table);
+        x86_mmu_unmap_entry(next_aligned_v_addr, X86_PAE_PAGING_LEVELS, init_table, freed_tables);
 #else
-        x86_mmu_unmap_entry(next_aligned_v_addr, X86_PAGING_LEVELS, init_table);
+        x86_mmu_unmap_entry(next_aligned_v_addr, X86_PAGING_LEVELS, init_table, freed_tables);
 #endif
         next_aligned_v_addr += PAGE_SIZE;
         count--;
@@ -490,6 +496,14 @@ status_t x86_mmu_unmap(map_addr_t init_table, vaddr_t vaddr, uint count)
     return NO_ERROR;
 }
 
+void x86_mmu_free_tables(struct list_node *tables)
+{
+    struct list_node *table;
+
+    while ((table = list_remove_head(tables)))
+        free(table);
+}
+
 int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
 {
     map_addr_t init_table_from_cr3;
@@ -505,7 +519,11 @@ int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
     DEBUG_ASSERT(x86_get_cr3());
     init_table_from_cr3 = x86_get_cr3();
 
-    return (x86_mmu_unmap(X86_PHYS_TO_VIRT(init_table_from_cr3), vaddr, count));
+    struct list_node freed_tables = LIST_INITIAL_VALUE(freed_tables);
+    status_t ret = x86_mmu_unmap(X86_PHYS_TO_VIRT(init_table_from_cr3), vaddr, count, &freed_tables);
+    x86_tlb_flush_range(vaddr, count, &freed_tables);
+
+    return ret;
 }
 
 /**
@@ -539,7 +557,9 @@ status_t x86_mmu_map_range(map_addr_t init_table, struct map_range *range, arch_
         if (map_status) {
             dprintf(SPEW, "Add mapping failed with err=%d\n", map_status);
             /* Unmap the partial mapping - if any */
-            x86_mmu_unmap(init_table, range->start_vaddr, index);
+            struct list_node freed_tables = LIST_INITIAL_VALUE(freed_tables);
+            x86_mmu_unmap(init_table, range->start_vaddr, index, &freed_tables);
+            x86_tlb_flush_range(range->start_vaddr, index, &freed_tables);
             return map_status;
         }
         next_aligned_v_addr += PAGE_SIZE;
@@ -54,6 +54,10 @@ map_addr_t pdp_high[NO_OF_PT_ENTRIES] __ALIGNED(PAGE_SIZE);
 /* a big pile of page tables needed to map 64GB of memory into kernel space using 2MB pages */
 map_addr_t linear_map_pdp[(64ULL*GB) / (2*MB)];
 
+/* process context ids in use, 12 bits of cr3 */
+#define X86_PCID_BITS 12
+static bool pcid_enabled;
+
 /**
  * @brief  check if the virtual address is aligned and canonical
  *
@@ -322,7 +326,9 @@ static void update_pt_entry(vaddr_t vaddr, paddr_t paddr,  uint64_t pde, arch_fl
     pt_index = (((uint64_t)vaddr >> PT_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
     pt_table[pt_index] = (uint64_t)paddr;
     pt_table[pt_index] |= flags | X86_MMU_PG_P;
-    if (!(flags & X86_MMU_PG_U))
+    /* kernel half pages are global, supervisor pages of a user aspace are not
+     * so they don't outlive a switch away from it */
+    if (!(flags & X86_MMU_PG_U) && is_kernel_address(vaddr))
         pt_table[pt_index] |= X86_MMU_PG_G; /* setting global flag for kernel pages */
 }
 
@@ -478,7 +484,8 @@ clean:
  * @brief  x86-64 MMU unmap an entry in the page tables recursively and clear out tables
  *
  */
-static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, vaddr_t table_entry)
+static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, vaddr_t table_entry,
+                                struct list_node *freed_tables)
 {
     uint32_t offset = 0, next_level_offset = 0;
     vaddr_t *table, *next_table_addr, value;
@@ -531,7 +538,7 @@ static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, vaddr_t table_entry)
     LTRACEF_LEVEL(2, "recursing\n");
 
     level -= 1;
-    x86_mmu_unmap_entry(vaddr, level, (vaddr_t)next_table_addr);
+    x86_mmu_unmap_entry(vaddr, level, (vaddr_t)next_table_addr, freed_tables);
     level += 1;
 
     LTRACEF_LEVEL(2, "next_table_addr %p\n", next_table_addr);
@@ -543,7 +550,10 @@ static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, vaddr_t table_entry)
             if ((next_table_addr[next_level_offset] & X86_MMU_PG_P) != 0)
                 return; /* There is an entry in the next level table */
         }
-        pmm_free_page(paddr_to_vm_page(X86_VIRT_TO_PHYS(next_table_addr)));
+        /* other cpus may still walk it through their paging structure caches,
+         * it goes back to the pmm once the tlb shootdown is done */
+        vm_page_t *page = paddr_to_vm_page(X86_VIRT_TO_PHYS(next_table_addr));
+        list_add_tail(freed_tables, &page->node);
     }
     /* All present bits for all entries in next level table for this address are 0 */
     if ((X86_PHYS_TO_VIRT(table[offset]) & X86_MMU_PG_P) != 0) {
@@ -555,7 +565,7 @@ static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, vaddr_t table_entry)
     }
 }
 
-status_t x86_mmu_unmap(map_addr_t pml4, vaddr_t vaddr, uint count)
+status_t x86_mmu_unmap(map_addr_t pml4, vaddr_t vaddr, uint count, struct list_node *freed_tables)
 {
     vaddr_t next_aligned_v_addr;
 
@@ -568,7 +578,7 @@ status_t x86_mmu_unmap(map_addr_t pml4, vaddr_t vaddr, uint count)
 
     next_aligned_v_addr = vaddr;
     while (count > 0) {
-        x86_mmu_unmap_entry(next_aligned_v_addr, X86_PAGING_LEVELS, pml4);
+        x86_mmu_unmap_entry(next_aligned_v_addr, X86_PAGING_LEVELS, pml4, freed_tables);
         next_aligned_v_addr += PAGE_SIZE;
         count--;
     }
@@ -577,8 +587,6 @@ status_t x86_mmu_unmap(map_addr_t pml4, vaddr_t vaddr, uint count)
 
 int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
 {
-    addr_t current_cr3_val;
-
     LTRACEF("aspace %p, vaddr 0x%lx, count %u\n", aspace, vaddr, count);
 
     DEBUG_ASSERT(aspace);
@@ -589,10 +597,16 @@ int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
     if (count == 0)
         return NO_ERROR;
 
-    DEBUG_ASSERT(x86_get_cr3());
-    current_cr3_val = (addr_t)x86_get_cr3();
+    struct list_node freed_tables = LIST_INITIAL_VALUE(freed_tables);
+    status_t ret = x86_mmu_unmap(aspace->pml4, vaddr, count, &freed_tables);
+
+    /* invlpg only reaches the current pcid, so cpus that switch back to a
+     * user aspace later have to drop whatever they kept tagged with its pcid */
+    if (!(aspace->flags & ARCH_ASPACE_FLAG_KERNEL))
+        __atomic_store_n(&aspace->stale_cpus, ~0U, __ATOMIC_RELEASE);
+    x86_tlb_flush_range(vaddr, count, &freed_tables);
 
-    return (x86_mmu_unmap(X86_PHYS_TO_VIRT(current_cr3_val), vaddr, count));
+    return ret;
 }
 
 /**
@@ -627,7 +641,9 @@ status_t x86_mmu_map_range(map_addr_t pml4, struct map_range *range, arch_flags_
         if (map_status) {
             dprintf(SPEW, "Add mapping failed with err=%d\n", map_status);
             /* Unmap the partial mapping - if any */
-            x86_mmu_unmap(pml4, range->start_vaddr, index);
+            struct list_node freed_tables = LIST_INITIAL_VALUE(freed_tables);
+            x86_mmu_unmap(pml4, range->start_vaddr, index, &freed_tables);
+            x86_tlb_flush_range(range->start_vaddr, index, &freed_tables);
             return map_status;
         }
         next_aligned_v_addr += PAGE_SIZE;
@@ -638,7 +654,6 @@ status_t x86_mmu_map_range(map_addr_t pml4, struct map_range *range, arch_flags_
 
 status_t arch_mmu_query(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t *paddr, uint *flags)
 {
-    addr_t current_cr3_val;
     uint32_t ret_level;
     map_addr_t last_valid_entry;
     arch_flags_t ret_flags;
@@ -648,17 +663,12 @@ status_t arch_mmu_query(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t *paddr, ui
 
     DEBUG_ASSERT(aspace);
 
-    if (!paddr)
-        return ERR_INVALID_ARGS;
-
-    DEBUG_ASSERT(x86_get_cr3());
-    current_cr3_val = (addr_t)x86_get_cr3();
-
-    stat = x86_mmu_get_mapping(X86_PHYS_TO_VIRT(current_cr3_val), vaddr, &ret_level, &ret_flags, &last_valid_entry);
+    stat = x86_mmu_get_mapping(aspace->pml4, vaddr, &ret_level, &ret_flags, &last_valid_entry);
     if (stat)
         return stat;
 
-    *paddr = (paddr_t)(last_valid_entry);
+    if (paddr)
+        *paddr = (paddr_t)(last_valid_entry);
     LTRACEF("paddr 0x%llx\n", last_valid_entry);
 
     /* converting x86 arch specific flags to arch mmu flags */
@@ -670,7 +680,6 @@ status_t arch_mmu_query(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t *paddr, ui
 
 int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
 {
-    addr_t current_cr3_val;
     struct map_range range;
 
     DEBUG_ASSERT(aspace);
@@ -686,14 +695,11 @@ int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count
     if (count == 0)
         return NO_ERROR;
 
-    DEBUG_ASSERT(x86_get_cr3());
-    current_cr3_val = (addr_t)x86_get_cr3();
-
     range.start_vaddr = vaddr;
     range.start_paddr = paddr;
     range.size = count * PAGE_SIZE;
 
-    return (x86_mmu_map_range(X86_PHYS_TO_VIRT(current_cr3_val), &range, flags));
+    return (x86_mmu_map_range(aspace->pml4, &range, flags));
 }
 
 void x86_mmu_early_init(void)
@@ -711,6 +717,14 @@ void x86_mmu_early_init(void)
         cr4 |= X86_CR4_SMEP;
     if (check_smap_avail())
         cr4 |=X86_CR4_SMAP;
+    /* make the X86_MMU_PG_G kernel mappings global, so their tlb entries are
+     * shared by every pcid and invlpg or a PGE toggle drops them everywhere */
+    cr4 |= X86_CR4_PGE;
+    /* tag tlb entries with the aspace so switching doesn't flush them */
+    if (check_pcid_avail()) {
+        cr4 |= X86_CR4_PCIDE;
+        pcid_enabled = true;
+    }
     x86_set_cr4(cr4);
 
     /* Set NXE bit in MSR_EFER*/
@@ -738,30 +752,108 @@ void x86_mmu_init(void)
 {
 }
 
-/*
- * x86-64 does not support multiple address spaces at the moment, so fail if these apis
- * are used for it.
- */
 status_t arch_mmu_init_aspace(arch_aspace_t *aspace, vaddr_t base, size_t size, uint flags)
 {
+    LTRACEF("aspace %p, base 0x%lx, size 0x%zx, flags 0x%x\n", aspace, base, size, flags);
+
     DEBUG_ASSERT(aspace);
 
-    if ((flags & ARCH_ASPACE_FLAG_KERNEL) == 0) {
-        return ERR_NOT_SUPPORTED;
+    aspace->flags = flags;
+    aspace->base = base;
+    aspace->size = size;
+    aspace->asid = 0;
+    aspace->stale_cpus = 0;
+
+    if (flags & ARCH_ASPACE_FLAG_KERNEL) {
+        /* the kernel runs on the tables set up in start.S */
+        aspace->pml4_phys = x86_get_cr3() & X86_PG_FRAME;
+        aspace->pml4 = X86_PHYS_TO_VIRT(aspace->pml4_phys);
+        return NO_ERROR;
     }
 
+    /* user aspaces live in the lower half, the upper half is the kernel's */
+    DEBUG_ASSERT(base + size - 1 <= ((1ull << PML4_SHIFT) * NO_OF_PT_ENTRIES / 2) - 1);
+
+    map_addr_t *table = _map_alloc_page();
+    if (!table)
+        return ERR_NO_MEMORY;
+
+    const map_addr_t *kernel_table = (const map_addr_t *)vmm_get_kernel_aspace()->arch_aspace.pml4;
+    memcpy(&table[NO_OF_PT_ENTRIES / 2], &kernel_table[NO_OF_PT_ENTRIES / 2],
+           sizeof(map_addr_t) * NO_OF_PT_ENTRIES / 2);
+
+    aspace->pml4 = (map_addr_t)table;
+    aspace->pml4_phys = vaddr_to_paddr(table);
+
+    LTRACEF("pml4 0x%llx, phys 0x%lx\n", aspace->pml4, aspace->pml4_phys);
+
     return NO_ERROR;
 }
 
 status_t arch_mmu_destroy_aspace(arch_aspace_t *aspace)
 {
+    LTRACEF("aspace %p\n", aspace);
+
+    DEBUG_ASSERT(aspace);
+    DEBUG_ASSERT((aspace->flags & ARCH_ASPACE_FLAG_KERNEL) == 0);
+
+    /* every region has been unmapped by now, which frees the lower level tables */
+    map_addr_t *table = (map_addr_t *)aspace->pml4;
+    for (uint i = 0; i < NO_OF_PT_ENTRIES / 2; i++)
+        DEBUG_ASSERT((table[i] & X86_MMU_PG_P) == 0);
+
+    pmm_free_kpages(table, 1);
+    aspace->pml4 = 0;
+
     return NO_ERROR;
 }
 
+void x86_mmu_free_tables(struct list_node *tables)
+{
+    pmm_free(tables);
+}
+
+/* drop every tlb entry of every pcid, including global ones */
+static void x86_tlb_flush_all(void)
+{
+    ulong cr4 = x86_get_cr4();
+
+    x86_set_cr4(cr4 ^ X86_CR4_PGE);
+    x86_set_cr4(cr4);
+}
+
 void arch_mmu_context_switch(arch_aspace_t *aspace)
 {
-    if (aspace != NULL) {
-        PANIC_UNIMPLEMENTED;
+    uint64_t cr3;
+
+    LTRACEF("aspace %p\n", aspace);
+
+    if (aspace) {
+        DEBUG_ASSERT((aspace->flags & ARCH_ASPACE_FLAG_KERNEL) == 0);
+        cr3 = aspace->pml4_phys;
+    } else {
+        cr3 = vmm_get_kernel_aspace()->arch_aspace.pml4_phys;
     }
-}
 
+    if (pcid_enabled) {
+        if (vmm_asid_activate(aspace, X86_PCID_BITS))
+            x86_tlb_flush_all();
+
+        if (aspace) {
+            uint cpu_bit = 1U << arch_curr_cpu_num();
+            uint stale = __atomic_fetch_and(&aspace->stale_cpus, ~cpu_bit, __ATOMIC_ACQUIRE);
+
+            /* user pcids start at 1, the allocator never hands out 0 */
+            DEBUG_ASSERT(aspace->asid & X86_CR3_PCID_MASK);
+            cr3 |= aspace->asid & X86_CR3_PCID_MASK;
+            if (!(stale & cpu_bit))
+                cr3 |= X86_CR3_NOFLUSH;
+        } else {
+            /* pcid 0 is the kernel's alone and the kernel half is mapped
+             * global (CR4.PGE), so kernel only threads keep what it cached */
+            cr3 |= X86_CR3_NOFLUSH;
+        }
+    }
+
+    x86_set_cr3(cr3);
+}
@@ -22,6 +22,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <assert.h>
 #include <debug.h>
 #include <arch.h>
 #include <arch/ops.h>
@@ -30,6 +31,9 @@
 #include <arch/x86/descriptor.h>
 #include <arch/fpu.h>
 #include <arch/mmu.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
 #include <platform.h>
 #include <sys/types.h>
 #include <string.h>
@@ -117,3 +121,124 @@ void arch_enter_uspace(vaddr_t entry_point, vaddr_t user_stack_top, uint32_t fla
     __UNREACHABLE;
 #endif
 }
+
+/* batches covering more pages than this flush the whole tlb instead of page by page */
+#define X86_TLB_FLUSH_ALL_PAGES 32
+
+/* ranges queued before a batch is flushed early */
+#define X86_TLB_BATCH_RANGES 16
+
+struct x86_tlb_range {
+    vaddr_t vaddr;
+    uint count;
+};
+
+struct x86_tlb_batch {
+    uint count;
+    uint pages;
+    struct x86_tlb_range range[X86_TLB_BATCH_RANGES];
+
+    /* page tables emptied by the unmaps, freed once the flush is done */
+    struct list_node tables;
+};
+
+/* the batch opened by arch_mmu_unmap_batch_begin(), one at a time */
+static struct {
+    mutex_t lock;
+    thread_t *owner;
+    struct x86_tlb_batch batch;
+} x86_tlb_pending = {
+    .lock = MUTEX_INITIAL_VALUE(x86_tlb_pending.lock),
+    .batch.tables = LIST_INITIAL_VALUE(x86_tlb_pending.batch.tables),
+};
+
+static void x86_tlb_flush_task(void *context)
+{
+    const struct x86_tlb_batch *batch = context;
+
+    if (batch->pages > X86_TLB_FLUSH_ALL_PAGES) {
+        ulong cr4 = x86_get_cr4();
+        if (cr4 & X86_CR4_PGE) {
+            /* toggling PGE drops the global kernel entries too */
+            x86_set_cr4(cr4 & ~X86_CR4_PGE);
+            x86_set_cr4(cr4);
+        } else {
+            x86_set_cr3(x86_get_cr3());
+        }
+        return;
+    }
+
+    for (uint r = 0; r < batch->count; r++) {
+        const struct x86_tlb_range *range = &batch->range[r];
+        for (uint i = 0; i < range->count; i++) {
+            __asm__ volatile("invlpg (%0)" :: "r" (range->vaddr + i * PAGE_SIZE) : "memory");
+        }
+    }
+}
+
+/* every queued range goes out as a single cross call */
+static void x86_tlb_batch_flush(struct x86_tlb_batch *batch)
+{
+    if (batch->count == 0)
+        return;
+
+    mp_sync_exec(MP_CPU_ALL_BUT_LOCAL, &x86_tlb_flush_task, batch);
+    x86_tlb_flush_task(batch);
+
+    /* no cpu can reach the old tables through its tlb any more */
+    x86_mmu_free_tables(&batch->tables);
+
+    batch->count = 0;
+    batch->pages = 0;
+}
+
+static void x86_tlb_batch_add(struct x86_tlb_batch *batch, vaddr_t vaddr, uint count,
+                              struct list_node *tables)
+{
+    struct list_node *table;
+
+    if (batch->count == X86_TLB_BATCH_RANGES)
+        x86_tlb_batch_flush(batch);
+
+    while ((table = list_remove_head(tables)))
+        list_add_tail(&batch->tables, table);
+
+    batch->range[batch->count].vaddr = vaddr;
+    batch->range[batch->count].count = count;
+    batch->count++;
+    /* only compared against the full flush threshold, so keep it from wrapping */
+    batch->pages += MIN(count, X86_TLB_FLUSH_ALL_PAGES + 1);
+}
+
+/*
+ * Invalidate a range of pages on every cpu. Inside a batch the range is only
+ * queued and goes out with the others when the batch ends, otherwise it is
+ * flushed right away.
+ */
+void x86_tlb_flush_range(vaddr_t vaddr, uint count, struct list_node *freed_tables)
+{
+    if (x86_tlb_pending.owner == get_current_thread()) {
+        x86_tlb_batch_add(&x86_tlb_pending.batch, vaddr, count, freed_tables);
+        return;
+    }
+
+    struct x86_tlb_batch batch = { 0 };
+    list_initialize(&batch.tables);
+    x86_tlb_batch_add(&batch, vaddr, count, freed_tables);
+    x86_tlb_batch_flush(&batch);
+}
+
+void arch_mmu_unmap_batch_begin(arch_aspace_t *aspace)
+{
+    mutex_acquire(&x86_tlb_pending.lock);
+    DEBUG_ASSERT(x86_tlb_pending.batch.count == 0);
+    x86_tlb_pending.owner = get_current_thread();
+}
+
+void arch_mmu_unmap_batch_end(arch_aspace_t *aspace)
+{
+    DEBUG_ASSERT(x86_tlb_pending.owner == get_current_thread());
+    x86_tlb_batch_flush(&x86_tlb_pending.batch);
+    x86_tlb_pending.owner = NULL;
+    mutex_release(&x86_tlb_pending.lock);
+}
@@ -22,10 +22,14 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <debug.h>
+#include <err.h>
 #include <trace.h>
 #include <arch/x86.h>
 #include <arch/fpu.h>
 #include <kernel/thread.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 /* exceptions */
 #define INT_DIVIDE_0        0x00
@@ -114,6 +118,29 @@ void x86_pfe_handler(x86_iframe_t *frame)
     thread_t *current_thread;
     error_code = frame->err_code;
 
+#if WITH_KERNEL_VM
+    /* not present faults may be the first touch of a demand committed page,
+     * the vmm can block so only try if the faulting code was preemptible */
+    if (!(error_code & (PFEX_P | PFEX_RSV)) && (frame->flags & X86_FLAGS_IF)) {
+        vaddr_t fault_addr = x86_get_cr2();
+        uint pf_flags = 0;
+
+        if (error_code & PFEX_W)
+            pf_flags |= VMM_PF_FLAG_WRITE;
+        if (error_code & PFEX_U)
+            pf_flags |= VMM_PF_FLAG_USER;
+        if (error_code & PFEX_I)
+            pf_flags |= VMM_PF_FLAG_INSTRUCTION;
+
+        arch_enable_ints();
+        status_t err = vmm_page_fault_handler(fault_addr, pf_flags);
+        arch_disable_ints();
+
+        if (err == NO_ERROR)
+            return;
+    }
+#endif
+
 #ifdef PAGE_FAULT_DEBUG_INFO
     addr_t v_addr, ssp, esp, ip, rip;
     v_addr = x86_get_cr2();
@@ -23,12 +23,37 @@
 #pragma once
 
 #include <compiler.h>
+#include <sys/types.h>
+#include <arch/x86/mmu.h>
+#include <kernel/asid.h>
 
 __BEGIN_CDECLS
 
 struct arch_aspace {
+#if ARCH_X86_64
+    /* top level page table, the kernel half is shared by every aspace */
+    map_addr_t pml4;
+    paddr_t pml4_phys;
+
+    /* process context id, allocated by kernel/vm/asid.c */
+    asid_t asid;
+
+    /* cpus that may still have tlb entries tagged with the pcid for unmapped pages */
+    uint stale_cpus;
+
+    uint flags;
+
+    /* range of address space */
+    vaddr_t base;
+    size_t size;
+#else
     // nothing for now, does not support address spaces other than the kernel
+#endif
 };
 
+#if ARCH_X86_64
+#define ARCH_ASPACE_HAS_ASID 1
+#endif
+
 __END_CDECLS
 
@@ -33,12 +33,79 @@ typedef unsigned long spin_lock_t;
 typedef x86_flags_t spin_lock_saved_state_t;
 typedef uint spin_lock_save_flags_t;
 
-/* simple implementation of spinlocks for no smp support */
 static inline void arch_spin_lock_init(spin_lock_t *lock)
 {
     *lock = SPIN_LOCK_INITIAL_VALUE;
 }
 
+#if WITH_SMP && X86_TICKET_SPINLOCKS
+/*
+ * Ticket lock, so waiters get the lock in the order they arrived. The low 16
+ * bits of the lock word are the ticket currently being served, the next 16
+ * the next ticket to hand out. The lock is free when the two are equal.
+ */
+#define X86_SPIN_TICKET_INC (1u << 16)
+
+static inline bool arch_spin_lock_held(spin_lock_t *lock)
+{
+    uint32_t val = __atomic_load_n((uint32_t *)lock, __ATOMIC_RELAXED);
+    return (val & 0xffff) != (val >> 16);
+}
+
+static inline void arch_spin_lock(spin_lock_t *lock)
+{
+    uint32_t val = __atomic_fetch_add((uint32_t *)lock, X86_SPIN_TICKET_INC, __ATOMIC_ACQUIRE);
+    uint16_t ticket = val >> 16;
+
+    while ((uint16_t)val != ticket) {
+        __asm__ volatile("pause");
+        val = __atomic_load_n((uint16_t *)lock, __ATOMIC_ACQUIRE);
+    }
+}
+
+static inline int arch_spin_trylock(spin_lock_t *lock)
+{
+    uint32_t val = __atomic_load_n((uint32_t *)lock, __ATOMIC_RELAXED);
+
+    if ((val & 0xffff) != (val >> 16))
+        return 1;
+
+    return !__atomic_compare_exchange_n((uint32_t *)lock, &val, val + X86_SPIN_TICKET_INC,
+                                        false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void arch_spin_unlock(spin_lock_t *lock)
+{
+    /* only the holder writes the ticket being served */
+    uint16_t *owner = (uint16_t *)lock;
+    __atomic_store_n(owner, *owner + 1, __ATOMIC_RELEASE);
+}
+#elif WITH_SMP
+/* test-and-set lock, spinning on a plain load so waiters don't bounce the line */
+static inline bool arch_spin_lock_held(spin_lock_t *lock)
+{
+    return __atomic_load_n(lock, __ATOMIC_RELAXED) != 0;
+}
+
+static inline void arch_spin_lock(spin_lock_t *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED) != 0)
+            __asm__ volatile("pause");
+    }
+}
+
+static inline int arch_spin_trylock(spin_lock_t *lock)
+{
+    return __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0;
+}
+
+static inline void arch_spin_unlock(spin_lock_t *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+#else
+/* simple implementation of spinlocks for no smp support */
 static inline bool arch_spin_lock_held(spin_lock_t *lock)
 {
     return *lock != 0;
@@ -58,6 +125,7 @@ static inline void arch_spin_unlock(spin_lock_t *lock)
 {
     *lock = 0;
 }
+#endif
 
 /* flags are unused on x86 */
 #define ARCH_DEFAULT_SPIN_LOCK_FLAG_INTERRUPTS  0
@@ -136,6 +136,8 @@ typedef tss_32_t tss_t;
 typedef tss_64_t tss_t;
 #endif
 
+#define X86_FLAGS_IF (1 << 9) /* interrupts enabled */
+
 #define X86_CR0_PE 0x00000001 /* protected mode enable */
 #define X86_CR0_MP 0x00000002 /* monitor coprocessor */
 #define X86_CR0_EM 0x00000004 /* emulation */
@@ -146,14 +148,18 @@ typedef tss_64_t tss_t;
 #define X86_CR0_CD 0x40000000 /* cache disable */
 #define X86_CR0_PG 0x80000000 /* enable paging */
 #define X86_CR4_PAE 0x00000020 /* PAE paging */
+#define X86_CR4_PGE 0x00000080 /* page global enable */
 #define X86_CR4_OSFXSR 0x00000200 /* os supports fxsave */
 #define X86_CR4_OSXMMEXPT 0x00000400 /* os supports xmm exception */
+#define X86_CR4_PCIDE 0x00020000 /* process context ids */
 #define X86_CR4_OSXSAVE 0x00040000 /* os supports xsave */
 #define X86_CR4_SMEP 0x00100000 /* SMEP protection enabling */
 #define X86_CR4_SMAP 0x00200000 /* SMAP protection enabling */
 #define x86_EFER_NXE 0x00000800 /* to enable execute disable bit */
 #define x86_MSR_EFER 0xc0000080 /* EFER Model Specific Register id */
 #define X86_CR4_PSE 0xffffffef /* Disabling PSE bit in the CR4 */
+#define X86_CR3_PCID_MASK 0xfffULL /* pcid in the low bits of cr3 */
+#define X86_CR3_NOFLUSH (1ULL << 63) /* keep the pcid's tlb entries on a cr3 load */
 
 #if ARCH_X86_32
 static inline void set_in_cr0(uint32_t mask)
@@ -843,6 +849,18 @@ static inline uint64_t check_smap_avail(void)
     return ((reg_b>>0x13) & 0x1);
 }
 
+static inline uint64_t check_pcid_avail(void)
+{
+    uint32_t reg_a = 0x01;
+    uint32_t reg_b = 0x0;
+    uint32_t reg_c = 0x0;
+    uint32_t reg_d = 0x0;
+    __asm__ __volatile__ (
+        "cpuid \n\t"
+        :"+a" (reg_a), "=b" (reg_b), "+c" (reg_c), "=d" (reg_d));
+    return ((reg_c>>0x11) & 0x1);
+}
+
 #endif // ARCH_X86_64
 
 __END_CDECLS
@@ -101,6 +101,7 @@
 
 #include <sys/types.h>
 #include <compiler.h>
+#include <list.h>
 
 __BEGIN_CDECLS
 
@@ -149,7 +150,10 @@ status_t x86_mmu_get_mapping(map_addr_t init_table, vaddr_t vaddr, uint32_t *ret
 status_t x86_mmu_map_range (map_addr_t pt, struct map_range *range, arch_flags_t flags);
 status_t x86_mmu_add_mapping(map_addr_t init_table, map_addr_t paddr,
                              vaddr_t vaddr, arch_flags_t flags);
-status_t x86_mmu_unmap(map_addr_t init_table, vaddr_t vaddr, uint count);
+/* emptied page tables are queued on freed_tables, free them after the tlb flush */
+status_t x86_mmu_unmap(map_addr_t init_table, vaddr_t vaddr, uint count, struct list_node *freed_tables);
+void x86_mmu_free_tables(struct list_node *tables);
+void x86_tlb_flush_range(vaddr_t vaddr, uint count, struct list_node *freed_tables);
 
 void x86_mmu_early_init(void);
 void x86_mmu_init(void);
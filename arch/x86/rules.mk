@@ -41,6 +41,13 @@ GLOBAL_DEFINES += \
 	SMP_MAX_CPUS=1 \
 	X86_WITH_FPU=1
 
+# fair ticket spinlocks, set to false for the plain test-and-set lock
+X86_TICKET_SPINLOCKS ?= true
+ifeq (true,$(call TOBOOL,$(X86_TICKET_SPINLOCKS)))
+GLOBAL_DEFINES += \
+	X86_TICKET_SPINLOCKS=1
+endif
+
 MODULE_SRCS += \
 	$(SUBARCH_DIR)/start.S \
 	$(SUBARCH_DIR)/asm.S \
@@ -30,7 +30,7 @@
 #include <err.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
-#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
 #include <lib/bio.h>
 
@@ -73,56 +73,78 @@ struct virtio_blk_req {
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
 
+#define VIRTIO_BLOCK_RING_SIZE  256
+
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
 static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count);
 static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count);
+static status_t virtio_bdev_submit(struct bdev *bdev, bio_request_t *req);
 
 struct virtio_block_dev {
     struct virtio_device *dev;
 
-    mutex_t lock;
-    event_t io_event;
+    spin_lock_t lock;
 
     /* bio block device */
     bdev_t bdev;
 
-    /* one blk_req structure for io, not crossing a page boundary */
+    /* a blk_req header and response byte for every possible chain head */
     struct virtio_blk_req *blk_req;
-    paddr_t blk_req_phys;
+    uint8_t *blk_response;
+
+    /* requests in flight, indexed by the head of their descriptor chain */
+    bio_request_t *pending[VIRTIO_BLOCK_RING_SIZE];
 
-    /* one uint8_t response word */
-    uint8_t blk_response;
-    paddr_t blk_response_phys;
+    /* requests waiting for descriptors to free up */
+    struct list_node queue;
 };
 
+static paddr_t virtio_block_phys(const void *ptr)
+{
+#if WITH_KERNEL_VM
+    return vaddr_to_paddr((void *)ptr);
+#else
+    return (paddr_t)(uintptr_t)ptr;
+#endif
+}
+
+/* worst case number of descriptors a transfer to or from buf needs */
+static size_t virtio_block_desc_count(const void *buf, size_t len)
+{
+#if WITH_KERNEL_VM
+    /* header, response and one per page of the buffer */
+    vaddr_t va = (vaddr_t)buf;
+    return 2 + (ROUNDUP(va + len, PAGE_SIZE) - ROUNDDOWN(va, PAGE_SIZE)) / PAGE_SIZE;
+#else
+    return 3;
+#endif
+}
+
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
 {
     LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
 
     /* allocate a new block device */
-    struct virtio_block_dev *bdev = malloc(sizeof(struct virtio_block_dev));
+    struct virtio_block_dev *bdev = calloc(1, sizeof(struct virtio_block_dev));
     if (!bdev)
         return ERR_NO_MEMORY;
 
-    mutex_init(&bdev->lock);
-    event_init(&bdev->io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    bdev->lock = SPIN_LOCK_INITIAL_VALUE;
+    list_initialize(&bdev->queue);
 
     bdev->dev = dev;
     dev->priv = bdev;
 
-    bdev->blk_req = memalign(sizeof(struct virtio_blk_req), sizeof(struct virtio_blk_req));
-#if WITH_KERNEL_VM
-    bdev->blk_req_phys = vaddr_to_paddr(bdev->blk_req);
-#else
-    bdev->blk_freq_phys = (uint64_t)(uintptr_t)bdev->blk_req;
-#endif
-    LTRACEF("blk_req structure at %p (0x%lx phys)\n", bdev->blk_req, bdev->blk_req_phys);
-
-#if WITH_KERNEL_VM
-    bdev->blk_response_phys = vaddr_to_paddr(&bdev->blk_response);
-#else
-    bdev->blk_response_phys = (uint64_t)(uintptr_t)&bdev->blk_response;
-#endif
+    bdev->blk_req = memalign(sizeof(struct virtio_blk_req),
+                             sizeof(struct virtio_blk_req) * VIRTIO_BLOCK_RING_SIZE);
+    bdev->blk_response = malloc(VIRTIO_BLOCK_RING_SIZE);
+    if (!bdev->blk_req || !bdev->blk_response) {
+        free(bdev->blk_req);
+        free(bdev->blk_response);
+        free(bdev);
+        return ERR_NO_MEMORY;
+    }
+    LTRACEF("blk_req structures at %p, responses at %p\n", bdev->blk_req, bdev->blk_response);
 
     /* make sure the device is reset */
     virtio_reset_device(dev);
@@ -140,7 +162,7 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     // XXX check features bits and ack/nak them
 
     /* allocate a virtio ring */
-    virtio_alloc_ring(dev, 0, 256);
+    virtio_alloc_ring(dev, 0, VIRTIO_BLOCK_RING_SIZE);
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_block_irq_driver_callback;
@@ -159,6 +181,7 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     /* override our block device hooks */
     bdev->bdev.read_block = &virtio_bdev_read_block;
     bdev->bdev.write_block = &virtio_bdev_write_block;
+    bdev->bdev.submit = &virtio_bdev_submit;
 
     bio_register_device(&bdev->bdev);
 
@@ -167,69 +190,40 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     return NO_ERROR;
 }
 
-static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e)
-{
-    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
-
-    LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
-
-    /* parse our descriptor chain, add back to the free queue */
-    uint16_t i = e->id;
-    for (;;) {
-        int next;
-        struct vring_desc *desc = virtio_desc_index_to_desc(dev, ring, i);
-
-        //virtio_dump_desc(desc);
-
-        if (desc->flags & VRING_DESC_F_NEXT) {
-            next = desc->next;
-        } else {
-            /* end of chain */
-            next = -1;
-        }
-
-        virtio_free_desc(dev, ring, i);
-
-        if (next < 0)
-            break;
-        i = next;
-    }
-
-    /* signal our event */
-    event_signal(&bdev->io_event, false);
-
-    return INT_RESCHEDULE;
-}
-
-ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
+/* put a request on the ring if there are enough descriptors, with the lock held */
+static bool virtio_block_queue_locked(struct virtio_block_dev *bdev, bio_request_t *req)
 {
-    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
-
-    uint16_t i;
+    struct virtio_device *dev = bdev->dev;
+    size_t len = (size_t)req->count * bdev->bdev.block_size;
+    bool write = (req->op == BIO_OP_WRITE);
     struct vring_desc *desc;
-    paddr_t pa;
-    vaddr_t va = (vaddr_t)buf;
-
-    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
-
-    mutex_acquire(&bdev->lock);
+    uint16_t i;
 
-    /* set up the request */
-    bdev->blk_req->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    bdev->blk_req->ioprio = 0;
-    bdev->blk_req->sector = offset / 512;
-    LTRACEF("blk_req type %u ioprio %u sector %llu\n",
-            bdev->blk_req->type, bdev->blk_req->ioprio, bdev->blk_req->sector);
+    if (dev->ring[0].free_count < virtio_block_desc_count(req->buf, len))
+        return false;
 
     /* put together a transfer */
     desc = virtio_alloc_desc_chain(dev, 0, 3, &i);
+    DEBUG_ASSERT(desc);
     LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
 
+    DEBUG_ASSERT(bdev->pending[i] == NULL);
+    bdev->pending[i] = req;
+
+    /* set up the request, the header is picked by the chain's head */
+    struct virtio_blk_req *blk_req = &bdev->blk_req[i];
+    blk_req->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    blk_req->ioprio = 0;
+    blk_req->sector = ((uint64_t)req->block * bdev->bdev.block_size) / 512;
+    bdev->blk_response[i] = VIRTIO_BLK_S_IOERR;
+    LTRACEF("blk_req type %u ioprio %u sector %llu\n",
+            blk_req->type, blk_req->ioprio, blk_req->sector);
+
     // XXX not cache safe.
     // At the moment only tested on arm qemu, which doesn't emulate cache.
 
     /* set up the descriptor pointing to the head */
-    desc->addr = bdev->blk_req_phys;
+    desc->addr = virtio_block_phys(blk_req);
     desc->len = sizeof(struct virtio_blk_req);
     desc->flags |= VRING_DESC_F_NEXT;
 
@@ -237,11 +231,12 @@ ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offs
     desc = virtio_desc_index_to_desc(dev, 0, desc->next);
 #if WITH_KERNEL_VM
     /* translate the first buffer */
-    pa = vaddr_to_paddr((void *)va);
+    vaddr_t va = (vaddr_t)req->buf;
+    paddr_t pa = vaddr_to_paddr((void *)va);
     desc->addr = (uint64_t)pa;
     /* desc->len is filled in below */
 #else
-    desc->addr = (uint64_t)(uintptr_t)buf;
+    desc->addr = (uint64_t)(uintptr_t)req->buf;
     desc->len = len;
 #endif
     desc->flags |= write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
@@ -284,30 +279,130 @@ ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offs
             desc = next_desc;
         }
         len -= len_tohandle;
-        next_pa += PAGE_SIZE;
+        next_pa = pa + PAGE_SIZE;
     }
 #endif
 
     /* set up the descriptor pointing to the response */
     desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-    desc->addr = bdev->blk_response_phys;
+    desc->addr = virtio_block_phys(&bdev->blk_response[i]);
     desc->len = 1;
     desc->flags = VRING_DESC_F_WRITE;
 
     /* submit the transfer */
     virtio_submit_chain(dev, 0, i);
 
-    /* kick it off */
-    virtio_kick(dev, 0);
+    return true;
+}
 
-    /* wait for the transfer to complete */
-    event_wait(&bdev->io_event);
+static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e)
+{
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+
+    LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
+
+    spin_lock(&bdev->lock);
+
+    /* find the request this chain belonged to */
+    uint16_t i = e->id;
+    bio_request_t *req = bdev->pending[i];
+    uint8_t status = bdev->blk_response[i];
+    bdev->pending[i] = NULL;
+
+    /* parse our descriptor chain, add back to the free queue */
+    for (;;) {
+        int next;
+        struct vring_desc *desc = virtio_desc_index_to_desc(dev, ring, i);
+
+        //virtio_dump_desc(desc);
 
-    LTRACEF("status 0x%hhx\n", bdev->blk_response);
+        if (desc->flags & VRING_DESC_F_NEXT) {
+            next = desc->next;
+        } else {
+            /* end of chain */
+            next = -1;
+        }
+
+        virtio_free_desc(dev, ring, i);
+
+        if (next < 0)
+            break;
+        i = next;
+    }
+
+    /* start as many of the waiting requests as now fit */
+    bool kick = false;
+    bio_request_t *queued;
+    while ((queued = list_peek_head_type(&bdev->queue, bio_request_t, node))) {
+        if (!virtio_block_queue_locked(bdev, queued))
+            break;
+        list_delete(&queued->node);
+        kick = true;
+    }
+    if (kick)
+        virtio_kick(dev, 0);
 
-    mutex_release(&bdev->lock);
+    spin_unlock(&bdev->lock);
 
-    return len;
+    DEBUG_ASSERT(req);
+    LTRACEF("req %p status 0x%hhx\n", req, status);
+
+    bio_complete_request(req, (status == VIRTIO_BLK_S_OK) ?
+                         (ssize_t)(req->count * bdev->bdev.block_size) : ERR_IO);
+
+    return INT_RESCHEDULE;
+}
+
+static status_t virtio_bdev_submit(struct bdev *_bdev, bio_request_t *req)
+{
+    struct virtio_block_dev *bdev = containerof(_bdev, struct virtio_block_dev, bdev);
+
+    LTRACEF("dev %p, req %p, op %d, block 0x%x, count %u\n", _bdev, req, req->op, req->block, req->count);
+
+    if (virtio_block_desc_count(req->buf, (size_t)req->count * bdev->bdev.block_size) > VIRTIO_BLOCK_RING_SIZE)
+        return ERR_TOO_BIG;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bdev->lock, state);
+
+    /* stay behind anything already waiting for descriptors */
+    if (list_is_empty(&bdev->queue) && virtio_block_queue_locked(bdev, req)) {
+        /* kick it off */
+        virtio_kick(bdev->dev, 0);
+    } else {
+        list_add_tail(&bdev->queue, &req->node);
+    }
+
+    spin_unlock_irqrestore(&bdev->lock, state);
+
+    return NO_ERROR;
+}
+
+ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
+{
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+    bio_request_t req;
+    status_t err;
+
+    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+
+    DEBUG_ASSERT((offset % bdev->bdev.block_size) == 0);
+    DEBUG_ASSERT((len % bdev->bdev.block_size) == 0);
+
+    if (len == 0)
+        return 0;
+
+    bio_request_init(&req, write ? BIO_OP_WRITE : BIO_OP_READ, buf,
+                     offset / bdev->bdev.block_size, len / bdev->bdev.block_size,
+                     NULL, NULL);
+    req.dev = &bdev->bdev;
+
+    err = virtio_bdev_submit(&bdev->bdev, &req);
+    if (err < 0)
+        return err;
+
+    /* wait for the transfer to complete */
+    return bio_wait_request(&req);
 }
 
 static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
@@ -316,12 +411,8 @@ static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block
 
     LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
 
-    if (virtio_block_read_write(dev->dev, buf, (off_t)block * dev->bdev.block_size,
-                                count * dev->bdev.block_size, false) == 0) {
-        return count * dev->bdev.block_size;
-    } else {
-        return ERR_IO;
-    }
+    return virtio_block_read_write(dev->dev, buf, (off_t)block * dev->bdev.block_size,
+                                   count * dev->bdev.block_size, false);
 }
 
 static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count)
@@ -330,11 +421,6 @@ static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_
 
     LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
 
-    if (virtio_block_read_write(dev->dev, (void *)buf, (off_t)block * dev->bdev.block_size,
-                                count * dev->bdev.block_size, true) == 0) {
-        return count * dev->bdev.block_size;
-    } else {
-        return ERR_IO;
-    }
+    return virtio_block_read_write(dev->dev, (void *)buf, (off_t)block * dev->bdev.block_size,
+                                   count * dev->bdev.block_size, true);
 }
-
@@ -37,3 +37,6 @@ status_t virtio_net_get_mac_addr(uint8_t mac_addr[6]);
 struct pktbuf;
 extern status_t virtio_net_send_minip_pkt(struct pktbuf *p);
 
+/* the MINIP_TX_* features virtio_net_send_minip_pkt supports */
+uint32_t virtio_net_minip_tx_features(void);
+
@@ -51,9 +51,15 @@ struct virtio_net_hdr {
     uint16_t gso_size;
     uint16_t csum_start;
     uint16_t csum_offset;
-    uint16_t num_buffers; // unused in tx
+    uint16_t num_buffers; // only there with VIRTIO_NET_F_MRG_RXBUF, unused in tx
 } __PACKED;
 
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM         (1<<0)
+#define VIRTIO_NET_HDR_F_DATA_VALID         (1<<1)
+
+#define VIRTIO_NET_HDR_GSO_NONE             0
+#define VIRTIO_NET_HDR_GSO_TCPV4            1
+
 #define VIRTIO_NET_F_CSUM                   (1<<0)
 #define VIRTIO_NET_F_GUEST_CSUM             (1<<1)
 #define VIRTIO_NET_F_CTRL_GUEST_OFFLOADS    (1<<2)
@@ -79,7 +85,8 @@ struct virtio_net_hdr {
 #define VIRTIO_NET_S_LINK_UP                (1<<0)
 #define VIRTIO_NET_S_ANNOUNCE               (1<<1)
 
-#define TX_RING_SIZE 16
+/* room for a couple of 64K TSO frames gathered from mss sized pktbufs */
+#define TX_RING_SIZE 128
 #define RX_RING_SIZE 16
 
 #define RING_RX 0
@@ -92,6 +99,8 @@ struct virtio_net_dev {
     bool started;
 
     struct virtio_net_config *config;
+    uint32_t features; // what we accepted of the host's features
+    size_t hdr_len;    // length of the virtio_net_hdr in front of every frame
 
     spin_lock_t lock;
     event_t rx_event;
@@ -160,9 +169,21 @@ status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features)
     /* ack and set the driver status bit */
     virtio_status_acknowledge_driver(dev);
 
-    // XXX check features bits and ack/nak them
     dump_feature_bits(host_features);
 
+    /* take the offloads minip can use. TSO needs the host to do checksums, and
+     * receive segmentation is left off, the rx ring can't hold a 64K frame */
+    ndev->features = host_features & (VIRTIO_NET_F_MAC | VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM |
+                                      VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_MRG_RXBUF);
+    if (!(ndev->features & VIRTIO_NET_F_CSUM))
+        ndev->features &= ~VIRTIO_NET_F_HOST_TSO4;
+    virtio_set_guest_features(dev, ndev->features);
+
+    /* the header only carries num_buffers with mergeable rx buffers, in both directions */
+    ndev->hdr_len = sizeof(struct virtio_net_hdr);
+    if (!(ndev->features & VIRTIO_NET_F_MRG_RXBUF))
+        ndev->hdr_len -= sizeof(uint16_t);
+
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_net_irq_driver_callback;
 
@@ -199,61 +220,99 @@ status_t virtio_net_start(void)
     return NO_ERROR;
 }
 
+/* Queue a packet, possibly multi-part, for transmit. Each part gets a
+ * descriptor of its own, so data the stack is still holding on to can be sent
+ * without copying it. On failure the packet is left as it was passed in.
+ */
 static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t *p2)
 {
     struct virtio_device *vdev = ndev->dev;
 
     uint16_t i;
     pktbuf_t *p;
+    pktbuf_t *q;
 
     DEBUG_ASSERT(ndev);
 
-    p = pktbuf_alloc();
-    if (!p)
-        return ERR_NO_MEMORY;
+    /* the virtio header goes in front of the packet if there is room for it,
+     * otherwise in a pktbuf of its own */
+    const size_t hdr_len = ndev->hdr_len;
+    const uint8_t *frame = p2->data;
+    struct virtio_net_hdr *hdr;
+    if (pktbuf_avail_head(p2) >= hdr_len) {
+        p = NULL;
+        hdr = pktbuf_prepend(p2, hdr_len);
+    } else {
+        p = pktbuf_alloc();
+        if (!p)
+            return ERR_NO_MEMORY;
+
+        hdr = pktbuf_append(p, hdr_len);
+        pktbuf_link(p, p2);
+    }
+    memset(hdr, 0, hdr_len);
+
+    /* pass along whatever the stack left for us to finish, offsets are from the start of the frame */
+    if (p2->flags & PKTBUF_FLAG_CKSUM_PARTIAL) {
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = p2->csum_start;
+        hdr->csum_offset = p2->csum_offset;
 
-    /* point our header to the base of the first pktbuf */
-    struct virtio_net_hdr *hdr = pktbuf_append(p, sizeof(struct virtio_net_hdr) - 2);
-    memset(hdr, 0, p->dlen);
+        if (p2->gso_size) {
+            /* the tcp header is in the first part, the data offset gives its length */
+            const uint8_t *tcp = frame + p2->csum_start;
+
+            hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+            hdr->gso_size = p2->gso_size;
+            hdr->hdr_len = p2->csum_start + ((tcp[12] >> 4) & 0xf) * 4;
+        }
+    }
+
+    pktbuf_t *first = p ? p : p2;
+    uint count = 0;
+    for (q = first; q; q = q->next)
+        count++;
 
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&ndev->lock, state);
 
     /* only queue if we have enough tx descriptors */
-    if (ndev->tx_pending_count + 2 > TX_RING_SIZE)
+    if (ndev->tx_pending_count + count > TX_RING_SIZE)
         goto nodesc;
 
     /* allocate a chain of descriptors for our transfer */
-    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_TX, 2, &i);
+    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_TX, count, &i);
     if (!desc) {
+nodesc:
         spin_unlock_irqrestore(&ndev->lock, state);
 
-nodesc:
         TRACEF("out of virtio tx descriptors, tx_pending_count %u\n", ndev->tx_pending_count);
-        pktbuf_free(p, true);
+        if (p)
+            pktbuf_free(p, true);
+        else
+            pktbuf_consume(p2, hdr_len);
 
         return ERR_NO_MEMORY;
     }
 
-    ndev->tx_pending_count += 2;
+    ndev->tx_pending_count += count;
 
-    /* save a pointer to our pktbufs for the irq handler to free */
-    LTRACEF("saving pointer to pkt in index %u and %u\n", i, desc->next);
-    DEBUG_ASSERT(ndev->pending_tx_packet[i] == NULL);
-    DEBUG_ASSERT(ndev->pending_tx_packet[desc->next] == NULL);
-    ndev->pending_tx_packet[i] = p;
-    ndev->pending_tx_packet[desc->next] = p2;
+    /* point a descriptor at each part, saving the pktbufs for the irq handler to free */
+    uint16_t index = i;
+    for (q = first; q; q = q->next) {
+        LTRACEF("saving pointer to pkt %p in index %u\n", q, index);
+        DEBUG_ASSERT(ndev->pending_tx_packet[index] == NULL);
+        ndev->pending_tx_packet[index] = q;
 
-    /* set up the descriptor pointing to the header */
-    desc->addr = pktbuf_data_phys(p);
-    desc->len = p->dlen;
-    desc->flags |= VRING_DESC_F_NEXT;
+        desc->addr = pktbuf_data_phys(q);
+        desc->len = q->dlen;
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(vdev, RING_TX, desc->next);
-    desc->addr = pktbuf_data_phys(p2);
-    desc->len = p2->dlen;
-    desc->flags = 0;
+        if (q->next) {
+            DEBUG_ASSERT(desc->flags & VRING_DESC_F_NEXT);
+            index = desc->next;
+            desc = virtio_desc_index_to_desc(vdev, RING_TX, index);
+        }
+    }
 
     /* submit the transfer */
     virtio_submit_chain(vdev, RING_TX, i);
@@ -300,9 +359,9 @@ static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p)
     /* point our header to the base of the pktbuf */
     p->data = p->buffer;
     struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)p->data;
-    memset(hdr, 0, sizeof(struct virtio_net_hdr) - 2);
+    memset(hdr, 0, ndev->hdr_len);
 
-    p->dlen = sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS;
+    p->dlen = ndev->hdr_len + VIRTIO_NET_MSS;
 
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&ndev->lock, state);
@@ -364,7 +423,7 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
             LTRACEF("rx pktbuf %p filled\n", p);
 
             /* trim the pktbuf according to the written length in the used element descriptor */
-            if (e->len > (sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS)) {
+            if (e->len > (ndev->hdr_len + VIRTIO_NET_MSS)) {
                 TRACEF("bad used len on RX %u\n", e->len);
                 p->dlen = 0;
             } else {
@@ -402,6 +461,7 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
 static int virtio_net_rx_worker(void *arg)
 {
     struct virtio_net_dev *ndev = (struct virtio_net_dev *)arg;
+    uint skip = 0; // trailing buffers of a frame being dropped
 
     for (;;) {
         event_wait(&ndev->rx_event);
@@ -420,11 +480,30 @@ static int virtio_net_rx_worker(void *arg)
 
             LTRACEF("got packet len %u\n", p->dlen);
 
+            if (skip > 0) {
+                skip--;
+                virtio_net_queue_rx(ndev, p);
+                continue;
+            }
+
             /* process our packet */
-            struct virtio_net_hdr *hdr = pktbuf_consume(p, sizeof(struct virtio_net_hdr) - 2);
+            struct virtio_net_hdr *hdr = pktbuf_consume(p, ndev->hdr_len);
             if (hdr) {
-                /* call up into the stack */
-                minip_rx_driver_callback(p);
+                uint num_buffers = (ndev->features & VIRTIO_NET_F_MRG_RXBUF) ? hdr->num_buffers : 1;
+
+                if (num_buffers > 1) {
+                    /* without receive segmentation every frame fits in one buffer, so this shouldn't happen */
+                    TRACEF("dropping frame spread over %u rx buffers\n", num_buffers);
+                    skip = num_buffers - 1;
+                } else {
+                    /* the host vouches for the checksum, or it came from the host and never had one */
+                    p->flags &= ~(PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD);
+                    if (hdr->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID))
+                        p->flags |= PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD;
+
+                    /* call up into the stack */
+                    minip_rx_driver_callback(p);
+                }
             }
 
             /* requeue the pktbuf in the rx queue */
@@ -455,19 +534,26 @@ status_t virtio_net_send_minip_pkt(pktbuf_t *p)
 
     DEBUG_ASSERT(p && p->dlen);
 
-    if ((p->flags & PKTBUF_FLAG_EOF) == 0) {
-        /* can't handle multi part packets yet */
-        PANIC_UNIMPLEMENTED;
-
-        return ERR_NOT_IMPLEMENTED;
-    }
-
     /* hand the pktbuf off to the nic, it owns the pktbuf from now on out unless it fails */
     status_t err = virtio_net_queue_tx_pktbuf(the_ndev, p);
     if (err < 0) {
-        pktbuf_free(p, true);
+        pktbuf_free_chain(p, true);
     }
 
     return err;
 }
 
+uint32_t virtio_net_minip_tx_features(void)
+{
+    if (!the_ndev)
+        return 0;
+
+    uint32_t features = MINIP_TX_SG;
+    if (the_ndev->features & VIRTIO_NET_F_CSUM)
+        features |= MINIP_TX_CSUM;
+    if (the_ndev->features & VIRTIO_NET_F_HOST_TSO4)
+        features |= MINIP_TX_TSO4;
+
+    return features;
+}
+
@@ -406,6 +406,12 @@ void virtio_status_driver_ok(struct virtio_device *dev)
     dev->mmio_config->status |= VIRTIO_STATUS_DRIVER_OK;
 }
 
+void virtio_set_guest_features(struct virtio_device *dev, uint32_t features)
+{
+    dev->mmio_config->guest_features_sel = 0;
+    dev->mmio_config->guest_features = features;
+}
+
 void virtio_init(uint level)
 {
 }
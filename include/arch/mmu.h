@@ -56,6 +56,12 @@ int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count
 int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count) __NONNULL((1));
 status_t arch_mmu_query(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t *paddr, uint *flags) __NONNULL((1));
 
+/* unmaps by the calling thread between begin and end may defer their tlb
+ * invalidation until end. Unmapped pages must not be freed before end returns.
+ */
+void arch_mmu_unmap_batch_begin(arch_aspace_t *aspace) __NONNULL((1));
+void arch_mmu_unmap_batch_end(arch_aspace_t *aspace) __NONNULL((1));
+
 vaddr_t arch_mmu_pick_spot(arch_aspace_t *aspace,
                            vaddr_t base, uint prev_region_arch_mmu_flags,
                            vaddr_t end,  uint next_region_arch_mmu_flags,
@@ -44,15 +44,24 @@ typedef enum {
     MP_IPI_RESCHEDULE,
 } mp_ipi_t;
 
+/* cross call task, run with interrupts disabled */
+typedef void (*mp_sync_task_t)(void *context);
+
 #ifdef WITH_SMP
 void mp_init(void);
 
 void mp_reschedule(mp_cpu_mask_t target, uint flags);
 void mp_set_curr_cpu_active(bool active);
 
+/* run task on the target cpus and wait for it to complete everywhere */
+void mp_sync_exec(mp_cpu_mask_t target, mp_sync_task_t task, void *context);
+
 /* called from arch code during reschedule irq */
 enum handler_return mp_mbx_reschedule_irq(void);
 
+/* called from arch code during generic irq */
+enum handler_return mp_mbx_generic_irq(void);
+
 /* global mp state to track what the cpus are up to */
 struct mp_state {
     volatile mp_cpu_mask_t active_cpus;
@@ -109,7 +118,18 @@ static inline void mp_init(void) {}
 static inline void mp_reschedule(mp_cpu_mask_t target, uint flags) {}
 static inline void mp_set_curr_cpu_active(bool active) {}
 
+static inline void mp_sync_exec(mp_cpu_mask_t target, mp_sync_task_t task, void *context)
+{
+    if (target != MP_CPU_ALL_BUT_LOCAL && (target & 1)) {
+        spin_lock_saved_state_t state;
+        arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+        task(context);
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+    }
+}
+
 static inline enum handler_return mp_mbx_reschedule_irq(void) { return 0; }
+static inline enum handler_return mp_mbx_generic_irq(void) { return 0; }
 
 // only one cpu exists in UP and if you're calling these functions, it's active...
 static inline int mp_is_cpu_active(uint cpu) { return 1; }
@@ -33,18 +33,23 @@ __BEGIN_CDECLS;
 
 #define MUTEX_MAGIC (0x6D757478)  // 'mutx'
 
+/* values of mutex_t.val */
+#define MUTEX_FREE      0
+#define MUTEX_HELD      1
+#define MUTEX_CONTESTED 2  // held, and there may be threads in the wait queue
+
 typedef struct mutex {
     uint32_t magic;
+    volatile int val;
     thread_t *holder;
-    int count;
     wait_queue_t wait;
 } mutex_t;
 
 #define MUTEX_INITIAL_VALUE(m) \
 { \
     .magic = MUTEX_MAGIC, \
+    .val = MUTEX_FREE, \
     .holder = NULL, \
-    .count = 0, \
     .wait = WAIT_QUEUE_INITIAL_VALUE((m).wait), \
 }
 
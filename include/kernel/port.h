@@ -47,10 +47,23 @@ typedef struct {
     port_packet_t packet;
 } port_result_t;
 
+/* A buffer passed by reference, see port_write_ref().
+ */
+typedef struct {
+    void *buf;
+    size_t len;
+} port_ref_t;
+
+typedef struct {
+    void *ctx;
+    port_ref_t ref;
+} port_ref_result_t;
+
 typedef enum {
     PORT_MODE_BROADCAST   = 0,
     PORT_MODE_UNICAST     = 1,
     PORT_MODE_BIG_BUFFER  = 2,
+    PORT_MODE_REF         = 4,  // unicast only, carries port_ref_t messages
 } port_mode_t;
 
 /* Inits the port subsystem
@@ -92,6 +105,17 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count);
  */
 status_t port_read(port_t port, lk_time_t timeout, port_result_t *result);
 
+/* Hand the buffer |buf| of |len| bytes to the reader of a PORT_MODE_REF port,
+ * non-blocking. Nothing is copied, on success the reader owns the buffer. It
+ * must come from malloc(), undelivered buffers are freed with the port.
+ */
+status_t port_write_ref(port_t port, void *buf, size_t len);
+
+/* Read one buffer from a PORT_MODE_REF port, blocking like port_read(). The
+ * caller owns the returned buffer. Reference ports cannot be in port groups.
+ */
+status_t port_read_ref(port_t port, lk_time_t timeout, port_ref_result_t *result);
+
 /* Destroy the write-side port, flush queued packets and release all resources,
  * all calls will now fail on that port. Only a closed port can be destroyed.
  */
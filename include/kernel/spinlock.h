@@ -27,10 +27,22 @@
 
 __BEGIN_CDECLS
 
+#if SPINLOCK_STATS
+/* account one acquire of lock, called with it held */
+void spin_lock_stats_record(spin_lock_t *lock, bool contended, uint32_t wait_cycles);
+#endif
+
 /* interrupts should already be disabled */
 static inline void spin_lock(spin_lock_t *lock)
 {
+#if SPINLOCK_STATS
+    bool contended = arch_spin_lock_held(lock);
+    uint32_t start = arch_cycle_count();
+    arch_spin_lock(lock);
+    spin_lock_stats_record(lock, contended, arch_cycle_count() - start);
+#else
     arch_spin_lock(lock);
+#endif
 }
 
 /* Returns 0 on success, non-0 on failure */
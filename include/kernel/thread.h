@@ -87,13 +87,15 @@ typedef struct thread {
 
     /* active bits */
     struct list_node queue_node;
+    int64_t run_queue_seq; /* insertion order while in a run queue */
     int priority;
     enum thread_state state;
     int remaining_quantum;
+    int quantum; /* preemption quantum in ticks, 0 to use the priority default */
     unsigned int flags;
 #if WITH_SMP
     int curr_cpu;
-    int pinned_cpu; /* only run on pinned_cpu if >= 0 */
+    int pinned_cpu; /* only run on pinned_cpu if >= 0, must not change while queued */
 #endif
 #if WITH_KERNEL_VM
     vmm_aspace_t *aspace;
@@ -128,7 +130,9 @@ typedef struct thread {
 #define thread_curr_cpu(t) ((t)->curr_cpu)
 #define thread_pinned_cpu(t) ((t)->pinned_cpu)
 #define thread_set_curr_cpu(t,c) ((t)->curr_cpu = (c))
-#define thread_set_pinned_cpu(t, c) ((t)->pinned_cpu = (c))
+/* the run queue a thread sits on depends on its pinning, so it can't change while queued */
+#define thread_set_pinned_cpu(t, c) \
+    do { DEBUG_ASSERT((t)->state != THREAD_READY); (t)->pinned_cpu = (c); } while (0)
 #else
 #define thread_curr_cpu(t) (0)
 #define thread_pinned_cpu(t) (-1)
@@ -146,6 +150,10 @@ typedef struct thread {
 #define DEFAULT_PRIORITY (NUM_PRIORITIES / 2)
 #define HIGH_PRIORITY ((NUM_PRIORITIES / 4) * 3)
 
+/* preemption */
+#define THREAD_TICK_PERIOD 10 /* ms between preemption ticks */
+#define DEFAULT_QUANTUM 5 /* ticks */
+
 /* stack size */
 #ifdef CUSTOM_DEFAULT_STACK_SIZE
 #define DEFAULT_STACK_SIZE CUSTOM_DEFAULT_STACK_SIZE
@@ -170,6 +178,8 @@ status_t thread_detach(thread_t *t);
 status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout);
 status_t thread_detach_and_resume(thread_t *t);
 status_t thread_set_real_time(thread_t *t);
+status_t thread_set_quantum(thread_t *t, int quantum);
+status_t thread_set_priority_quantum(int low_priority, int high_priority, int quantum);
 
 void dump_thread(thread_t *t);
 void arch_dump_thread(thread_t *t);
@@ -230,9 +240,13 @@ struct thread_stats {
     ulong interrupts; /* platform code increment this */
     ulong timer_ints; /* timer code increment this */
     ulong timers; /* timer code increment this */
+    ulong ticks_avoided; /* preemption ticks skipped while running tickless */
 
 #if WITH_SMP
     ulong reschedule_ipis;
+    ulong generic_ipis;
+    ulong steals; /* threads pulled from another cpu's run queue while idle */
+    ulong migrations; /* threads pushed to another cpu's run queue */
 #endif
 };
 
@@ -45,6 +45,11 @@ typedef struct timer {
 
     timer_callback callback;
     void *arg;
+
+    /* where the timer sits in its cpu's timer wheel, owned by the timer code */
+    uint16_t cpu;
+    uint8_t wheel_level;
+    uint8_t wheel_index;
 } timer_t;
 
 #define TIMER_INITIAL_VALUE(t) \
@@ -61,7 +66,9 @@ typedef struct timer {
  * - Timer callbacks occur from interrupt context
  * - Timers may be programmed or canceled from interrupt or thread context
  * - Timers may be canceled or reprogrammed from within their callback
- * - Timers currently are dispatched from a 10ms periodic tick
+ * - Timers currently are dispatched from a 10ms periodic tick, or from a
+ *   oneshot programmed for the next deadline on PLATFORM_HAS_DYNAMIC_TIMER
+ * - Arming and canceling a timer are constant time
 */
 void timer_initialize(timer_t *);
 void timer_set_oneshot(timer_t *, lk_time_t delay, timer_callback, void *arg);
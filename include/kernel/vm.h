@@ -83,10 +83,12 @@ typedef struct vm_page {
     struct list_node node;
 
     uint flags : 8;
-    uint ref : 24;
+    uint order : 5; /* size of a free buddy block, valid on its first page */
+    uint ref : 19;
 } vm_page_t;
 
 #define VM_PAGE_FLAG_NONFREE  (0x1)
+#define VM_PAGE_FLAG_BUDDY    (0x2) /* first page of a free buddy block */
 
 /* kernel address space */
 #ifndef KERNEL_ASPACE_BASE
@@ -119,6 +121,10 @@ static inline bool is_user_address(vaddr_t va)
 }
 
 /* physical allocator */
+
+/* largest buddy block is 2^PMM_MAX_ORDER pages */
+#define PMM_MAX_ORDER 20
+
 typedef struct pmm_arena {
     struct list_node node;
     const char *name;
@@ -132,7 +138,7 @@ typedef struct pmm_arena {
     size_t free_count;
 
     struct vm_page *page_array;
-    struct list_node free_list;
+    struct list_node free_list[PMM_MAX_ORDER + 1]; /* free buddy blocks by order */
 } pmm_arena_t;
 
 #define PMM_ARENA_FLAG_KMAP (0x1) /* this arena is already mapped and useful for kallocs */
@@ -203,6 +209,7 @@ typedef struct vmm_aspace {
     size_t  size;
 
     struct list_node region_list;
+    struct vmm_region *region_tree;
 
     arch_aspace_t arch_aspace;
 } vmm_aspace_t;
@@ -219,11 +226,19 @@ typedef struct vmm_region {
     vaddr_t base;
     size_t  size;
 
+    /* address ordered AVL tree of the aspace's regions, alongside region_list */
+    struct vmm_region *tree_left;
+    struct vmm_region *tree_right;
+    int tree_height;
+    size_t gap_before;  /* free space between the previous region and this one */
+    size_t max_gap;     /* largest gap_before in this subtree */
+
     struct list_node page_list;
 } vmm_region_t;
 
 #define VMM_REGION_FLAG_RESERVED 0x1
 #define VMM_REGION_FLAG_PHYSICAL 0x2
+#define VMM_REGION_FLAG_COMMIT_ON_DEMAND 0x4
 
 /* grab a handle to the kernel address space */
 extern vmm_aspace_t _kernel_aspace;
@@ -271,6 +286,18 @@ status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t va);
 /* For the above region creation routines. Allocate virtual space at the passed in pointer. */
 #define VMM_FLAG_VALLOC_SPECIFIC 0x1
 
+/* For vmm_alloc. Only reserve the region, its pages are allocated, zeroed and mapped
+   by vmm_page_fault_handler on first touch. */
+#define VMM_FLAG_COMMIT_ON_DEMAND 0x2
+
+#define VMM_PF_FLAG_WRITE       0x1
+#define VMM_PF_FLAG_USER        0x2
+#define VMM_PF_FLAG_INSTRUCTION 0x4
+
+/* Called by the arch page fault handlers for translation faults, with interrupts enabled.
+   Returns NO_ERROR if the fault was resolved and the access can be retried. */
+status_t vmm_page_fault_handler(vaddr_t addr, uint pf_flags);
+
 /* allocate a new address space */
 status_t vmm_create_aspace(vmm_aspace_t **aspace, const char *name, uint flags);
 
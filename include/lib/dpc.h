@@ -25,12 +25,52 @@
 
 #include <list.h>
 #include <sys/types.h>
+#include <compiler.h>
+
+__BEGIN_CDECLS
 
 typedef void (*dpc_callback)(void *arg);
 
 #define DPC_FLAG_NORESCHED 0x1
 
+/* A deferred procedure call, embedded in the caller's own structure so that
+ * queueing one never allocates. Initialize with dpc_init() or
+ * DPC_INITIAL_VALUE() and leave the fields alone afterwards.
+ */
+typedef struct dpc {
+    struct list_node node;
+    volatile int queued;
+    uint flags;
+    dpc_callback cb;
+    void *arg;
+    lk_bigtime_t queue_time;
+} dpc_t;
+
+#define DPC_INITIAL_VALUE(_cb, _arg) \
+{ \
+    .node = LIST_INITIAL_CLEARED_VALUE, \
+    .queued = 0, \
+    .flags = 0, \
+    .cb = (_cb), \
+    .arg = (_arg), \
+    .queue_time = 0, \
+}
+
+void dpc_init(dpc_t *dpc, dpc_callback cb, void *arg);
+
+/* Queue |dpc| to run on the current cpu's dpc thread. Safe from interrupt
+ * context if DPC_FLAG_NORESCHED is passed. Returns ERR_ALREADY_EXISTS if it is
+ * still queued from before; the pending call covers this one. The dpc is
+ * marked idle just before the callback runs, so the callback may requeue it,
+ * and must not be freed while queued.
+ */
+status_t dpc_enqueue(dpc_t *dpc, uint flags);
+
+/* Allocating variant for one-off calls, |cb| gets |arg| once.
+ */
 status_t dpc_queue(dpc_callback, void *arg, uint flags);
 
+__END_CDECLS
+
 #endif
 
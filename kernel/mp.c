@@ -36,6 +36,29 @@
 /* a global state structure, aligned on cpu cache line to minimize aliasing */
 struct mp_state mp __CPU_ALIGN;
 
+/* a cross call, shared by all the cpus it targets */
+struct mp_sync_context {
+    mp_sync_task_t task;
+    void *task_context;
+    volatile mp_cpu_mask_t outstanding_cpus;
+};
+
+/* mailbox entry, one per target cpu, owned by the caller of mp_sync_exec */
+struct mp_ipi_task {
+    struct mp_ipi_task *next;
+    struct mp_sync_context *context;
+};
+
+/*
+ * Per cpu mailbox of pending cross calls. Senders push onto it with a
+ * compare and swap, the owning cpu takes the whole list with a swap, so
+ * no lock is needed on either side.
+ */
+static struct mp_ipi_mailbox {
+    /* aligned here so each cpu's mailbox gets a cache line of its own */
+    struct mp_ipi_task *head __CPU_ALIGN;
+} ipi_mailbox[SMP_MAX_CPUS];
+
 void mp_init(void)
 {
 }
@@ -60,6 +83,91 @@ void mp_reschedule(mp_cpu_mask_t target, uint flags)
     arch_mp_send_ipi(target, MP_IPI_RESCHEDULE);
 }
 
+static void mp_mbx_post(uint cpu, struct mp_ipi_task *task)
+{
+    struct mp_ipi_task *head = __atomic_load_n(&ipi_mailbox[cpu].head, __ATOMIC_RELAXED);
+
+    do {
+        task->next = head;
+    } while (!__atomic_compare_exchange_n(&ipi_mailbox[cpu].head, &head, task, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* run everything posted to the local cpu's mailbox, interrupts must be disabled */
+static void mp_mbx_run_tasks(uint cpu)
+{
+    struct mp_ipi_task *list = __atomic_exchange_n(&ipi_mailbox[cpu].head, NULL, __ATOMIC_ACQUIRE);
+    struct mp_ipi_task *ordered = NULL;
+
+    /* the mailbox is a stack, run the tasks in the order they were posted */
+    while (list) {
+        struct mp_ipi_task *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    while (ordered) {
+        /* the task lives on the caller's stack, done with it once we signal */
+        struct mp_ipi_task *next = ordered->next;
+        struct mp_sync_context *context = ordered->context;
+
+        context->task(context->task_context);
+        __atomic_fetch_and(&context->outstanding_cpus, ~(1U << cpu), __ATOMIC_RELEASE);
+
+        ordered = next;
+    }
+}
+
+/*
+ * Run task(context) on every cpu in target and wait for all of them to finish.
+ * The task runs in interrupt context with interrupts disabled. If target is
+ * MP_CPU_ALL_BUT_LOCAL every other active cpu is targeted, otherwise the local
+ * cpu runs the task too if it is in the mask.
+ */
+void mp_sync_exec(mp_cpu_mask_t target, mp_sync_task_t task, void *context)
+{
+    struct mp_ipi_task ipi_tasks[SMP_MAX_CPUS];
+    spin_lock_saved_state_t state;
+
+    /* stay on this cpu until every target has checked in */
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    uint local_cpu = arch_curr_cpu_num();
+    bool run_local = (target != MP_CPU_ALL_BUT_LOCAL) && (target & (1U << local_cpu));
+
+    target &= mp.active_cpus & ~(1U << local_cpu);
+
+    LTRACEF("local %u, target 0x%x, task %p\n", local_cpu, target, task);
+
+    struct mp_sync_context sync = {
+        .task = task,
+        .task_context = context,
+        .outstanding_cpus = target,
+    };
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!(target & (1U << i)))
+            continue;
+
+        ipi_tasks[i].context = &sync;
+        mp_mbx_post(i, &ipi_tasks[i]);
+    }
+
+    if (target)
+        arch_mp_send_ipi(target, MP_IPI_GENERIC);
+
+    if (run_local)
+        task(context);
+
+    while (__atomic_load_n(&sync.outstanding_cpus, __ATOMIC_ACQUIRE)) {
+        /* two cpus cross calling each other with interrupts off must not deadlock */
+        mp_mbx_run_tasks(local_cpu);
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
 void mp_set_curr_cpu_active(bool active)
 {
     atomic_or((volatile int *)&mp.active_cpus, 1U << arch_curr_cpu_num());
@@ -75,4 +183,19 @@ enum handler_return mp_mbx_reschedule_irq(void)
 
     return (mp.active_cpus & (1U << cpu)) ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
 }
+
+enum handler_return mp_mbx_generic_irq(void)
+{
+    uint cpu = arch_curr_cpu_num();
+
+    LTRACEF("cpu %u\n", cpu);
+
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    THREAD_STATS_INC(generic_ipis);
+
+    mp_mbx_run_tasks(cpu);
+
+    return INT_NO_RESCHEDULE;
+}
 #endif
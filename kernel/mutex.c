@@ -35,6 +35,82 @@
 #include <assert.h>
 #include <err.h>
 #include <kernel/thread.h>
+#include <platform.h>
+
+/*
+ * The mutex state lives in one int, updated with atomics. An uncontended
+ * acquire or release is a single compare and swap, and the thread lock is
+ * only taken to block or to wake a waiter:
+ *
+ * MUTEX_FREE: nobody holds it.
+ * MUTEX_HELD: held, the wait queue is empty.
+ * MUTEX_CONTESTED: held, and there may be waiters. Set by a thread (with the
+ *   thread lock held) just before it blocks, so the holder's release fails
+ *   its compare and swap and goes to the slow path to wake it up.
+ *
+ * A woken waiter competes for the mutex again rather than being handed it,
+ * so a running thread may grab it first.
+ */
+
+#if WITH_SMP
+/* how long a thread spins on a mutex whose holder is running elsewhere */
+#define MUTEX_SPIN_MAX 1000
+/* spins between looks at the holder, which take the thread lock */
+#define MUTEX_SPIN_CHECK 100
+#endif
+
+static inline bool mutex_try_acquire(mutex_t *m)
+{
+    int expected = MUTEX_FREE;
+    return __atomic_compare_exchange_n(&m->val, &expected, MUTEX_HELD, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+#if WITH_SMP
+/*
+ * Whether the holder is running on another cpu. A holder clears m->holder
+ * before it releases, and has to take the thread lock to exit, so with the
+ * thread lock held a holder we can see is still around to look at.
+ */
+static bool mutex_holder_running(mutex_t *m)
+{
+    bool running = true;
+
+    THREAD_LOCK(state);
+    thread_t *holder = m->holder;
+    if (holder && (holder->state != THREAD_RUNNING ||
+                   thread_curr_cpu(holder) == (int)arch_curr_cpu_num()))
+        running = false;
+    THREAD_UNLOCK(state);
+
+    return running;
+}
+
+/*
+ * A holder running on another cpu will probably let go before we could
+ * block and be woken again, so spin for a bit while that's the case.
+ */
+static bool mutex_spin(mutex_t *m)
+{
+    for (uint i = 0; i < MUTEX_SPIN_MAX; i++) {
+        int val = __atomic_load_n(&m->val, __ATOMIC_RELAXED);
+        if (val == MUTEX_FREE) {
+            if (mutex_try_acquire(m))
+                return true;
+            continue;
+        }
+
+        /* leave it to the wait queue if there are already waiters */
+        if (val == MUTEX_CONTESTED)
+            return false;
+
+        if (i % MUTEX_SPIN_CHECK == 0 && !mutex_holder_running(m))
+            return false;
+    }
+
+    return false;
+}
+#endif
 
 /**
  * @brief  Initialize a mutex_t
@@ -62,7 +138,8 @@ void mutex_destroy(mutex_t *m)
 
     THREAD_LOCK(state);
     m->magic = 0;
-    m->count = 0;
+    m->val = MUTEX_FREE;
+    m->holder = NULL;
     wait_queue_destroy(&m->wait, true);
     THREAD_UNLOCK(state);
 }
@@ -87,28 +164,53 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
               get_current_thread(), get_current_thread()->name, m);
 #endif
 
-    THREAD_LOCK(state);
+    /* fast path, nobody holds it */
+    if (likely(mutex_try_acquire(m))) {
+        m->holder = get_current_thread();
+        return NO_ERROR;
+    }
+
+    if (timeout == 0)
+        return ERR_TIMED_OUT;
+
+#if WITH_SMP
+    if (mutex_spin(m)) {
+        m->holder = get_current_thread();
+        return NO_ERROR;
+    }
+#endif
 
+    lk_time_t deadline = current_time() + timeout;
     status_t ret = NO_ERROR;
-    if (unlikely(++m->count > 1)) {
-        ret = wait_queue_block(&m->wait, timeout);
-        if (unlikely(ret < NO_ERROR)) {
-            /* if the acquisition timed out, back out the acquire and exit */
-            if (likely(ret == ERR_TIMED_OUT)) {
-                /*
-                 * race: the mutex may have been destroyed after the timeout,
-                 * but before we got scheduled again which makes messing with the
-                 * count variable dangerous.
-                 */
-                m->count--;
+
+    THREAD_LOCK(state);
+
+    /* flag the mutex contested before blocking, so the release comes and wakes
+     * us. if it turns out to be free, it's ours. */
+    while (__atomic_exchange_n(&m->val, MUTEX_CONTESTED, __ATOMIC_ACQUIRE) != MUTEX_FREE) {
+        lk_time_t wait = INFINITE_TIME;
+        if (timeout != INFINITE_TIME) {
+            lk_time_t now = current_time();
+            if (TIME_GTE(now, deadline)) {
+                ret = ERR_TIMED_OUT;
+                goto err;
             }
-            /* if there was a general error, it may have been destroyed out from
-             * underneath us, so just exit (which is really an invalid state anyway)
-             */
+            wait = deadline - now;
+        }
+
+        ret = wait_queue_block(&m->wait, wait);
+        if (unlikely(ret < NO_ERROR)) {
+            /* timed out, or the mutex was destroyed out from underneath us
+             * (which is really an invalid state anyway) */
             goto err;
         }
     }
 
+    /* nobody else is queued, so the next release can take the fast path. anyone
+     * about to block has to get past the thread lock and re-flag it first. */
+    if (m->wait.count == 0)
+        m->val = MUTEX_HELD;
+
     m->holder = get_current_thread();
 
 err:
@@ -130,16 +232,21 @@ status_t mutex_release(mutex_t *m)
     }
 #endif
 
+    m->holder = NULL;
+
+    /* fast path, nobody waiting */
+    int expected = MUTEX_HELD;
+    if (likely(__atomic_compare_exchange_n(&m->val, &expected, MUTEX_FREE, false,
+                                           __ATOMIC_RELEASE, __ATOMIC_RELAXED)))
+        return NO_ERROR;
+
     THREAD_LOCK(state);
 
-    m->holder = 0;
+    __atomic_store_n(&m->val, MUTEX_FREE, __ATOMIC_RELEASE);
 
-    if (unlikely(--m->count >= 1)) {
-        /* release a thread */
-        wait_queue_wake_one(&m->wait, true, NO_ERROR);
-    }
+    /* release a thread to go compete for it */
+    wait_queue_wake_one(&m->wait, true, NO_ERROR);
 
     THREAD_UNLOCK(state);
     return NO_ERROR;
 }
-
@@ -35,8 +35,21 @@
 #include <pow2.h>
 #include <err.h>
 #include <kernel/thread.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <kernel/port.h>
 
+// Locking: port_lock covers the named port list and the links between
+// write ports, read ports and groups changing. Each write port's lock
+// serializes its writers against each other and against readers coming and
+// going. Port groups and all waiting are under the thread lock. The order
+// is port_lock, write port lock, thread lock.
+//
+// The packet buffers are rings with a single producer, the writer holding
+// the write port lock, and any number of lock-free consumers. Readers only
+// take the thread lock when there is nothing to read, and writers only when
+// someone may be waiting.
+
 // write ports can be in two states, open and closed, which have a
 // different magic number.
 
@@ -53,17 +66,23 @@
 
 #define MAX_PORT_GROUP_COUNT 256
 
+typedef union {
+    port_packet_t packet;
+    port_ref_t ref;
+} port_slot_t;
+
 typedef struct {
     uint log2;
-    uint avail;
-    uint head;
-    uint tail;
-    port_packet_t packet[1];
+    bool refs;
+    uint head;  // next slot to read, advanced by readers
+    uint tail;  // next slot to write, advanced by the writer
+    port_slot_t slot[1];
 } port_buf_t;
 
 typedef struct {
     int magic;
     struct list_node node;
+    spin_lock_t lock;
     port_buf_t *buf;
     struct list_node rp_list;
     port_mode_t mode;
@@ -83,54 +102,88 @@ typedef struct {
     port_buf_t *buf;
     void *ctx;
     wait_queue_t wait;
+    volatile int waiters;
     write_port_t *wport;
     port_group_t *gport;
 } read_port_t;
 
 
 static struct list_node write_port_list;
+static mutex_t port_lock = MUTEX_INITIAL_VALUE(port_lock);
 
 
-static port_buf_t *make_buf(uint pk_count)
+static port_buf_t *make_buf(uint pk_count, bool refs)
 {
-    uint size = sizeof(port_buf_t) + ((pk_count - 1) * sizeof(port_packet_t));
+    uint size = sizeof(port_buf_t) + ((pk_count - 1) * sizeof(port_slot_t));
     port_buf_t *buf = (port_buf_t *) malloc(size);
     if (!buf)
         return NULL;
     buf->log2 = log2_uint(pk_count);
+    buf->refs = refs;
     buf->head = buf->tail = 0;
-    buf->avail = pk_count;
     return buf;
 }
 
 static inline bool buf_is_empty(port_buf_t *buf)
 {
-    return buf->avail == valpow2(buf->log2);
+    return __atomic_load_n(&buf->head, __ATOMIC_SEQ_CST) ==
+           __atomic_load_n(&buf->tail, __ATOMIC_SEQ_CST);
 }
 
-static status_t buf_write(port_buf_t *buf, const port_packet_t *packets, size_t count)
+// only one writer at a time, under the write port lock.
+static status_t buf_write(port_buf_t *buf, const port_packet_t *packets,
+                          const port_ref_t *ref, size_t count)
 {
-    if (buf->avail < count)
+    uint head = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+    uint tail = buf->tail;
+
+    if (valpow2(buf->log2) - (tail - head) < count)
         return ERR_NOT_ENOUGH_BUFFER;
 
     for (size_t ix = 0; ix != count; ix++) {
-        buf->packet[buf->tail] = packets[ix];
-        buf->tail = modpow2(++buf->tail, buf->log2);
+        port_slot_t *slot = &buf->slot[modpow2(tail + ix, buf->log2)];
+        if (ref)
+            slot->ref = ref[ix];
+        else
+            slot->packet = packets[ix];
     }
-    buf->avail -= count;
+
+    // sequentially consistent, so that either the writer sees a reader's
+    // waiters count or the reader sees the new tail. see read_one().
+    __atomic_store_n(&buf->tail, tail + count, __ATOMIC_SEQ_CST);
     return NO_ERROR;
 }
 
-static status_t buf_read(port_buf_t *buf, port_result_t *pr)
+// any number of readers, lock-free.
+static status_t buf_read(port_buf_t *buf, port_slot_t *slot)
 {
-    if (buf_is_empty(buf))
-        return ERR_NO_MSG;
-    pr->packet = buf->packet[buf->head];
-    buf->head = modpow2(++buf->head, buf->log2);
-    ++buf->avail;
+    uint head = __atomic_load_n(&buf->head, __ATOMIC_RELAXED);
+
+    do {
+        if (head == __atomic_load_n(&buf->tail, __ATOMIC_SEQ_CST))
+            return ERR_NO_MSG;
+        // the copy is only kept if nobody else consumed the slot meanwhile.
+        *slot = buf->slot[modpow2(head, buf->log2)];
+    } while (!__atomic_compare_exchange_n(&buf->head, &head, head + 1, false,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
     return NO_ERROR;
 }
 
+static void free_buf(port_buf_t *buf)
+{
+    if (!buf)
+        return;
+
+    // references nobody read are still owned by the port.
+    if (buf->refs) {
+        port_slot_t slot;
+        while (buf_read(buf, &slot) == NO_ERROR)
+            free(slot.ref.buf);
+    }
+    free(buf);
+}
+
 // must be called before any use of ports.
 void port_init(void)
 {
@@ -142,56 +195,58 @@ status_t port_create(const char *name, port_mode_t mode, port_t *port)
     if (!name || !port)
         return ERR_INVALID_ARGS;
 
-    // only unicast ports can have a large buffer.
-    if (mode & PORT_MODE_BROADCAST) {
-        if (mode & PORT_MODE_BIG_BUFFER)
+    // only unicast ports can have a large buffer or pass references.
+    if (!(mode & PORT_MODE_UNICAST)) {
+        if (mode & (PORT_MODE_BIG_BUFFER | PORT_MODE_REF))
             return ERR_INVALID_ARGS;
     }
 
     if (strlen(name) >= PORT_NAME_LEN)
         return ERR_INVALID_ARGS;
 
-    // lookup for existing port, return that if found.
-    write_port_t *wp = NULL;
-    THREAD_LOCK(state1);
-    list_for_every_entry(&write_port_list, wp, write_port_t, node) {
-        if (strcmp(wp->name, name) == 0) {
-            // can't return closed ports.
-            if (wp->magic == WRITEPORT_MAGIC_X)
-                wp = NULL;
-            THREAD_UNLOCK(state1);
-            if (wp) {
-                *port = (void *) wp;
-                return ERR_ALREADY_EXISTS;
-            } else {
-                return ERR_BUSY;
-            }
-        }
-    }
-    THREAD_UNLOCK(state1);
-
-    // not found, create the write port and the circular buffer.
-    wp = calloc(1, sizeof(write_port_t));
+    // assume success; create the write port and the circular buffer.
+    write_port_t *wp = calloc(1, sizeof(write_port_t));
     if (!wp)
         return ERR_NO_MEMORY;
 
     wp->magic = WRITEPORT_MAGIC_W;
     wp->mode = mode;
+    spin_lock_init(&wp->lock);
     strlcpy(wp->name, name, sizeof(wp->name));
     list_initialize(&wp->rp_list);
 
     uint size = (mode & PORT_MODE_BIG_BUFFER) ?  PORT_BUFF_SIZE_BIG : PORT_BUFF_SIZE;
-    wp->buf = make_buf(size);
+    wp->buf = make_buf(size, mode & PORT_MODE_REF);
     if (!wp->buf) {
         free(wp);
         return ERR_NO_MEMORY;
     }
 
-    // todo: race condtion! a port with the same name could have been created
-    // by another thread at is point.
-    THREAD_LOCK(state2);
-    list_add_tail(&write_port_list, &wp->node);
-    THREAD_UNLOCK(state2);
+    // lookup for existing port, return that if found.
+    status_t rc = NO_ERROR;
+    write_port_t *existing;
+    mutex_acquire(&port_lock);
+    list_for_every_entry(&write_port_list, existing, write_port_t, node) {
+        if (strcmp(existing->name, name) == 0) {
+            // can't return closed ports.
+            if (existing->magic == WRITEPORT_MAGIC_X) {
+                rc = ERR_BUSY;
+            } else {
+                *port = (void *) existing;
+                rc = ERR_ALREADY_EXISTS;
+            }
+            break;
+        }
+    }
+    if (rc == NO_ERROR)
+        list_add_tail(&write_port_list, &wp->node);
+    mutex_release(&port_lock);
+
+    if (rc != NO_ERROR) {
+        free_buf(wp->buf);
+        free(wp);
+        return rc;
+    }
 
     *port = (void *)wp;
     return NO_ERROR;
@@ -214,7 +269,7 @@ status_t port_open(const char *name, void *ctx, port_t *port)
     // |buf| might not be needed, but we always allocate outside the lock.
     // this buffer is only needed for broadcast ports, but we don't know
     // that here.
-    port_buf_t *buf = make_buf(PORT_BUFF_SIZE);
+    port_buf_t *buf = make_buf(PORT_BUFF_SIZE, false);
     if (!buf) {
         free(rp);
         return ERR_NO_MEMORY;
@@ -223,41 +278,38 @@ status_t port_open(const char *name, void *ctx, port_t *port)
     // find the named write port and associate it with read port.
     status_t rc = ERR_NOT_FOUND;
 
-    THREAD_LOCK(state);
+    mutex_acquire(&port_lock);
     write_port_t *wp = NULL;
     list_for_every_entry(&write_port_list, wp, write_port_t, node) {
         if (strcmp(wp->name, name) == 0) {
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&wp->lock, state);
             // found; add read port to write port list.
-            rp->wport = wp;
             if (wp->buf) {
                 // this is the first read port; transfer the circular buffer.
                 list_add_tail(&wp->rp_list, &rp->w_node);
                 rp->buf = wp->buf;
                 wp->buf = NULL;
                 rc = NO_ERROR;
-            } else if (buf) {
-                // not first read port.
-                if (wp->mode & PORT_MODE_UNICAST) {
-                    // cannot add a second listener.
-                    rc = ERR_NOT_ALLOWED;
-                    break;
-                }
-                // use the new (small) circular buffer.
+            } else if (wp->mode & PORT_MODE_UNICAST) {
+                // cannot add a second listener.
+                rc = ERR_NOT_ALLOWED;
+            } else {
+                // not first read port, use the new (small) circular buffer.
                 list_add_tail(&wp->rp_list, &rp->w_node);
                 rp->buf = buf;
                 buf = NULL;
                 rc = NO_ERROR;
-            } else {
-                // |buf| allocation failed and the buffer was needed.
-                rc = ERR_NO_MEMORY;
             }
+            if (rc == NO_ERROR)
+                rp->wport = wp;
+            spin_unlock_irqrestore(&wp->lock, state);
             break;
         }
     }
-    THREAD_UNLOCK(state);
+    mutex_release(&port_lock);
 
-    if (buf)
-        free(buf);
+    free(buf);
 
     if (rc == NO_ERROR) {
         *port = (void *)rp;
@@ -290,10 +342,12 @@ status_t port_group(port_t *ports, size_t count, port_t *group)
 
     status_t rc = NO_ERROR;
 
+    mutex_acquire(&port_lock);
     THREAD_LOCK(state);
     for (size_t ix = 0; ix != count; ix++) {
         read_port_t *rp = (read_port_t *)ports[ix];
-        if ((rp->magic != READPORT_MAGIC) || rp->gport) {
+        if ((rp->magic != READPORT_MAGIC) || rp->gport ||
+            (rp->buf && rp->buf->refs)) {
             // wrong type of port, or port already part of a group,
             // in any case, undo the changes to the previous read ports.
             for (size_t jx = 0; jx != ix; jx++) {
@@ -303,10 +357,11 @@ status_t port_group(port_t *ports, size_t count, port_t *group)
             break;
         }
         // link port group and read port.
-        rp->gport = pg;
+        __atomic_store_n(&rp->gport, pg, __ATOMIC_SEQ_CST);
         list_add_tail(&pg->rp_list, &rp->g_node);
     }
     THREAD_UNLOCK(state);
+    mutex_release(&port_lock);
 
     if (rc == NO_ERROR) {
         *group = (port_t *)pg;
@@ -327,18 +382,20 @@ status_t port_group_add(port_t group, port_t port)
         return ERR_INVALID_ARGS;
 
     read_port_t *rp = (read_port_t *)port;
-    if (rp->magic != READPORT_MAGIC || rp->gport)
+    if (rp->magic != READPORT_MAGIC || rp->gport || rp->buf->refs)
         return ERR_BAD_HANDLE;
 
     status_t rc = NO_ERROR;
+    mutex_acquire(&port_lock);
     THREAD_LOCK(state);
 
     if (list_length(&pg->rp_list) == MAX_PORT_GROUP_COUNT) {
         rc = ERR_TOO_BIG;
     } else {
-        rp->gport = pg;
+        // from here on writers wake the group, see port_write().
+        __atomic_store_n(&rp->gport, pg, __ATOMIC_SEQ_CST);
         list_add_tail(&pg->rp_list, &rp->g_node);
-        
+
         // If the new read port being added has messages available, try to wake
         // any readers that might be present.
         if (!buf_is_empty(rp->buf)) {
@@ -347,6 +404,7 @@ status_t port_group_add(port_t group, port_t port)
     }
 
     THREAD_UNLOCK(state);
+    mutex_release(&port_lock);
 
     return rc;
 }
@@ -365,6 +423,7 @@ status_t port_group_remove(port_t group, port_t port)
     if (rp->magic != READPORT_MAGIC || rp->gport != pg)
         return ERR_BAD_HANDLE;
 
+    mutex_acquire(&port_lock);
     THREAD_LOCK(state);
 
     bool found = false;
@@ -375,46 +434,57 @@ status_t port_group_remove(port_t group, port_t port)
         }
     }
 
-    if (!found)
-        return ERR_BAD_HANDLE;
-
-    list_delete(&rp->g_node);
+    if (found) {
+        list_delete(&rp->g_node);
+        rp->gport = NULL;
+    }
 
     THREAD_UNLOCK(state);
+    mutex_release(&port_lock);
 
-    return NO_ERROR;
+    return found ? NO_ERROR : ERR_BAD_HANDLE;
 }
 
-status_t port_write(port_t port, const port_packet_t *pk, size_t count)
+static status_t write_common(write_port_t *wp, const port_packet_t *pk,
+                             const port_ref_t *ref, size_t count)
 {
-    if (!port || !pk)
-        return ERR_INVALID_ARGS;
-
-    write_port_t *wp = (write_port_t *)port;
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&wp->lock, state);
     if (wp->magic != WRITEPORT_MAGIC_W) {
         // wrong port type.
-        THREAD_UNLOCK(state);
+        spin_unlock_irqrestore(&wp->lock, state);
         return ERR_BAD_HANDLE;
     }
+    if (!(wp->mode & PORT_MODE_REF) != !ref) {
+        // packets to a reference port or the other way around.
+        spin_unlock_irqrestore(&wp->lock, state);
+        return ERR_NOT_VALID;
+    }
 
     status_t status = NO_ERROR;
     int awake_count = 0;
 
     if (wp->buf) {
         // there are no read ports, just write to the buffer.
-        status = buf_write(wp->buf, pk, count);
+        status = buf_write(wp->buf, pk, ref, count);
     } else {
         // there are read ports. for each, write and attempt to wake a thread
         // from the port group or from the read port itself.
         read_port_t *rp;
         list_for_every_entry(&wp->rp_list, rp, read_port_t, w_node) {
-            if (buf_write(rp->buf, pk, count) < 0) {
+            if (buf_write(rp->buf, pk, ref, count) < 0) {
                 // buffer full.
                 status = ERR_PARTIAL_WRITE;
                 continue;
             }
 
+            // nobody can be waiting on this port unless they said so, and
+            // group readers look at the port under the thread lock.
+            if (!__atomic_load_n(&rp->waiters, __ATOMIC_SEQ_CST) &&
+                !__atomic_load_n(&rp->gport, __ATOMIC_SEQ_CST))
+                continue;
+
+            THREAD_LOCK(tstate);
             int awaken = 0;
             if (rp->gport) {
                 awaken = wait_queue_wake_one(&rp->gport->wait, false, NO_ERROR);
@@ -422,12 +492,13 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count)
             if (!awaken) {
                 awaken = wait_queue_wake_one(&rp->wait, false, NO_ERROR);
             }
+            THREAD_UNLOCK(tstate);
 
             awake_count += awaken;
         }
     }
 
-    THREAD_UNLOCK(state);
+    spin_unlock_irqrestore(&wp->lock, state);
 
 #if RESCHEDULE_POLICY
     if (awake_count)
@@ -437,23 +508,56 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count)
     return status;
 }
 
-static inline status_t read_no_lock(read_port_t *rp, lk_time_t timeout, port_result_t *result)
+status_t port_write(port_t port, const port_packet_t *pk, size_t count)
 {
-    status_t status = buf_read(rp->buf, result);
-    result->ctx = rp->ctx;
+    if (!port || !pk)
+        return ERR_INVALID_ARGS;
+
+    return write_common((write_port_t *)port, pk, NULL, count);
+}
 
-    if (status != ERR_NO_MSG)
-        return status;
+status_t port_write_ref(port_t port, void *buf, size_t len)
+{
+    if (!port || !buf)
+        return ERR_INVALID_ARGS;
+
+    port_ref_t ref = { .buf = buf, .len = len };
+    return write_common((write_port_t *)port, NULL, &ref, 1);
+}
+
+static status_t read_one(read_port_t *rp, lk_time_t timeout, port_slot_t *slot)
+{
+    // fast path, no locks at all.
+    status_t rc = buf_read(rp->buf, slot);
+    if (rc != ERR_NO_MSG)
+        return rc;
 
-    // early return allows compiler to elide the rest for the group read case.
     if (!timeout)
         return ERR_TIMED_OUT;
 
-    status_t wr = wait_queue_block(&rp->wait, timeout);
-    if (wr != NO_ERROR)
-        return wr;
-    // recursive tail call is usually optimized away with a goto.
-    return read_no_lock(rp, timeout, result);
+    THREAD_LOCK(state);
+    for (;;) {
+        // announce ourselves before looking again, so a writer that we miss
+        // is sure to see us and come wake us up.
+        __atomic_add_fetch(&rp->waiters, 1, __ATOMIC_SEQ_CST);
+        rc = buf_read(rp->buf, slot);
+        if (rc == NO_ERROR) {
+            __atomic_sub_fetch(&rp->waiters, 1, __ATOMIC_RELAXED);
+            break;
+        }
+
+        rc = wait_queue_block(&rp->wait, timeout);
+        if (rc == ERR_OBJECT_DESTROYED) {
+            // the read port was closed, it may be gone already.
+            break;
+        }
+        __atomic_sub_fetch(&rp->waiters, 1, __ATOMIC_RELAXED);
+        if (rc != NO_ERROR)
+            break;
+    }
+    THREAD_UNLOCK(state);
+
+    return rc;
 }
 
 status_t port_read(port_t port, lk_time_t timeout, port_result_t *result)
@@ -463,32 +567,62 @@ status_t port_read(port_t port, lk_time_t timeout, port_result_t *result)
 
     status_t rc = ERR_GENERIC;
     read_port_t *rp = (read_port_t *)port;
+    port_slot_t slot;
 
-    THREAD_LOCK(state);
     if (rp->magic == READPORT_MAGIC) {
         // dealing with a single port.
-        rc = read_no_lock(rp, timeout, result);
+        if (rp->buf->refs)
+            return ERR_NOT_VALID;
+        result->ctx = rp->ctx;
+        rc = read_one(rp, timeout, &slot);
+        if (rc == NO_ERROR)
+            result->packet = slot.packet;
     } else if (rp->magic == PORTGROUP_MAGIC) {
-        // dealing with a port group.
+        // dealing with a port group. writers to its ports take the thread
+        // lock to wake us, so once we hold it nothing new can be missed.
         port_group_t *pg = (port_group_t *)port;
+        THREAD_LOCK(state);
         do {
             // read each port with no timeout.
             // todo: this order is fixed, probably a bad thing.
             list_for_every_entry(&pg->rp_list, rp, read_port_t, g_node) {
-                rc = read_no_lock(rp, 0, result);
-                if (rc != ERR_TIMED_OUT)
+                rc = buf_read(rp->buf, &slot);
+                if (rc == NO_ERROR) {
+                    result->ctx = rp->ctx;
+                    result->packet = slot.packet;
                     goto read_exit;
+                }
             }
             // no data, block on the group waitqueue.
             rc = wait_queue_block(&pg->wait, timeout);
         } while (rc == NO_ERROR);
+read_exit:
+        THREAD_UNLOCK(state);
     } else {
         // wrong port type.
         rc = ERR_BAD_HANDLE;
     }
 
-read_exit:
-    THREAD_UNLOCK(state);
+    return rc;
+}
+
+status_t port_read_ref(port_t port, lk_time_t timeout, port_ref_result_t *result)
+{
+    if (!port || !result)
+        return ERR_INVALID_ARGS;
+
+    read_port_t *rp = (read_port_t *)port;
+    if (rp->magic != READPORT_MAGIC)
+        return ERR_BAD_HANDLE;
+    if (!rp->buf->refs)
+        return ERR_NOT_VALID;
+
+    port_slot_t slot;
+    result->ctx = rp->ctx;
+    status_t rc = read_one(rp, timeout, &slot);
+    if (rc == NO_ERROR)
+        result->ref = slot.ref;
+
     return rc;
 }
 
@@ -500,20 +634,23 @@ status_t port_destroy(port_t port)
     write_port_t *wp = (write_port_t *) port;
     port_buf_t *buf = NULL;
 
-    THREAD_LOCK(state);
+    mutex_acquire(&port_lock);
     if (wp->magic != WRITEPORT_MAGIC_X) {
         // wrong port type.
-        THREAD_UNLOCK(state);
+        mutex_release(&port_lock);
         return ERR_BAD_HANDLE;
     }
     // remove self from global named ports list.
     list_delete(&wp->node);
 
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&wp->lock, state);
     if (wp->buf) {
         // we have no readers.
         buf = wp->buf;
     } else {
         // for each reader:
+        THREAD_LOCK(tstate);
         read_port_t *rp;
         list_for_every_entry(&wp->rp_list, rp, read_port_t, w_node) {
             // wake the read and group ports.
@@ -524,12 +661,14 @@ status_t port_destroy(port_t port)
             // remove self from reader ports.
             rp->wport = NULL;
         }
+        THREAD_UNLOCK(tstate);
     }
 
     wp->magic = 0;
-    THREAD_UNLOCK(state);
+    spin_unlock_irqrestore(&wp->lock, state);
+    mutex_release(&port_lock);
 
-    free(buf);
+    free_buf(buf);
     free(wp);
     return NO_ERROR;
 }
@@ -541,20 +680,29 @@ status_t port_close(port_t port)
 
     read_port_t *rp = (read_port_t *) port;
     port_buf_t *buf = NULL;
+    spin_lock_saved_state_t state;
 
-    THREAD_LOCK(state);
+    mutex_acquire(&port_lock);
     if (rp->magic == READPORT_MAGIC) {
         // dealing with a read port.
         if (rp->wport) {
             // remove self from write port list and reassign the bufer if last.
+            write_port_t *wp = rp->wport;
+            spin_lock_irqsave(&wp->lock, state);
             list_delete(&rp->w_node);
-            if (list_is_empty(&rp->wport->rp_list)) {
-                rp->wport->buf = rp->buf;
-                rp->buf = NULL;
+            if (list_is_empty(&wp->rp_list)) {
+                wp->buf = rp->buf;
             } else {
                 buf = rp->buf;
             }
+            spin_unlock_irqrestore(&wp->lock, state);
+        } else {
+            // the write port is gone, and the buffer with it.
+            buf = rp->buf;
         }
+        rp->buf = NULL;
+
+        THREAD_LOCK(tstate);
         if (rp->gport) {
             // remove self from port group list.
             list_delete(&rp->g_node);
@@ -562,10 +710,12 @@ status_t port_close(port_t port)
         // wake up waiters, the return code is ERR_OBJECT_DESTROYED.
         wait_queue_destroy(&rp->wait, true);
         rp->magic = 0;
+        THREAD_UNLOCK(tstate);
 
     } else if (rp->magic == PORTGROUP_MAGIC) {
         // dealing with a port group.
         port_group_t *pg = (port_group_t *) port;
+        THREAD_LOCK(tstate);
         // wake up waiters.
         wait_queue_destroy(&pg->wait, true);
         // remove self from reader ports.
@@ -574,24 +724,26 @@ status_t port_close(port_t port)
             rp->gport = NULL;
         }
         pg->magic = 0;
+        THREAD_UNLOCK(tstate);
 
     } else if (rp->magic == WRITEPORT_MAGIC_W) {
         // dealing with a write port.
         write_port_t *wp = (write_port_t *) port;
         // mark it as closed. Now it can be read but not written to.
+        spin_lock_irqsave(&wp->lock, state);
         wp->magic = WRITEPORT_MAGIC_X;
-        THREAD_UNLOCK(state);
+        spin_unlock_irqrestore(&wp->lock, state);
+        mutex_release(&port_lock);
         return NO_ERROR;
 
     } else {
-        THREAD_UNLOCK(state);
+        mutex_release(&port_lock);
         return ERR_BAD_HANDLE;
     }
 
-    THREAD_UNLOCK(state);
+    mutex_release(&port_lock);
 
-    free(buf);
+    free_buf(buf);
     free(port);
     return NO_ERROR;
 }
-
@@ -18,6 +18,14 @@ MODULE_SRCS := \
 	$(LOCAL_DIR)/mp.c \
 	$(LOCAL_DIR)/port.c
 
+# per lock acquire and wait cycle counts, see the spinlocks console command
+ifeq (true,$(call TOBOOL,$(SPINLOCK_STATS)))
+GLOBAL_DEFINES += \
+	SPINLOCK_STATS=1
+MODULE_SRCS += \
+	$(LOCAL_DIR)/spinlock.c
+endif
+
 ifeq ($(WITH_KERNEL_VM),1)
 MODULE_DEPS += kernel/vm
 else
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2026 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief  Spinlock contention statistics
+ *
+ * Built with SPINLOCK_STATS, every spin_lock() records whether the lock was
+ * already held and how many cycles it took to get it. Counters live in a
+ * small table keyed by lock address. Each entry is only updated by the holder
+ * of its lock, so the lock itself serializes the updates.
+ */
+
+#include <debug.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kernel/spinlock.h>
+
+#define SPIN_LOCK_STATS_SLOTS 256
+
+struct spin_lock_stats {
+    spin_lock_t *lock;
+    ulong acquires;
+    ulong contended;
+    uint64_t wait_cycles;
+    uint32_t max_wait_cycles;
+};
+
+static struct spin_lock_stats spin_lock_stats[SPIN_LOCK_STATS_SLOTS];
+
+/* locks that didn't fit in the table */
+static volatile int spin_lock_stats_dropped;
+
+static struct spin_lock_stats *spin_lock_stats_lookup(spin_lock_t *lock)
+{
+    uint start = ((uintptr_t)lock / sizeof(spin_lock_t)) % SPIN_LOCK_STATS_SLOTS;
+
+    for (uint i = 0; i < SPIN_LOCK_STATS_SLOTS; i++) {
+        struct spin_lock_stats *s = &spin_lock_stats[(start + i) % SPIN_LOCK_STATS_SLOTS];
+        spin_lock_t *cur = __atomic_load_n(&s->lock, __ATOMIC_RELAXED);
+
+        if (cur == lock)
+            return s;
+
+        /* claim an empty slot, other cpus may be racing for it with other locks */
+        if (!cur && __atomic_compare_exchange_n(&s->lock, &cur, lock, false,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return s;
+        if (cur == lock)
+            return s;
+    }
+
+    return NULL;
+}
+
+void spin_lock_stats_record(spin_lock_t *lock, bool contended, uint32_t wait_cycles)
+{
+    struct spin_lock_stats *s = spin_lock_stats_lookup(lock);
+    if (!s) {
+        atomic_add(&spin_lock_stats_dropped, 1);
+        return;
+    }
+
+    s->acquires++;
+    if (contended) {
+        s->contended++;
+        s->wait_cycles += wait_cycles;
+        if (wait_cycles > s->max_wait_cycles)
+            s->max_wait_cycles = wait_cycles;
+    }
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_spinlocks(int argc, const cmd_args *argv)
+{
+    if (argc > 1 && !strcmp(argv[1].str, "reset")) {
+        /* racy against concurrent acquires, good enough to start a measurement */
+        for (uint i = 0; i < SPIN_LOCK_STATS_SLOTS; i++) {
+            spin_lock_stats[i].acquires = 0;
+            spin_lock_stats[i].contended = 0;
+            spin_lock_stats[i].wait_cycles = 0;
+            spin_lock_stats[i].max_wait_cycles = 0;
+        }
+        spin_lock_stats_dropped = 0;
+        return 0;
+    }
+
+    printf("%-18s %12s %12s %14s %12s\n", "lock", "acquires", "contended",
+           "avg wait", "max wait");
+    for (uint i = 0; i < SPIN_LOCK_STATS_SLOTS; i++) {
+        struct spin_lock_stats *s = &spin_lock_stats[i];
+        if (!s->lock || !s->acquires)
+            continue;
+
+        printf("%-18p %12lu %12lu %14llu %12u\n", s->lock, s->acquires, s->contended,
+               s->contended ? s->wait_cycles / s->contended : 0ULL, s->max_wait_cycles);
+    }
+    if (spin_lock_stats_dropped)
+        printf("%d locks not tracked, table full\n", spin_lock_stats_dropped);
+
+    return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("spinlocks", "spinlock contention statistics, 'reset' to clear", &cmd_spinlocks)
+STATIC_COMMAND_END(spinlock_stats);
+
+#endif
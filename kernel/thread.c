@@ -64,12 +64,39 @@ static struct list_node thread_list;
 /* master thread spinlock */
 spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/*
+ * The per cpu run queues, each on its own cache line.
+ *
+ * There is no per queue lock: every queue is protected by the global
+ * thread_lock, so enqueue, dequeue and stealing still serialize across cpus.
+ * Wait queues, timers and thread state changes all run under thread_lock
+ * and touch the queues from inside it, so a lock per queue would first need
+ * those split away from thread_lock.
+ *
+ * Threads pinned to a cpu and threads free to run anywhere are kept in separate
+ * priority lists, so neither picking the next thread nor stealing has to skip
+ * over threads that are not eligible. Every insertion is stamped with a
+ * sequence number (decreasing for head inserts, increasing for tail inserts)
+ * so that two lists at the same priority merge in the order a single list
+ * would have had.
+ */
+struct run_queue_list {
+    struct list_node list[NUM_PRIORITIES];
+    uint32_t bitmap;
+    uint count;
+};
+
+struct run_queue {
+    struct run_queue_list pinned;
+    struct run_queue_list unpinned;
+    int64_t head_seq;
+    int64_t tail_seq;
+} __CPU_ALIGN;
+
+static struct run_queue run_queue[SMP_MAX_CPUS];
 
 /* make sure the bitmap is large enough to cover our number of priorities */
-STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue_bitmap) * 8);
+STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue[0].pinned.bitmap) * 8);
 
 /* Priority of current thread running on cpu, or last signalled */
 static int cpu_priority[SMP_MAX_CPUS];
@@ -86,14 +113,184 @@ static thread_t _idle_thread;
 /* local routines */
 static void thread_resched(void);
 static void idle_thread_routine(void) __NO_RETURN;
+static bool thread_is_real_time_or_idle(thread_t *t);
+
+/* default preemption quantum for each priority, see thread_set_priority_quantum() */
+static int priority_quantum[NUM_PRIORITIES];
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-/* preemption timer */
+/* preemption timer, only armed while another thread could take over the cpu */
 static timer_t preempt_timer[SMP_MAX_CPUS];
+static bool preempt_timer_armed[SMP_MAX_CPUS];
+#if THREAD_STATS
+/* running a preemptible thread with the preemption timer stopped, and since when */
+static bool cpu_tickless[SMP_MAX_CPUS];
+static lk_bigtime_t cpu_tickless_timestamp[SMP_MAX_CPUS];
+#endif
+
+static void thread_update_preempt_timer(uint cpu, thread_t *t);
+#endif
+
+/*
+ * Pick the cpu whose run queue a newly runnable thread should go on.
+ *
+ * Pinned threads always go to their cpu. The current thread goes back on
+ * the local queue. Otherwise the thread stays local unless it cannot
+ * preempt what is running here, in which case it is pushed to the active,
+ * non real-time cpu running the lowest priority thread, provided that is
+ * lower than the thread's own priority.
+ */
+static uint run_queue_select_cpu(thread_t *t)
+{
+#if WITH_SMP
+    uint cpu = arch_curr_cpu_num();
+
+    if (t->pinned_cpu >= 0)
+        return (uint)t->pinned_cpu;
+
+    if (t == get_current_thread() || t->priority > cpu_priority[cpu])
+        return cpu;
+
+    uint best_cpu = cpu;
+    int best_cpu_priority = cpu_priority[cpu];
+    mp_cpu_mask_t candidates = mp.active_cpus & ~mp_get_realtime_mask();
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!(candidates & (1U << i)))
+            continue;
+
+        if (cpu_priority[i] < best_cpu_priority) {
+            best_cpu = i;
+            best_cpu_priority = cpu_priority[i];
+        }
+    }
+
+    if (best_cpu_priority < t->priority)
+        return best_cpu;
+
+    return cpu;
+#else
+    return 0;
 #endif
+}
 
 /* run queue manipulation */
-static void insert_in_run_queue_head(thread_t *t)
+static inline struct run_queue_list *run_queue_list_for(struct run_queue *rq, thread_t *t)
+{
+    return (thread_pinned_cpu(t) >= 0) ? &rq->pinned : &rq->unpinned;
+}
+
+static void run_queue_add_head(struct run_queue *rq, thread_t *t)
+{
+    struct run_queue_list *rql = run_queue_list_for(rq, t);
+
+    t->run_queue_seq = --rq->head_seq;
+    list_add_head(&rql->list[t->priority], &t->queue_node);
+    rql->bitmap |= (1<<t->priority);
+    rql->count++;
+}
+
+static void run_queue_add_tail(struct run_queue *rq, thread_t *t)
+{
+    struct run_queue_list *rql = run_queue_list_for(rq, t);
+
+    t->run_queue_seq = ++rq->tail_seq;
+    list_add_tail(&rql->list[t->priority], &t->queue_node);
+    rql->bitmap |= (1<<t->priority);
+    rql->count++;
+}
+
+static void remove_from_run_queue(struct run_queue *rq, thread_t *t)
+{
+    struct run_queue_list *rql = run_queue_list_for(rq, t);
+
+    DEBUG_ASSERT(list_in_list(&t->queue_node));
+
+    list_delete(&t->queue_node);
+    rql->count--;
+
+    if (list_is_empty(&rql->list[t->priority]))
+        rql->bitmap &= ~(1<<t->priority);
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/*
+ * Does cpu have a queued thread that would be allowed to take over from t
+ * when t's quantum runs out? Lower priority threads never would.
+ */
+static bool run_queue_has_contender(uint cpu, thread_t *t)
+{
+    uint32_t bitmap = run_queue[cpu].pinned.bitmap | run_queue[cpu].unpinned.bitmap;
+
+    if (!bitmap)
+        return false;
+
+    return (int)(sizeof(bitmap) * 8 - 1 - __builtin_clz(bitmap)) >= t->priority;
+}
+
+/*
+ * Arm the preemption timer only while t, running on the local cpu, has
+ * something to be preempted for. A regular thread alone on its cpu runs
+ * without a tick until another thread of the same or higher priority is
+ * queued behind it.
+ */
+static void thread_update_preempt_timer(uint cpu, thread_t *t)
+{
+    bool preemptible = !thread_is_real_time_or_idle(t);
+    bool need_timer = preemptible && run_queue_has_contender(cpu, t);
+
+    DEBUG_ASSERT(cpu == arch_curr_cpu_num());
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+
+#if THREAD_STATS
+    bool tickless = preemptible && !need_timer;
+    if (tickless != cpu_tickless[cpu]) {
+        lk_bigtime_t now = current_time_hires();
+        if (tickless) {
+            cpu_tickless_timestamp[cpu] = now;
+        } else {
+            thread_stats[cpu].ticks_avoided +=
+                (now - cpu_tickless_timestamp[cpu]) / (THREAD_TICK_PERIOD * 1000);
+        }
+        cpu_tickless[cpu] = tickless;
+    }
+#endif
+
+    if (need_timer == preempt_timer_armed[cpu])
+        return;
+
+#if DEBUG_THREAD_CONTEXT_SWITCH
+    dprintf(ALWAYS, "%s: %s preempt, cpu %d, thread %p (%s)\n",
+            __func__, need_timer ? "start" : "stop", cpu, t, t->name);
+#endif
+
+    if (need_timer) {
+        timer_set_periodic(&preempt_timer[cpu], THREAD_TICK_PERIOD,
+                           (timer_callback)thread_timer_tick, NULL);
+    } else {
+        timer_cancel(&preempt_timer[cpu]);
+    }
+    preempt_timer_armed[cpu] = need_timer;
+}
+#endif
+
+/*
+ * A thread queued on the local cpu may give the running thread a reason
+ * to be preempted again.
+ */
+static void run_queue_check_preempt(uint cpu, thread_t *t)
+{
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    thread_t *current_thread = get_current_thread();
+
+    if (cpu == arch_curr_cpu_num() && t != current_thread &&
+            current_thread->state == THREAD_RUNNING) {
+        thread_update_preempt_timer(cpu, current_thread);
+    }
+#endif
+}
+
+static uint insert_in_run_queue_head(thread_t *t)
 {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_READY);
@@ -101,11 +298,14 @@ static void insert_in_run_queue_head(thread_t *t)
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    list_add_head(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    uint cpu = run_queue_select_cpu(t);
+    run_queue_add_head(&run_queue[cpu], t);
+    run_queue_check_preempt(cpu, t);
+
+    return cpu;
 }
 
-static void insert_in_run_queue_tail(thread_t *t)
+static uint insert_in_run_queue_tail(thread_t *t)
 {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_READY);
@@ -113,8 +313,11 @@ static void insert_in_run_queue_tail(thread_t *t)
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    list_add_tail(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    uint cpu = run_queue_select_cpu(t);
+    run_queue_add_tail(&run_queue[cpu], t);
+    run_queue_check_preempt(cpu, t);
+
+    return cpu;
 }
 
 static void init_thread_struct(thread_t *t, const char *name)
@@ -250,18 +453,70 @@ status_t thread_set_real_time(thread_t *t)
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
 
     THREAD_LOCK(state);
+    t->flags |= THREAD_FLAG_REAL_TIME;
 #if PLATFORM_HAS_DYNAMIC_TIMER
     if (t == get_current_thread()) {
         /* if we're currently running, cancel the preemption timer. */
-        timer_cancel(&preempt_timer[arch_curr_cpu_num()]);
+        thread_update_preempt_timer(arch_curr_cpu_num(), t);
     }
 #endif
-    t->flags |= THREAD_FLAG_REAL_TIME;
     THREAD_UNLOCK(state);
 
     return NO_ERROR;
 }
 
+/**
+ * @brief Set the preemption quantum of a thread
+ *
+ * @param t Thread to change
+ * @param quantum Number of preemption ticks the thread may run before
+ *                yielding to a thread of equal priority, or 0 to use the
+ *                default for the thread's priority.
+ *
+ * @return NO_ERROR on success
+ */
+status_t thread_set_quantum(thread_t *t, int quantum)
+{
+    if (!t || quantum < 0)
+        return ERR_INVALID_ARGS;
+
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+
+    THREAD_LOCK(state);
+    t->quantum = quantum;
+    THREAD_UNLOCK(state);
+
+    return NO_ERROR;
+}
+
+/**
+ * @brief Set the default preemption quantum for a band of priorities
+ *
+ * @param low_priority Lowest priority in the band
+ * @param high_priority Highest priority in the band
+ * @param quantum Number of preemption ticks, must be at least 1
+ *
+ * @return NO_ERROR on success
+ */
+status_t thread_set_priority_quantum(int low_priority, int high_priority, int quantum)
+{
+    if (low_priority < LOWEST_PRIORITY || high_priority > HIGHEST_PRIORITY ||
+            low_priority > high_priority || quantum <= 0)
+        return ERR_INVALID_ARGS;
+
+    THREAD_LOCK(state);
+    for (int i = low_priority; i <= high_priority; i++)
+        priority_quantum[i] = quantum;
+    THREAD_UNLOCK(state);
+
+    return NO_ERROR;
+}
+
+static int thread_quantum(thread_t *t)
+{
+    return t->quantum ? t->quantum : priority_quantum[t->priority];
+}
+
 static bool thread_is_realtime(thread_t *t)
 {
     return (t->flags & THREAD_FLAG_REAL_TIME) && t->priority > DEFAULT_PRIORITY;
@@ -277,28 +532,23 @@ static bool thread_is_real_time_or_idle(thread_t *t)
     return !!(t->flags & (THREAD_FLAG_REAL_TIME | THREAD_FLAG_IDLE));
 }
 
-static mp_cpu_mask_t thread_get_mp_reschedule_target(thread_t *current_thread, thread_t *t)
+static mp_cpu_mask_t thread_get_mp_reschedule_target(thread_t *current_thread, thread_t *t, uint target_cpu)
 {
 #if WITH_SMP
     uint cpu = arch_curr_cpu_num();
-    uint target_cpu;
-
-    if (t->pinned_cpu != -1 && current_thread->pinned_cpu == t->pinned_cpu)
-        return 0;
 
-    if (t->pinned_cpu == -1 || (uint)t->pinned_cpu == cpu)
+    if (target_cpu == cpu)
         return 0;
 
-    target_cpu = (uint)t->pinned_cpu;
-
     if (t->priority < cpu_priority[target_cpu])
         return 0;
 
 #ifdef DEBUG_THREAD_CPU_WAKE
     dprintf(ALWAYS, "%s: cpu %d, wake cpu %d, priority %d for priority %d thread (current priority %d)\n",
         __func__, cpu, target_cpu, cpu_priority[target_cpu], t->priority, current_thread->priority);
-    cpu_priority[target_cpu] = t->priority;
 #endif
+    /* claim the cpu so other wakeups in this window look elsewhere */
+    cpu_priority[target_cpu] = t->priority;
 
     return 1UL << target_cpu;
 #else
@@ -306,9 +556,9 @@ static mp_cpu_mask_t thread_get_mp_reschedule_target(thread_t *current_thread, t
 #endif
 }
 
-static void thread_mp_reschedule(thread_t *current_thread, thread_t *t)
+static void thread_mp_reschedule(thread_t *current_thread, thread_t *t, uint target_cpu)
 {
-    mp_reschedule(thread_get_mp_reschedule_target(current_thread, t), 0);
+    mp_reschedule(thread_get_mp_reschedule_target(current_thread, t, target_cpu), 0);
 }
 
 /**
@@ -331,12 +581,12 @@ status_t thread_resume(thread_t *t)
     THREAD_LOCK(state);
     if (t->state == THREAD_SUSPENDED) {
         t->state = THREAD_READY;
-        insert_in_run_queue_head(t);
+        uint cpu = insert_in_run_queue_head(t);
         if (!ints_disabled) /* HACK, don't resced into bootstrap thread before idle thread is set up */
             resched = true;
-    }
 
-    thread_mp_reschedule(get_current_thread(), t);
+        thread_mp_reschedule(get_current_thread(), t, cpu);
+    }
 
     THREAD_UNLOCK(state);
 
@@ -483,50 +733,132 @@ static void idle_thread_routine(void)
         arch_idle();
 }
 
-static thread_t *get_top_thread(int cpu, bool unlink)
+/* highest priority thread in one of the run queue's lists, or NULL */
+static inline thread_t *run_queue_list_peek(struct run_queue_list *rql, int *priority)
+{
+    if (!rql->bitmap)
+        return NULL;
+
+    *priority = sizeof(rql->bitmap) * 8 - 1 - __builtin_clz(rql->bitmap);
+    return list_peek_head_type(&rql->list[*priority], thread_t, queue_node);
+}
+
+/*
+ * Find the highest priority thread in a cpu's run queue, in constant time.
+ * The pinned and unpinned lists are merged by priority, then by insertion
+ * order.
+ */
+static thread_t *run_queue_top_thread(struct run_queue *rq, bool unlink)
 {
     thread_t *newthread;
-    uint32_t local_run_queue_bitmap = run_queue_bitmap;
+    int pinned_priority, unpinned_priority;
+
+    thread_t *pinned = run_queue_list_peek(&rq->pinned, &pinned_priority);
+    thread_t *unpinned = run_queue_list_peek(&rq->unpinned, &unpinned_priority);
+
+    if (!pinned) {
+        newthread = unpinned;
+    } else if (!unpinned) {
+        newthread = pinned;
+    } else if (pinned_priority != unpinned_priority) {
+        newthread = (pinned_priority > unpinned_priority) ? pinned : unpinned;
+    } else {
+        newthread = (pinned->run_queue_seq < unpinned->run_queue_seq) ? pinned : unpinned;
+    }
 
-    while (local_run_queue_bitmap) {
-        /* find the first (remaining) queue with a thread in it */
-        uint next_queue = sizeof(run_queue_bitmap) * 8 - 1 - __builtin_clz(local_run_queue_bitmap);
+    if (newthread && unlink)
+        remove_from_run_queue(rq, newthread);
+
+    return newthread;
+}
 
-        list_for_every_entry(&run_queue[next_queue], newthread, thread_t, queue_node) {
 #if WITH_SMP
-            if (newthread->pinned_cpu < 0 || newthread->pinned_cpu == cpu)
-#endif
-            {
-                if (unlink) {
-                    list_delete(&newthread->queue_node);
+/* highest priority thread that another cpu may take from a run queue */
+static thread_t *run_queue_top_unpinned_thread(struct run_queue *rq, bool unlink)
+{
+    int priority;
+    thread_t *t = run_queue_list_peek(&rq->unpinned, &priority);
 
-                    if (list_is_empty(&run_queue[next_queue]))
-                        run_queue_bitmap &= ~(1<<next_queue);
-                }
+    if (t && unlink)
+        remove_from_run_queue(rq, t);
 
-                return newthread;
-            }
+    return t;
+}
+
+/*
+ * Called when a cpu is about to go idle. Pull the highest priority unpinned
+ * thread off the run queue holding the most unpinned threads.
+ */
+static thread_t *run_queue_steal(uint cpu)
+{
+    uint busiest_cpu = 0;
+    uint busiest_count = 0;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (i == cpu)
+            continue;
+
+        if (run_queue[i].unpinned.count > busiest_count) {
+            busiest_cpu = i;
+            busiest_count = run_queue[i].unpinned.count;
         }
+    }
+
+    if (busiest_count == 0)
+        return NULL;
+
+    THREAD_STATS_INC(steals);
+    return run_queue_top_unpinned_thread(&run_queue[busiest_cpu], true);
+}
+#endif
 
-        local_run_queue_bitmap &= ~(1<<next_queue);
+static thread_t *get_top_thread(int cpu, bool unlink)
+{
+    thread_t *newthread;
+
+    newthread = run_queue_top_thread(&run_queue[cpu], unlink);
+    if (newthread)
+        return newthread;
+
+#if WITH_SMP
+    if (unlink) {
+        newthread = run_queue_steal(cpu);
+        if (newthread)
+            return newthread;
     }
+#endif
+
     /* no threads to run, select the idle thread for this cpu */
     return idle_thread(cpu);
 }
 
+/*
+ * If the local run queue holds a thread that could preempt whatever is running
+ * on another cpu, migrate it there and kick that cpu.
+ */
 static void thread_cond_mp_reschedule(thread_t *current_thread, const char *caller)
 {
 #if WITH_SMP
     int i;
+    uint cpu = arch_curr_cpu_num();
     uint best_cpu = ~0U;
     int best_cpu_priority = INT_MAX;
-    thread_t *t = get_top_thread(-1, false);
+    thread_t *t;
 
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
+    /* look for the best thread on the local queue that could run elsewhere */
+    t = run_queue_top_unpinned_thread(&run_queue[cpu], false);
+    if (!t)
+        return;
+
     for (i = 0; i < SMP_MAX_CPUS; i++) {
-        if (!mp_is_cpu_active(i))
+        if (!mp_is_cpu_active(i) || (uint)i == cpu)
+            continue;
+
+        /* a real time cpu would not pick it up until it blocks */
+        if (mp_get_realtime_mask() & (1U << i))
             continue;
 
         if (cpu_priority[i] < best_cpu_priority) {
@@ -540,10 +872,15 @@ static void thread_cond_mp_reschedule(thread_t *current_thread, const char *call
 
 #ifdef DEBUG_THREAD_CPU_WAKE
     dprintf(ALWAYS, "%s from %s: cpu %d, wake cpu %d, priority %d for priority %d thread (%s), current %d (%s)\n",
-            __func__, caller, arch_curr_cpu_num(), best_cpu, best_cpu_priority,
+            __func__, caller, cpu, best_cpu, best_cpu_priority,
             t->priority, t->name,
             current_thread->priority, current_thread->name);
 #endif
+    /* move it to the head of the target cpu's queue */
+    remove_from_run_queue(&run_queue[cpu], t);
+    run_queue_add_head(&run_queue[best_cpu], t);
+    THREAD_STATS_INC(migrations);
+
     cpu_priority[best_cpu] = t->priority;
     mp_reschedule(1UL << best_cpu, 0);
 #endif
@@ -581,12 +918,16 @@ void thread_resched(void)
 
     oldthread = current_thread;
 
-    if (newthread == oldthread)
-        return;
-
     /* set up quantum for the new thread if it was consumed */
     if (newthread->remaining_quantum <= 0) {
-        newthread->remaining_quantum = 5; // XXX make this smarter
+        newthread->remaining_quantum = thread_quantum(newthread);
+    }
+
+    if (newthread == oldthread) {
+#if PLATFORM_HAS_DYNAMIC_TIMER
+        thread_update_preempt_timer(cpu, newthread);
+#endif
+        return;
     }
 
     /* mark the cpu ownership of the threads */
@@ -622,26 +963,11 @@ void thread_resched(void)
     KEVLOG_THREAD_SWITCH(oldthread, newthread);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    if (thread_is_real_time_or_idle(newthread)) {
+    if (thread_is_real_time_or_idle(newthread))
         thread_cond_mp_reschedule(newthread, __func__);
-        if (!thread_is_real_time_or_idle(oldthread)) {
-            /* if we're switching from a non real time to a real time, cancel
-             * the preemption timer. */
-#if DEBUG_THREAD_CONTEXT_SWITCH
-            dprintf(ALWAYS, "arch_context_switch: stop preempt, cpu %d, old %p (%s), new %p (%s)\n",
-                    cpu, oldthread, oldthread->name, newthread, newthread->name);
-#endif
-            timer_cancel(&preempt_timer[cpu]);
-        }
-    } else if (thread_is_real_time_or_idle(oldthread)) {
-        /* if we're switching from a real time (or idle thread) to a regular one,
-         * set up a periodic timer to run our preemption tick. */
-#if DEBUG_THREAD_CONTEXT_SWITCH
-        dprintf(ALWAYS, "arch_context_switch: start preempt, cpu %d, old %p (%s), new %p (%s)\n",
-                cpu, oldthread, oldthread->name, newthread, newthread->name);
-#endif
-        timer_set_periodic(&preempt_timer[cpu], 10, (timer_callback)thread_timer_tick, NULL);
-    }
+
+    /* the preemption tick only runs while the new thread has competition */
+    thread_update_preempt_timer(cpu, newthread);
 #endif
 
     /* set some optional target debug leds */
@@ -792,8 +1118,8 @@ void thread_unblock(thread_t *t, bool resched)
     DEBUG_ASSERT(!thread_is_idle(t));
 
     t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
-    thread_mp_reschedule(get_current_thread(), t);
+    uint cpu = insert_in_run_queue_head(t);
+    thread_mp_reschedule(get_current_thread(), t, cpu);
     if (resched)
         thread_resched();
 }
@@ -831,7 +1157,8 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
     THREAD_LOCK(state);
 
     t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
+    uint cpu = insert_in_run_queue_head(t);
+    thread_mp_reschedule(get_current_thread(), t, cpu);
 
     THREAD_UNLOCK(state);
 
@@ -878,9 +1205,16 @@ void thread_init_early(void)
 
     DEBUG_ASSERT(arch_curr_cpu_num() == 0);
 
-    /* initialize the run queues */
     for (i=0; i < NUM_PRIORITIES; i++)
-        list_initialize(&run_queue[i]);
+        priority_quantum[i] = DEFAULT_QUANTUM;
+
+    /* initialize the run queues */
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        for (i=0; i < NUM_PRIORITIES; i++) {
+            list_initialize(&run_queue[cpu].pinned.list[i]);
+            list_initialize(&run_queue[cpu].unpinned.list[i]);
+        }
+    }
 
     /* initialize the thread list */
     list_initialize(&thread_list);
@@ -1249,8 +1583,8 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
             current_thread->state = THREAD_READY;
             insert_in_run_queue_head(current_thread);
         }
-        insert_in_run_queue_head(t);
-        thread_mp_reschedule(current_thread, t);
+        uint cpu = insert_in_run_queue_head(t);
+        thread_mp_reschedule(current_thread, t, cpu);
         if (reschedule) {
             thread_resched();
         }
@@ -1305,8 +1639,8 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
         t->wait_queue_block_ret = wait_queue_error;
         t->blocking_wait_queue = NULL;
 
-        insert_in_run_queue_head(t);
-        mp_reschedule_target |= thread_get_mp_reschedule_target(current_thread, t);
+        uint cpu = insert_in_run_queue_head(t);
+        mp_reschedule_target |= thread_get_mp_reschedule_target(current_thread, t, cpu);
         ret++;
     }
 
@@ -1367,8 +1701,8 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
     t->blocking_wait_queue = NULL;
     t->state = THREAD_READY;
     t->wait_queue_block_ret = wait_queue_error;
-    insert_in_run_queue_head(t);
-    thread_mp_reschedule(get_current_thread(), t);
+    uint cpu = insert_in_run_queue_head(t);
+    thread_mp_reschedule(get_current_thread(), t, cpu);
 
     return NO_ERROR;
 }
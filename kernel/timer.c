@@ -49,10 +49,45 @@
 
 spin_lock_t timer_lock;
 
+/*
+ * Each cpu keeps its timers in a hierarchical timing wheel. Level 0 has one
+ * slot per millisecond for the next TIMER_WHEEL_SIZE ms, every level above
+ * covers TIMER_WHEEL_SIZE times the span of the one below. A timer is filed
+ * in the lowest level that covers its deadline and is cascaded one level down
+ * each time the wheel reaches the start of its slot, so arming and canceling
+ * are constant time and each timer is touched at most once per level.
+ *
+ * A bitmap of occupied slots per level lets the next deadline be found
+ * without walking any lists. Deadlines on level 0 are exact; for the levels
+ * above it the start of the next occupied slot is reported, which is when it
+ * has to be cascaded.
+ */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1U << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS 5
+
+/* span of the whole wheel, later deadlines are clamped to it */
+#define TIMER_WHEEL_MAX_DELTA ((1U << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+struct timer_wheel_level {
+    uint64_t bitmap;
+    struct list_node slot[TIMER_WHEEL_SIZE];
+};
+
 struct timer_state {
-    struct list_node timer_queue;
+    /* the next millisecond the wheel has not yet processed */
+    lk_time_t base;
+    uint count;
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    bool armed;
+    lk_time_t armed_deadline;
+#endif
+    struct timer_wheel_level level[TIMER_WHEEL_LEVELS];
 } __CPU_ALIGN;
 
+STATIC_ASSERT(TIMER_WHEEL_SIZE <= sizeof(uint64_t) * 8);
+
 static struct timer_state timers[SMP_MAX_CPUS];
 
 static enum handler_return timer_tick(void *arg, lk_time_t now);
@@ -65,24 +100,152 @@ void timer_initialize(timer_t *timer)
     *timer = (timer_t)TIMER_INITIAL_VALUE(*timer);
 }
 
+static inline uint timer_wheel_index(lk_time_t time, uint level)
+{
+    return (time >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+}
+
 static void insert_timer_in_queue(uint cpu, timer_t *timer)
 {
-    timer_t *entry;
+    struct timer_state *ts = &timers[cpu];
+    lk_time_t deadline = timer->scheduled_time;
+    uint level;
 
     DEBUG_ASSERT(arch_ints_disabled());
 
     LTRACEF("timer %p, cpu %u, scheduled %u, periodic %u\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
 
-    list_for_every_entry(&timers[cpu].timer_queue, entry, timer_t, node) {
-        if (TIME_GT(entry->scheduled_time, timer->scheduled_time)) {
-            list_add_before(&entry->node, &timer->node);
-            return;
+    /* anything already due goes in the slot being processed next */
+    if (TIME_LT(deadline, ts->base))
+        deadline = ts->base;
+
+    lk_time_t delta = deadline - ts->base;
+    if (delta > TIMER_WHEEL_MAX_DELTA) {
+        deadline = ts->base + TIMER_WHEEL_MAX_DELTA;
+        delta = TIMER_WHEEL_MAX_DELTA;
+    }
+
+    /* find the lowest level whose span covers the deadline */
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < (1U << ((level + 1) * TIMER_WHEEL_BITS)))
+            break;
+    }
+
+    uint index = timer_wheel_index(deadline, level);
+    struct timer_wheel_level *l = &ts->level[level];
+
+    list_add_tail(&l->slot[index], &timer->node);
+    l->bitmap |= 1ULL << index;
+
+    timer->cpu = cpu;
+    timer->wheel_level = level;
+    timer->wheel_index = index;
+    ts->count++;
+}
+
+static void remove_timer_from_queue(timer_t *timer)
+{
+    struct timer_state *ts = &timers[timer->cpu];
+    struct timer_wheel_level *l = &ts->level[timer->wheel_level];
+
+    DEBUG_ASSERT(list_in_list(&timer->node));
+
+    list_delete(&timer->node);
+    if (list_is_empty(&l->slot[timer->wheel_index]))
+        l->bitmap &= ~(1ULL << timer->wheel_index);
+    ts->count--;
+}
+
+/*
+ * Return the time of the next event on a cpu's wheel: a timer firing on
+ * level 0 or a slot on a higher level needing to be cascaded.
+ */
+static bool timer_wheel_next_event(uint cpu, lk_time_t *event)
+{
+    struct timer_state *ts = &timers[cpu];
+    bool found = false;
+    lk_time_t next = 0;
+
+    if (ts->count == 0)
+        return false;
+
+    for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t bitmap = ts->level[level].bitmap;
+        if (!bitmap)
+            continue;
+
+        uint shift = level * TIMER_WHEEL_BITS;
+
+        /* the first block of this level that has not been cascaded yet */
+        lk_time_t block = ts->base >> shift;
+        if (level > 0 && (ts->base & ((1U << shift) - 1)))
+            block++;
+
+        /* rotate so bit 0 is the slot for that block */
+        uint start = block & TIMER_WHEEL_MASK;
+        if (start)
+            bitmap = (bitmap >> start) | (bitmap << (TIMER_WHEEL_SIZE - start));
+
+        lk_time_t t = (block + __builtin_ctzll(bitmap)) << shift;
+        if (!found || TIME_LT(t, next)) {
+            next = t;
+            found = true;
+        }
+    }
+
+    *event = next;
+    return found;
+}
+
+/* move every timer in a slot down to the level that now covers it */
+static void timer_wheel_cascade(uint cpu, uint level)
+{
+    struct timer_state *ts = &timers[cpu];
+    struct timer_wheel_level *l = &ts->level[level];
+    uint index = timer_wheel_index(ts->base, level);
+    timer_t *timer;
+
+    if (!(l->bitmap & (1ULL << index)))
+        return;
+
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    while ((timer = list_remove_head_type(&l->slot[index], timer_t, node)))
+        list_add_tail(&list, &timer->node);
+    l->bitmap &= ~(1ULL << index);
+
+    while ((timer = list_remove_head_type(&list, timer_t, node))) {
+        ts->count--;
+        insert_timer_in_queue(cpu, timer);
+    }
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* program the local hardware timer for the next event on this cpu's wheel */
+static void timer_update_platform_timer(uint cpu, lk_time_t now)
+{
+    struct timer_state *ts = &timers[cpu];
+    lk_time_t event;
+
+    if (!timer_wheel_next_event(cpu, &event)) {
+        if (ts->armed) {
+            LTRACEF("clearing old hw timer, nothing in the queue\n");
+            platform_stop_timer();
+            ts->armed = false;
         }
+        return;
     }
 
-    /* walked off the end of the list */
-    list_add_tail(&timers[cpu].timer_queue, &timer->node);
+    if (ts->armed && ts->armed_deadline == event)
+        return;
+
+    lk_time_t delay = TIME_LT(event, now) ? 0 : event - now;
+
+    LTRACEF("setting new timer for %u msecs\n", (uint)delay);
+    platform_set_oneshot_timer(timer_tick, NULL, delay);
+    ts->armed = true;
+    ts->armed_deadline = event;
 }
+#endif
 
 static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_callback callback, void *arg)
 {
@@ -108,14 +271,15 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
     spin_lock_irqsave(&timer_lock, state);
 
     uint cpu = arch_curr_cpu_num();
+
+    /* an empty wheel can skip straight to the present */
+    if (timers[cpu].count == 0)
+        timers[cpu].base = now;
+
     insert_timer_in_queue(cpu, timer);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    if (list_peek_head_type(&timers[cpu].timer_queue, timer_t, node) == timer) {
-        /* we just modified the head of the timer queue */
-        LTRACEF("setting new timer for %u msecs\n", delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    timer_update_platform_timer(cpu, now);
 #endif
 
     spin_unlock_irqrestore(&timer_lock, state);
@@ -173,14 +337,9 @@ void timer_cancel(timer_t *timer)
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&timer_lock, state);
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-    uint cpu = arch_curr_cpu_num();
-
-    timer_t *oldhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-#endif
-
-    if (list_in_list(&timer->node))
-        list_delete(&timer->node);
+    bool queued = list_in_list(&timer->node);
+    if (queued)
+        remove_timer_from_queue(timer);
 
     /* to keep it from being reinserted into the queue if called from
      * periodic timer callback.
@@ -190,23 +349,10 @@ void timer_cancel(timer_t *timer)
     timer->arg = NULL;
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    /* see if we've just modified the head of the timer queue */
-    timer_t *newhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (newhead == NULL) {
-        LTRACEF("clearing old hw timer, nothing in the queue\n");
-        platform_stop_timer();
-    } else if (newhead != oldhead) {
-        lk_time_t delay;
-        lk_time_t now = current_time();
-
-        if (TIME_LT(newhead->scheduled_time, now))
-            delay = 0;
-        else
-            delay = newhead->scheduled_time - now;
-
-        LTRACEF("setting new timer to %u\n", (uint) delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    /* only the local hardware timer can be reprogrammed, a remote cpu
+     * just takes one spurious tick */
+    if (queued && timer->cpu == arch_curr_cpu_num())
+        timer_update_platform_timer(timer->cpu, current_time());
 #endif
 
     spin_unlock_irqrestore(&timer_lock, state);
@@ -224,64 +370,78 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 //  KEVLOG_TIMER_TICK(); // enable only if necessary
 
     uint cpu = arch_curr_cpu_num();
+    struct timer_state *ts = &timers[cpu];
 
     LTRACEF("cpu %u now %u, sp %p\n", cpu, now, __GET_FRAME());
 
     spin_lock(&timer_lock);
 
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* the oneshot that got us here has fired */
+    ts->armed = false;
+#endif
+
     for (;;) {
-        /* see if there's an event to process */
-        timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-        if (likely(timer == 0))
-            break;
-        LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
-        if (likely(TIME_LT(now, timer->scheduled_time)))
+        /* jump to the next event, or to the present if there is none before it */
+        lk_time_t event;
+        if (!timer_wheel_next_event(cpu, &event) || TIME_GT(event, now)) {
+            ts->base = now + 1;
             break;
+        }
+        ts->base = event;
 
-        /* process it */
-        LTRACEF("timer %p\n", timer);
-        DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
-        list_delete(&timer->node);
+        /* cascade any higher level slots that start here */
+        for (uint level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if (ts->base & ((1U << (level * TIMER_WHEEL_BITS)) - 1))
+                break;
+            timer_wheel_cascade(cpu, level);
+        }
+
+        /* fire everything due at this millisecond */
+        uint index = timer_wheel_index(ts->base, 0);
+        for (;;) {
+            timer = list_peek_head_type(&ts->level[0].slot[index], timer_t, node);
+            if (!timer)
+                break;
 
-        /* we pulled it off the list, release the list lock to handle it */
-        spin_unlock(&timer_lock);
+            /* process it */
+            LTRACEF("timer %p\n", timer);
+            DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
+            remove_timer_from_queue(timer);
 
-        LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
+            /* we pulled it off the list, release the list lock to handle it */
+            spin_unlock(&timer_lock);
 
-        THREAD_STATS_INC(timers);
+            LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
 
-        bool periodic = timer->periodic_time > 0;
+            THREAD_STATS_INC(timers);
 
-        LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
-        KEVLOG_TIMER_CALL(timer->callback, timer->arg);
-        if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
-            ret = INT_RESCHEDULE;
+            bool periodic = timer->periodic_time > 0;
 
-        /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
-        spin_lock(&timer_lock);
+            LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
+            KEVLOG_TIMER_CALL(timer->callback, timer->arg);
+            if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
+                ret = INT_RESCHEDULE;
 
-        /* if it was a periodic timer and it hasn't been requeued
-         * by the callback put it back in the list
-         */
-        if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
-            LTRACEF("periodic timer, period %u\n", timer->periodic_time);
-            timer->scheduled_time = now + timer->periodic_time;
-            insert_timer_in_queue(cpu, timer);
+            /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
+            spin_lock(&timer_lock);
+
+            /* if it was a periodic timer and it hasn't been requeued
+             * by the callback put it back in the list
+             */
+            if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
+                LTRACEF("periodic timer, period %u\n", timer->periodic_time);
+                timer->scheduled_time = now + timer->periodic_time;
+                insert_timer_in_queue(cpu, timer);
+            }
         }
+
+        ts->base++;
     }
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
     /* reset the timer to the next event */
-    timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (timer) {
-        /* has to be the case or it would have fired already */
-        DEBUG_ASSERT(TIME_GT(timer->scheduled_time, now));
-
-        lk_time_t delay = timer->scheduled_time - now;
-
-        LTRACEF("setting new timer for %u msecs for event %p\n", (uint)delay, timer);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    timer_update_platform_timer(cpu, now);
 
     /* we're done manipulating the timer queue */
     spin_unlock(&timer_lock);
@@ -302,7 +462,10 @@ void timer_init(void)
 {
     timer_lock = SPIN_LOCK_INITIAL_VALUE;
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-        list_initialize(&timers[i].timer_queue);
+        for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            for (uint index = 0; index < TIMER_WHEEL_SIZE; index++)
+                list_initialize(&timers[i].level[level].slot[index]);
+        }
     }
 #if !PLATFORM_HAS_DYNAMIC_TIMER
     /* register for a periodic timer tick */
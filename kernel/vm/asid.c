@@ -37,6 +37,19 @@ static bool old_asid_active;
 static struct arch_aspace *active_aspace[SMP_MAX_CPUS];
 static uint64_t active_asid_version[SMP_MAX_CPUS];
 
+/*
+ * Hand out the next asid. Hardware value 0 is never used, it is left to the
+ * kernel, so every generation starts at 1.
+ */
+static uint64_t vmm_asid_next(uint64_t asid_mask)
+{
+    if (!(++last_asid & asid_mask)) {
+        old_asid_active = true;
+        last_asid++;
+    }
+    return last_asid;
+}
+
 static bool vmm_asid_current(struct arch_aspace *aspace, uint64_t ref,
                              uint64_t asid_mask)
 {
@@ -82,11 +95,8 @@ static void vmm_asid_allocate(struct arch_aspace *aspace, uint cpu,
         }
     }
 
-    aspace->asid = ++last_asid;
+    aspace->asid = vmm_asid_next(asid_mask);
     LTRACEF("cpu %d: aspace %p, new asid 0x%llx\n", cpu, aspace, aspace->asid);
-    if (!(last_asid & asid_mask)) {
-        old_asid_active = true;
-    }
 
     if (old_asid_active) {
         i = 0;
@@ -96,7 +106,7 @@ static void vmm_asid_allocate(struct arch_aspace *aspace, uint cpu,
                 old_asid_active = true;
                 if (!((active_aspace[i]->asid ^ last_asid) & asid_mask)) {
                     /* Skip asid in use by other CPUs */
-                    aspace->asid = ++last_asid;
+                    aspace->asid = vmm_asid_next(asid_mask);
                     LTRACEF("cpu %d: conflict asid 0x%llx at cpu %d, new asid 0x%llx\n",
                             cpu, active_aspace[i]->asid, i, aspace->asid);
                     i = 0;
@@ -31,6 +31,7 @@
 #include <string.h>
 #include <pow2.h>
 #include <lib/console.h>
+#include <kernel/mp.h>
 #include <kernel/mutex.h>
 
 #define LOCAL_TRACE 0
@@ -94,6 +95,330 @@ vm_page_t *paddr_to_vm_page(paddr_t addr)
     return NULL;
 }
 
+/*
+ * Free memory in each arena is kept as naturally aligned power of two blocks
+ * of pages (buddies). A free block of order n starts on a page frame number
+ * that is a multiple of 2^n, so a block of the right order is also physically
+ * aligned to its size. Only the first page of a free block is on a free list,
+ * flagged VM_PAGE_FLAG_BUDDY with its order, the rest are simply not
+ * VM_PAGE_FLAG_NONFREE.
+ */
+static inline paddr_t arena_base_pfn(const pmm_arena_t *a)
+{
+    return a->base / PAGE_SIZE;
+}
+
+static inline vm_page_t *arena_pfn_to_page(pmm_arena_t *a, paddr_t pfn)
+{
+    return &a->page_array[pfn - arena_base_pfn(a)];
+}
+
+static inline paddr_t arena_page_to_pfn(const pmm_arena_t *a, const vm_page_t *page)
+{
+    return arena_base_pfn(a) + (page - a->page_array);
+}
+
+static inline bool arena_has_block(const pmm_arena_t *a, paddr_t pfn, uint order)
+{
+    return pfn >= arena_base_pfn(a) &&
+           pfn + (1UL << order) <= arena_base_pfn(a) + a->size / PAGE_SIZE;
+}
+
+static pmm_arena_t *page_to_arena(const vm_page_t *page)
+{
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if (PAGE_BELONGS_TO_ARENA(page, a))
+            return a;
+    }
+    return NULL;
+}
+
+static void buddy_add_block(pmm_arena_t *a, paddr_t pfn, uint order)
+{
+    vm_page_t *page = arena_pfn_to_page(a, pfn);
+
+    DEBUG_ASSERT(!(page->flags & VM_PAGE_FLAG_BUDDY));
+
+    page->flags |= VM_PAGE_FLAG_BUDDY;
+    page->order = order;
+    list_add_head(&a->free_list[order], &page->node);
+}
+
+static void buddy_remove_block(pmm_arena_t *a, vm_page_t *page)
+{
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_BUDDY);
+
+    list_delete(&page->node);
+    page->flags &= ~VM_PAGE_FLAG_BUDDY;
+}
+
+/* mark a run of pages allocated, they must already be off the free lists */
+static void buddy_mark_allocated(pmm_arena_t *a, paddr_t pfn, uint count)
+{
+    for (uint i = 0; i < count; i++) {
+        vm_page_t *page = arena_pfn_to_page(a, pfn + i);
+
+        DEBUG_ASSERT(!(page->flags & (VM_PAGE_FLAG_NONFREE | VM_PAGE_FLAG_BUDDY)));
+        page->flags |= VM_PAGE_FLAG_NONFREE;
+    }
+    a->free_count -= count;
+}
+
+/* free a block, merging it with its buddy for as long as the buddy is free too */
+static void buddy_free_block(pmm_arena_t *a, paddr_t pfn, uint order)
+{
+    while (order < PMM_MAX_ORDER) {
+        paddr_t buddy_pfn = pfn ^ (1UL << order);
+        if (!arena_has_block(a, buddy_pfn, order))
+            break;
+
+        vm_page_t *buddy = arena_pfn_to_page(a, buddy_pfn);
+        if (!(buddy->flags & VM_PAGE_FLAG_BUDDY) || buddy->order != order)
+            break;
+
+        buddy_remove_block(a, buddy);
+        pfn &= ~(1UL << order);
+        order++;
+    }
+
+    buddy_add_block(a, pfn, order);
+}
+
+/* put a run of free pages that are off the free lists back as the largest
+ * aligned blocks that fit */
+static void buddy_release_run(pmm_arena_t *a, paddr_t pfn, size_t count)
+{
+    while (count > 0) {
+        uint order = 0;
+        while (order < PMM_MAX_ORDER &&
+                (pfn & (1UL << order)) == 0 &&
+                (2UL << order) <= count)
+            order++;
+
+        buddy_free_block(a, pfn, order);
+        pfn += 1UL << order;
+        count -= 1UL << order;
+    }
+}
+
+/* free a run of allocated pages */
+static void buddy_free_run(pmm_arena_t *a, paddr_t pfn, size_t count)
+{
+    for (uint i = 0; i < count; i++)
+        arena_pfn_to_page(a, pfn + i)->flags &= ~VM_PAGE_FLAG_NONFREE;
+    a->free_count += count;
+
+    buddy_release_run(a, pfn, count);
+}
+
+/* take a block of at least the given order off the free lists, splitting a
+ * larger one if needed, and return its first page frame */
+static bool buddy_alloc_block(pmm_arena_t *a, uint order, paddr_t *pfn_out)
+{
+    uint found;
+    for (found = order; found <= PMM_MAX_ORDER; found++) {
+        if (!list_is_empty(&a->free_list[found]))
+            break;
+    }
+    if (found > PMM_MAX_ORDER)
+        return false;
+
+    vm_page_t *page = list_peek_head_type(&a->free_list[found], vm_page_t, node);
+    paddr_t pfn = arena_page_to_pfn(a, page);
+    buddy_remove_block(a, page);
+
+    /* give back the upper halves until the block is the size we want */
+    while (found > order) {
+        found--;
+        buddy_add_block(a, pfn + (1UL << found), found);
+    }
+
+    *pfn_out = pfn;
+    return true;
+}
+
+/* pull a single free page out of whichever free block contains it */
+static void buddy_remove_page(pmm_arena_t *a, paddr_t pfn)
+{
+    paddr_t block_pfn = pfn;
+    uint order;
+
+    /* blocks are naturally aligned, so the head is at one of the alignments below pfn */
+    for (order = 0; order <= PMM_MAX_ORDER; order++) {
+        block_pfn = pfn & ~((1UL << order) - 1);
+        if (!arena_has_block(a, block_pfn, 0))
+            continue;
+
+        vm_page_t *head = arena_pfn_to_page(a, block_pfn);
+        if ((head->flags & VM_PAGE_FLAG_BUDDY) && head->order >= order) {
+            order = head->order;
+            buddy_remove_block(a, head);
+            break;
+        }
+    }
+    DEBUG_ASSERT(order <= PMM_MAX_ORDER);
+
+    /* split it down, freeing the halves that don't contain pfn */
+    while (order > 0) {
+        order--;
+        paddr_t upper = block_pfn + (1UL << order);
+        if (pfn >= upper) {
+            buddy_add_block(a, block_pfn, order);
+            block_pfn = upper;
+        } else {
+            buddy_add_block(a, upper, order);
+        }
+    }
+    DEBUG_ASSERT(block_pfn == pfn);
+}
+
+/*
+ * Per cpu cache of free pages for single page allocations. Only pages from the
+ * highest priority arena are cached, and only if it is KMAP, so a cached page
+ * is always one the arena walk would have picked first. Only its own cpu
+ * touches a cache, with interrupts disabled. It is refilled and drained a
+ * batch at a time under the pmm lock. Cached pages are off the buddy free
+ * lists and count as allocated until drained.
+ */
+#define PMM_CPU_CACHE_PAGES 32
+#define PMM_CPU_CACHE_BATCH (PMM_CPU_CACHE_PAGES / 2)
+
+struct pmm_cpu_cache {
+    uint count;
+    vm_page_t *pages[PMM_CPU_CACHE_PAGES];
+} __CPU_ALIGN;
+
+static struct pmm_cpu_cache cpu_cache[SMP_MAX_CPUS];
+
+/* the arena the cpu caches hold pages from, NULL if none is suitable */
+static pmm_arena_t *cpu_cache_arena(void)
+{
+    pmm_arena_t *a = list_peek_head_type(&arena_list, pmm_arena_t, node);
+
+    return (a && (a->flags & PMM_ARENA_FLAG_KMAP)) ? a : NULL;
+}
+
+static vm_page_t *cpu_cache_alloc(void)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    struct pmm_cpu_cache *cache = &cpu_cache[arch_curr_cpu_num()];
+    vm_page_t *page = cache->count ? cache->pages[--cache->count] : NULL;
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return page;
+}
+
+/* stash as many pages as fit in the local cache, return how many did */
+static uint cpu_cache_put(vm_page_t **pages, uint count)
+{
+    uint put = 0;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    struct pmm_cpu_cache *cache = &cpu_cache[arch_curr_cpu_num()];
+    while (put < count && cache->count < PMM_CPU_CACHE_PAGES)
+        cache->pages[cache->count++] = pages[put++];
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return put;
+}
+
+/* called with the lock held */
+static void free_page_locked(vm_page_t *page)
+{
+    pmm_arena_t *a = page_to_arena(page);
+
+    DEBUG_ASSERT(a);
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
+
+    buddy_free_run(a, arena_page_to_pfn(a, page), 1);
+}
+
+static vm_page_t *cpu_cache_refill(void)
+{
+    vm_page_t *batch[PMM_CPU_CACHE_BATCH];
+    uint count = 0;
+
+    mutex_acquire(&lock);
+    pmm_arena_t *a = cpu_cache_arena();
+    if (a) {
+        paddr_t pfn;
+        while (count < PMM_CPU_CACHE_BATCH && buddy_alloc_block(a, 0, &pfn)) {
+            buddy_mark_allocated(a, pfn, 1);
+            batch[count++] = arena_pfn_to_page(a, pfn);
+        }
+    }
+
+    if (count == 0) {
+        mutex_release(&lock);
+        return NULL;
+    }
+
+    vm_page_t *page = batch[--count];
+    uint put = cpu_cache_put(batch, count);
+    while (put < count)
+        free_page_locked(batch[put++]);
+    mutex_release(&lock);
+
+    return page;
+}
+
+static void cpu_cache_free(vm_page_t *page)
+{
+    vm_page_t *batch[PMM_CPU_CACHE_BATCH];
+    uint count = 0;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    struct pmm_cpu_cache *cache = &cpu_cache[arch_curr_cpu_num()];
+    if (cache->count == PMM_CPU_CACHE_PAGES) {
+        while (count < PMM_CPU_CACHE_BATCH)
+            batch[count++] = cache->pages[--cache->count];
+    }
+    cache->pages[cache->count++] = page;
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (count > 0) {
+        mutex_acquire(&lock);
+        while (count > 0)
+            free_page_locked(batch[--count]);
+        mutex_release(&lock);
+    }
+}
+
+/* runs on each cpu with interrupts disabled, moves its cached pages to its list */
+static void cpu_cache_flush(void *context)
+{
+    struct list_node *list = (struct list_node *)context + arch_curr_cpu_num();
+    struct pmm_cpu_cache *cache = &cpu_cache[arch_curr_cpu_num()];
+
+    while (cache->count > 0)
+        list_add_tail(list, &cache->pages[--cache->count]->node);
+}
+
+/* called with the lock held, give every cpu's cached pages back to the buddy lists */
+static void cpu_cache_drain_locked(void)
+{
+    struct list_node lists[SMP_MAX_CPUS];
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        list_initialize(&lists[i]);
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    cpu_cache_flush(lists);
+    mp_sync_exec(MP_CPU_ALL_BUT_LOCAL, &cpu_cache_flush, lists);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        vm_page_t *page;
+        while ((page = list_remove_head_type(&lists[i], vm_page_t, node)))
+            free_page_locked(page);
+    }
+}
+
 status_t pmm_add_arena(pmm_arena_t *arena)
 {
     LTRACEF("arena %p name '%s' base 0x%lx size 0x%zx\n", arena, arena->name, arena->base, arena->size);
@@ -119,23 +444,20 @@ done_add:
 
     /* zero out some of the structure */
     arena->free_count = 0;
-    list_initialize(&arena->free_list);
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++)
+        list_initialize(&arena->free_list[i]);
 
     /* allocate an array of pages to back this one */
     size_t page_count = arena->size / PAGE_SIZE;
     arena->page_array = boot_alloc_mem(page_count * sizeof(vm_page_t));
 
-    /* initialize all of the pages */
+    /* initialize all of the pages as allocated */
     memset(arena->page_array, 0, page_count * sizeof(vm_page_t));
+    for (size_t i = 0; i < page_count; i++)
+        arena->page_array[i].flags = VM_PAGE_FLAG_NONFREE;
 
-    /* add them to the free list */
-    for (size_t i = 0; i < page_count; i++) {
-        vm_page_t *p = &arena->page_array[i];
-
-        list_add_tail(&arena->free_list, &p->node);
-
-        arena->free_count++;
-    }
+    /* and free them into the buddy lists */
+    buddy_free_run(arena, arena_base_pfn(arena), page_count);
 
     return NO_ERROR;
 }
@@ -151,28 +473,44 @@ size_t pmm_alloc_pages(uint count, struct list_node *list)
     if (count == 0)
         return 0;
 
-    mutex_acquire(&lock);
+    /* single pages come from the local cache if possible */
+    if (count == 1) {
+        vm_page_t *page = cpu_cache_alloc();
+        if (!page)
+            page = cpu_cache_refill();
+        if (page) {
+            clear_page(page);
+            list_add_tail(list, &page->node);
+            return 1;
+        }
+    }
 
-    /* walk the arenas in order, allocating as many pages as we can from each */
-    pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        while (allocated < count) {
-            vm_page_t *page = list_remove_head_type(&a->free_list, vm_page_t, node);
-            if (!page)
-                goto done;
+    mutex_acquire(&lock);
 
-            clear_page(page);
+    for (int pass = 0; pass < 2 && allocated < count; pass++) {
+        /* walk the arenas in order, allocating as many pages as we can from each */
+        pmm_arena_t *a;
+        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+            while (allocated < count) {
+                paddr_t pfn;
+                if (!buddy_alloc_block(a, 0, &pfn))
+                    break;
 
-            a->free_count--;
+                buddy_mark_allocated(a, pfn, 1);
 
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+                vm_page_t *page = arena_pfn_to_page(a, pfn);
+                clear_page(page);
+                list_add_tail(list, &page->node);
 
-            allocated++;
+                allocated++;
+            }
         }
+
+        /* try again with the pages held in the cpu caches */
+        if (pass == 0 && allocated < count)
+            cpu_cache_drain_locked();
     }
 
-done:
     mutex_release(&lock);
     return allocated;
 }
@@ -191,6 +529,9 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
 
     mutex_acquire(&lock);
 
+    /* pages sitting in the cpu caches count as allocated, put them back first */
+    cpu_cache_drain_locked();
+
     /* walk through the arenas, looking to see if the physical page belongs to it */
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
@@ -205,13 +546,11 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
                 break;
             }
 
-            DEBUG_ASSERT(list_in_list(&page->node));
-
-            list_delete(&page->node);
-            page->flags |= VM_PAGE_FLAG_NONFREE;
+            paddr_t pfn = arena_page_to_pfn(a, page);
+            buddy_remove_page(a, pfn);
+            buddy_mark_allocated(a, pfn, 1);
             list_add_tail(list, &page->node);
 
-            a->free_count--;
             allocated++;
             address += PAGE_SIZE;
         }
@@ -240,16 +579,9 @@ size_t pmm_free(struct list_node *list)
         DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
 
         /* see which arena this page belongs to and add it */
-        pmm_arena_t *a;
-        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-            if (PAGE_BELONGS_TO_ARENA(page, a)) {
-                page->flags &= ~VM_PAGE_FLAG_NONFREE;
-
-                list_add_head(&a->free_list, &page->node);
-                a->free_count++;
-                count++;
-                break;
-            }
+        if (page_to_arena(page)) {
+            free_page_locked(page);
+            count++;
         }
     }
 
@@ -261,6 +593,14 @@ size_t pmm_free_page(vm_page_t *page)
 {
     DEBUG_ASSERT(page);
 
+    /* single pages from the cached arena go back to the local cache */
+    pmm_arena_t *a = page_to_arena(page);
+    if (a && a == cpu_cache_arena()) {
+        DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
+        cpu_cache_free(page);
+        return 1;
+    }
+
     struct list_node list;
     list_initialize(&list);
 
@@ -274,8 +614,18 @@ void *pmm_alloc_kpages(uint count, struct list_node *list)
 {
     LTRACEF("count %u\n", count);
 
-    // XXX do fast path for single page
-
+    /* fast path for single page */
+    if (count == 1) {
+        vm_page_t *page = cpu_cache_alloc();
+        if (!page)
+            page = cpu_cache_refill();
+        if (page) {
+            clear_page(page);
+            if (list)
+                list_add_tail(list, &page->node);
+            return paddr_to_kvaddr(vm_page_to_paddr(page));
+        }
+    }
 
     paddr_t pa;
     size_t alloc_count = pmm_alloc_contiguous(count, PAGE_SIZE_SHIFT, &pa, list);
@@ -291,6 +641,11 @@ size_t pmm_free_kpages(void *_ptr, uint count)
 
     uint8_t *ptr = (uint8_t *)_ptr;
 
+    if (count == 1) {
+        vm_page_t *p = paddr_to_vm_page(vaddr_to_paddr(ptr));
+        return p ? pmm_free_page(p) : 0;
+    }
+
     struct list_node list;
     list_initialize(&list);
 
@@ -307,6 +662,72 @@ size_t pmm_free_kpages(void *_ptr, uint count)
     return pmm_free(&list);
 }
 
+/* hand out count pages starting at pfn, which have already been pulled out of the free lists */
+static void contiguous_alloc_run(pmm_arena_t *a, paddr_t pfn, uint count, paddr_t *pa, struct list_node *list)
+{
+    buddy_mark_allocated(a, pfn, count);
+
+    for (uint i = 0; i < count; i++) {
+        vm_page_t *p = arena_pfn_to_page(a, pfn + i);
+
+        clear_page(p);
+
+        if (list)
+            list_add_tail(list, &p->node);
+    }
+
+    if (pa)
+        *pa = pfn * PAGE_SIZE;
+}
+
+/* slow path, search the arena page by page for a suitably aligned free run */
+static bool contiguous_alloc_scan(pmm_arena_t *a, uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list)
+{
+    /* walk the list starting at alignment boundaries.
+     * calculate the starting offset into this arena, based on the
+     * base address of the arena to handle the case where the arena
+     * is not aligned on the same boundary requested.
+     */
+    paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
+    if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+        return false;
+
+    uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
+    uint start = aligned_offset;
+    LTRACEF("starting search at aligned offset %u\n", start);
+    LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
+
+retry:
+    /* search while we're still within the arena and have a chance of finding a slot
+       (start + count < end of arena) */
+    while ((start < a->size / PAGE_SIZE) &&
+            ((start + count) <= a->size / PAGE_SIZE)) {
+        vm_page_t *p = &a->page_array[start];
+        for (uint i = 0; i < count; i++) {
+            if (p->flags & VM_PAGE_FLAG_NONFREE) {
+                /* this run is broken, break out of the inner loop.
+                 * start over at the next alignment boundary
+                 */
+                start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
+                goto retry;
+            }
+            p++;
+        }
+
+        /* we found a run */
+        LTRACEF("found run from pn %u to %u\n", start, start + count);
+
+        paddr_t pfn = arena_base_pfn(a) + start;
+        for (uint i = 0; i < count; i++)
+            buddy_remove_page(a, pfn + i);
+
+        contiguous_alloc_run(a, pfn, count, pa, list);
+        return true;
+    }
+
+    return false;
+}
+
 size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list)
 {
     LTRACEF("count %u, align %u\n", count, alignment_log2);
@@ -316,70 +737,40 @@ size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, str
     if (alignment_log2 < PAGE_SIZE_SHIFT)
         alignment_log2 = PAGE_SIZE_SHIFT;
 
+    /* a block of this order is big enough and aligned enough */
+    uint order = log2_uint(round_up_pow2_u32(count));
+    order = MAX(order, (uint)(alignment_log2 - PAGE_SIZE_SHIFT));
+
     mutex_acquire(&lock);
 
-    pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        // XXX make this a flag to only search kmap?
-        if (a->flags & PMM_ARENA_FLAG_KMAP) {
-            /* walk the list starting at alignment boundaries.
-             * calculate the starting offset into this arena, based on the
-             * base address of the arena to handle the case where the arena
-             * is not aligned on the same boundary requested.
-             */
-            paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
-            if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+    for (int pass = 0; pass < 2; pass++) {
+        pmm_arena_t *a;
+        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+            // XXX make this a flag to only search kmap?
+            if (!(a->flags & PMM_ARENA_FLAG_KMAP))
                 continue;
 
-            uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
-            uint start = aligned_offset;
-            LTRACEF("starting search at aligned offset %u\n", start);
-            LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
+            paddr_t pfn;
+            if (order <= PMM_MAX_ORDER && buddy_alloc_block(a, order, &pfn)) {
+                LTRACEF("found order %u block at pfn 0x%lx\n", order, pfn);
 
-retry:
-            /* search while we're still within the arena and have a chance of finding a slot
-               (start + count < end of arena) */
-            while ((start < a->size / PAGE_SIZE) &&
-                    ((start + count) <= a->size / PAGE_SIZE)) {
-                vm_page_t *p = &a->page_array[start];
-                for (uint i = 0; i < count; i++) {
-                    if (p->flags & VM_PAGE_FLAG_NONFREE) {
-                        /* this run is broken, break out of the inner loop.
-                         * start over at the next alignment boundary
-                         */
-                        start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
-                        goto retry;
-                    }
-                    p++;
-                }
-
-                /* we found a run */
-                LTRACEF("found run from pn %u to %u\n", start, start + count);
-
-                /* remove the pages from the run out of the free list */
-                for (uint i = start; i < start + count; i++) {
-                    p = &a->page_array[i];
-                    DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_NONFREE));
-                    DEBUG_ASSERT(list_in_list(&p->node));
-
-                    list_delete(&p->node);
-                    p->flags |= VM_PAGE_FLAG_NONFREE;
-                    a->free_count--;
-
-                    clear_page(p);
-
-                    if (list)
-                        list_add_tail(list, &p->node);
-                }
-
-                if (pa)
-                    *pa = a->base + start * PAGE_SIZE;
+                /* keep the first count pages, give back the tail */
+                buddy_release_run(a, pfn + count, (1UL << order) - count);
 
+                contiguous_alloc_run(a, pfn, count, pa, list);
                 mutex_release(&lock);
+                return count;
+            }
 
+            /* no block is free, but a smaller unaligned run may still be */
+            if (contiguous_alloc_scan(a, count, alignment_log2, pa, list)) {
+                mutex_release(&lock);
                 return count;
             }
         }
+
+        /* try again with the pages held in the cpu caches */
+        cpu_cache_drain_locked();
     }
 
     mutex_release(&lock);
@@ -411,6 +802,12 @@ static void dump_arena(const pmm_arena_t *arena, bool dump_pages)
         }
     }
 
+    /* dump the number of free blocks of each order */
+    printf("\tfree blocks by order:");
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++)
+        printf(" %zu", list_length((struct list_node *)&arena->free_list[i]));
+    printf("\n");
+
     /* dump the free pages */
     printf("\tfree ranges:\n");
     ssize_t last = -1;
@@ -31,6 +31,11 @@
 
 #define LOCAL_TRACE 0
 
+/* pages mapped per demand fault, the faulting one and its unbacked neighbours */
+#ifndef VMM_FAULT_AROUND_PAGES
+#define VMM_FAULT_AROUND_PAGES 8
+#endif
+
 static struct list_node aspace_list = LIST_INITIAL_VALUE(aspace_list);
 static mutex_t vmm_lock = MUTEX_INITIAL_VALUE(vmm_lock);
 
@@ -131,6 +136,206 @@ static vmm_region_t *alloc_region_struct(const char *name, vaddr_t base, size_t
     return r;
 }
 
+/*
+ * Each aspace keeps its regions both on the address sorted region_list and
+ * in an AVL tree keyed by base address. Every tree node also records the
+ * size of the unused gap in front of it and the largest such gap in its
+ * subtree, so lookups and first fit gap searches are O(log n).
+ */
+static inline int region_tree_height(const vmm_region_t *n)
+{
+    return n ? n->tree_height : 0;
+}
+
+static inline size_t region_tree_max_gap(const vmm_region_t *n)
+{
+    return n ? n->max_gap : 0;
+}
+
+static void region_tree_update(vmm_region_t *n)
+{
+    n->tree_height = 1 + MAX(region_tree_height(n->tree_left), region_tree_height(n->tree_right));
+    n->max_gap = MAX(n->gap_before,
+                     MAX(region_tree_max_gap(n->tree_left), region_tree_max_gap(n->tree_right)));
+}
+
+static vmm_region_t *region_tree_rotate_right(vmm_region_t *n)
+{
+    vmm_region_t *l = n->tree_left;
+
+    n->tree_left = l->tree_right;
+    l->tree_right = n;
+    region_tree_update(n);
+    region_tree_update(l);
+    return l;
+}
+
+static vmm_region_t *region_tree_rotate_left(vmm_region_t *n)
+{
+    vmm_region_t *r = n->tree_right;
+
+    n->tree_right = r->tree_left;
+    r->tree_left = n;
+    region_tree_update(n);
+    region_tree_update(r);
+    return r;
+}
+
+static vmm_region_t *region_tree_balance(vmm_region_t *n)
+{
+    region_tree_update(n);
+
+    int balance = region_tree_height(n->tree_left) - region_tree_height(n->tree_right);
+    if (balance > 1) {
+        if (region_tree_height(n->tree_left->tree_left) < region_tree_height(n->tree_left->tree_right))
+            n->tree_left = region_tree_rotate_left(n->tree_left);
+        return region_tree_rotate_right(n);
+    }
+    if (balance < -1) {
+        if (region_tree_height(n->tree_right->tree_right) < region_tree_height(n->tree_right->tree_left))
+            n->tree_right = region_tree_rotate_right(n->tree_right);
+        return region_tree_rotate_left(n);
+    }
+
+    return n;
+}
+
+static vmm_region_t *region_tree_insert_node(vmm_region_t *n, vmm_region_t *r)
+{
+    if (!n)
+        return r;
+
+    if (r->base < n->base)
+        n->tree_left = region_tree_insert_node(n->tree_left, r);
+    else
+        n->tree_right = region_tree_insert_node(n->tree_right, r);
+
+    return region_tree_balance(n);
+}
+
+static vmm_region_t *region_tree_remove_min(vmm_region_t *n, vmm_region_t **min)
+{
+    if (!n->tree_left) {
+        *min = n;
+        return n->tree_right;
+    }
+
+    n->tree_left = region_tree_remove_min(n->tree_left, min);
+    return region_tree_balance(n);
+}
+
+static vmm_region_t *region_tree_remove_node(vmm_region_t *n, vmm_region_t *r)
+{
+    DEBUG_ASSERT(n);
+
+    if (r->base < n->base) {
+        n->tree_left = region_tree_remove_node(n->tree_left, r);
+    } else if (r->base > n->base) {
+        n->tree_right = region_tree_remove_node(n->tree_right, r);
+    } else {
+        DEBUG_ASSERT(n == r);
+
+        if (!r->tree_right)
+            return r->tree_left;
+
+        /* replace it with its successor */
+        vmm_region_t *min;
+        vmm_region_t *right = region_tree_remove_min(r->tree_right, &min);
+        min->tree_left = r->tree_left;
+        min->tree_right = right;
+        n = min;
+    }
+
+    return region_tree_balance(n);
+}
+
+/* recompute the gap summaries on the path down to r after its gap_before changed */
+static void region_tree_update_path(vmm_region_t *n, vmm_region_t *r)
+{
+    DEBUG_ASSERT(n);
+
+    if (r->base < n->base)
+        region_tree_update_path(n->tree_left, r);
+    else if (r->base > n->base)
+        region_tree_update_path(n->tree_right, r);
+
+    region_tree_update(n);
+}
+
+static void region_tree_set_gap(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *prev = list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node);
+
+    r->gap_before = r->base - (prev ? prev->base + prev->size : aspace->base);
+}
+
+/* add a region to the tree, it must already be in its spot in region_list */
+static void region_tree_insert(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    r->tree_left = r->tree_right = NULL;
+    region_tree_set_gap(aspace, r);
+    region_tree_update(r);
+
+    aspace->region_tree = region_tree_insert_node(aspace->region_tree, r);
+
+    /* the region after it now has a smaller gap */
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    if (next) {
+        region_tree_set_gap(aspace, next);
+        region_tree_update_path(aspace->region_tree, next);
+    }
+}
+
+/* remove a region from the tree and region_list */
+static void region_tree_remove(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+
+    aspace->region_tree = region_tree_remove_node(aspace->region_tree, r);
+    list_delete(&r->node);
+
+    /* the region after it inherits its gap */
+    if (next) {
+        region_tree_set_gap(aspace, next);
+        region_tree_update_path(aspace->region_tree, next);
+    }
+}
+
+/* find the last region starting at or below vaddr */
+static vmm_region_t *region_tree_find_floor(const vmm_aspace_t *aspace, vaddr_t vaddr)
+{
+    vmm_region_t *n = aspace->region_tree;
+    vmm_region_t *floor = NULL;
+
+    while (n) {
+        if (vaddr < n->base) {
+            n = n->tree_left;
+        } else {
+            floor = n;
+            n = n->tree_right;
+        }
+    }
+
+    return floor;
+}
+
+/* find the lowest region starting at or above start with at least size free in front of it */
+static vmm_region_t *region_tree_find_gap(vmm_region_t *n, vaddr_t start, size_t size)
+{
+    if (!n || n->max_gap < size)
+        return NULL;
+
+    if (n->base >= start) {
+        vmm_region_t *r = region_tree_find_gap(n->tree_left, start, size);
+        if (r)
+            return r;
+        if (n->gap_before >= size)
+            return n;
+    }
+
+    return region_tree_find_gap(n->tree_right, start, size);
+}
+
 /* add a region to the appropriate spot in the address space list,
  * testing to see if there's a space */
 static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
@@ -149,31 +354,31 @@ static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
 
     vaddr_t r_end = r->base + r->size - 1;
 
-    /* does it fit in front */
-    vmm_region_t *last;
-    last = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
-    if (!last || r_end < last->base) {
-        /* empty list or not empty and fits before the first element */
-        list_add_head(&aspace->region_list, &r->node);
-        return NO_ERROR;
+    /* the only regions it could collide with are the ones on either side of its base */
+    vmm_region_t *prev = region_tree_find_floor(aspace, r->base);
+    vmm_region_t *next;
+    if (prev) {
+        if (r->base <= prev->base + prev->size - 1) {
+            LTRACEF("couldn't find spot\n");
+            return ERR_NO_MEMORY;
+        }
+        next = list_next_type(&aspace->region_list, &prev->node, vmm_region_t, node);
+    } else {
+        next = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
     }
 
-    /* walk the list, finding the right spot to put it */
-    list_for_every_entry(&aspace->region_list, last, vmm_region_t, node) {
-        /* does it go after last? */
-        if (r->base > last->base + last->size - 1) {
-            /* get the next element in the list */
-            vmm_region_t *next = list_next_type(&aspace->region_list, &last->node, vmm_region_t, node);
-            if (!next || (r_end < next->base)) {
-                /* end of the list or next exists and it goes between them */
-                list_add_after(&last->node, &r->node);
-                return NO_ERROR;
-            }
-        }
+    if (next && r_end >= next->base) {
+        LTRACEF("couldn't find spot\n");
+        return ERR_NO_MEMORY;
     }
 
-    LTRACEF("couldn't find spot\n");
-    return ERR_NO_MEMORY;
+    if (prev)
+        list_add_after(&prev->node, &r->node);
+    else
+        list_add_head(&aspace->region_list, &r->node);
+    region_tree_insert(aspace, r);
+
+    return NO_ERROR;
 }
 
 /*
@@ -189,6 +394,17 @@ __WEAK vaddr_t arch_mmu_pick_spot(arch_aspace_t *aspace, vaddr_t base, uint prev
     return ALIGN(base, align);
 }
 
+/*
+ *  Arches that invalidate the tlb as part of every unmap have nothing to batch.
+ */
+__WEAK void arch_mmu_unmap_batch_begin(arch_aspace_t *aspace)
+{
+}
+
+__WEAK void arch_mmu_unmap_batch_end(arch_aspace_t *aspace)
+{
+}
+
 /*
  *  Returns true if the caller has to stop search
  */
@@ -250,28 +466,29 @@ static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
     vaddr_t align = 1UL << align_pow2;
 
     vaddr_t spot;
-    vmm_region_t *r = NULL;
-
-    /* try to pick spot at the beginning of address space */
-    if (check_gap(aspace, NULL,
-                  list_peek_head_type(&aspace->region_list, vmm_region_t, node),
-                  &spot, align, size, arch_mmu_flags))
-        goto done;
-
-    /* search the middle of the list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if (check_gap(aspace, r,
-                      list_next_type(&aspace->region_list, &r->node, vmm_region_t, node),
-                      &spot, align, size, arch_mmu_flags))
+    vmm_region_t *prev = NULL;
+    vmm_region_t *next;
+
+    /* try the gaps in front of each region in address order, skipping the ones too small */
+    vaddr_t start = aspace->base;
+    while ((next = region_tree_find_gap(aspace->region_tree, start, size))) {
+        prev = list_prev_type(&aspace->region_list, &next->node, vmm_region_t, node);
+        if (check_gap(aspace, prev, next, &spot, align, size, arch_mmu_flags))
             goto done;
+        start = next->base + 1;
     }
 
+    /* and then the gap at the end of the address space */
+    prev = list_peek_tail_type(&aspace->region_list, vmm_region_t, node);
+    if (check_gap(aspace, prev, NULL, &spot, align, size, arch_mmu_flags))
+        goto done;
+
     /* couldn't find anything */
     return -1;
 
 done:
     if (before)
-        *before = r ? &r->node : &aspace->region_list;
+        *before = prev ? &prev->node : &aspace->region_list;
     return spot;
 }
 
@@ -310,8 +527,9 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
 
         r->base = (vaddr_t)vaddr;
 
-        /* add it to the region list */
+        /* add it to the region list and tree */
         list_add_after(before, &r->node);
+        region_tree_insert(aspace, r);
     }
 
     return r;
@@ -528,26 +746,32 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
         vaddr = (vaddr_t)*ptr;
     }
 
-    /* allocate physical memory up front, in case it cant be satisfied */
-
-    /* allocate a random pile of pages */
     struct list_node page_list;
     list_initialize(&page_list);
 
-    size_t count = pmm_alloc_pages(size / PAGE_SIZE, &page_list);
-    DEBUG_ASSERT(count <= size);
-    if (count < size / PAGE_SIZE) {
-        LTRACEF("failed to allocate enough pages (asked for %zu, got %zu)\n", size / PAGE_SIZE, count);
-        pmm_free(&page_list);
-        err = ERR_NO_MEMORY;
-        goto err;
+    uint region_flags = VMM_REGION_FLAG_PHYSICAL;
+    if (vmm_flags & VMM_FLAG_COMMIT_ON_DEMAND) {
+        /* the pages get allocated and mapped as they're touched */
+        region_flags |= VMM_REGION_FLAG_COMMIT_ON_DEMAND;
+    } else {
+        /* allocate physical memory up front, in case it cant be satisfied */
+
+        /* allocate a random pile of pages */
+        size_t count = pmm_alloc_pages(size / PAGE_SIZE, &page_list);
+        DEBUG_ASSERT(count <= size);
+        if (count < size / PAGE_SIZE) {
+            LTRACEF("failed to allocate enough pages (asked for %zu, got %zu)\n", size / PAGE_SIZE, count);
+            pmm_free(&page_list);
+            err = ERR_NO_MEMORY;
+            goto err;
+        }
     }
 
     mutex_acquire(&vmm_lock);
 
     /* allocate a region and put it in the aspace list */
     vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
-                                   VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+                                   region_flags, arch_mmu_flags);
     if (!r) {
         err = ERR_NO_MEMORY;
         goto err1;
@@ -595,15 +819,81 @@ static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr)
     if (!aspace)
         return NULL;
 
-    /* search the region list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if ((vaddr >= r->base) && (vaddr <= r->base + r->size - 1))
-            return r;
-    }
+    /* the only candidate is the last region starting at or below vaddr */
+    r = region_tree_find_floor(aspace, vaddr);
+    if (r && vaddr <= r->base + r->size - 1)
+        return r;
 
     return NULL;
 }
 
+/* back a single page of a demand committed region, if nobody got to it first */
+static status_t vmm_commit_page(vmm_aspace_t *aspace, vmm_region_t *r, vaddr_t va)
+{
+    if (arch_mmu_query(&aspace->arch_aspace, va, NULL, NULL) >= 0)
+        return NO_ERROR;
+
+    struct list_node page_list = LIST_INITIAL_VALUE(page_list);
+    if (pmm_alloc_pages(1, &page_list) != 1)
+        return ERR_NO_MEMORY;
+
+    vm_page_t *p = list_peek_head_type(&page_list, vm_page_t, node);
+    status_t err = arch_mmu_map(&aspace->arch_aspace, va, vm_page_to_paddr(p), 1, r->arch_mmu_flags);
+    if (err < 0) {
+        pmm_free(&page_list);
+        return err;
+    }
+
+    list_delete(&p->node);
+    list_add_tail(&r->page_list, &p->node);
+
+    return NO_ERROR;
+}
+
+status_t vmm_page_fault_handler(vaddr_t addr, uint pf_flags)
+{
+    LTRACEF("addr 0x%lx pf_flags 0x%x\n", addr, pf_flags);
+
+    vmm_aspace_t *aspace = vaddr_to_aspace((void *)addr);
+    if (!aspace)
+        return ERR_NOT_FOUND;
+
+    mutex_acquire(&vmm_lock);
+
+    status_t err = ERR_NOT_FOUND;
+    vmm_region_t *r = vmm_find_region(aspace, addr);
+    if (!r || !(r->flags & VMM_REGION_FLAG_COMMIT_ON_DEMAND))
+        goto out;
+
+    /* the access has to be one the region's mapping allows */
+    err = ERR_ACCESS_DENIED;
+    if ((pf_flags & VMM_PF_FLAG_WRITE) && (r->arch_mmu_flags & ARCH_MMU_FLAG_PERM_RO))
+        goto out;
+    if ((pf_flags & VMM_PF_FLAG_USER) && !(r->arch_mmu_flags & ARCH_MMU_FLAG_PERM_USER))
+        goto out;
+    if ((pf_flags & VMM_PF_FLAG_INSTRUCTION) && (r->arch_mmu_flags & ARCH_MMU_FLAG_PERM_NO_EXECUTE))
+        goto out;
+
+    vaddr_t va = ROUNDDOWN(addr, PAGE_SIZE);
+    err = vmm_commit_page(aspace, r, va);
+    if (err < 0)
+        goto out;
+
+    /* fault around, mapping the rest of the aligned window while we're here */
+    vaddr_t window = ROUNDDOWN(va, VMM_FAULT_AROUND_PAGES * PAGE_SIZE);
+    for (uint i = 0; i < VMM_FAULT_AROUND_PAGES; i++) {
+        vaddr_t v = window + i * PAGE_SIZE;
+        if (v == va || v < r->base || v > r->base + r->size - 1)
+            continue;
+        if (vmm_commit_page(aspace, r, v) < 0)
+            break;
+    }
+
+out:
+    mutex_release(&vmm_lock);
+    return err;
+}
+
 static bool vmm_region_is_match(vmm_region_t *r, vaddr_t va, size_t size, uint32_t flags)
 {
     if (!r) {
@@ -629,7 +919,7 @@ status_t vmm_free_region_etc(vmm_aspace_t *aspace, vaddr_t vaddr, size_t size, u
     }
 
     /* remove it from aspace */
-    list_delete(&r->node);
+    region_tree_remove(aspace, r);
 
     /* unmap it */
     arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
@@ -710,6 +1000,9 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
     /* free all of the regions */
     struct list_node region_list = LIST_INITIAL_VALUE(region_list);
 
+    /* one tlb shootdown for all of the regions, before any page is freed */
+    arch_mmu_unmap_batch_begin(&aspace->arch_aspace);
+
     vmm_region_t *r;
     while ((r = list_remove_head_type(&aspace->region_list, vmm_region_t, node))) {
         /* add it to our tempoary list */
@@ -718,6 +1011,9 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
         /* unmap it */
         arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
     }
+
+    arch_mmu_unmap_batch_end(&aspace->arch_aspace);
+    aspace->region_tree = NULL;
     mutex_release(&vmm_lock);
 
     /* without the vmm lock held, free all of the pmm pages and the structure */
@@ -807,6 +1103,7 @@ usage:
         printf("%s alloc <size> <align_pow2>\n", argv[0].str);
         printf("%s alloc_physical <paddr> <size> <align_pow2>\n", argv[0].str);
         printf("%s alloc_contig <size> <align_pow2>\n", argv[0].str);
+        printf("%s alloc_demand <size> <align_pow2>\n", argv[0].str);
         printf("%s free_region <address>\n", argv[0].str);
         printf("%s create_aspace\n", argv[0].str);
         printf("%s create_test_aspace\n", argv[0].str);
@@ -843,6 +1140,13 @@ usage:
         void *ptr = (void *)0x99;
         status_t err = vmm_alloc_contiguous(test_aspace, "contig test", argv[2].u, &ptr, argv[3].u, 0, 0);
         printf("vmm_alloc_contig returns %d, ptr %p\n", err, ptr);
+    } else if (!strcmp(argv[1].str, "alloc_demand")) {
+        if (argc < 4) goto notenoughargs;
+
+        void *ptr = (void *)0x99;
+        status_t err = vmm_alloc(test_aspace, "demand test", argv[2].u, &ptr, argv[3].u,
+                                 VMM_FLAG_COMMIT_ON_DEMAND, 0);
+        printf("vmm_alloc returns %d, ptr %p\n", err, ptr);
     } else if (!strcmp(argv[1].str, "free_region")) {
         if (argc < 2) goto notenoughargs;
 
@@ -21,22 +21,33 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <list.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <sys/types.h>
 #include <debug.h>
+#include <err.h>
 #include <trace.h>
+#include <pow2.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
 #include <lib/bcache.h>
 #include <lib/bio.h>
 
 #define LOCAL_TRACE 0
 
+/* split the cache into up to this many independently locked shards */
+#define BCACHE_MAX_SHARDS 8
+/* but don't make shards smaller than this */
+#define BCACHE_MIN_SHARD_BLOCKS 16
+
 struct bcache_block {
-    struct list_node node;
+    struct list_node node; /* hash bucket or free list */
     bnum_t blocknum;
     int ref_count;
     bool is_dirty;
+    bool referenced; /* used since the clock hand last went past */
     void *ptr;
 };
 
@@ -46,48 +57,131 @@ struct bcache_stats {
     uint32_t misses;
     uint32_t reads;
     uint32_t writes;
+    uint32_t evictions;
+};
+
+/*
+ * Blocks are spread over the shards by a hash of their number. Each shard
+ * owns a fixed slice of the cache's blocks, finds them through a hash table
+ * and evicts them with the clock algorithm, all under its own lock.
+ */
+struct bcache_shard {
+    mutex_t lock;
+    struct bcache_stats stats;
+
+    struct list_node free_list;
+
+    struct list_node *hash;
+    uint hash_mask;
+
+    struct bcache_block *blocks;
+    uint count;
+    uint clock_hand;
+};
+
+/* a read-ahead run in flight, its blocks are added to the cache when it is collected */
+struct bcache_prefetch {
+    struct list_node node;
+    bio_request_t req;
+    uint blocknum;
+    uint count;
+    void *buf;
 };
 
 struct bcache {
     bdev_t *dev;
     size_t block_size;
     int count;
-    struct bcache_stats stats;
 
-    struct list_node free_list;
-    struct list_node lru_list;
+    struct bcache_shard *shards;
+    uint shard_count;
 
     struct bcache_block *blocks;
+
+    /* taken before any shard lock */
+    mutex_t prefetch_lock;
+    struct list_node prefetch_list;
+    uint prefetch_blocks;
 };
 
+static inline uint32_t hash_block(uint blocknum)
+{
+    return blocknum * 0x9e3779b1U;
+}
+
+static inline struct bcache_shard *block_shard(struct bcache *cache, uint blocknum)
+{
+    return &cache->shards[hash_block(blocknum) % cache->shard_count];
+}
+
+static inline struct list_node *block_bucket(struct bcache *cache, struct bcache_shard *shard, uint blocknum)
+{
+    return &shard->hash[(hash_block(blocknum) / cache->shard_count) & shard->hash_mask];
+}
+
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count)
 {
     struct bcache *cache;
 
-    cache = malloc(sizeof(struct bcache));
+    DEBUG_ASSERT(block_count > 0);
+
+    cache = calloc(1, sizeof(struct bcache));
+    if (!cache)
+        return NULL;
 
     cache->dev = dev;
     cache->block_size = block_size;
     cache->count = block_count;
-    memset(&cache->stats, 0, sizeof(cache->stats));
-
-    list_initialize(&cache->free_list);
-    list_initialize(&cache->lru_list);
-
-    cache->blocks = malloc(sizeof(struct bcache_block) * block_count);
-    int i;
-    for (i=0; i < block_count; i++) {
-        cache->blocks[i].ref_count = 0;
-        cache->blocks[i].is_dirty = false;
-        cache->blocks[i].ptr = malloc(block_size);
-        // add to the free list
-        list_add_head(&cache->free_list, &cache->blocks[i].node);
+    mutex_init(&cache->prefetch_lock);
+    list_initialize(&cache->prefetch_list);
+
+    cache->shard_count = MIN(BCACHE_MAX_SHARDS, MAX(1, block_count / BCACHE_MIN_SHARD_BLOCKS));
+    cache->shard_count = 1U << log2_uint(cache->shard_count);
+
+    cache->shards = calloc(cache->shard_count, sizeof(struct bcache_shard));
+    cache->blocks = calloc(block_count, sizeof(struct bcache_block));
+    if (!cache->shards || !cache->blocks)
+        goto err;
+
+    struct bcache_block *blocks = cache->blocks;
+    for (uint i = 0; i < cache->shard_count; i++) {
+        struct bcache_shard *shard = &cache->shards[i];
+
+        /* hand out the blocks as evenly as possible */
+        shard->count = block_count / cache->shard_count;
+        if (i < block_count % cache->shard_count)
+            shard->count++;
+        shard->blocks = blocks;
+        blocks += shard->count;
+
+        mutex_init(&shard->lock);
+        list_initialize(&shard->free_list);
+
+        uint buckets = round_up_pow2_u32(shard->count);
+        shard->hash = malloc(sizeof(struct list_node) * buckets);
+        if (!shard->hash)
+            goto err;
+        shard->hash_mask = buckets - 1;
+        for (uint j = 0; j < buckets; j++)
+            list_initialize(&shard->hash[j]);
+
+        for (uint j = 0; j < shard->count; j++) {
+            shard->blocks[j].ptr = malloc(block_size);
+            if (!shard->blocks[j].ptr)
+                goto err;
+            // add to the free list
+            list_add_head(&shard->free_list, &shard->blocks[j].node);
+        }
     }
 
     return (bcache_t)cache;
+
+err:
+    bcache_destroy(cache);
+    return NULL;
 }
 
-static int flush_block(struct bcache *cache, struct bcache_block *block)
+static int flush_block(struct bcache *cache, struct bcache_shard *shard, struct bcache_block *block)
 {
     int rc;
 
@@ -98,105 +192,216 @@ static int flush_block(struct bcache *cache, struct bcache_block *block)
         goto exit;
 
     block->is_dirty = false;
-    cache->stats.writes++;
+    shard->stats.writes++;
     rc = 0;
 exit:
     return (rc);
 }
 
+static void prefetch_collect(struct bcache *cache, uint blocknum, uint count);
+
 void bcache_destroy(bcache_t _cache)
 {
     struct bcache *cache = _cache;
     int i;
 
-    for (i=0; i < cache->count; i++) {
-        DEBUG_ASSERT(cache->blocks[i].ref_count == 0);
+    /* the device still owns the buffers of any read-ahead in flight */
+    prefetch_collect(cache, 0, UINT_MAX);
 
-        if (cache->blocks[i].is_dirty)
-            printf("warning: freeing dirty block %u\n",
-                   cache->blocks[i].blocknum);
+    if (cache->blocks) {
+        for (i=0; i < cache->count; i++) {
+            DEBUG_ASSERT(cache->blocks[i].ref_count == 0);
 
-        free(cache->blocks[i].ptr);
+            if (cache->blocks[i].is_dirty)
+                printf("warning: freeing dirty block %u\n",
+                       cache->blocks[i].blocknum);
+
+            free(cache->blocks[i].ptr);
+        }
+    }
+
+    if (cache->shards) {
+        for (uint j = 0; j < cache->shard_count; j++) {
+            if (cache->shards[j].hash)
+                mutex_destroy(&cache->shards[j].lock);
+            free(cache->shards[j].hash);
+        }
     }
 
+    free(cache->blocks);
+    free(cache->shards);
+    mutex_destroy(&cache->prefetch_lock);
     free(cache);
 }
 
-/* find a block if it's already present */
-static struct bcache_block *find_block(struct bcache *cache, uint blocknum)
+/* find a block if it's already present, with the shard locked */
+static struct bcache_block *lookup_block(struct bcache *cache, struct bcache_shard *shard,
+                                         uint blocknum, uint32_t *depth)
 {
-    uint32_t depth = 0;
     struct bcache_block *block;
 
     LTRACEF("num %u\n", blocknum);
 
-    block = NULL;
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
+    list_for_every_entry(block_bucket(cache, shard, blocknum), block, struct bcache_block, node) {
         LTRACEF("looking at entry %p, num %u\n", block, block->blocknum);
-        depth++;
+        (*depth)++;
 
-        if (block->blocknum == blocknum) {
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
-            cache->stats.hits++;
-            cache->stats.depth += depth;
+        if (block->blocknum == blocknum)
             return block;
-        }
     }
 
-    cache->stats.misses++;
     return NULL;
 }
 
-/* allocate a new block */
-static struct bcache_block *alloc_block(struct bcache *cache)
+/* look up a block for a read, counting the hit or miss */
+static struct bcache_block *find_block(struct bcache *cache, struct bcache_shard *shard, uint blocknum)
+{
+    uint32_t depth = 0;
+    struct bcache_block *block = lookup_block(cache, shard, blocknum, &depth);
+
+    if (block) {
+        block->referenced = true;
+        shard->stats.hits++;
+        shard->stats.depth += depth;
+    } else {
+        shard->stats.misses++;
+    }
+
+    return block;
+}
+
+/* allocate a new block, it is in no hash bucket until the caller adds it */
+static struct bcache_block *alloc_block(struct bcache *cache, struct bcache_shard *shard)
 {
     int err;
     struct bcache_block *block;
 
     /* pop one off the free list if it's present */
-    block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
+    block = list_remove_head_type(&shard->free_list, struct bcache_block, node);
     if (block) {
-        block->ref_count = 0;
-        list_add_tail(&cache->lru_list, &block->node);
         LTRACEF("found block %p on free list\n", block);
-        return block;
+        goto found;
     }
 
-    /* walk the lru, looking for a free block */
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
+    /* sweep the clock, giving recently used blocks a second chance */
+    for (uint i = 0; i < shard->count * 2; i++) {
+        block = &shard->blocks[shard->clock_hand];
+        shard->clock_hand = (shard->clock_hand + 1) % shard->count;
+
         LTRACEF("looking at %p, num %u\n", block, block->blocknum);
-        if (block->ref_count == 0) {
-            if (block->is_dirty) {
-                err = flush_block(cache, block);
-                if (err)
-                    return NULL;
-            }
+        if (block->ref_count > 0)
+            continue;
+        if (block->referenced) {
+            block->referenced = false;
+            continue;
+        }
 
-            // add it to the tail of the lru
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
-            return block;
+        if (block->is_dirty) {
+            err = flush_block(cache, shard, block);
+            if (err)
+                return NULL;
         }
+
+        list_delete(&block->node);
+        shard->stats.evictions++;
+        goto found;
     }
 
     return NULL;
+
+found:
+    block->ref_count = 0;
+    block->is_dirty = false;
+    block->referenced = false;
+    return block;
+}
+
+/* wait for a read-ahead run and add whichever of its blocks are still missing */
+static void prefetch_install(struct bcache *cache, struct bcache_prefetch *pf)
+{
+    ssize_t ret = bio_wait_request(&pf->req);
+    uint valid = (ret > 0) ? MIN(pf->count, (size_t)ret / cache->block_size) : 0;
+    uint32_t depth = 0;
+
+    LTRACEF("blocknum %u, count %u, ret %zd\n", pf->blocknum, pf->count, ret);
+
+    for (uint i = 0; i < valid; i++) {
+        struct bcache_shard *shard = block_shard(cache, pf->blocknum + i);
+
+        mutex_acquire(&shard->lock);
+        if (!lookup_block(cache, shard, pf->blocknum + i, &depth)) {
+            struct bcache_block *block = alloc_block(cache, shard);
+            if (block) {
+                block->blocknum = pf->blocknum + i;
+                memcpy(block->ptr, (uint8_t *)pf->buf + i * cache->block_size, cache->block_size);
+                list_add_head(block_bucket(cache, shard, pf->blocknum + i), &block->node);
+                shard->stats.reads++;
+            }
+        }
+        mutex_release(&shard->lock);
+    }
+
+    free(pf->buf);
+    free(pf);
+}
+
+/*
+ * Collect read-ahead runs that overlap the range, waiting for them if they
+ * are still in flight, along with any that have already finished. Must be
+ * called before the range is looked up or filled, without a shard lock held.
+ */
+static void prefetch_collect(struct bcache *cache, uint blocknum, uint count)
+{
+    struct list_node ready = LIST_INITIAL_VALUE(ready);
+    struct bcache_prefetch *pf, *temp;
+
+    /* racing with a new run only means the caller reads the blocks itself */
+    if (list_is_empty(&cache->prefetch_list))
+        return;
+
+    mutex_acquire(&cache->prefetch_lock);
+    list_for_every_entry_safe(&cache->prefetch_list, pf, temp, struct bcache_prefetch, node) {
+        if (event_wait_timeout(&pf->req.done, 0) == NO_ERROR ||
+                (count > 0 && bio_does_overlap(pf->blocknum, pf->count, blocknum, count))) {
+            list_delete(&pf->node);
+            cache->prefetch_blocks -= pf->count;
+            list_add_tail(&ready, &pf->node);
+        }
+    }
+    mutex_release(&cache->prefetch_lock);
+
+    while ((pf = list_remove_head_type(&ready, struct bcache_prefetch, node)))
+        prefetch_install(cache, pf);
+}
+
+/* is the block part of a read-ahead run in flight, with the prefetch lock held */
+static bool prefetch_pending(struct bcache *cache, uint blocknum)
+{
+    struct bcache_prefetch *pf;
+
+    list_for_every_entry(&cache->prefetch_list, pf, struct bcache_prefetch, node) {
+        if (blocknum >= pf->blocknum && blocknum - pf->blocknum < pf->count)
+            return true;
+    }
+
+    return false;
 }
 
-static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blocknum)
+static struct bcache_block *find_or_fill_block(struct bcache *cache, struct bcache_shard *shard, uint blocknum)
 {
     int err;
 
     LTRACEF("block %u\n", blocknum);
 
     /* see if it's already in the cache */
-    struct bcache_block *block = find_block(cache, blocknum);
+    struct bcache_block *block = find_block(cache, shard, blocknum);
     if (block == NULL) {
         LTRACEF("wasn't allocated\n");
 
         /* allocate a new block and fill it */
-        block = alloc_block(cache);
-        DEBUG_ASSERT(block);
+        block = alloc_block(cache, shard);
+        if (!block)
+            return NULL;
 
         LTRACEF("wasn't allocated, new block %p\n", block);
 
@@ -204,11 +409,12 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
         err = bio_read(cache->dev, block->ptr, (off_t)blocknum * cache->block_size, cache->block_size);
         if (err < 0) {
             /* free the block, return an error */
-            list_add_tail(&cache->free_list, &block->node);
+            list_add_tail(&shard->free_list, &block->node);
             return NULL;
         }
 
-        cache->stats.reads++;
+        list_add_head(block_bucket(cache, shard, blocknum), &block->node);
+        shard->stats.reads++;
     }
 
     DEBUG_ASSERT(block->blocknum == blocknum);
@@ -219,64 +425,216 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
 int bcache_read_block(bcache_t _cache, void *buf, uint blocknum)
 {
     struct bcache *cache = _cache;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
+    int err = 0;
 
     LTRACEF("buf %p, blocknum %u\n", buf, blocknum);
 
-    struct bcache_block *block = find_or_fill_block(cache, blocknum);
+    prefetch_collect(cache, blocknum, 1);
+
+    mutex_acquire(&shard->lock);
+
+    struct bcache_block *block = find_or_fill_block(cache, shard, blocknum);
     if (block == NULL) {
         /* error */
-        return -1;
+        err = -1;
+        goto exit;
     }
 
     memcpy(buf, block->ptr, cache->block_size);
-    return 0;
+exit:
+    mutex_release(&shard->lock);
+    return err;
 }
 
 int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum)
 {
     struct bcache *cache = _cache;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
+    int err = 0;
 
     LTRACEF("ptr %p, blocknum %u\n", ptr, blocknum);
 
     DEBUG_ASSERT(ptr);
 
-    struct bcache_block *block = find_or_fill_block(cache, blocknum);
+    prefetch_collect(cache, blocknum, 1);
+
+    mutex_acquire(&shard->lock);
+
+    struct bcache_block *block = find_or_fill_block(cache, shard, blocknum);
     if (block == NULL) {
         /* error */
-        return -1;
+        err = -1;
+        goto exit;
     }
 
     /* increment the ref count to keep it from being freed */
     block->ref_count++;
     *ptr = block->ptr;
-
-    return 0;
+exit:
+    mutex_release(&shard->lock);
+    return err;
 }
 
 int bcache_put_block(bcache_t _cache, uint blocknum)
 {
     struct bcache *cache = _cache;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
+    uint32_t depth = 0;
 
     LTRACEF("blocknum %u\n", blocknum);
 
-    struct bcache_block *block = find_block(cache, blocknum);
+    mutex_acquire(&shard->lock);
+
+    struct bcache_block *block = lookup_block(cache, shard, blocknum, &depth);
 
     /* be pretty hard on the caller for now */
     DEBUG_ASSERT(block);
     DEBUG_ASSERT(block->ref_count > 0);
 
     block->ref_count--;
+    block->referenced = true;
 
+    mutex_release(&shard->lock);
     return 0;
 }
 
+int bcache_read_blocks(bcache_t _cache, void *_buf, uint blocknum, uint count)
+{
+    struct bcache *cache = _cache;
+    uint8_t *buf = _buf;
+    uint run = 0;
+    ssize_t err;
+
+    LTRACEF("buf %p, blocknum %u, count %u\n", buf, blocknum, count);
+
+    prefetch_collect(cache, blocknum, count);
+
+    for (uint i = 0; i <= count; i++) {
+        bool cached = false;
+
+        if (i < count) {
+            struct bcache_shard *shard = block_shard(cache, blocknum + i);
+
+            mutex_acquire(&shard->lock);
+            struct bcache_block *block = find_block(cache, shard, blocknum + i);
+            if (block) {
+                memcpy(buf + i * cache->block_size, block->ptr, cache->block_size);
+                cached = true;
+            }
+            mutex_release(&shard->lock);
+        }
+
+        /* read the run of missing blocks before this one in one go */
+        if ((cached || i == count) && run > 0) {
+            uint start = i - run;
+            size_t len = run * cache->block_size;
+
+            err = bio_read(cache->dev, buf + start * cache->block_size,
+                           (off_t)(blocknum + start) * cache->block_size, len);
+            if (err < 0 || (size_t)err != len)
+                return -1;
+            run = 0;
+        }
+
+        if (!cached)
+            run++;
+    }
+
+    return 0;
+}
+
+int bcache_prefetch(bcache_t _cache, uint blocknum, uint count)
+{
+    struct bcache *cache = _cache;
+    bdev_t *dev = cache->dev;
+    uint32_t depth = 0;
+    int err = 0;
+
+    /* runs are submitted in device blocks */
+    if (cache->block_size < dev->block_size || cache->block_size % dev->block_size)
+        return 0;
+    uint dev_blocks = cache->block_size / dev->block_size;
+
+    mutex_acquire(&cache->prefetch_lock);
+
+    /* don't let read-ahead push out more than half the cache */
+    uint limit = (uint)cache->count / 2;
+    count = MIN(count, limit - MIN(limit, cache->prefetch_blocks));
+
+    LTRACEF("blocknum %u, count %u\n", blocknum, count);
+
+    /*
+     * Hold the queue so the runs go out merged and sorted. Nothing in here
+     * may wait for the device, the caller can have it plugged as well.
+     */
+    bio_plug(dev);
+
+    uint i = 0;
+    while (i < count) {
+        /* find the next run of blocks that aren't cached or on their way */
+        uint start = i;
+        for (; i < count; i++) {
+            struct bcache_shard *shard = block_shard(cache, blocknum + i);
+
+            mutex_acquire(&shard->lock);
+            bool present = lookup_block(cache, shard, blocknum + i, &depth) != NULL;
+            mutex_release(&shard->lock);
+
+            if (present || prefetch_pending(cache, blocknum + i)) {
+                if (i > start)
+                    break;
+                start = i + 1;
+            }
+        }
+        if (i == start)
+            break;
+
+        struct bcache_prefetch *pf = malloc(sizeof(struct bcache_prefetch));
+        void *buf = memalign(CACHE_LINE, (i - start) * cache->block_size);
+        if (!pf || !buf) {
+            free(pf);
+            free(buf);
+            err = -1;
+            break;
+        }
+
+        pf->blocknum = blocknum + start;
+        pf->count = i - start;
+        pf->buf = buf;
+        bio_request_init(&pf->req, BIO_OP_READ, buf, pf->blocknum * dev_blocks,
+                         pf->count * dev_blocks, NULL, NULL);
+
+        if (bio_submit_request(dev, &pf->req) < 0) {
+            free(pf);
+            free(buf);
+            err = -1;
+            break;
+        }
+
+        list_add_tail(&cache->prefetch_list, &pf->node);
+        cache->prefetch_blocks += pf->count;
+    }
+
+    mutex_release(&cache->prefetch_lock);
+
+    /* and let them go, they are collected when the blocks are first used */
+    bio_unplug(dev);
+
+    return err;
+}
+
 int bcache_mark_block_dirty(bcache_t priv, uint blocknum)
 {
     int err;
     struct bcache *cache = priv;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
     struct bcache_block *block;
+    uint32_t depth = 0;
+
+    mutex_acquire(&shard->lock);
 
-    block = find_block(cache, blocknum);
+    block = lookup_block(cache, shard, blocknum, &depth);
     if (!block) {
         err = -1;
         goto exit;
@@ -285,6 +643,7 @@ int bcache_mark_block_dirty(bcache_t priv, uint blocknum)
     block->is_dirty = true;
     err = 0;
 exit:
+    mutex_release(&shard->lock);
     return (err);
 }
 
@@ -292,42 +651,55 @@ int bcache_zero_block(bcache_t priv, uint blocknum)
 {
     int err;
     struct bcache *cache = priv;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
     struct bcache_block *block;
+    uint32_t depth = 0;
+
+    /* a read-ahead landing later must not bring back the old contents */
+    prefetch_collect(cache, blocknum, 1);
 
-    block = find_block(cache, blocknum);
+    mutex_acquire(&shard->lock);
+
+    block = lookup_block(cache, shard, blocknum, &depth);
     if (!block) {
-        block = alloc_block(cache);
+        block = alloc_block(cache, shard);
         if (!block) {
             err = -1;
             goto exit;
         }
 
         block->blocknum = blocknum;
+        list_add_head(block_bucket(cache, shard, blocknum), &block->node);
     }
 
     memset(block->ptr, 0, cache->block_size);
     block->is_dirty = true;
     err = 0;
 exit:
+    mutex_release(&shard->lock);
     return (err);
 }
 
 int bcache_flush(bcache_t priv)
 {
-    int err;
+    int err = 0;
     struct bcache *cache = priv;
-    struct bcache_block *block;
 
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        if (block->is_dirty) {
-            err = flush_block(cache, block);
-            if (err)
-                goto exit;
+    for (uint i = 0; i < cache->shard_count && !err; i++) {
+        struct bcache_shard *shard = &cache->shards[i];
+
+        mutex_acquire(&shard->lock);
+        for (uint j = 0; j < shard->count; j++) {
+            struct bcache_block *block = &shard->blocks[j];
+            if (block->is_dirty) {
+                err = flush_block(cache, shard, block);
+                if (err)
+                    break;
+            }
         }
+        mutex_release(&shard->lock);
     }
 
-    err = 0;
-exit:
     return (err);
 }
 
@@ -335,16 +707,34 @@ void bcache_dump(bcache_t priv, const char *name)
 {
     uint32_t finds;
     struct bcache *cache = priv;
+    struct bcache_stats stats;
+
+    memset(&stats, 0, sizeof(stats));
+    for (uint i = 0; i < cache->shard_count; i++) {
+        struct bcache_shard *shard = &cache->shards[i];
+
+        mutex_acquire(&shard->lock);
+        stats.hits += shard->stats.hits;
+        stats.depth += shard->stats.depth;
+        stats.misses += shard->stats.misses;
+        stats.reads += shard->stats.reads;
+        stats.writes += shard->stats.writes;
+        stats.evictions += shard->stats.evictions;
+        mutex_release(&shard->lock);
+    }
 
-    finds = cache->stats.hits + cache->stats.misses;
+    finds = stats.hits + stats.misses;
 
-    printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u writes=%u\n",
+    printf("%s: blocks=%d shards=%u hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u writes=%u evictions=%u\n",
            name,
-           cache->stats.hits,
-           finds ? (cache->stats.hits * 100) / finds : 0,
-           cache->stats.hits ? cache->stats.depth / cache->stats.hits : 0,
-           cache->stats.misses,
-           finds ? (cache->stats.misses * 100) / finds : 0,
-           cache->stats.reads,
-           cache->stats.writes);
+           cache->count,
+           cache->shard_count,
+           stats.hits,
+           finds ? (stats.hits * 100) / finds : 0,
+           stats.hits ? stats.depth / stats.hits : 0,
+           stats.misses,
+           finds ? (stats.misses * 100) / finds : 0,
+           stats.reads,
+           stats.writes,
+           stats.evictions);
 }
@@ -35,3 +35,18 @@ int bcache_read_block(bcache_t, void *, uint block);
 int bcache_get_block(bcache_t, void **, uint block);
 int bcache_put_block(bcache_t, uint block);
 
+// read a range of blocks, runs that aren't cached are read straight into buf
+int bcache_read_blocks(bcache_t, void *buf, uint block, uint count);
+
+// start loading a range of blocks into the cache ahead of use, without waiting for them
+int bcache_prefetch(bcache_t, uint block, uint count);
+
+int bcache_mark_block_dirty(bcache_t, uint block);
+int bcache_zero_block(bcache_t, uint block);
+
+// write back every dirty block
+int bcache_flush(bcache_t);
+
+// print hit, miss and eviction stats
+void bcache_dump(bcache_t, const char *name);
+
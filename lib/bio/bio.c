@@ -29,6 +29,8 @@
 #include <list.h>
 #include <pow2.h>
 #include <lib/bio.h>
+
+#include "bio_priv.h"
 #include <kernel/mutex.h>
 #include <lk/init.h>
 
@@ -297,6 +299,21 @@ static ssize_t bio_default_write_block(struct bdev *dev, const void *buf, bnum_t
     return ERR_NOT_SUPPORTED;
 }
 
+/* run the request synchronously on devices without a queue of their own */
+static status_t bio_default_submit(struct bdev *dev, bio_request_t *req)
+{
+    ssize_t result;
+
+    if (req->op == BIO_OP_WRITE)
+        result = dev->write_block(dev, req->buf, req->block, req->count);
+    else
+        result = dev->read_block(dev, req->buf, req->block, req->count);
+
+    bio_complete_request(req, result);
+
+    return NO_ERROR;
+}
+
 static void bdev_inc_ref(bdev_t *dev)
 {
     LTRACEF("Add ref \"%s\" %d -> %d\n", dev->name, dev->ref, dev->ref + 1);
@@ -315,6 +332,9 @@ static void bdev_dec_ref(bdev_t *dev)
 
         TRACEF("last ref, removing (%s)\n", dev->name);
 
+        bio_sched_destroy(dev->sched);
+        dev->sched = NULL;
+
         // call the close hook if it exists
         if (dev->close)
             dev->close(dev);
@@ -406,6 +426,9 @@ ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count)
     if (count == 0)
         return 0;
 
+    if (dev->sched)
+        return bio_sched_sync(dev, BIO_OP_READ, buf, block, count);
+
     return dev->read_block(dev, buf, block, count);
 }
 
@@ -436,6 +459,9 @@ ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count)
     if (count == 0)
         return 0;
 
+    if (dev->sched)
+        return bio_sched_sync(dev, BIO_OP_WRITE, (void *)buf, block, count);
+
     return dev->write_block(dev, buf, block, count);
 }
 
@@ -453,6 +479,68 @@ ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len)
     return dev->erase(dev, offset, len);
 }
 
+void bio_request_init(bio_request_t *req, enum bio_op op, void *buf,
+                      bnum_t block, uint count,
+                      bio_callback_t callback, void *arg)
+{
+    DEBUG_ASSERT(req);
+
+    list_clear_node(&req->node);
+    req->dev = NULL;
+    req->block = block;
+    req->op = op;
+    req->buf = buf;
+    req->count = count;
+    req->result = 0;
+    req->callback = callback;
+    req->arg = arg;
+    event_init(&req->done, false, 0);
+}
+
+status_t bio_submit_request(bdev_t *dev, bio_request_t *req)
+{
+    LTRACEF("dev '%s', req %p, op %d, buf %p, block %u, count %u\n",
+            dev->name, req, req->op, req->buf, req->block, req->count);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(req->buf);
+
+    req->dev = dev;
+
+    /* range check */
+    req->count = bio_trim_block_range(dev, req->block, req->count);
+    if (req->count == 0) {
+        bio_complete_request(req, 0);
+        return NO_ERROR;
+    }
+
+    if (dev->sched)
+        return bio_sched_queue(dev->sched, req);
+
+    return dev->submit(dev, req);
+}
+
+ssize_t bio_wait_request(bio_request_t *req)
+{
+    DEBUG_ASSERT(!req->callback);
+
+    event_wait(&req->done);
+    event_destroy(&req->done);
+
+    return req->result;
+}
+
+void bio_complete_request(bio_request_t *req, ssize_t result)
+{
+    LTRACEF("req %p, result %zd\n", req, result);
+
+    req->result = result;
+    if (req->callback)
+        req->callback(req);
+    else
+        event_signal(&req->done, false);
+}
+
 int bio_ioctl(bdev_t *dev, int request, void *argp)
 {
     LTRACEF("dev '%s', request %08x, argp %p\n", dev->name, request, argp);
@@ -489,6 +577,7 @@ void bio_initialize_bdev(bdev_t *dev,
     dev->erase_byte = 0;
     dev->ref = 0;
     dev->flags = flags;
+    dev->sched = NULL;
 
 #if DEBUG
     // If we have been supplied information about our erase geometry, sanity
@@ -537,6 +626,7 @@ void bio_initialize_bdev(bdev_t *dev,
     dev->write = bio_default_write;
     dev->write_block = bio_default_write_block;
     dev->erase = bio_default_erase;
+    dev->submit = bio_default_submit;
     dev->close = NULL;
 }
 
@@ -546,6 +636,9 @@ void bio_register_device(bdev_t *dev)
 
     LTRACEF(" '%s'\n", dev->name);
 
+    /* without a scheduler requests go straight to the device */
+    dev->sched = bio_sched_create(dev);
+
     bdev_inc_ref(dev);
 
     mutex_acquire(&bdevs.lock);
@@ -589,6 +682,9 @@ void bio_dump_devices(void)
         }
 
         printf("\n");
+
+        if (entry->sched)
+            bio_sched_dump(entry->sched);
     }
     mutex_release(&bdevs.lock);
 }
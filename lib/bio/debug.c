@@ -39,12 +39,16 @@
 #define DMA_ALIGNMENT (CACHE_LINE)
 #define THREE_BYTE_ADDR_BOUNDARY (16777216)
 #define SUB_ERASE_TEST_SAMPLES (32)
+#define BENCH_REQUESTS (1024)
+#define BENCH_REQUEST_SIZE (4096)
+#define BENCH_MAX_DEPTH (64)
 
 #if defined(WITH_LIB_CONSOLE)
 
 #if LK_DEBUGLEVEL > 0
 static int cmd_bio(int argc, const cmd_args *argv);
 static int bio_test_device(bdev_t *device);
+static int bio_bench_device(bdev_t *device, uint depth, bool random);
 
 STATIC_COMMAND_START
 STATIC_COMMAND("bio", "block io debug commands", &cmd_bio)
@@ -66,6 +70,7 @@ usage:
         printf("%s ioctl <device> <request> <arg>\n", argv[0].str);
         printf("%s remove <device>\n", argv[0].str);
         printf("%s test <device>\n", argv[0].str);
+        printf("%s bench <device> <queue depth> [random]\n", argv[0].str);
 #if WITH_LIB_PARTITION
         printf("%s partscan <device> [offset]\n", argv[0].str);
 #endif
@@ -222,6 +227,21 @@ usage:
         int err = bio_test_device(dev);
         bio_close(dev);
 
+        rc = err;
+    } else if (!strcmp(argv[1].str, "bench")) {
+        if (argc < 4) goto notenoughargs;
+
+        bool random = (argc > 4 && !strcmp(argv[4].str, "random"));
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        int err = bio_bench_device(dev, argv[3].u, random);
+        bio_close(dev);
+
         rc = err;
 #if WITH_LIB_PARTITION
     } else if (!strcmp(argv[1].str, "partscan")) {
@@ -289,6 +309,105 @@ usage:
 
 #endif
 
+struct bench_slot {
+    bio_request_t req;
+    event_t *event;
+    void *buf;
+    volatile bool busy;
+};
+
+static void bench_callback(bio_request_t *req)
+{
+    struct bench_slot *slot = req->arg;
+
+    slot->busy = false;
+    event_signal(slot->event, false);
+}
+
+// Reads BENCH_REQUESTS chunks keeping up to depth of them in flight at once.
+static int bio_bench_device(bdev_t *device, uint depth, bool random)
+{
+    struct bench_slot slots[BENCH_MAX_DEPTH];
+    event_t event;
+    uint count = MAX(1U, BENCH_REQUEST_SIZE / device->block_size);
+    uint chunks = device->block_count / count;
+    uint issued = 0, completed = 0;
+    int err = 0;
+
+    if (depth == 0 || depth > BENCH_MAX_DEPTH) {
+        printf("queue depth must be between 1 and %d\n", BENCH_MAX_DEPTH);
+        return ERR_INVALID_ARGS;
+    }
+    if (chunks == 0) {
+        printf("device too small\n");
+        return ERR_INVALID_ARGS;
+    }
+
+    event_init(&event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    for (uint i = 0; i < depth; i++) {
+        slots[i].event = &event;
+        slots[i].buf = memalign(DMA_ALIGNMENT, count * device->block_size);
+        slots[i].busy = false;
+        slots[i].req.callback = NULL;
+        if (!slots[i].buf) {
+            depth = i;
+            err = ERR_NO_MEMORY;
+            goto out;
+        }
+    }
+
+    lk_time_t t = current_time();
+    while (completed < BENCH_REQUESTS) {
+        for (uint i = 0; i < depth; i++) {
+            struct bench_slot *slot = &slots[i];
+
+            if (slot->busy)
+                continue;
+
+            /* reap the last request in this slot */
+            if (slot->req.callback) {
+                if (slot->req.result < 0 && err == 0)
+                    err = slot->req.result;
+                slot->req.callback = NULL;
+                completed++;
+            }
+
+            if (issued == BENCH_REQUESTS)
+                continue;
+
+            uint chunk = random ? (uint)rand() % chunks : issued % chunks;
+            bio_request_init(&slot->req, BIO_OP_READ, slot->buf, chunk * count, count,
+                             &bench_callback, slot);
+            slot->busy = true;
+            issued++;
+
+            status_t serr = bio_submit_request(device, &slot->req);
+            if (serr < 0) {
+                slot->busy = false;
+                slot->req.result = serr;
+            }
+        }
+
+        if (completed < BENCH_REQUESTS)
+            event_wait_timeout(&event, 100);
+    }
+    t = current_time() - t;
+
+    uint64_t bytes = (uint64_t)BENCH_REQUESTS * count * device->block_size;
+    printf("%s reads, depth %u: %u requests of %u bytes in %u msecs (%llu bytes/sec), err %d\n",
+           random ? "random" : "sequential", depth, BENCH_REQUESTS,
+           (uint)(count * device->block_size), (uint)t,
+           t ? bytes * 1000 / t : 0, err);
+
+out:
+    for (uint i = 0; i < depth; i++)
+        free(slots[i].buf);
+    event_destroy(&event);
+
+    return err;
+}
+
 // Returns the number of blocks that do not match the reference pattern.
 static bool is_valid_block(bdev_t *device, bnum_t block_num, uint8_t *pattern,
                            size_t pattern_length)
@@ -26,6 +26,7 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <list.h>
+#include <kernel/event.h>
 
 __BEGIN_CDECLS;
 
@@ -46,6 +47,9 @@ typedef struct bio_erase_geometry_info {
     size_t erase_shift;
 } bio_erase_geometry_info_t;
 
+struct bio_request;
+struct bio_sched;
+
 typedef struct bdev {
     struct list_node node;
     volatile int ref;
@@ -65,6 +69,9 @@ typedef struct bdev {
 
     uint32_t flags;
 
+    /* merges and orders requests, set up when the device is registered */
+    struct bio_sched *sched;
+
     /* function pointers */
     ssize_t (*read)(struct bdev *, void *buf, off_t offset, size_t len);
     ssize_t (*read_block)(struct bdev *, void *buf, bnum_t block, uint count);
@@ -73,8 +80,45 @@ typedef struct bdev {
     ssize_t (*erase)(struct bdev *, off_t offset, size_t len);
     int (*ioctl)(struct bdev *, int request, void *argp);
     void (*close)(struct bdev *);
+
+    /* queue an asynchronous request, completed later with bio_complete_request */
+    status_t (*submit)(struct bdev *, struct bio_request *req);
 } bdev_t;
 
+/* asynchronous block requests */
+enum bio_op {
+    BIO_OP_READ,
+    BIO_OP_WRITE,
+};
+
+typedef struct bio_request bio_request_t;
+typedef void (*bio_callback_t)(bio_request_t *req);
+
+struct bio_request {
+    /* for use by the device while the request is queued */
+    struct list_node node;
+
+    /* the device stack may remap these while the request is in flight */
+    bdev_t *dev;
+    bnum_t block;
+
+    enum bio_op op;
+    void *buf;
+    uint count;
+
+    /* bytes transferred or an error, valid once the request completes */
+    ssize_t result;
+
+    /*
+     * If set, called when the request completes, possibly from interrupt
+     * context. Otherwise the completion is signaled for bio_wait_request.
+     */
+    bio_callback_t callback;
+    void *arg;
+
+    event_t done;
+};
+
 /* user api */
 bdev_t *bio_open(const char *name);
 void bio_close(bdev_t *dev);
@@ -85,6 +129,19 @@ ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count);
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len);
 int bio_ioctl(bdev_t *dev, int request, void *argp);
 
+void bio_request_init(bio_request_t *req, enum bio_op op, void *buf,
+                      bnum_t block, uint count,
+                      bio_callback_t callback, void *arg);
+status_t bio_submit_request(bdev_t *dev, bio_request_t *req);
+ssize_t bio_wait_request(bio_request_t *req);
+
+/* hold requests back while submitting a batch so adjacent ones can merge */
+void bio_plug(bdev_t *dev);
+void bio_unplug(bdev_t *dev);
+
+/* called by the device when a request finishes */
+void bio_complete_request(bio_request_t *req, ssize_t result);
+
 /* register a block device */
 void bio_register_device(bdev_t *dev);
 void bio_unregister_device(bdev_t *dev);
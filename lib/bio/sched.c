@@ -0,0 +1,628 @@
+/*
+ * Copyright (c) 2026 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <trace.h>
+#include <err.h>
+#include <list.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arch/ops.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <lk/init.h>
+#include <platform.h>
+#include <lib/bio.h>
+
+#include "bio_priv.h"
+
+#define LOCAL_TRACE 0
+
+/*
+ * A small deadline elevator that sits in front of every registered block
+ * device. Requests are queued sorted by block, adjacent ones are merged into
+ * a single transfer, and transfers are handed to the device's submit hook in
+ * a one way sweep across the disk. Reads go ahead of writes, and anything
+ * that has waited past its deadline is serviced next regardless of position.
+ */
+
+/* transfers handed to the device at once, the rest wait and merge */
+#define BIO_SCHED_MAX_INFLIGHT   16
+/* don't merge past this many bytes */
+#define BIO_SCHED_MAX_XFER       (128 * 1024)
+/* msecs before a queued request is serviced out of order */
+#define BIO_SCHED_READ_EXPIRE    100
+#define BIO_SCHED_WRITE_EXPIRE   1000
+/* reads dispatched ahead of waiting writes before a write gets a turn */
+#define BIO_SCHED_WRITES_STARVED 2
+/* transfers per device, queueing fails once they are all in use */
+#define BIO_SCHED_POOL_XFERS     (BIO_SCHED_MAX_INFLIGHT * 2)
+/* bounce buffers for merges of scattered buffers, allocated on first use and kept */
+#define BIO_SCHED_BOUNCE_BUFS    4
+
+struct bio_sched_xfer {
+    struct list_node node;      /* sorted queue, then the worker's done list */
+    struct list_node fifo_node; /* arrival order, for deadlines */
+    struct bio_sched *sched;
+
+    /* what the device sees */
+    bio_request_t req;
+
+    /* requests merged into this transfer, in block order */
+    struct list_node children;
+    uint child_count;
+
+    lk_time_t deadline;
+    lk_bigtime_t queue_time;
+
+    /* slot in the scheduler's bounce pool, or -1 */
+    int bounce_slot;
+    void *bounce;
+};
+
+struct bio_sched_queue {
+    struct list_node sorted;
+    struct list_node fifo;
+};
+
+struct bio_sched {
+    bdev_t *dev;
+    spin_lock_t lock;
+
+    /* indexed by enum bio_op */
+    struct bio_sched_queue queue[2];
+
+    /* dispatched transfers, until the worker is done with them */
+    uint inflight;
+    /* transfers the worker is restarting the queues for */
+    uint completing;
+    /* signaled when inflight and completing both drop to zero */
+    event_t idle;
+
+    uint plugged;
+    uint starved;
+    bnum_t head_pos;
+
+    struct list_node free_xfers;
+    struct bio_sched_xfer pool[BIO_SCHED_POOL_XFERS];
+    /* signaled when a transfer goes back to the pool */
+    event_t xfer_freed;
+
+    uint bounce_busy;
+    void *bounce[BIO_SCHED_BOUNCE_BUFS];
+
+    struct {
+        uint32_t requests[2];
+        uint32_t merges;
+        uint32_t xfers;
+        uint64_t latency; /* usecs, summed over transfers */
+        uint64_t max_latency;
+    } stats;
+};
+
+/* completed transfers are freed and the queues restarted from a thread */
+static struct {
+    spin_lock_t lock;
+    struct list_node done;
+    event_t event;
+} bio_sched_worker = {
+    .lock = SPIN_LOCK_INITIAL_VALUE,
+    .done = LIST_INITIAL_VALUE(bio_sched_worker.done),
+    .event = EVENT_INITIAL_VALUE(bio_sched_worker.event, false, EVENT_FLAG_AUTOUNSIGNAL),
+};
+
+static void bio_sched_run(struct bio_sched *s);
+static void bio_sched_xfer_done(bio_request_t *req);
+
+struct bio_sched *bio_sched_create(bdev_t *dev)
+{
+    struct bio_sched *s = calloc(1, sizeof(struct bio_sched));
+    if (!s)
+        return NULL;
+
+    s->dev = dev;
+    s->lock = SPIN_LOCK_INITIAL_VALUE;
+    event_init(&s->idle, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&s->xfer_freed, false, EVENT_FLAG_AUTOUNSIGNAL);
+    for (uint i = 0; i < countof(s->queue); i++) {
+        list_initialize(&s->queue[i].sorted);
+        list_initialize(&s->queue[i].fifo);
+    }
+
+    list_initialize(&s->free_xfers);
+    for (uint i = 0; i < countof(s->pool); i++)
+        list_add_tail(&s->free_xfers, &s->pool[i].node);
+
+    return s;
+}
+
+void bio_sched_destroy(struct bio_sched *s)
+{
+    spin_lock_saved_state_t state;
+    bool busy;
+
+    if (!s)
+        return;
+
+    /*
+     * The callers' requests complete before the worker has finished with
+     * the transfers that carried them, so wait for it to let go of s.
+     */
+    for (;;) {
+        spin_lock_irqsave(&s->lock, state);
+        busy = s->inflight > 0 || s->completing > 0;
+        spin_unlock_irqrestore(&s->lock, state);
+
+        if (!busy)
+            break;
+        event_wait(&s->idle);
+    }
+
+    DEBUG_ASSERT(list_is_empty(&s->queue[BIO_OP_READ].sorted));
+    DEBUG_ASSERT(list_is_empty(&s->queue[BIO_OP_WRITE].sorted));
+
+    for (uint i = 0; i < countof(s->bounce); i++)
+        free(s->bounce[i]);
+    event_destroy(&s->idle);
+    event_destroy(&s->xfer_freed);
+    free(s);
+}
+
+/* take a transfer from the pool, with the lock held. NULL if it is empty */
+static struct bio_sched_xfer *bio_sched_xfer_get(struct bio_sched *s)
+{
+    return list_remove_head_type(&s->free_xfers, struct bio_sched_xfer, node);
+}
+
+/* give a transfer back, with the lock held */
+static void bio_sched_xfer_put(struct bio_sched *s, struct bio_sched_xfer *x)
+{
+    if (!x)
+        return;
+
+    if (x->bounce_slot >= 0)
+        s->bounce_busy &= ~(1U << x->bounce_slot);
+
+    list_add_head(&s->free_xfers, &x->node);
+    event_signal(&s->xfer_freed, false);
+}
+
+static void bio_sched_xfer_init(struct bio_sched *s, struct bio_sched_xfer *x, bio_request_t *req)
+{
+    x->sched = s;
+    x->queue_time = current_time_hires();
+    x->deadline = current_time() +
+                  ((req->op == BIO_OP_READ) ? BIO_SCHED_READ_EXPIRE : BIO_SCHED_WRITE_EXPIRE);
+    x->bounce_slot = -1;
+    x->bounce = NULL;
+    list_initialize(&x->children);
+    list_add_tail(&x->children, &req->node);
+    x->child_count = 1;
+    bio_request_init(&x->req, req->op, NULL, req->block, req->count, &bio_sched_xfer_done, x);
+    x->req.dev = s->dev;
+}
+
+/* append b's requests to a, which ends where b starts. returns b, now unused */
+static struct bio_sched_xfer *bio_sched_coalesce(struct bio_sched_xfer *a, struct bio_sched_xfer *b)
+{
+    DEBUG_ASSERT(a->req.block + a->req.count == b->req.block);
+
+    bio_request_t *child;
+    while ((child = list_remove_head_type(&b->children, bio_request_t, node)))
+        list_add_tail(&a->children, &child->node);
+
+    a->req.count += b->req.count;
+    a->child_count += b->child_count;
+    if (TIME_LT(b->deadline, a->deadline))
+        a->deadline = b->deadline;
+    a->queue_time = MIN(a->queue_time, b->queue_time);
+
+    list_delete(&b->node);
+    list_delete(&b->fifo_node);
+
+    return b;
+}
+
+/*
+ * Try to merge req onto the front or back of a queued transfer, with the
+ * lock held. If that makes two queued transfers adjacent they are joined and
+ * the spare one is returned in *unused for the caller to free.
+ */
+static bool bio_sched_merge(struct bio_sched *s, bio_request_t *req, struct bio_sched_xfer **unused)
+{
+    struct bio_sched_queue *q = &s->queue[req->op];
+    uint max_count = BIO_SCHED_MAX_XFER / s->dev->block_size;
+    struct bio_sched_xfer *x;
+
+    list_for_every_entry(&q->sorted, x, struct bio_sched_xfer, node) {
+        /* the queue is sorted, nothing further on can touch req */
+        if (x->req.block > req->block + req->count)
+            break;
+        if (x->req.count + req->count > max_count)
+            continue;
+
+        if (x->req.block + x->req.count == req->block) {
+            /* back merge */
+            list_add_tail(&x->children, &req->node);
+            x->req.count += req->count;
+            x->child_count++;
+
+            struct bio_sched_xfer *next = list_next_type(&q->sorted, &x->node, struct bio_sched_xfer, node);
+            if (next && x->req.block + x->req.count == next->req.block &&
+                    x->req.count + next->req.count <= max_count)
+                *unused = bio_sched_coalesce(x, next);
+            return true;
+        }
+
+        if (req->block + req->count == x->req.block) {
+            /* front merge */
+            list_add_head(&x->children, &req->node);
+            x->req.block = req->block;
+            x->req.count += req->count;
+            x->child_count++;
+
+            struct bio_sched_xfer *prev = list_prev_type(&q->sorted, &x->node, struct bio_sched_xfer, node);
+            if (prev && prev->req.block + prev->req.count == x->req.block &&
+                    prev->req.count + x->req.count <= max_count)
+                *unused = bio_sched_coalesce(prev, x);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* add a new transfer to the queues, with the lock held */
+static void bio_sched_insert(struct bio_sched *s, struct bio_sched_xfer *x)
+{
+    struct bio_sched_queue *q = &s->queue[x->req.op];
+    struct bio_sched_xfer *entry;
+
+    list_for_every_entry(&q->sorted, entry, struct bio_sched_xfer, node) {
+        if (entry->req.block > x->req.block) {
+            /* add before this one */
+            list_add_tail(&entry->node, &x->node);
+            goto added;
+        }
+    }
+    list_add_tail(&q->sorted, &x->node);
+
+added:
+    list_add_tail(&q->fifo, &x->fifo_node);
+}
+
+static bool bio_sched_contiguous(struct bio_sched_xfer *x)
+{
+    bio_request_t *child;
+    uint8_t *expected = NULL;
+
+    list_for_every_entry(&x->children, child, bio_request_t, node) {
+        if (expected && (uint8_t *)child->buf != expected)
+            return false;
+        expected = (uint8_t *)child->buf + child->count * x->sched->dev->block_size;
+    }
+
+    return true;
+}
+
+/* pick the next transfer to dispatch, with the lock held */
+static struct bio_sched_xfer *bio_sched_next(struct bio_sched *s)
+{
+    bool reads = !list_is_empty(&s->queue[BIO_OP_READ].sorted);
+    bool writes = !list_is_empty(&s->queue[BIO_OP_WRITE].sorted);
+    struct bio_sched_queue *q;
+    struct bio_sched_xfer *x;
+
+    if (reads && (!writes || s->starved < BIO_SCHED_WRITES_STARVED)) {
+        q = &s->queue[BIO_OP_READ];
+        if (writes)
+            s->starved++;
+    } else if (writes) {
+        q = &s->queue[BIO_OP_WRITE];
+        s->starved = 0;
+    } else {
+        return NULL;
+    }
+
+    /* the oldest transfer goes first if it has expired */
+    x = list_peek_head_type(&q->fifo, struct bio_sched_xfer, fifo_node);
+    if (TIME_LT(current_time(), x->deadline)) {
+        /* otherwise continue the sweep, wrapping around at the end */
+        struct bio_sched_xfer *entry;
+
+        x = NULL;
+        list_for_every_entry(&q->sorted, entry, struct bio_sched_xfer, node) {
+            if (entry->req.block >= s->head_pos) {
+                x = entry;
+                break;
+            }
+        }
+        if (!x)
+            x = list_peek_head_type(&q->sorted, struct bio_sched_xfer, node);
+    }
+
+    /* a merge of scattered buffers waits for a bounce buffer to come free */
+    if (!bio_sched_contiguous(x)) {
+        uint slot;
+        for (slot = 0; slot < countof(s->bounce); slot++) {
+            if (!(s->bounce_busy & (1U << slot)))
+                break;
+        }
+        if (slot == countof(s->bounce))
+            return NULL;
+
+        s->bounce_busy |= 1U << slot;
+        x->bounce_slot = slot;
+    }
+
+    list_delete(&x->node);
+    list_delete(&x->fifo_node);
+    s->head_pos = x->req.block + x->req.count;
+
+    return x;
+}
+
+static void bio_sched_dispatch(struct bio_sched *s, struct bio_sched_xfer *x)
+{
+    bio_request_t *child;
+    status_t err;
+
+    LTRACEF("dev '%s', xfer %p, op %d, block %u, count %u, children %u\n",
+            s->dev->name, x, x->req.op, x->req.block, x->req.count, x->child_count);
+
+    if (x->bounce_slot < 0) {
+        /* transfer straight to or from the callers' buffers */
+        child = list_peek_head_type(&x->children, bio_request_t, node);
+        x->req.buf = child->buf;
+    } else {
+        /* merges never grow past the bounce buffer size */
+        DEBUG_ASSERT(x->req.count * s->dev->block_size <= BIO_SCHED_MAX_XFER);
+
+        /* the slot is ours until the transfer is retired */
+        if (!s->bounce[x->bounce_slot])
+            s->bounce[x->bounce_slot] = memalign(CACHE_LINE, BIO_SCHED_MAX_XFER);
+        x->bounce = s->bounce[x->bounce_slot];
+        if (!x->bounce) {
+            bio_complete_request(&x->req, ERR_NO_MEMORY);
+            return;
+        }
+
+        if (x->req.op == BIO_OP_WRITE) {
+            uint8_t *pos = x->bounce;
+            list_for_every_entry(&x->children, child, bio_request_t, node) {
+                memcpy(pos, child->buf, child->count * s->dev->block_size);
+                pos += child->count * s->dev->block_size;
+            }
+        }
+        x->req.buf = x->bounce;
+    }
+
+    err = s->dev->submit(s->dev, &x->req);
+    if (err < 0)
+        bio_complete_request(&x->req, err);
+}
+
+/* dispatch transfers until the device is busy or the queues are empty */
+static void bio_sched_run(struct bio_sched *s)
+{
+    spin_lock_saved_state_t state;
+    struct bio_sched_xfer *x;
+
+    for (;;) {
+        spin_lock_irqsave(&s->lock, state);
+        if (s->plugged || s->inflight >= BIO_SCHED_MAX_INFLIGHT ||
+                (x = bio_sched_next(s)) == NULL) {
+            spin_unlock_irqrestore(&s->lock, state);
+            return;
+        }
+        s->inflight++;
+        s->stats.xfers++;
+        spin_unlock_irqrestore(&s->lock, state);
+
+        bio_sched_dispatch(s, x);
+    }
+}
+
+/* completion of a transfer, possibly in interrupt context */
+static void bio_sched_xfer_done(bio_request_t *req)
+{
+    struct bio_sched_xfer *x = req->arg;
+    struct bio_sched *s = x->sched;
+    size_t block_size = s->dev->block_size;
+    spin_lock_saved_state_t state;
+    bio_request_t *child;
+    size_t pos = 0;
+
+    LTRACEF("xfer %p, result %zd\n", x, req->result);
+
+    /* hand each request its share of the transfer */
+    while ((child = list_remove_head_type(&x->children, bio_request_t, node))) {
+        size_t len = child->count * block_size;
+        ssize_t result;
+
+        if (req->result < 0)
+            result = req->result;
+        else if (pos + len <= (size_t)req->result)
+            result = len;
+        else
+            result = ERR_IO;
+
+        if (x->bounce && req->op == BIO_OP_READ && result > 0)
+            memcpy(child->buf, (uint8_t *)x->bounce + pos, len);
+        pos += len;
+
+        bio_complete_request(child, result);
+    }
+
+    lk_bigtime_t latency = current_time_hires() - x->queue_time;
+
+    spin_lock_irqsave(&s->lock, state);
+    s->stats.latency += latency;
+    s->stats.max_latency = MAX(s->stats.max_latency, latency);
+    spin_unlock_irqrestore(&s->lock, state);
+
+    /*
+     * Let the worker retire it and start the next transfers. It stays
+     * counted as inflight until then, so s can't go away under the worker.
+     */
+    spin_lock_irqsave(&bio_sched_worker.lock, state);
+    list_add_tail(&bio_sched_worker.done, &x->node);
+    spin_unlock_irqrestore(&bio_sched_worker.lock, state);
+
+    event_signal(&bio_sched_worker.event, false);
+}
+
+status_t bio_sched_queue(struct bio_sched *s, bio_request_t *req)
+{
+    spin_lock_saved_state_t state;
+    struct bio_sched_xfer *unused = NULL;
+    struct bio_sched_xfer *x = NULL;
+    bool merged;
+
+    DEBUG_ASSERT(req->count > 0);
+
+    spin_lock_irqsave(&s->lock, state);
+    merged = bio_sched_merge(s, req, &unused);
+    if (merged) {
+        s->stats.requests[req->op]++;
+        s->stats.merges++;
+        bio_sched_xfer_put(s, unused);
+    } else if ((x = bio_sched_xfer_get(s)) != NULL) {
+        bio_sched_xfer_init(s, x, req);
+        s->stats.requests[req->op]++;
+        bio_sched_insert(s, x);
+    }
+    spin_unlock_irqrestore(&s->lock, state);
+
+    if (merged)
+        return NO_ERROR;
+
+    /* may be called from completion callbacks, so never fall back to the heap */
+    if (!x)
+        return ERR_NO_MEMORY;
+
+    bio_sched_run(s);
+
+    return NO_ERROR;
+}
+
+ssize_t bio_sched_sync(bdev_t *dev, enum bio_op op, void *buf, bnum_t block, uint count)
+{
+    bio_request_t req;
+    status_t err;
+
+    bio_request_init(&req, op, buf, block, count, NULL, NULL);
+    req.dev = dev;
+
+    /* we're in thread context and about to block anyway, wait for a transfer */
+    while ((err = bio_sched_queue(dev->sched, &req)) == ERR_NO_MEMORY)
+        event_wait(&dev->sched->xfer_freed);
+    if (err < 0)
+        return err;
+
+    return bio_wait_request(&req);
+}
+
+void bio_plug(bdev_t *dev)
+{
+    struct bio_sched *s = dev->sched;
+    spin_lock_saved_state_t state;
+
+    if (!s)
+        return;
+
+    spin_lock_irqsave(&s->lock, state);
+    s->plugged++;
+    spin_unlock_irqrestore(&s->lock, state);
+}
+
+void bio_unplug(bdev_t *dev)
+{
+    struct bio_sched *s = dev->sched;
+    spin_lock_saved_state_t state;
+
+    if (!s)
+        return;
+
+    spin_lock_irqsave(&s->lock, state);
+    DEBUG_ASSERT(s->plugged > 0);
+    s->plugged--;
+    spin_unlock_irqrestore(&s->lock, state);
+
+    bio_sched_run(s);
+}
+
+void bio_sched_dump(struct bio_sched *s)
+{
+    printf("\t\treads %u writes %u merges %u transfers %u inflight %u, latency avg %llu max %llu usecs\n",
+           s->stats.requests[BIO_OP_READ], s->stats.requests[BIO_OP_WRITE],
+           s->stats.merges, s->stats.xfers, s->inflight,
+           s->stats.xfers ? s->stats.latency / s->stats.xfers : 0,
+           s->stats.max_latency);
+}
+
+static int bio_sched_worker_thread(void *arg)
+{
+    spin_lock_saved_state_t state;
+    struct bio_sched_xfer *x;
+
+    for (;;) {
+        event_wait(&bio_sched_worker.event);
+
+        for (;;) {
+            spin_lock_irqsave(&bio_sched_worker.lock, state);
+            x = list_remove_head_type(&bio_sched_worker.done, struct bio_sched_xfer, node);
+            spin_unlock_irqrestore(&bio_sched_worker.lock, state);
+
+            if (!x)
+                break;
+
+            struct bio_sched *s = x->sched;
+
+            spin_lock_irqsave(&s->lock, state);
+            s->inflight--;
+            s->completing++;
+            bio_sched_xfer_put(s, x);
+            spin_unlock_irqrestore(&s->lock, state);
+
+            bio_sched_run(s);
+
+            /* signaled with the lock held, s may be freed as soon as it drops */
+            spin_lock_irqsave(&s->lock, state);
+            s->completing--;
+            if (s->inflight == 0 && s->completing == 0)
+                event_signal(&s->idle, false);
+            spin_unlock_irqrestore(&s->lock, state);
+        }
+    }
+
+    return 0;
+}
+
+static void bio_sched_init(uint level)
+{
+    thread_detach_and_resume(thread_create("bio sched", &bio_sched_worker_thread, NULL,
+                                           HIGH_PRIORITY, DEFAULT_STACK_SIZE));
+}
+
+LK_INIT_HOOK(bio_sched, &bio_sched_init, LK_INIT_LEVEL_THREADING);
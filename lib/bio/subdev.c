@@ -71,6 +71,16 @@ static ssize_t subdev_write_block(struct bdev *_dev, const void *buf, bnum_t blo
     return bio_write_block(subdev->parent, buf, block + subdev->offset, count);
 }
 
+static status_t subdev_submit(struct bdev *_dev, bio_request_t *req)
+{
+    subdev_t *subdev = (subdev_t *)_dev;
+
+    /* remap the request onto the parent and pass it down */
+    req->block += subdev->offset;
+
+    return bio_submit_request(subdev->parent, req);
+}
+
 static ssize_t subdev_erase(struct bdev *_dev, off_t offset, size_t len)
 {
     subdev_t *subdev = (subdev_t *)_dev;
@@ -182,6 +192,7 @@ status_t bio_publish_subdevice(const char *parent_dev,
     sub->dev.write = &subdev_write;
     sub->dev.write_block = &subdev_write_block;
     sub->dev.erase = &subdev_erase;
+    sub->dev.submit = &subdev_submit;
     sub->dev.close = &subdev_close;
 
     bio_register_device(&sub->dev);
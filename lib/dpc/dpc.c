@@ -20,76 +20,201 @@
  * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
+#include <assert.h>
 #include <debug.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <list.h>
 #include <malloc.h>
 #include <err.h>
+#include <pow2.h>
+#include <platform.h>
 #include <lib/dpc.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/spinlock.h>
 #include <lk/init.h>
 
-struct dpc {
-    struct list_node node;
+/* private dpc flags */
+#define DPC_FLAG_ALLOCATED 0x100  // allocated by dpc_queue(), freed after running
 
-    dpc_callback cb;
-    void *arg;
+/* queue to run latency, bucket n counts calls that waited less than 2^n us */
+#define DPC_LATENCY_BUCKETS 16
+
+/* each cpu queues to and drains its own list, from its own thread */
+struct dpc_cpu {
+    spin_lock_t lock;
+    struct list_node list;
+    event_t event;
+    thread_t *thread;
+
+    /* only touched by the cpu's dpc thread */
+    ulong runs;
+    ulong batches;
+    ulong latency[DPC_LATENCY_BUCKETS];
 };
 
-static struct list_node dpc_list = LIST_INITIAL_VALUE(dpc_list);
-static event_t dpc_event;
+static struct dpc_cpu dpc_cpus[SMP_MAX_CPUS];
 
-static int dpc_thread_routine(void *arg);
+void dpc_init(dpc_t *dpc, dpc_callback cb, void *arg)
+{
+    *dpc = (dpc_t)DPC_INITIAL_VALUE(cb, arg);
+}
 
-status_t dpc_queue(dpc_callback cb, void *arg, uint flags)
+status_t dpc_enqueue(dpc_t *dpc, uint flags)
 {
-    struct dpc *dpc;
+    DEBUG_ASSERT(dpc->cb);
+
+    /* claim it, so it can only ever be on one cpu's list */
+    if (atomic_cmpxchg(&dpc->queued, 0, 1) != 0)
+        return ERR_ALREADY_EXISTS;
+
+    dpc->queue_time = current_time_hires();
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct dpc_cpu *cpu = &dpc_cpus[arch_curr_cpu_num()];
+    spin_lock(&cpu->lock);
+    list_add_tail(&cpu->list, &dpc->node);
+    spin_unlock(&cpu->lock);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 
-    dpc = malloc(sizeof(struct dpc));
+    event_signal(&cpu->event, (flags & DPC_FLAG_NORESCHED) ? false : true);
 
+    return NO_ERROR;
+}
+
+status_t dpc_queue(dpc_callback cb, void *arg, uint flags)
+{
+    dpc_t *dpc = malloc(sizeof(dpc_t));
     if (dpc == NULL)
         return ERR_NO_MEMORY;
 
-    dpc->cb = cb;
-    dpc->arg = arg;
-    enter_critical_section();
-    list_add_tail(&dpc_list, &dpc->node);
-    event_signal(&dpc_event, (flags & DPC_FLAG_NORESCHED) ? false : true);
-    exit_critical_section();
+    dpc_init(dpc, cb, arg);
+    dpc->flags = DPC_FLAG_ALLOCATED;
 
-    return NO_ERROR;
+    return dpc_enqueue(dpc, flags);
 }
 
-static int dpc_thread_routine(void *arg)
+static void dpc_account(struct dpc_cpu *cpu, lk_bigtime_t queue_time)
 {
-    for (;;) {
-        event_wait(&dpc_event);
+    lk_bigtime_t wait = current_time_hires() - queue_time;
+    uint bucket = 0;
+
+    if (wait)
+        bucket = MIN(log2_uint(MIN(wait, (lk_bigtime_t)UINT32_MAX)) + 1, DPC_LATENCY_BUCKETS - 1);
+
+    cpu->latency[bucket]++;
+    cpu->runs++;
+}
 
-        enter_critical_section();
-        struct dpc *dpc = list_remove_head_type(&dpc_list, struct dpc, node);
-        if (!dpc)
-            event_unsignal(&dpc_event);
-        exit_critical_section();
+static int dpc_thread_routine(void *arg)
+{
+    struct dpc_cpu *cpu = (struct dpc_cpu *)arg;
+    struct list_node batch;
+    spin_lock_saved_state_t state;
 
-        if (dpc) {
-//          dprintf("dpc calling %p, arg %p\n", dpc->cb, dpc->arg);
-            dpc->cb(dpc->arg);
+    for (;;) {
+        event_wait(&cpu->event);
 
-            free(dpc);
+        /* take everything queued so far in one go */
+        spin_lock_irqsave(&cpu->lock, state);
+        if (list_is_empty(&cpu->list)) {
+            spin_unlock_irqrestore(&cpu->lock, state);
+            continue;
+        }
+        batch.next = cpu->list.next;
+        batch.prev = cpu->list.prev;
+        batch.next->prev = &batch;
+        batch.prev->next = &batch;
+        list_initialize(&cpu->list);
+        spin_unlock_irqrestore(&cpu->lock, state);
+
+        cpu->batches++;
+
+        dpc_t *dpc;
+        while ((dpc = list_remove_head_type(&batch, dpc_t, node))) {
+            dpc_account(cpu, dpc->queue_time);
+
+            /* copy out what we need, the callback may requeue or free it */
+            dpc_callback cb = dpc->cb;
+            void *cb_arg = dpc->arg;
+            bool allocated = dpc->flags & DPC_FLAG_ALLOCATED;
+            if (!allocated)
+                atomic_swap(&dpc->queued, 0);
+
+//          dprintf("dpc calling %p, arg %p\n", cb, cb_arg);
+            cb(cb_arg);
+
+            if (allocated)
+                free(dpc);
         }
     }
 
     return 0;
 }
 
-static void dpc_init(uint level)
+static void dpc_init_cpu(uint level)
+{
+    uint cpu_num = arch_curr_cpu_num();
+    struct dpc_cpu *cpu = &dpc_cpus[cpu_num];
+
+    char name[16];
+    snprintf(name, sizeof(name), "dpc %u", cpu_num);
+
+    cpu->thread = thread_create(name, &dpc_thread_routine, cpu, DPC_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!cpu->thread)
+        panic("failed to create dpc thread for cpu %u\n", cpu_num);
+
+    thread_set_pinned_cpu(cpu->thread, cpu_num);
+    thread_detach_and_resume(cpu->thread);
+}
+
+static void dpc_init_hook(uint level)
 {
-    event_init(&dpc_event, false, 0);
+    /* set up every cpu's queue, so secondaries can queue before their thread exists */
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        spin_lock_init(&dpc_cpus[i].lock);
+        list_initialize(&dpc_cpus[i].list);
+        event_init(&dpc_cpus[i].event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    }
 
-    thread_detach_and_resume(thread_create("dpc", &dpc_thread_routine, NULL, DPC_PRIORITY, DEFAULT_STACK_SIZE));
+    dpc_init_cpu(level);
 }
 
-LK_INIT_HOOK(libdpc, &dpc_init, LK_INIT_LEVEL_THREADING);
+LK_INIT_HOOK(libdpc, &dpc_init_hook, LK_INIT_LEVEL_THREADING);
+LK_INIT_HOOK_FLAGS(libdpc_cpu, &dpc_init_cpu, LK_INIT_LEVEL_THREADING, LK_INIT_FLAG_SECONDARY_CPUS);
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_dpc(int argc, const cmd_args *argv)
+{
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct dpc_cpu *cpu = &dpc_cpus[i];
+        if (!mp_is_cpu_active(i) || !cpu->thread)
+            continue;
+
+        printf("cpu %u: %lu calls in %lu batches\n", i, cpu->runs, cpu->batches);
+        printf("\tqueue to run latency:\n");
+        for (uint b = 0; b < DPC_LATENCY_BUCKETS; b++) {
+            if (!cpu->latency[b])
+                continue;
+            if (b == DPC_LATENCY_BUCKETS - 1)
+                printf("\t\t>= %u us: %lu\n", 1U << (b - 1), cpu->latency[b]);
+            else
+                printf("\t\t < %u us: %lu\n", 1U << b, cpu->latency[b]);
+        }
+    }
+
+    return 0;
+}
 
+STATIC_COMMAND_START
+STATIC_COMMAND("dpc", "dpc queue statistics", &cmd_dpc)
+STATIC_COMMAND_END(dpc);
 
+#endif
@@ -73,6 +73,12 @@ static void endian_swap_superblock(struct ext2_super_block *sb)
     LE32SWAP(sb->s_last_orphan);
     LE32SWAP(sb->s_default_mount_opts);
     LE32SWAP(sb->s_first_meta_bg);
+
+    /* ext4 */
+    LE16SWAP(sb->s_desc_size);
+    LE32SWAP(sb->s_blocks_count_hi);
+    LE32SWAP(sb->s_r_blocks_count_hi);
+    LE32SWAP(sb->s_free_blocks_count_hi);
 }
 
 static void endian_swap_inode(struct ext2_inode *inode)
@@ -100,14 +106,60 @@ static void endian_swap_inode(struct ext2_inode *inode)
     LE16SWAP(inode->i_gid_high);
 }
 
-static void endian_swap_group_desc(struct ext2_group_desc *gd)
+static void endian_swap_group_desc(struct ext4_group_desc *gd)
 {
-    LE32SWAP(gd->bg_block_bitmap);
-    LE32SWAP(gd->bg_inode_bitmap);
-    LE32SWAP(gd->bg_inode_table);
-    LE16SWAP(gd->bg_free_blocks_count);
-    LE16SWAP(gd->bg_free_inodes_count);
-    LE16SWAP(gd->bg_used_dirs_count);
+    LE32SWAP(gd->lo.bg_block_bitmap);
+    LE32SWAP(gd->lo.bg_inode_bitmap);
+    LE32SWAP(gd->lo.bg_inode_table);
+    LE16SWAP(gd->lo.bg_free_blocks_count);
+    LE16SWAP(gd->lo.bg_free_inodes_count);
+    LE16SWAP(gd->lo.bg_used_dirs_count);
+    LE32SWAP(gd->bg_block_bitmap_hi);
+    LE32SWAP(gd->bg_inode_bitmap_hi);
+    LE32SWAP(gd->bg_inode_table_hi);
+}
+
+/* read the group descriptor table, widening 32 byte descriptors to the ext4 layout */
+static int ext2_read_group_desc(ext2_t *ext2)
+{
+    size_t desc_size = EXT2_MIN_DESC_SIZE;
+    if (ext2->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+        desc_size = MAX(ext2->sb.s_desc_size, EXT2_MIN_DESC_SIZE);
+    if (desc_size > EXT2_BLOCK_SIZE(ext2->sb))
+        return ERR_NOT_VALID;
+
+    size_t table_size = desc_size * ext2->s_group_count;
+    uint8_t *table = malloc(table_size);
+    ext2->gd = calloc(ext2->s_group_count, sizeof(struct ext4_group_desc));
+    if (!table || !ext2->gd) {
+        free(table);
+        return ERR_NO_MEMORY;
+    }
+
+    /* the table starts in the block after the superblock */
+    int err = bio_read(ext2->dev, table,
+                       (off_t)(ext2->sb.s_first_data_block + 1) * EXT2_BLOCK_SIZE(ext2->sb),
+                       table_size);
+    if (err < 0) {
+        free(table);
+        return err;
+    }
+
+    int i;
+    for (i=0; i < ext2->s_group_count; i++) {
+        memcpy(&ext2->gd[i], table + i * desc_size, MIN(desc_size, sizeof(struct ext4_group_desc)));
+        endian_swap_group_desc(&ext2->gd[i]);
+        LTRACEF("group %d:\n", i);
+        LTRACEF("\tblock bitmap %d\n", ext2->gd[i].lo.bg_block_bitmap);
+        LTRACEF("\tinode bitmap %d\n", ext2->gd[i].lo.bg_inode_bitmap);
+        LTRACEF("\tinode table %d\n", ext2->gd[i].lo.bg_inode_table);
+        LTRACEF("\tfree blocks %d\n", ext2->gd[i].lo.bg_free_blocks_count);
+        LTRACEF("\tfree inodes %d\n", ext2->gd[i].lo.bg_free_inodes_count);
+        LTRACEF("\tused dirs %d\n", ext2->gd[i].lo.bg_used_dirs_count);
+    }
+
+    free(table);
+    return 0;
 }
 
 status_t ext2_mount(bdev_t *dev, fscookie **cookie)
@@ -119,7 +171,7 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie)
     if (!dev)
         return ERR_NOT_FOUND;
 
-    ext2_t *ext2 = malloc(sizeof(ext2_t));
+    ext2_t *ext2 = calloc(1, sizeof(ext2_t));
     ext2->dev = dev;
 
     err = bio_read(dev, &ext2->sb, 1024, sizeof(struct ext2_super_block));
@@ -156,35 +208,40 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie)
     }
 
     /* make sure it doesn't have any ro features we don't support */
-    if (ext2->sb.s_feature_ro_compat & ~(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER|EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) {
+    if (ext2->sb.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_UNSUPPORTED) {
         err = -3;
         return err;
     }
 
-    /* read in all the group descriptors */
-    ext2->gd = malloc(sizeof(struct ext2_group_desc) * ext2->s_group_count);
-    err = bio_read(ext2->dev, (void *)ext2->gd,
-                   (EXT2_BLOCK_SIZE(ext2->sb) == 4096) ? 4096 : 2048,
-                   sizeof(struct ext2_group_desc) * ext2->s_group_count);
-    if (err < 0) {
-        err = -4;
-        return err;
+    /* or any incompatible ones. flex_bg only moves the bitmaps and inode
+     * tables around, which the group descriptors already point at. */
+    if (ext2->sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_UNSUPPORTED) {
+        LTRACEF("unsupported incompat features 0x%x\n",
+                ext2->sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_UNSUPPORTED);
+        err = ERR_NOT_SUPPORTED;
+        goto err;
     }
 
-    int i;
-    for (i=0; i < ext2->s_group_count; i++) {
-        endian_swap_group_desc(&ext2->gd[i]);
-        LTRACEF("group %d:\n", i);
-        LTRACEF("\tblock bitmap %d\n", ext2->gd[i].bg_block_bitmap);
-        LTRACEF("\tinode bitmap %d\n", ext2->gd[i].bg_inode_bitmap);
-        LTRACEF("\tinode table %d\n", ext2->gd[i].bg_inode_table);
-        LTRACEF("\tfree blocks %d\n", ext2->gd[i].bg_free_blocks_count);
-        LTRACEF("\tfree inodes %d\n", ext2->gd[i].bg_free_inodes_count);
-        LTRACEF("\tused dirs %d\n", ext2->gd[i].bg_used_dirs_count);
+    /* descriptors past s_first_meta_bg live in their own meta groups, which we can't find */
+    if ((ext2->sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG) &&
+            ext2->sb.s_first_meta_bg < (uint32_t)ext2->s_group_count) {
+        err = ERR_NOT_SUPPORTED;
+        goto err;
     }
 
+    /* the block cache and bio address blocks with 32 bits */
+    if ((ext2->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) && ext2->sb.s_blocks_count_hi != 0) {
+        err = ERR_OUT_OF_RANGE;
+        goto err;
+    }
+
+    /* read in all the group descriptors */
+    err = ext2_read_group_desc(ext2);
+    if (err < 0)
+        goto err;
+
     /* initialize the block cache */
-    ext2->cache = bcache_create(ext2->dev, EXT2_BLOCK_SIZE(ext2->sb), 4);
+    ext2->cache = bcache_create(ext2->dev, EXT2_BLOCK_SIZE(ext2->sb), EXT2_CACHE_BLOCKS);
 
     /* load the first inode */
     err = ext2_load_inode(ext2, EXT2_ROOT_INO, &ext2->root_inode);
@@ -200,6 +257,7 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie)
 err:
     LTRACEF("exiting with err code %d\n", err);
 
+    free(ext2->gd);
     free(ext2);
     return err;
 }
@@ -222,8 +280,9 @@ static void get_inode_addr(ext2_t *ext2, inodenum_t num, blocknum_t *block, size
 
     uint32_t group = num / ext2->sb.s_inodes_per_group;
 
-    // calculate the start of the inode table for the group it's in
-    *block = ext2->gd[group].bg_inode_table;
+    // calculate the start of the inode table for the group it's in. with flex_bg it
+    // may sit in another group; the hi half is zero since mount refuses >32 bit block counts
+    *block = ext2->gd[group].lo.bg_inode_table;
 
     // add the offset of the inode within the group
     size_t offset = (num % EXT2_INODES_PER_GROUP(ext2->sb)) * EXT2_INODE_SIZE(ext2->sb);
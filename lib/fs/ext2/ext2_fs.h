@@ -81,6 +81,29 @@ struct ext2_group_desc {
     uint32_t    bg_reserved[3];
 };
 
+/*
+ * ext4 group descriptor, used when the 64bit feature is set and
+ * s_desc_size is at least EXT4_MIN_DESC_SIZE_64BIT. The first half is
+ * laid out like the ext2 one.
+ */
+struct ext4_group_desc {
+    struct ext2_group_desc lo;
+    uint32_t    bg_block_bitmap_hi; /* Blocks bitmap block MSB */
+    uint32_t    bg_inode_bitmap_hi; /* Inodes bitmap block MSB */
+    uint32_t    bg_inode_table_hi;  /* Inodes table block MSB */
+    uint16_t    bg_free_blocks_count_hi;/* Free blocks count MSB */
+    uint16_t    bg_free_inodes_count_hi;/* Free inodes count MSB */
+    uint16_t    bg_used_dirs_count_hi;  /* Directories count MSB */
+    uint16_t    bg_itable_unused_hi;    /* Unused inodes count MSB */
+    uint32_t    bg_exclude_bitmap_hi;   /* Exclude bitmap block MSB */
+    uint16_t    bg_block_bitmap_csum_hi;/* crc32c(s_uuid+grp_num+bbitmap) MSB */
+    uint16_t    bg_inode_bitmap_csum_hi;/* crc32c(s_uuid+grp_num+ibitmap) MSB */
+    uint32_t    bg_reserved;
+};
+
+#define EXT2_MIN_DESC_SIZE          32
+#define EXT4_MIN_DESC_SIZE_64BIT    64
+
 /*
  * Macro-instructions used to manage group descriptors
  */
@@ -165,6 +188,47 @@ struct ext2_inode {
 #define i_gid_high  osd2.linux2.l_i_gid_high
 #define i_reserved2 osd2.linux2.l_i_reserved2
 
+/*
+ * Inode flags
+ */
+#define EXT4_EXTENTS_FL         0x00080000 /* Inode uses extents */
+#define EXT4_INLINE_DATA_FL     0x10000000 /* Inode has inline data */
+
+/*
+ * ext4 extent tree. With EXT4_EXTENTS_FL set, i_block holds a header
+ * followed by up to four extents or index entries. Index entries point
+ * at blocks holding another header and a full block of entries.
+ */
+#define EXT4_EXT_MAGIC          0xf30a
+#define EXT4_EXT_MAX_DEPTH      5
+
+/* extents longer than this are uninitialized, read back as zeros */
+#define EXT4_EXT_INIT_MAX_LEN   32768
+
+struct ext4_extent_header {
+    uint16_t    eh_magic;   /* EXT4_EXT_MAGIC */
+    uint16_t    eh_entries; /* number of valid entries */
+    uint16_t    eh_max;     /* capacity of store in entries */
+    uint16_t    eh_depth;   /* has tree real underlying blocks? */
+    uint32_t    eh_generation;  /* generation of the tree */
+};
+
+/* leaf entry, eh_depth == 0 */
+struct ext4_extent {
+    uint32_t    ee_block;   /* first logical block extent covers */
+    uint16_t    ee_len;     /* number of blocks covered by extent */
+    uint16_t    ee_start_hi;    /* high 16 bits of physical block */
+    uint32_t    ee_start_lo;    /* low 32 bits of physical block */
+};
+
+/* interior entry, eh_depth > 0 */
+struct ext4_extent_idx {
+    uint32_t    ei_block;   /* index covers logical blocks from 'block' */
+    uint32_t    ei_leaf_lo; /* pointer to the physical block of the next level */
+    uint16_t    ei_leaf_hi; /* high 16 bits of physical block */
+    uint16_t    ei_unused;
+};
+
 /*
  * File system states
  */
@@ -281,11 +345,29 @@ struct ext2_super_block {
     uint32_t    s_last_orphan;      /* start of list of inodes to delete */
     uint32_t    s_hash_seed[4];     /* HTREE hash seed */
     uint8_t s_def_hash_version; /* Default hash version to use */
-    uint8_t s_reserved_char_pad;
-    uint16_t    s_reserved_word_pad;
+    uint8_t s_jnl_backup_type;
+    uint16_t    s_desc_size;        /* size of group descriptor */
     uint32_t    s_default_mount_opts;
     uint32_t    s_first_meta_bg;    /* First metablock block group */
-    uint32_t    s_reserved[190];    /* Padding to the end of the block */
+    /*
+     * ext4 fields, valid when the matching features are set.
+     */
+    uint32_t    s_mkfs_time;        /* When the filesystem was created */
+    uint32_t    s_jnl_blocks[17];   /* Backup of the journal inode */
+    uint32_t    s_blocks_count_hi;  /* Blocks count MSB */
+    uint32_t    s_r_blocks_count_hi;    /* Reserved blocks count MSB */
+    uint32_t    s_free_blocks_count_hi; /* Free blocks count MSB */
+    uint16_t    s_min_extra_isize;  /* All inodes have at least # bytes */
+    uint16_t    s_want_extra_isize;     /* New inodes should reserve # bytes */
+    uint32_t    s_flags;        /* Miscellaneous flags */
+    uint16_t    s_raid_stride;      /* RAID stride */
+    uint16_t    s_mmp_interval;     /* # seconds to wait in MMP checking */
+    uint64_t    s_mmp_block;        /* Block for multi-mount protection */
+    uint32_t    s_raid_stripe_width;    /* blocks on all data disks (N*stride)*/
+    uint8_t s_log_groups_per_flex;  /* FLEX_BG group size */
+    uint8_t s_checksum_type;    /* metadata checksum algorithm used */
+    uint16_t    s_reserved_pad;
+    uint32_t    s_reserved[162];    /* Padding to the end of the block */
 };
 
 /*
@@ -342,6 +424,13 @@ struct ext2_super_block {
 #define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
 #define EXT2_FEATURE_RO_COMPAT_LARGE_FILE   0x0002
 #define EXT2_FEATURE_RO_COMPAT_BTREE_DIR    0x0004
+#define EXT4_FEATURE_RO_COMPAT_HUGE_FILE    0x0008
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM     0x0010
+#define EXT4_FEATURE_RO_COMPAT_DIR_NLINK    0x0020
+#define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE  0x0040
+#define EXT4_FEATURE_RO_COMPAT_QUOTA        0x0100
+#define EXT4_FEATURE_RO_COMPAT_BIGALLOC     0x0200
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM    0x0400
 #define EXT2_FEATURE_RO_COMPAT_ANY      0xffffffff
 
 #define EXT2_FEATURE_INCOMPAT_COMPRESSION   0x0001
@@ -349,14 +438,33 @@ struct ext2_super_block {
 #define EXT3_FEATURE_INCOMPAT_RECOVER       0x0004
 #define EXT3_FEATURE_INCOMPAT_JOURNAL_DEV   0x0008
 #define EXT2_FEATURE_INCOMPAT_META_BG       0x0010
+#define EXT4_FEATURE_INCOMPAT_EXTENTS       0x0040
+#define EXT4_FEATURE_INCOMPAT_64BIT     0x0080
+#define EXT4_FEATURE_INCOMPAT_MMP       0x0100
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG       0x0200
+#define EXT4_FEATURE_INCOMPAT_CSUM_SEED     0x2000
+#define EXT4_FEATURE_INCOMPAT_LARGEDIR      0x4000
+#define EXT4_FEATURE_INCOMPAT_INLINE_DATA   0x8000
 #define EXT2_FEATURE_INCOMPAT_ANY       0xffffffff
 
 #define EXT2_FEATURE_COMPAT_SUPP    EXT2_FEATURE_COMPAT_EXT_ATTR
 #define EXT2_FEATURE_INCOMPAT_SUPP  (EXT2_FEATURE_INCOMPAT_FILETYPE| \
-                     EXT2_FEATURE_INCOMPAT_META_BG)
+                     EXT2_FEATURE_INCOMPAT_META_BG| \
+                     EXT4_FEATURE_INCOMPAT_EXTENTS| \
+                     EXT4_FEATURE_INCOMPAT_64BIT| \
+                     EXT4_FEATURE_INCOMPAT_MMP| \
+                     EXT4_FEATURE_INCOMPAT_FLEX_BG| \
+                     EXT4_FEATURE_INCOMPAT_CSUM_SEED| \
+                     EXT4_FEATURE_INCOMPAT_LARGEDIR)
 #define EXT2_FEATURE_RO_COMPAT_SUPP (EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER| \
                      EXT2_FEATURE_RO_COMPAT_LARGE_FILE| \
-                     EXT2_FEATURE_RO_COMPAT_BTREE_DIR)
+                     EXT2_FEATURE_RO_COMPAT_BTREE_DIR| \
+                     EXT4_FEATURE_RO_COMPAT_HUGE_FILE| \
+                     EXT4_FEATURE_RO_COMPAT_GDT_CSUM| \
+                     EXT4_FEATURE_RO_COMPAT_DIR_NLINK| \
+                     EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE| \
+                     EXT4_FEATURE_RO_COMPAT_QUOTA| \
+                     EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)
 #define EXT2_FEATURE_RO_COMPAT_UNSUPPORTED  ~EXT2_FEATURE_RO_COMPAT_SUPP
 #define EXT2_FEATURE_INCOMPAT_UNSUPPORTED   ~EXT2_FEATURE_INCOMPAT_SUPP
 
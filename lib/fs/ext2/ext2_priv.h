@@ -39,7 +39,7 @@ typedef struct {
 
     struct ext2_super_block sb;
     int s_group_count;
-    struct ext2_group_desc *gd;
+    struct ext4_group_desc *gd; // unpacked to the 64 byte layout, hi halves zero on ext2/3
     struct ext2_inode root_inode;
 } ext2_t;
 
@@ -54,8 +54,21 @@ typedef struct {
 
     struct cache_block ind_cache[3]; // cache of indirect blocks as they're scanned
     struct ext2_inode inode;
+
+    // sequential read detection
+    off_t ra_next;   // where the next read starts if it's sequential
+    uint ra_window;  // blocks to read ahead, grows while reads stay sequential
 } ext2_file_t;
 
+/* size of the block cache, in fs blocks */
+#define EXT2_CACHE_BLOCKS 64
+
+/* read-ahead window bounds, in fs blocks */
+#define EXT2_READAHEAD_MIN 4
+#define EXT2_READAHEAD_MAX 32
+/* physical runs mapped, then queued together, per read-ahead batch */
+#define EXT2_READAHEAD_RUNS 8
+
 /* internal routines */
 int ext2_load_inode(ext2_t *ext2, inodenum_t num, struct ext2_inode *inode);
 int ext2_lookup(ext2_t *ext2, const char *path, inodenum_t *inum); // path to inode
@@ -67,6 +80,7 @@ int ext2_put_block(ext2_t *ext2, blocknum_t bnum);
 
 off_t ext2_file_len(ext2_t *ext2, struct ext2_inode *inode);
 ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *buf, off_t offset, size_t len);
+void ext2_readahead_inode(ext2_t *ext2, struct ext2_inode *inode, uint file_block, uint count);
 int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len);
 
 /* fs api */
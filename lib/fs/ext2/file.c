@@ -70,8 +70,25 @@ ssize_t ext2_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len)
         return -1;
     }
 
+    // grow the read-ahead window while reads stay sequential, drop it otherwise
+    if (offset == file->ra_next && offset != 0) {
+        file->ra_window = file->ra_window ? MIN(file->ra_window * 2, EXT2_READAHEAD_MAX) : EXT2_READAHEAD_MIN;
+    } else {
+        file->ra_window = 0;
+    }
+
     // read from the inode
     err = ext2_read_inode(file->ext2, &file->inode, buf, offset, len);
+    if (err <= 0)
+        return err;
+
+    file->ra_next = offset + err;
+
+    // pull in the blocks the next read will want
+    if (file->ra_window) {
+        ext2_readahead_inode(file->ext2, &file->inode,
+                             file->ra_next / EXT2_BLOCK_SIZE(file->ext2->sb), file->ra_window);
+    }
 
     return err;
 }
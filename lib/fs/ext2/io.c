@@ -23,6 +23,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <err.h>
 #include <debug.h>
 #include <trace.h>
 #include "ext2_priv.h"
@@ -180,6 +181,156 @@ static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode,
     return block;
 }
 
+/* find the last of count extent or index entries starting at or before fileblock.
+ * both entry types are three words long with the logical block first. */
+static int extent_search(const uint32_t *entry, uint count, uint fileblock)
+{
+    int lo = 0;
+    int hi = (int)count - 1;
+    int found = -1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (LE32(entry[mid * 3]) <= fileblock) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return found;
+}
+
+/* walk the extent tree down to the leaf covering fileblock */
+static int extent_block_run(ext2_t *ext2, struct ext2_inode *inode, uint fileblock, uint max,
+                            blocknum_t *phys, uint *run)
+{
+    const struct ext4_extent_header *eh = (const void *)inode->i_block;
+    blocknum_t held = 0;
+    uint limit = UINT32_MAX; // first logical block past the subtree being searched
+    int err = 0;
+
+    LTRACEF("inode %p, fileblock %u, max %u\n", inode, fileblock, max);
+
+    for (uint depth = 0; ; depth++) {
+        uint entries = LE16(eh->eh_entries);
+        if (LE16(eh->eh_magic) != EXT4_EXT_MAGIC || entries > LE16(eh->eh_max) ||
+                depth > EXT4_EXT_MAX_DEPTH) {
+            err = ERR_BAD_STATE;
+            break;
+        }
+
+        if (LE16(eh->eh_depth) == 0) {
+            const struct ext4_extent *ex = (const void *)(eh + 1);
+            int i = extent_search((const uint32_t *)ex, entries, fileblock);
+
+            if (i >= 0) {
+                uint start = LE32(ex[i].ee_block);
+                uint len = LE16(ex[i].ee_len);
+                bool uninit = len > EXT4_EXT_INIT_MAX_LEN;
+                if (uninit)
+                    len -= EXT4_EXT_INIT_MAX_LEN;
+
+                if (fileblock - start < len) {
+                    /* block numbers past 32 bits are refused at mount */
+                    if (LE16(ex[i].ee_start_hi) != 0) {
+                        err = ERR_OUT_OF_RANGE;
+                        break;
+                    }
+                    *phys = uninit ? 0 : LE32(ex[i].ee_start_lo) + (fileblock - start);
+                    *run = MIN(max, len - (fileblock - start));
+                    break;
+                }
+            }
+
+            /* a hole, running up to the next extent */
+            if (i + 1 < (int)entries)
+                limit = LE32(ex[i + 1].ee_block);
+            *phys = 0;
+            *run = MIN(max, limit - fileblock);
+            break;
+        }
+
+        const struct ext4_extent_idx *ix = (const void *)(eh + 1);
+        int i = extent_search((const uint32_t *)ix, entries, fileblock);
+        if (i < 0) {
+            /* before the first index, a hole */
+            *phys = 0;
+            *run = MIN(max, (entries ? LE32(ix[0].ei_block) : limit) - fileblock);
+            break;
+        }
+        if (i + 1 < (int)entries)
+            limit = LE32(ix[i + 1].ei_block);
+        if (LE16(ix[i].ei_leaf_hi) != 0) {
+            err = ERR_OUT_OF_RANGE;
+            break;
+        }
+
+        /* descend, keeping the child pinned in the cache while it's searched */
+        blocknum_t child = LE32(ix[i].ei_leaf_lo);
+        void *ptr;
+        err = ext2_get_block(ext2, &ptr, child);
+        if (held)
+            ext2_put_block(ext2, held);
+        held = 0;
+        if (err < 0)
+            break;
+        held = child;
+        eh = ptr;
+    }
+
+    if (held)
+        ext2_put_block(ext2, held);
+
+    /* never hand back an empty run, even for a mangled tree */
+    if (err >= 0 && *run == 0)
+        *run = 1;
+
+    LTRACEF("err %d, phys %u, run %u\n", err, *phys, *run);
+
+    return err;
+}
+
+/* translate a file block to a physical block, and count how many of the
+ * following file blocks (up to max) sit contiguously after it on disk.
+ * holes come back as physical block 0. */
+static int file_block_run(ext2_t *ext2, struct ext2_inode *inode, uint fileblock, uint max,
+                          blocknum_t *phys, uint *run)
+{
+    if (inode->i_flags & EXT4_EXTENTS_FL)
+        return extent_block_run(ext2, inode, fileblock, max, phys, run);
+
+    blocknum_t block = file_block_to_fs_block(ext2, inode, fileblock);
+    uint count = 1;
+    while (count < max) {
+        blocknum_t next = file_block_to_fs_block(ext2, inode, fileblock + count);
+        if (block == 0 ? next != 0 : next != block + count)
+            break;
+        count++;
+    }
+
+    *phys = block;
+    *run = count;
+    return 0;
+}
+
+/* read a single file block, zero filling holes */
+static int file_block_read(ext2_t *ext2, struct ext2_inode *inode, uint fileblock, void *buf)
+{
+    blocknum_t phys_block;
+    uint run;
+    int err = file_block_run(ext2, inode, fileblock, 1, &phys_block, &run);
+    if (err < 0)
+        return err;
+
+    if (phys_block == 0) {
+        memset(buf, 0, EXT2_BLOCK_SIZE(ext2->sb));
+        return 0;
+    }
+    return ext2_read_block(ext2, buf, phys_block);
+}
+
 ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t offset, size_t len)
 {
     int err = 0;
@@ -207,12 +358,9 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
         uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
 
         /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-        if (phys_block == 0) {
-            memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
-        } else {
-            ext2_read_block(ext2, temp, phys_block);
-        }
+        err = file_block_read(ext2, inode, file_block, temp);
+        if (err < 0)
+            return err;
 
         /* copy out what we need */
         size_t block_offset = offset % EXT2_BLOCK_SIZE(ext2->sb);
@@ -226,40 +374,44 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
         buf += tocopy;
     }
 
-    /* handle middle blocks */
+    /* handle middle blocks, a physically contiguous run (or whole extent) at a time */
     while (len >= EXT2_BLOCK_SIZE(ext2->sb)) {
-        /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
+        blocknum_t phys_block;
+        uint run;
+        err = file_block_run(ext2, inode, file_block, len / EXT2_BLOCK_SIZE(ext2->sb),
+                             &phys_block, &run);
+        if (err < 0)
+            break;
+
+        size_t run_len = run * EXT2_BLOCK_SIZE(ext2->sb);
         if (phys_block == 0) {
-            memset(buf, 0, EXT2_BLOCK_SIZE(ext2->sb));
+            memset(buf, 0, run_len);
         } else {
-            ext2_read_block(ext2, buf, phys_block);
+            err = bcache_read_blocks(ext2->cache, buf, phys_block, run);
+            if (err < 0)
+                break;
         }
 
         /* increment our stuff */
-        file_block++;
-        len -= EXT2_BLOCK_SIZE(ext2->sb);
-        bytes_read += EXT2_BLOCK_SIZE(ext2->sb);
-        buf += EXT2_BLOCK_SIZE(ext2->sb);
+        file_block += run;
+        len -= run_len;
+        bytes_read += run_len;
+        buf += run_len;
     }
 
     /* handle partial last block */
-    if (len > 0) {
+    if (len > 0 && err >= 0) {
         uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
 
         /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-        if (phys_block == 0) {
-            memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
-        } else {
-            ext2_read_block(ext2, temp, phys_block);
-        }
+        err = file_block_read(ext2, inode, file_block, temp);
+        if (err >= 0) {
+            /* copy out what we need */
+            memcpy(buf, temp, len);
 
-        /* copy out what we need */
-        memcpy(buf, temp, len);
-
-        /* increment our stuff */
-        bytes_read += len;
+            /* increment our stuff */
+            bytes_read += len;
+        }
     }
 
     LTRACEF("err %d, bytes_read %zu\n", err, bytes_read);
@@ -267,3 +419,53 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
     return (err < 0) ? err : (ssize_t)bytes_read;
 }
 
+
+void ext2_readahead_inode(ext2_t *ext2, struct ext2_inode *inode, uint file_block, uint count)
+{
+    uint file_blocks = DIV_ROUND_UP(ext2_file_len(ext2, inode), EXT2_BLOCK_SIZE(ext2->sb));
+
+    LTRACEF("inode %p, file_block %u, count %u, file_blocks %u\n", inode, file_block, count, file_blocks);
+
+    if (file_block >= file_blocks)
+        return;
+    count = MIN(count, file_blocks - file_block);
+
+    while (count > 0) {
+        struct {
+            blocknum_t block;
+            uint count;
+        } runs[EXT2_READAHEAD_RUNS];
+        uint nruns = 0;
+
+        /* map the runs first, that may read indirect blocks and has to
+         * happen before the device is plugged */
+        while (count > 0 && nruns < countof(runs)) {
+            blocknum_t phys_block;
+            uint run;
+            if (file_block_run(ext2, inode, file_block, count, &phys_block, &run) < 0) {
+                count = 0;
+                break;
+            }
+
+            if (phys_block != 0) {
+                runs[nruns].block = phys_block;
+                runs[nruns].count = run;
+                nruns++;
+            }
+
+            file_block += run;
+            count -= run;
+        }
+
+        /* queue them all before letting any go, so runs adjacent on disk
+         * merge. nothing here waits for them to land */
+        bio_plug(ext2->dev);
+        for (uint i = 0; i < nruns; i++) {
+            if (bcache_prefetch(ext2->cache, runs[i].block, runs[i].count) < 0) {
+                count = 0;
+                break;
+            }
+        }
+        bio_unplug(ext2->dev);
+    }
+}
@@ -71,7 +71,12 @@ status_t fat32_mount(bdev_t *dev, fscookie **cookie)
         goto end;
     }
 
-    fat_fs_t *fat = malloc(sizeof(fat_fs_t));
+    /* zeroed, fat32_next_cluster_in_chain reads last_fat_block before the first walk sets it */
+    fat_fs_t *fat = calloc(1, sizeof(fat_fs_t));
+    if (!fat) {
+        result = ERR_NO_MEMORY;
+        goto end;
+    }
     fat->lba_start = 1024;
     fat->dev = dev;
 
@@ -166,7 +171,13 @@ status_t fat32_mount(bdev_t *dev, fscookie **cookie)
     }
 
     fat->bytes_per_cluster = fat->sectors_per_cluster * fat->bytes_per_sector;
-    fat->cache = bcache_create(fat->dev, fat->bytes_per_sector, 4);
+    fat->cache = bcache_create(fat->dev, fat->bytes_per_sector, FAT_CACHE_SECTORS);
+
+    /* queue the start of the FAT as one read, that's where most chain walks begin.
+     * it lands in the cache in the background while the mount finishes */
+    fat->last_fat_block = (fat->lba_start / fat->bytes_per_sector) + fat->reserved_sectors;
+    fat->prefetch_end = fat->last_fat_block + MIN(FAT_MOUNT_SECTORS, fat->sectors_per_fat);
+    bcache_prefetch(fat->cache, fat->last_fat_block, fat->prefetch_end - fat->last_fat_block);
 
     *cookie = (fscookie *)fat;
 end:
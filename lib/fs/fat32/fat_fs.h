@@ -47,13 +47,39 @@ typedef struct {
     uint32_t root_cluster;
     uint32_t root_entries;
     uint32_t root_start;
+
+    uint32_t last_fat_block; // FAT sector of the last chain lookup
+    uint32_t prefetch_end;   // first FAT sector past the last read-ahead window
 } fat_fs_t;
 
+/* size of the sector cache */
+#define FAT_CACHE_SECTORS 128
+
+/* FAT sectors to read ahead when a chain walk moves on to the next one */
+#define FAT_READAHEAD_SECTORS 8
+
+/* FAT sectors loaded with one read at mount, where most chains start */
+#define FAT_MOUNT_SECTORS 64
+
+/* a run of clusters that are contiguous both in the file and on disk */
+struct fat_cluster_run {
+    uint32_t file_cluster; // index of the first cluster within the file
+    uint32_t cluster;      // first cluster on disk
+    uint32_t count;
+};
+
 typedef struct {
     fat_fs_t *fat_fs;
     uint32_t start_cluster;
     uint32_t length;
     uint8_t attributes;
+
+    /* cluster map, extended as reads reach further into the file */
+    struct fat_cluster_run *runs;
+    uint32_t run_count;
+    uint32_t run_capacity;
+    uint32_t mapped_clusters; // file clusters covered by runs
+    uint32_t next_cluster;    // chain entry after the last mapped cluster
 } fat_file_t;
 
 typedef enum {
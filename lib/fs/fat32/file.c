@@ -38,13 +38,26 @@
 
 uint32_t fat32_next_cluster_in_chain(fat_fs_t *fat, uint32_t cluster)
 {
-    uint32_t fat_sector = (cluster) >> 7;
-    uint32_t fat_index = (cluster ) & 127;
+    uint32_t entries_per_sector = fat->bytes_per_sector / (fat->fat_bits / 8);
+    uint32_t fat_sector = cluster / entries_per_sector;
+    uint32_t fat_index = cluster % entries_per_sector;
 
     uint32_t bnum = (fat->lba_start / fat->bytes_per_sector) + (fat->reserved_sectors + fat_sector);
     uint32_t next_cluster = 0x0fffffff;
 
 #if USE_CACHE
+    /* a walk down a contiguous chain that reaches the end of the last window queues
+     * the next few FAT sectors as one read. this sector waits for it, the rest are
+     * ready by the time the walk gets there. a jump elsewhere starts over */
+    if (bnum != fat->last_fat_block && bnum != fat->last_fat_block + 1) {
+        fat->prefetch_end = 0;
+    } else if (bnum == fat->last_fat_block + 1 && bnum >= fat->prefetch_end) {
+        uint32_t fat_end = (fat->lba_start / fat->bytes_per_sector) + fat->reserved_sectors + fat->sectors_per_fat;
+        fat->prefetch_end = bnum + MIN(FAT_READAHEAD_SECTORS, fat_end - bnum);
+        bcache_prefetch(fat->cache, bnum, fat->prefetch_end - bnum);
+    }
+    fat->last_fat_block = bnum;
+
     void *cache_ptr;
     int err = bcache_get_block(fat->cache, &cache_ptr, bnum);
     if (err < 0) {
@@ -54,6 +67,7 @@ uint32_t fat32_next_cluster_in_chain(fat_fs_t *fat, uint32_t cluster)
             uint32_t *table = (uint32_t *)cache_ptr;
             next_cluster = table[fat_index];
             LE32SWAP(next_cluster);
+            next_cluster &= 0x0fffffff;
         } else if (fat->fat_bits == 16) {
             uint16_t *table = (uint16_t *)cache_ptr;
             next_cluster = table[fat_index];
@@ -73,6 +87,12 @@ uint32_t fat32_next_cluster_in_chain(fat_fs_t *fat, uint32_t cluster)
     return next_cluster;
 }
 
+/* false for free, bad and end of chain entries */
+static inline bool fat32_cluster_valid(fat_fs_t *fat, uint32_t cluster)
+{
+    return cluster >= 2 && cluster < fat->total_clusters + 2;
+}
+
 static inline off_t fat32_offset_for_cluster(fat_fs_t *fat, uint32_t cluster)
 {
     off_t cluster_begin_lba = fat->reserved_sectors + (fat->fat_count * fat->sectors_per_fat);
@@ -186,11 +206,15 @@ status_t fat32_open_file(fscookie *cookie, const char *path, filecookie **fcooki
             free(filename);
 
             if (matched) {
-                uint16_t target_cluster = fat_read16(dir, offset + 0x1a);
+                uint32_t target_cluster = fat_read16(dir, offset + 0x1a);
+                if (fat->fat_bits == 32) {
+                    target_cluster |= (uint32_t)fat_read16(dir, offset + 0x14) << 16;
+                }
                 if (done == true) {
-                    file = malloc(sizeof(fat_file_t));
+                    file = calloc(1, sizeof(fat_file_t));
                     file->fat_fs = fat;
                     file->start_cluster = target_cluster;
+                    file->next_cluster = target_cluster;
                     file->length = fat_read32(dir, offset + 0x1c);
                     file->attributes = dir[0x0B + offset];
                     result = NO_ERROR;
@@ -218,7 +242,7 @@ status_t fat32_open_file(fscookie *cookie, const char *path, filecookie **fcooki
         } else {
             // XXX: untested!!!
             dir_cluster = fat32_next_cluster_in_chain(fat, dir_cluster);
-            if (dir_cluster == 0x0fffffff) {
+            if (!fat32_cluster_valid(fat, dir_cluster)) {
                 // no more clusters in the chain
                 break;
             }
@@ -231,51 +255,113 @@ out:
     return result;
 }
 
-ssize_t fat32_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len)
+/* extend the file's cluster map until it covers file_cluster or the chain ends */
+static status_t fat32_map_clusters(fat_file_t *file, uint32_t file_cluster)
 {
-    fat_file_t *file = (fat_file_t *)fcookie;
     fat_fs_t *fat = file->fat_fs;
-    bdev_t *dev = fat->dev;
 
-    uint32_t cluster = 0;
-    if (offset <= fat->bytes_per_cluster) {
-        cluster = file->start_cluster;
-    } else {
-        // XXX: support non-0 offsets
-        TRACE;
-        return -1;
+    while (file->mapped_clusters <= file_cluster) {
+        uint32_t cluster = file->next_cluster;
+        if (!fat32_cluster_valid(fat, cluster)) {
+            return ERR_NOT_FOUND;
+        }
+
+        /* start a new run unless this cluster carries on from the last one */
+        struct fat_cluster_run *run = file->run_count ? &file->runs[file->run_count - 1] : NULL;
+        if (!run || run->cluster + run->count != cluster) {
+            if (file->run_count == file->run_capacity) {
+                uint32_t capacity = MAX(8u, file->run_capacity * 2);
+                struct fat_cluster_run *runs = realloc(file->runs, capacity * sizeof(struct fat_cluster_run));
+                if (!runs) {
+                    return ERR_NO_MEMORY;
+                }
+                file->runs = runs;
+                file->run_capacity = capacity;
+            }
+            run = &file->runs[file->run_count++];
+            run->file_cluster = file->mapped_clusters;
+            run->cluster = cluster;
+            run->count = 0;
+        }
+
+        run->count++;
+        file->mapped_clusters++;
+        file->next_cluster = fat32_next_cluster_in_chain(fat, cluster);
     }
 
-    uint32_t length = file->length;
-    uint32_t amount_read = 0;
+    return NO_ERROR;
+}
+
+/* binary search the map for the run holding a mapped file cluster */
+static struct fat_cluster_run *fat32_find_run(fat_file_t *file, uint32_t file_cluster)
+{
+    uint32_t lo = 0;
+    uint32_t hi = file->run_count;
 
-    do {
-        off_t lba_addr = fat32_offset_for_cluster(fat, cluster);
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (file->runs[mid].file_cluster <= file_cluster) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return &file->runs[lo];
+}
+
+ssize_t fat32_read_file(filecookie *fcookie, void *_buf, off_t offset, size_t len)
+{
+    fat_file_t *file = (fat_file_t *)fcookie;
+    fat_fs_t *fat = file->fat_fs;
+    uint8_t *buf = _buf;
+
+    if (offset < 0) {
+        return ERR_INVALID_ARGS;
+    }
+    if (offset >= file->length) {
+        return 0;
+    }
+    len = MIN(len, (size_t)(file->length - offset));
+    if (len == 0) {
+        return 0;
+    }
 
-        uint32_t to_read = fat->bytes_per_cluster;
-        uint32_t next_cluster = 0;
-        while ((next_cluster = fat32_next_cluster_in_chain(fat, cluster)) == cluster + 1) {
-            cluster = next_cluster;
-            to_read += fat->bytes_per_cluster;
+    /* map every cluster the read touches */
+    uint32_t last_cluster = (offset + len - 1) / fat->bytes_per_cluster;
+    status_t err = fat32_map_clusters(file, last_cluster);
+    if (err == ERR_NO_MEMORY) {
+        return err;
+    }
+    if (err < 0) {
+        off_t mapped_len = (off_t)file->mapped_clusters * fat->bytes_per_cluster;
+        printf("no more clusters, mapped %lld of %u bytes\n", mapped_len, file->length);
+        if (mapped_len <= offset) {
+            return ERR_IO;
         }
-        cluster = next_cluster;
+        len = MIN(len, (size_t)(mapped_len - offset));
+    }
 
-        to_read = MIN(length - amount_read, to_read);
-        // XXX: support non-0 offsets
-        int err = bio_read(dev, buf+amount_read, lba_addr, to_read);
-        if (err < 0) {
-            return err;
+    /* one read per run of contiguous clusters */
+    size_t amount_read = 0;
+    while (amount_read < len) {
+        off_t pos = offset + amount_read;
+        uint32_t file_cluster = pos / fat->bytes_per_cluster;
+        uint32_t cluster_offset = pos % fat->bytes_per_cluster;
+
+        struct fat_cluster_run *run = fat32_find_run(file, file_cluster);
+        uint32_t cluster = run->cluster + (file_cluster - run->file_cluster);
+        size_t to_read = (size_t)(run->file_cluster + run->count - file_cluster) * fat->bytes_per_cluster - cluster_offset;
+        to_read = MIN(to_read, len - amount_read);
+
+        ssize_t read = bio_read(fat->dev, buf + amount_read,
+                                fat32_offset_for_cluster(fat, cluster) + cluster_offset, to_read);
+        if (read < 0) {
+            return read;
         }
 
         amount_read += to_read;
-
-        if (amount_read < length) {
-            if (cluster == 0x0fffffff) {
-                printf("no more clusters, amount_read=%i, to_read=%i\n", amount_read, to_read);
-                break;
-            }
-        }
-    } while (amount_read < length);
+    }
 
     return amount_read;
 }
@@ -283,6 +369,7 @@ ssize_t fat32_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len
 status_t fat32_close_file(filecookie *fcookie)
 {
     fat_file_t *file = (fat_file_t *)fcookie;
+    free(file->runs);
     free(file);
     return NO_ERROR;
 }
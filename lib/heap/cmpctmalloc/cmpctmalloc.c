@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <kernel/thread.h>
+#include <kernel/mp.h>
 #include <kernel/mutex.h>
 #include <kernel/spinlock.h>
 #include <lib/cmpctmalloc.h>
@@ -38,6 +39,8 @@
 // Allocation strategy takes place with a global mutex.  Freelist entries are
 // kept in linked lists with 8 different sizes per binary order of magnitude
 // and the header size is two words with eager coalescing on free.
+//
+// Small allocations go through per-cpu magazines first, see below.
 
 #ifdef DEBUG
 #define CMPCT_DEBUG
@@ -100,7 +103,33 @@ struct heap {
 // Heap static vars.
 static struct heap theheap;
 
+// Per-cpu magazines in front of the buckets for small allocations.  A magazine
+// is a stack of allocations of one bucket size that only its own cpu touches,
+// with interrupts disabled, so the common alloc and free take no lock.  Empty
+// magazines are refilled and full ones drained a batch at a time under the
+// heap lock.  Cached allocations keep their header and stay allocated as far
+// as the buckets are concerned until they are drained or trimmed.
+#define MAGAZINE_MAX_SIZE 256
+#define MAGAZINE_BUCKETS 24  // Buckets 0 to 23 hold up to MAGAZINE_MAX_SIZE.
+#define MAGAZINE_ROUNDS 16
+#define MAGAZINE_BATCH (MAGAZINE_ROUNDS / 2)
+
+typedef struct magazine {
+    unsigned count;
+    void *rounds[MAGAZINE_ROUNDS];
+} magazine_t;
+
+struct cpu_cache {
+    magazine_t magazines[MAGAZINE_BUCKETS];
+} __CPU_ALIGN;
+
+static struct cpu_cache cpu_caches[SMP_MAX_CPUS];
+
+// Turned off by the tests, which need to see every alloc and free.
+static bool magazines_enabled = true;
+
 static ssize_t heap_grow(size_t len, free_t **bucket);
+static void magazine_flush_all_locked(void);
 
 static void lock(void)
 {
@@ -572,6 +601,10 @@ static void cmpct_test_return_to_os(void)
 
 void cmpct_test(void)
 {
+    // The tests check the buckets directly, keep the magazines out of the way.
+    magazines_enabled = false;
+    cmpct_trim();
+
     cmpct_test_buckets();
     cmpct_test_get_back_newly_freed();
     cmpct_test_return_to_os();
@@ -628,6 +661,8 @@ void cmpct_test(void)
     }
 
     cmpct_dump();
+
+    magazines_enabled = true;
 }
 
 static void *large_alloc(size_t size)
@@ -664,6 +699,8 @@ void cmpct_trim(void)
     // header. They might be at the start or the end of a block, so we can trim
     // them and free the page(s).
     lock();
+    // Give cached small allocations back first so their space can coalesce.
+    magazine_flush_all_locked();
     for (int bucket = size_to_index_freeing(PAGE_SIZE);
             bucket < NUMBER_OF_BUCKETS;
             bucket++) {
@@ -730,27 +767,23 @@ void cmpct_trim(void)
     unlock();
 }
 
-void *cmpct_alloc(size_t size)
+// Called with the lock.  Only grows the heap if allowed to.
+static void *alloc_locked(size_t size, bool grow)
 {
-    if (size == 0u) return NULL;
-
-    if (size + sizeof(header_t) > (1u << HEAP_ALLOC_VIRTUAL_BITS)) return large_alloc(size);
-
     size_t rounded_up;
     int start_bucket = size_to_index_allocating(size, &rounded_up);
 
     rounded_up += sizeof(header_t);
 
-    lock();
     int bucket = find_nonempty_bucket(start_bucket);
     if (bucket == -1) {
+        if (!grow) return NULL;
         // Grow heap by at least 12% if we can.
         size_t growby = MIN(1u << HEAP_ALLOC_VIRTUAL_BITS,
                             MAX(theheap.size >> 3,
                                 MAX(HEAP_GROW_SIZE, rounded_up)));
         while (heap_grow(growby, NULL) < 0) {
             if (growby <= rounded_up) {
-                unlock();
                 return NULL;
             }
             growby = MAX(growby >> 1, rounded_up);
@@ -780,6 +813,202 @@ void *cmpct_alloc(size_t size)
     memset(result, ALLOC_FILL, size);
     memset(((char *)result) + size, PADDING_FILL, rounded_up - size - sizeof(header_t));
 #endif
+    return result;
+}
+
+// Called with the lock.
+static void free_locked(void *payload)
+{
+    header_t *header = (header_t *)payload - 1;
+    size_t size = header->size;
+    header_t *left = header->left;
+    if (left != NULL && is_tagged_as_free(left)) {
+        // Coalesce with left free object.
+        unlink_free_unknown_bucket((free_t *)left);
+        header_t *right = right_header(header);
+        if (is_tagged_as_free(right)) {
+            // Coalesce both sides.
+            unlink_free_unknown_bucket((free_t *)right);
+            header_t *right_right = right_header(right);
+            FixLeftPointer(right_right, left);
+            free_memory(left, left->left, left->size + size + right->size);
+        } else {
+            // Coalesce only left.
+            FixLeftPointer(right, left);
+            free_memory(left, left->left, left->size + size);
+        }
+    } else {
+        header_t *right = right_header(header);
+        if (is_tagged_as_free(right)) {
+            // Coalesce only right.
+            header_t *right_right = right_header(right);
+            unlink_free_unknown_bucket((free_t *)right);
+            FixLeftPointer(right_right, header);
+            free_memory(header, left, size + right->size);
+        } else {
+            free_memory(header, left, size);
+        }
+    }
+}
+
+#ifdef CMPCT_DEBUG
+// Magazine rounds look allocated to the buckets, so the double free check in
+// cmpct_free can't see them.  Freed rounds are free-filled instead, with a tag
+// derived from their address in the first word.  Rounds stashed straight from
+// a refill were never handed out and carry no tag.
+static uintptr_t magazine_tag(void *payload)
+{
+    return (uintptr_t)payload ^ (uintptr_t)0x6d616761;
+}
+
+static void magazine_debug_free(void *payload, size_t size)
+{
+    DEBUG_ASSERT(*(uintptr_t *)payload != magazine_tag(payload));  // Double free!
+    memset(payload, FREE_FILL, size);
+    *(uintptr_t *)payload = magazine_tag(payload);
+}
+
+static void magazine_debug_alloc(void *payload, size_t size, size_t rounded_up)
+{
+    if (*(uintptr_t *)payload == magazine_tag(payload)) {
+        for (size_t i = sizeof(uintptr_t); i < rounded_up - sizeof(header_t); i++) {
+            DEBUG_ASSERT(((uint8_t *)payload)[i] == FREE_FILL);  // Use after free!
+        }
+    }
+    memset(payload, ALLOC_FILL, size);
+    memset((char *)payload + size, PADDING_FILL, rounded_up - size - sizeof(header_t));
+}
+#endif
+
+static void *magazine_alloc(int bucket)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    magazine_t *mag = &cpu_caches[arch_curr_cpu_num()].magazines[bucket];
+    void *result = mag->count ? mag->rounds[--mag->count] : NULL;
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+    return result;
+}
+
+// Take a batch of allocations from the buckets, return one and stash the rest
+// in the magazine of whichever cpu we are on by then.
+static void *magazine_refill(int bucket, size_t size)
+{
+    void *batch[MAGAZINE_BATCH];
+    unsigned count = 0;
+
+    lock();
+    // Only the first allocation may grow the heap, no point growing it just
+    // to fill a magazine.
+    while (count < MAGAZINE_BATCH) {
+        void *ptr = alloc_locked(size, count == 0);
+        if (ptr == NULL) break;
+        batch[count++] = ptr;
+    }
+    unlock();
+
+    if (count == 0) return NULL;
+    void *result = batch[--count];
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    magazine_t *mag = &cpu_caches[arch_curr_cpu_num()].magazines[bucket];
+    while (count > 0 && mag->count < MAGAZINE_ROUNDS) {
+        mag->rounds[mag->count++] = batch[--count];
+    }
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (count > 0) {
+        lock();
+        while (count > 0) free_locked(batch[--count]);
+        unlock();
+    }
+    return result;
+}
+
+// Put an allocation in the local magazine, draining half of it back to the
+// buckets if it is full.
+static void magazine_free(void *payload, int bucket)
+{
+    void *batch[MAGAZINE_BATCH];
+    unsigned count = 0;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    magazine_t *mag = &cpu_caches[arch_curr_cpu_num()].magazines[bucket];
+    if (mag->count == MAGAZINE_ROUNDS) {
+        while (count < MAGAZINE_BATCH) batch[count++] = mag->rounds[--mag->count];
+    }
+    mag->rounds[mag->count++] = payload;
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (count > 0) {
+        lock();
+        while (count > 0) free_locked(batch[--count]);
+        unlock();
+    }
+}
+
+// Runs on each cpu with interrupts disabled.  Chains everything cached in the
+// cpu's magazines through the payloads onto its slot in the flushed array.
+static void magazine_flush_cpu(void *context)
+{
+    void **list = (void **)context + arch_curr_cpu_num();
+    struct cpu_cache *cache = &cpu_caches[arch_curr_cpu_num()];
+
+    for (int bucket = 0; bucket < MAGAZINE_BUCKETS; bucket++) {
+        magazine_t *mag = &cache->magazines[bucket];
+        while (mag->count > 0) {
+            void *ptr = mag->rounds[--mag->count];
+            *(void **)ptr = *list;
+            *list = ptr;
+        }
+    }
+}
+
+// Called with the lock.  Gives everything in every cpu's magazines back to the
+// buckets.
+static void magazine_flush_all_locked(void)
+{
+    void *flushed[SMP_MAX_CPUS] = { NULL };
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    magazine_flush_cpu(flushed);
+    mp_sync_exec(MP_CPU_ALL_BUT_LOCAL, &magazine_flush_cpu, flushed);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        void *ptr = flushed[cpu];
+        while (ptr != NULL) {
+            void *next = *(void **)ptr;
+            free_locked(ptr);
+            ptr = next;
+        }
+    }
+}
+
+void *cmpct_alloc(size_t size)
+{
+    if (size == 0u) return NULL;
+
+    if (size + sizeof(header_t) > (1u << HEAP_ALLOC_VIRTUAL_BITS)) return large_alloc(size);
+
+    size_t rounded_up;
+    size_to_index_allocating(size, &rounded_up);
+    if (rounded_up <= MAGAZINE_MAX_SIZE && magazines_enabled) {
+        // Same bucket the allocation will be freed into.
+        int bucket = size_to_index_freeing(rounded_up);
+        void *result = magazine_alloc(bucket);
+        if (result == NULL) return magazine_refill(bucket, rounded_up);
+#ifdef CMPCT_DEBUG
+        magazine_debug_alloc(result, size, rounded_up);
+#endif
+        return result;
+    }
+
+    lock();
+    void *result = alloc_locked(size, true);
     unlock();
     return result;
 }
@@ -818,36 +1047,16 @@ void cmpct_free(void *payload)
     if (payload == NULL) return;
     header_t *header = (header_t *)payload - 1;
     DEBUG_ASSERT(!is_tagged_as_free(header));  // Double free!
-    size_t size = header->size;
-    lock();
-    header_t *left = header->left;
-    if (left != NULL && is_tagged_as_free(left)) {
-        // Coalesce with left free object.
-        unlink_free_unknown_bucket((free_t *)left);
-        header_t *right = right_header(header);
-        if (is_tagged_as_free(right)) {
-            // Coalesce both sides.
-            unlink_free_unknown_bucket((free_t *)right);
-            header_t *right_right = right_header(right);
-            FixLeftPointer(right_right, left);
-            free_memory(left, left->left, left->size + size + right->size);
-        } else {
-            // Coalesce only left.
-            FixLeftPointer(right, left);
-            free_memory(left, left->left, left->size + size);
-        }
-    } else {
-        header_t *right = right_header(header);
-        if (is_tagged_as_free(right)) {
-            // Coalesce only right.
-            header_t *right_right = right_header(right);
-            unlink_free_unknown_bucket((free_t *)right);
-            FixLeftPointer(right_right, header);
-            free_memory(header, left, size + right->size);
-        } else {
-            free_memory(header, left, size);
-        }
+    size_t size = header->size - sizeof(header_t);
+    if (size <= MAGAZINE_MAX_SIZE && magazines_enabled) {
+#ifdef CMPCT_DEBUG
+        magazine_debug_free(payload, size);
+#endif
+        magazine_free(payload, size_to_index_freeing(size));
+        return;
     }
+    lock();
+    free_locked(payload);
     unlock();
 }
 
@@ -899,6 +1108,8 @@ void cmpct_init(void)
     // Create a mutex.
     mutex_init(&theheap.lock);
 
+    DEBUG_ASSERT(size_to_index_freeing(MAGAZINE_MAX_SIZE) == MAGAZINE_BUCKETS - 1);
+
     // Initialize the free list.
     for (int i = 0; i < NUMBER_OF_BUCKETS; i++) {
         theheap.free_lists[i] = NULL;
@@ -50,6 +50,14 @@ void minip_init_dhcp(tx_func_t tx_func, void *tx_arg);
 /* packet rx hook to hand to ethernet driver */
 void minip_rx_driver_callback(pktbuf_t *p);
 
+/* what the tx handler can do beyond sending a single contiguous pktbuf */
+#define MINIP_TX_SG   (1<<0) // takes multi-part pktbufs linked through next
+#define MINIP_TX_CSUM (1<<1) // finishes tcp checksums marked PKTBUF_FLAG_CKSUM_PARTIAL
+#define MINIP_TX_TSO4 (1<<2) // cuts tcp segments with gso_size set, of up to 64K
+
+void minip_set_tx_features(uint32_t features);
+uint32_t minip_get_tx_features(void);
+
 /* global configuration state */
 void minip_get_macaddr(uint8_t *addr);
 void minip_set_macaddr(const uint8_t *addr);
@@ -79,6 +87,18 @@ status_t tcp_close(tcp_socket_t *socket);
 ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len);
 ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len);
 
+/* zero copy variants. tcp_read_pktbuf lends out the next received pktbuf,
+ * returning its length, and the caller gives it back with pktbuf_free.
+ * tcp_write_pktbuf queues a pktbuf, or a chain of them linked through next,
+ * without copying and takes ownership even on failure. The data is sent and
+ * retransmitted straight out of the pktbufs, which are freed once acked, so a
+ * pktbuf_add_buffer callback tells the caller when its memory is free again.
+ */
+struct iovec;
+ssize_t tcp_read_pktbuf(tcp_socket_t *socket, pktbuf_t **p);
+ssize_t tcp_write_pktbuf(tcp_socket_t *socket, pktbuf_t *p);
+ssize_t tcp_writev(tcp_socket_t *socket, const struct iovec *iov, uint iov_cnt);
+
 static inline status_t tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket)
 {
     return tcp_accept_timeout(listen_socket, accept_socket, INFINITE_TIME);
@@ -52,6 +52,13 @@ typedef struct pktbuf {
     pktbuf_free_callback cb;
     void *cb_args;
     u8 *buffer;
+    struct pktbuf *next; // next part of a multi-part packet, NULL on the EOF part
+    volatile int ref;    // the header and buffer are released when this drops to 0
+
+    /* offloads asked of the driver, only looked at on the first part */
+    u16 csum_start;  // with PKTBUF_FLAG_CKSUM_PARTIAL, offset from data the checksum covers from
+    u16 csum_offset; // offset from csum_start of the checksum field
+    u16 gso_size;    // if nonzero, a tcp segment for the nic to cut into pieces this big
 } pktbuf_t;
 
 typedef struct pktbuf_pool_object {
@@ -66,6 +73,7 @@ typedef struct pktbuf_pool_object {
 #define PKTBUF_FLAG_CKSUM_UDP_GOOD (1<<2)
 #define PKTBUF_FLAG_EOF            (1<<3)
 #define PKTBUF_FLAG_CACHED         (1<<4)
+#define PKTBUF_FLAG_CKSUM_PARTIAL  (1<<5) // checksum field holds the pseudo header sum, the nic finishes it
 
 /* Return the physical address offset of data in the packet */
 static inline u32 pktbuf_data_phys(pktbuf_t *p)
@@ -73,6 +81,22 @@ static inline u32 pktbuf_data_phys(pktbuf_t *p)
     return p->phys_base + (p->data - p->buffer);
 }
 
+// total bytes in a multi-part packet
+static inline u32 pktbuf_chain_len(const pktbuf_t *p)
+{
+    u32 len = 0;
+    for (; p; p = p->next)
+        len += p->dlen;
+    return len;
+}
+
+// make next the part following p in a multi-part packet
+static inline void pktbuf_link(pktbuf_t *p, pktbuf_t *next)
+{
+    p->next = next;
+    p->flags &= ~PKTBUF_FLAG_EOF;
+}
+
 // number of bytes available for _prepend
 static inline u32 pktbuf_avail_head(pktbuf_t *p)
 {
@@ -89,6 +113,21 @@ static inline u32 pktbuf_avail_tail(pktbuf_t *p)
 pktbuf_t *pktbuf_alloc(void);
 pktbuf_t *pktbuf_alloc_empty(void);
 
+// same as pktbuf_alloc, but returns NULL rather than waiting if the pool is empty
+pktbuf_t *pktbuf_try_alloc(void);
+
+// allocate a header that shares len bytes of p's data starting at offset.
+// p's buffer is held until the clone and p have both been freed, so the
+// clone can be handed to a driver while its owner keeps using p. does not
+// wait for the pool.
+pktbuf_t *pktbuf_clone(pktbuf_t *p, u32 offset, u32 len);
+
+// move p's buffer, with its data, to a new header and give p a fresh pool
+// buffer in its place, so a driver can requeue p while the stack keeps what
+// was received in it. returns NULL, leaving p alone, if p's buffer did not
+// come from the pool, is shared with a clone, or the pool is empty.
+pktbuf_t *pktbuf_detach(pktbuf_t *p);
+
 /* Add a buffer to an existing packet buffer */
 void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz,
                        uint32_t flags, pktbuf_free_callback cb, void *cb_args);
@@ -96,6 +135,15 @@ void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz,
 // returns number of threads woken up
 int pktbuf_free(pktbuf_t *p, bool reschedule);
 
+// free every part of a multi-part packet
+void pktbuf_free_chain(pktbuf_t *p, bool reschedule);
+
+// copy the parts following p onto the end of p and free them, for drivers
+// that only take single part packets. p's data may be moved forward to make
+// room, as long as head_room bytes are left in front of it. ERR_NO_MEMORY if
+// they do not fit.
+status_t pktbuf_linearize(pktbuf_t *p, u32 head_room);
+
 // extend buffer by sz bytes, copied from data
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz);
 
@@ -105,6 +105,17 @@ void gen_random_mac_address(uint8_t *mac_addr)
 /* This function is called by minip to send packets */
 tx_func_t minip_tx_handler;
 void *minip_tx_arg;
+static uint32_t minip_tx_features;
+
+void minip_set_tx_features(uint32_t features)
+{
+    minip_tx_features = features;
+}
+
+uint32_t minip_get_tx_features(void)
+{
+    return minip_tx_features;
+}
 
 void minip_init(tx_func_t tx_handler, void *tx_arg,
                 uint32_t ip, uint32_t mask, uint32_t gateway)
@@ -119,6 +130,8 @@ void minip_init(tx_func_t tx_handler, void *tx_arg,
 
     arp_cache_init();
     net_timer_init();
+    tcp_init();
+    udp_init();
 }
 
 uint16_t ipv4_payload_len(struct ipv4_hdr *pkt)
@@ -213,12 +226,23 @@ const uint8_t *get_dest_mac(uint32_t host)
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto)
 {
     status_t ret = 0;
-    size_t data_len = p->dlen;
+    size_t data_len = pktbuf_chain_len(p);
     const uint8_t *dst_mac;
 
+    /* pull multi-part packets together for drivers that can't gather them */
+    if (p->next && !(minip_tx_features & MINIP_TX_SG)) {
+        if (pktbuf_linearize(p, sizeof(struct ipv4_hdr) + sizeof(struct eth_hdr)) < 0) {
+            pktbuf_free_chain(p, true);
+            return ERR_NO_MEMORY;
+        }
+    }
+
     struct ipv4_hdr *ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
     struct eth_hdr *eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
 
+    /* offload offsets are from the start of the frame by the time the driver sees them */
+    if (p->flags & PKTBUF_FLAG_CKSUM_PARTIAL)
+        p->csum_start += sizeof(struct ipv4_hdr) + sizeof(struct eth_hdr);
 
     if (dest_addr == IPV4_BCAST || dest_addr == minip_broadcast) {
         dst_mac = bcast_mac;
@@ -227,7 +251,7 @@ status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto)
 
     dst_mac = get_dest_mac(dest_addr);
     if (!dst_mac) {
-        pktbuf_free(p, true);
+        pktbuf_free_chain(p, true);
         ret = -EHOSTUNREACH;
         goto err;
     }
@@ -32,6 +32,8 @@
 #include <kernel/thread.h>
 #include <kernel/semaphore.h>
 #include <kernel/spinlock.h>
+#include <arch/ops.h>
+#include <err.h>
 #include <lib/pktbuf.h>
 #include <lib/pool.h>
 #include <lk/init.h>
@@ -48,12 +50,16 @@ static spin_lock_t lock;
 
 
 /* Take an object from the pool of pktbuf objects to act as a header or buffer.  */
-static void *get_pool_object(void)
+static void *get_pool_object(bool wait)
 {
     pool_t *entry;
     spin_lock_saved_state_t state;
 
-    sem_wait(&pktbuf_sem);
+    if (wait) {
+        sem_wait(&pktbuf_sem);
+    } else if (sem_trywait(&pktbuf_sem) != NO_ERROR) {
+        return NULL;
+    }
     spin_lock_irqsave(&lock, state);
     entry = pool_alloc(&pktbuf_pool);
     spin_unlock_irqrestore(&lock, state);
@@ -82,6 +88,12 @@ static void free_pktbuf_buf_cb(void *buf, void *arg)
     free_pool_object((pktbuf_pool_object_t *)buf, true);
 }
 
+/* Callback for a clone, drops the clone's hold on the pktbuf it shares a buffer with */
+static void free_clone_cb(void *buf, void *arg)
+{
+    pktbuf_free((pktbuf_t *)arg, false);
+}
+
 /* Add a buffer to a pktbuf. Header space for prepending data is adjusted based on
  * header_sz. cb is called when the pktbuf is freed / released by the driver level
  * and should handle proper management / freeing of the buffer pointed to by the iovec.
@@ -116,38 +128,120 @@ void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz, uint32
 #endif
 }
 
-pktbuf_t *pktbuf_alloc(void)
+static pktbuf_t *pktbuf_alloc_etc(bool wait)
 {
     pktbuf_t *p = NULL;
     void *buf = NULL;
 
-    p = get_pool_object();
+    p = get_pool_object(wait);
     if (!p) {
         return NULL;
     }
 
-    buf = get_pool_object();
+    buf = get_pool_object(wait);
     if (!buf) {
         free_pool_object((pktbuf_pool_object_t *)p, false);
         return NULL;
     }
 
     memset(p, 0, sizeof(pktbuf_t));
+    p->ref = 1;
     pktbuf_add_buffer(p, buf, PKTBUF_SIZE, PKTBUF_MAX_HDR, 0, free_pktbuf_buf_cb, NULL);
     return p;
 }
 
+pktbuf_t *pktbuf_alloc(void)
+{
+    return pktbuf_alloc_etc(true);
+}
+
+pktbuf_t *pktbuf_try_alloc(void)
+{
+    return pktbuf_alloc_etc(false);
+}
+
 pktbuf_t *pktbuf_alloc_empty(void)
 {
-    pktbuf_t *p = (pktbuf_t *) get_pool_object();
+    pktbuf_t *p = (pktbuf_t *) get_pool_object(true);
 
+    memset(p, 0, sizeof(pktbuf_t));
     p->flags = PKTBUF_FLAG_EOF;
+    p->ref = 1;
     return p;
 }
 
+pktbuf_t *pktbuf_clone(pktbuf_t *p, u32 offset, u32 len)
+{
+    DEBUG_ASSERT(p);
+    DEBUG_ASSERT(p->ref > 0);
+    DEBUG_ASSERT(offset + len <= p->dlen);
+
+    pktbuf_t *c = get_pool_object(false);
+    if (!c) {
+        return NULL;
+    }
+
+    memset(c, 0, sizeof(pktbuf_t));
+    c->ref = 1;
+    c->buffer = p->buffer;
+    c->blen = p->blen;
+    c->phys_base = p->phys_base;
+    c->data = p->data + offset;
+    c->dlen = len;
+    c->flags = PKTBUF_FLAG_EOF | (p->flags & PKTBUF_FLAG_CACHED);
+    c->cb = free_clone_cb;
+    c->cb_args = p;
+
+    atomic_add(&p->ref, 1);
+
+    return c;
+}
+
+pktbuf_t *pktbuf_detach(pktbuf_t *p)
+{
+    DEBUG_ASSERT(p);
+
+    if (p->cb != free_pktbuf_buf_cb || p->ref != 1) {
+        return NULL;
+    }
+
+    pktbuf_t *np = get_pool_object(false);
+    if (!np) {
+        return NULL;
+    }
+
+    void *buf = get_pool_object(false);
+    if (!buf) {
+        free_pool_object((pktbuf_pool_object_t *)np, false);
+        return NULL;
+    }
+
+    /* the new header takes over the buffer and everything describing the data in it */
+    memset(np, 0, sizeof(pktbuf_t));
+    np->ref = 1;
+    np->buffer = p->buffer;
+    np->blen = p->blen;
+    np->phys_base = p->phys_base;
+    np->data = p->data;
+    np->dlen = p->dlen;
+    np->flags = p->flags | PKTBUF_FLAG_EOF;
+    np->cb = p->cb;
+    np->cb_args = p->cb_args;
+
+    pktbuf_add_buffer(p, buf, PKTBUF_SIZE, PKTBUF_MAX_HDR, 0, free_pktbuf_buf_cb, NULL);
+
+    return np;
+}
+
 int pktbuf_free(pktbuf_t *p, bool reschedule)
 {
     DEBUG_ASSERT(p);
+    DEBUG_ASSERT(p->ref > 0);
+
+    /* a clone is still using the buffer, the last one out frees it */
+    if (atomic_add(&p->ref, -1) != 1) {
+        return 0;
+    }
 
     if (p->cb) {
         p->cb(p->buffer, p->cb_args);
@@ -157,6 +251,51 @@ int pktbuf_free(pktbuf_t *p, bool reschedule)
     return 1;
 }
 
+void pktbuf_free_chain(pktbuf_t *p, bool reschedule)
+{
+    while (p) {
+        pktbuf_t *next = p->next;
+        pktbuf_free(p, reschedule);
+        p = next;
+    }
+}
+
+status_t pktbuf_linearize(pktbuf_t *p, u32 head_room)
+{
+    DEBUG_ASSERT(p);
+
+    if (!p->next) {
+        return NO_ERROR;
+    }
+
+    u32 len = pktbuf_chain_len(p->next);
+    if (pktbuf_avail_tail(p) < len) {
+        /* slide the data forward into the header space it can spare, unless
+         * a clone is looking at it */
+        u32 shift = len - pktbuf_avail_tail(p);
+        if (p->ref != 1 || p->cb == free_clone_cb ||
+                pktbuf_avail_head(p) < head_room + shift) {
+            return ERR_NO_MEMORY;
+        }
+
+        memmove(p->data - shift, p->data, p->dlen);
+        p->data -= shift;
+    }
+
+    pktbuf_t *part = p->next;
+    while (part) {
+        pktbuf_t *next = part->next;
+        pktbuf_append_data(p, part->data, part->dlen);
+        pktbuf_free(part, false);
+        part = next;
+    }
+
+    p->next = NULL;
+    p->flags |= PKTBUF_FLAG_EOF;
+
+    return NO_ERROR;
+}
+
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz)
 {
     if (pktbuf_avail_tail(p) < sz) {
@@ -3,10 +3,20 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_DEPS := \
-	lib/cbuf \
 	lib/iovec \
 	lib/pool
 
+# tcp receive window and send buffer, in bytes. raise them for links with a
+# large bandwidth-delay product, window scaling is negotiated so the receive
+# window may go past 64K. both are held in pktbufs, so the pool needs to be
+# sized to match (PKTBUF_POOL_SIZE).
+MINIP_TCP_RX_WINDOW ?= 8192
+MINIP_TCP_TX_BUFFER ?= 8192
+
+MODULE_DEFINES += \
+	MINIP_TCP_RX_WINDOW=$(MINIP_TCP_RX_WINDOW) \
+	MINIP_TCP_TX_BUFFER=$(MINIP_TCP_TX_BUFFER)
+
 MODULE_SRCS += \
 	$(LOCAL_DIR)/arp.c \
 	$(LOCAL_DIR)/chksum.c \
@@ -30,10 +30,13 @@
 #include <err.h>
 #include <string.h>
 #include <sys/types.h>
+#include <iovec.h>
 #include <lib/console.h>
-#include <lib/cbuf.h>
+#include <kernel/event.h>
 #include <kernel/mutex.h>
+#include <kernel/thread.h>
 #include <kernel/semaphore.h>
+#include <kernel/spinlock.h>
 #include <arch/ops.h>
 #include <platform.h>
 
@@ -66,6 +69,69 @@ typedef struct tcp_mss_option {
     uint16_t mss;
 } __PACKED tcp_mss_option_t;
 
+#define TCP_OPTION_EOL 0
+#define TCP_OPTION_NOP 1
+#define TCP_OPTION_MSS 2
+#define TCP_OPTION_WSCALE 3
+#define TCP_OPTION_SACK_PERMITTED 4
+#define TCP_OPTION_SACK 5
+
+/* without timestamps, four blocks fit in the 40 bytes of option space */
+#define TCP_SACK_MAX_BLOCKS 4
+
+/* distinct SACKed ranges the sender remembers, and out of order segments the receiver holds */
+#define TCP_SACK_SCOREBOARD 8
+#define TCP_OOO_MAX_SEGMENTS 32
+
+/* duplicate acks that mark the segment at tx_win_low as lost */
+#define TCP_DUP_ACK_THRESHOLD 3
+
+/* largest window scale shift allowed by RFC 7323 */
+#define TCP_MAX_WSCALE 14
+
+typedef struct tcp_sack_block {
+    uint32_t start; // first sequence covered
+    uint32_t end;   // one past the last sequence covered
+} __PACKED tcp_sack_block_t;
+
+typedef struct tcp_sack_permitted_option {
+    uint8_t nop[2];
+    uint8_t kind; /* 0x4 */
+    uint8_t len;  /* 0x2 */
+} __PACKED tcp_sack_permitted_option_t;
+
+typedef struct tcp_wscale_option {
+    uint8_t nop;
+    uint8_t kind; /* 0x3 */
+    uint8_t len;  /* 0x3 */
+    uint8_t shift;
+} __PACKED tcp_wscale_option_t;
+
+typedef struct tcp_sack_option {
+    uint8_t nop[2];
+    uint8_t kind; /* 0x5 */
+    uint8_t len;  /* 2 + 8 * number of blocks */
+    tcp_sack_block_t block[TCP_SACK_MAX_BLOCKS];
+} __PACKED tcp_sack_option_t;
+
+/* the options we care about from an incoming segment, in host order */
+typedef struct tcp_options {
+    uint16_t mss; // 0 if not present
+    bool wscale_present;
+    uint8_t wscale;
+    bool sack_permitted;
+    uint sack_count;
+    tcp_sack_block_t sack[TCP_SACK_MAX_BLOCKS];
+} tcp_options_t;
+
+/* a received segment held until the hole in front of it is filled */
+typedef struct tcp_ooo_segment {
+    struct list_node node;
+    uint32_t sequence;
+    uint32_t len;
+    uint8_t data[];
+} tcp_ooo_segment_t;
+
 typedef enum tcp_state {
     STATE_CLOSED,
     STATE_LISTEN,
@@ -89,8 +155,11 @@ typedef enum tcp_flags {
     PKT_URG = 32
 } tcp_flags_t;
 
+struct tcp_hash_bucket;
+
 typedef struct tcp_socket {
     struct list_node node;
+    struct tcp_hash_bucket *bucket; // the hash chain it is on, if any
 
     mutex_t lock;
     volatile int ref;
@@ -102,26 +171,56 @@ typedef struct tcp_socket {
     uint16_t remote_port;
 
     uint32_t mss;
+    bool sack_ok; // both sides sent SACK permitted on the SYN
+    uint8_t tx_wscale; // shift applied to the windows they advertise
+    uint8_t rx_wscale; // shift applied to the windows we advertise
 
     /* rx */
     uint32_t rx_win_size;
     uint32_t rx_win_low;
     uint32_t rx_win_high;
-    uint8_t  *rx_buffer_raw;
-    cbuf_t   rx_buffer;
+    struct list_node rx_queue; // in order data waiting to be read, pktbufs linked by their list node
+    uint32_t rx_queue_bytes;
+    uint32_t rx_zero_copy; // segments queued in the buffer they arrived in
     event_t  rx_event;
     int      rx_full_mss_count; // number of packets we have received in a row with a full mss
     net_timer_t ack_delay_timer;
+    struct list_node rx_ooo_list; // out of order segments, sorted and non overlapping
+    uint32_t rx_ooo_bytes;
+    uint32_t rx_ooo_count;
+    uint32_t rx_ooo_last; // sequence of the most recently queued segment, reported first in SACKs
 
     /* tx */
     uint32_t tx_win_low;  // low side of the acked window
     uint32_t tx_win_high; // tx_win_low + their advertised window size
-    uint32_t tx_highest_seq; // highest sequence we have txed them
-    uint8_t  *tx_buffer;  // our outgoing buffer
-    uint32_t tx_buffer_size; // size of tx_buffer
-    uint32_t tx_buffer_offset; // offset into the buffer to append new data to
+    uint32_t tx_highest_seq; // next sequence to send, pulled back to tx_win_low on a timeout
+    uint32_t tx_max_seq; // highest sequence we have ever txed them
+    struct list_node tx_queue; // unacked data, the first byte of the first pktbuf is tx_win_low
+    uint32_t tx_queue_bytes;
+    uint32_t tx_buffer_size; // how much tx_queue may hold before writers block
+    pktbuf_t *tx_append; // the pktbuf tcp_write copies into while it has room
     event_t  tx_event;
     net_timer_t retransmit_timer;
+    tcp_sack_block_t tx_sack[TCP_SACK_SCOREBOARD]; // what they have SACKed above tx_win_low, sorted
+    uint tx_sack_count;
+    uint32_t tx_rexmit_high; // holes below this were already resent since the last timeout
+    uint tx_dup_acks;
+
+    /* congestion control, Reno with the NewReno partial ack response */
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t tx_recover; // tx_max_seq when the last recovery or timeout began
+    bool     tx_in_recovery;
+    uint32_t tx_retransmits; // segments resent
+    uint32_t tx_recoveries;  // fast recoveries entered
+    uint32_t tx_timeouts;    // retransmit timer expirations
+
+    /* round trip estimation, one segment timed at a time */
+    uint32_t srtt;   // smoothed rtt in usecs, scaled by 8
+    uint32_t rttvar; // rtt variance in usecs, scaled by 4
+    lk_time_t rto;
+    uint32_t rtt_seq;
+    lk_bigtime_t rtt_start; // 0 when nothing is being timed
 
     /* listen accept */
     semaphore_t accept_sem;
@@ -131,22 +230,46 @@ typedef struct tcp_socket {
 } tcp_socket_t;
 
 #define DEFAULT_MSS (1460)
-#define DEFAULT_RX_WINDOW_SIZE (8192)
-#define DEFAULT_TX_BUFFER_SIZE (8192)
+#define DEFAULT_RX_WINDOW_SIZE (MINIP_TCP_RX_WINDOW)
+#define DEFAULT_TX_BUFFER_SIZE (MINIP_TCP_TX_BUFFER)
+
+/* retransmit timeout bounds, the floor is kept low for the local links this
+ * stack usually runs on rather than the one second RFC 6298 asks for */
+#define TCP_RTO_INITIAL (1000)
+#define TCP_RTO_MIN (50)
+#define TCP_RTO_MAX (60000)
+#define TCP_CLOCK_GRANULARITY_US (1000)
+#define TCP_CWND_MAX (1U << 30)
 
-#define RETRANSMIT_TIMEOUT (50)
 #define DELAYED_ACK_TIMEOUT (50)
 #define TIME_WAIT_TIMEOUT (60000) // 1 minute
 
 #define FORCE_TCP_CHECKSUM (false)
 
+/* largest segment handed to a nic doing TSO, what fits in an ip packet
+ * behind the longest tcp header */
+#define TCP_TSO_MAX (0xffff - sizeof(struct ipv4_hdr) - 60)
+
 #define SEQUENCE_GTE(a, b) ((int32_t)((a) - (b)) >= 0)
 #define SEQUENCE_LTE(a, b) ((int32_t)((a) - (b)) <= 0)
 #define SEQUENCE_GT(a, b) ((int32_t)((a) - (b)) > 0)
 #define SEQUENCE_LT(a, b) ((int32_t)((a) - (b)) < 0)
 
-static mutex_t tcp_socket_list_lock = MUTEX_INITIAL_VALUE(tcp_socket_list_lock);
-static struct list_node tcp_socket_list = LIST_INITIAL_VALUE(tcp_socket_list);
+/* Sockets are hashed for inbound demux: connections on the full 4-tuple,
+ * listeners on their local port. Each chain has its own spinlock, so lookups
+ * never contend on anything global. The chain holds no reference, sockets are
+ * taken off it before the ref they were created with is dropped.
+ */
+#define TCP_CONN_HASH_BITS 6
+#define TCP_LISTEN_HASH_BITS 4
+
+struct tcp_hash_bucket {
+    spin_lock_t lock;
+    struct list_node list;
+};
+
+static struct tcp_hash_bucket tcp_conn_hash[1 << TCP_CONN_HASH_BITS];
+static struct tcp_hash_bucket tcp_listen_hash[1 << TCP_LISTEN_HASH_BITS];
 
 static bool tcp_debug = false;
 
@@ -154,13 +277,15 @@ static bool tcp_debug = false;
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port);
 static void add_socket_to_list(tcp_socket_t *s);
 static void remove_socket_from_list(tcp_socket_t *s);
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers);
-static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
-                         size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size);
-static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence);
+static tcp_socket_t *create_tcp_socket(void);
+static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, pktbuf_t *payload, uint16_t gso_size,
+                         tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size);
+static status_t tcp_socket_send(tcp_socket_t *s, uint32_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
+static void handle_data(tcp_socket_t *s, pktbuf_t *p, uint32_t sequence);
 static void send_ack(tcp_socket_t *s);
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size);
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, const tcp_options_t *opts, size_t data_len);
+static void tcp_ooo_flush(tcp_socket_t *s);
+static ssize_t tcp_write_pending_data(tcp_socket_t *s);
 static void handle_retransmit_timeout(void *_s);
 static void handle_time_wait_timeout(void *_s);
 static void handle_delayed_ack_timeout(void *_s);
@@ -169,10 +294,25 @@ static void tcp_wakeup_waiters(tcp_socket_t *s);
 static void inc_socket_ref(tcp_socket_t *s);
 static bool dec_socket_ref(tcp_socket_t *s);
 
-static uint16_t cksum_pheader(const tcp_pseudo_header_t *pheader, const void *buf, size_t len)
+/* checksum the pseudo header and every part of p. a part that starts at an
+ * odd offset into the segment has its sum byte swapped before it is added in */
+static uint16_t cksum_pheader(const tcp_pseudo_header_t *pheader, const pktbuf_t *p)
 {
-    uint16_t checksum = ones_sum16(0, pheader, sizeof(*pheader));
-    return ~ones_sum16(checksum, buf, len);
+    uint32_t sum = ones_sum16(0, pheader, sizeof(*pheader));
+    bool odd = false;
+
+    for (; p; p = p->next) {
+        uint16_t part = ones_sum16(0, p->data, p->dlen);
+        if (odd)
+            part = (uint16_t)((part >> 8) | (part << 8));
+        sum += part;
+        odd ^= (p->dlen & 1);
+    }
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
 }
 
 __NO_INLINE static void dump_tcp_header(const tcp_header_t *header)
@@ -226,10 +366,48 @@ static void dump_socket(tcp_socket_t *s)
         printf("\trx: wsize %u wlo %u whi %u (%u)\n",
                s->rx_win_size, s->rx_win_low, s->rx_win_high,
                s->rx_win_high - s->rx_win_low);
-        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u bufoff %u\n",
+        printf("\trx: queued %u, zero copy segments %u\n", s->rx_queue_bytes, s->rx_zero_copy);
+        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u queued %u\n",
                s->tx_win_low, s->tx_win_high, s->tx_win_high - s->tx_win_low,
                s->tx_highest_seq, s->tx_highest_seq - s->tx_win_low,
-               s->tx_buffer_size, s->tx_buffer_offset);
+               s->tx_buffer_size, s->tx_queue_bytes);
+        printf("\tsack %s: ooo segments %u bytes %u, scoreboard %u rexmit_high %u dup_acks %u\n",
+               s->sack_ok ? "on" : "off", s->rx_ooo_count, s->rx_ooo_bytes,
+               s->tx_sack_count, s->tx_rexmit_high, s->tx_dup_acks);
+        printf("\tcc: cwnd %u ssthresh %u%s, wscale tx %u rx %u, retransmits %u recoveries %u timeouts %u\n",
+               s->cwnd, s->ssthresh, s->tx_in_recovery ? " (recovery)" : "",
+               s->tx_wscale, s->rx_wscale, s->tx_retransmits, s->tx_recoveries, s->tx_timeouts);
+        printf("\trtt: srtt %u us rttvar %u us rto %u ms\n",
+               s->srtt >> 3, s->rttvar >> 2, s->rto);
+    }
+}
+
+static inline uint32_t tcp_hash(uint32_t val, uint bits)
+{
+    /* multiplicative hashing, the top bits are the best mixed */
+    return (val * 0x9e3779b1) >> (32 - bits);
+}
+
+static struct tcp_hash_bucket *conn_bucket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
+{
+    uint32_t val = remote_ip ^ tcp_hash(local_ip, 32) ^ (((uint32_t)remote_port << 16) | local_port);
+    return &tcp_conn_hash[tcp_hash(val, TCP_CONN_HASH_BITS)];
+}
+
+static struct tcp_hash_bucket *listen_bucket(uint16_t local_port)
+{
+    return &tcp_listen_hash[tcp_hash(local_port, TCP_LISTEN_HASH_BITS)];
+}
+
+void tcp_init(void)
+{
+    for (uint i = 0; i < countof(tcp_conn_hash); i++) {
+        spin_lock_init(&tcp_conn_hash[i].lock);
+        list_initialize(&tcp_conn_hash[i].list);
+    }
+    for (uint i = 0; i < countof(tcp_listen_hash); i++) {
+        spin_lock_init(&tcp_listen_hash[i].lock);
+        list_initialize(&tcp_listen_hash[i].list);
     }
 }
 
@@ -237,32 +415,31 @@ static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint
 {
     LTRACEF("remote ip 0x%x local ip 0x%x remote port %u local port %u\n", remote_ip, local_ip, remote_port, local_port);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    spin_lock_saved_state_t state;
+    struct tcp_hash_bucket *b = conn_bucket(remote_ip, local_ip, remote_port, local_port);
+    tcp_socket_t *s;
 
-    /* XXX replace with something faster, like a hash table */
-    tcp_socket_t *s = NULL;
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_CLOSED || s->state == STATE_LISTEN) {
+    spin_lock_irqsave(&b->lock, state);
+    list_for_every_entry(&b->list, s, tcp_socket_t, node) {
+        if (s->state == STATE_CLOSED)
             continue;
-        } else {
-            /* full check */
-            if (s->remote_ip == remote_ip &&
-                    s->local_ip == local_ip &&
-                    s->remote_port == remote_port &&
-                    s->local_port == local_port) {
-                goto out;
-            }
+
+        /* full check */
+        if (s->remote_ip == remote_ip &&
+                s->local_ip == local_ip &&
+                s->remote_port == remote_port &&
+                s->local_port == local_port) {
+            goto out;
         }
     }
+    spin_unlock_irqrestore(&b->lock, state);
 
-    /* walk the list again, looking only for listen matches */
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_LISTEN) {
-            /* sockets in listen state only care about local port */
-            if (s->local_port == local_port) {
-                goto out;
-            }
-        }
+    /* sockets in listen state only care about local port */
+    b = listen_bucket(local_port);
+    spin_lock_irqsave(&b->lock, state);
+    list_for_every_entry(&b->list, s, tcp_socket_t, node) {
+        if (s->state == STATE_LISTEN && s->local_port == local_port)
+            goto out;
     }
 
     /* fall through case returns null */
@@ -273,7 +450,7 @@ out:
     if (s)
         inc_socket_ref(s);
 
-    mutex_release(&tcp_socket_list_lock);
+    spin_unlock_irqrestore(&b->lock, state);
 
     return s;
 }
@@ -282,25 +459,37 @@ static void add_socket_to_list(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0); // we should have implicitly bumped the ref when creating the socket
+    DEBUG_ASSERT(!s->bucket);
+
+    /* the tuple and listen state are fixed from here on */
+    if (s->state == STATE_LISTEN)
+        s->bucket = listen_bucket(s->local_port);
+    else
+        s->bucket = conn_bucket(s->remote_ip, s->local_ip, s->remote_port, s->local_port);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&s->bucket->lock, state);
 
-    list_add_head(&tcp_socket_list, &s->node);
+    list_add_head(&s->bucket->list, &s->node);
 
-    mutex_release(&tcp_socket_list_lock);
+    spin_unlock_irqrestore(&s->bucket->lock, state);
 }
 
 static void remove_socket_from_list(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0);
+    DEBUG_ASSERT(s->bucket);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&s->bucket->lock, state);
 
     DEBUG_ASSERT(list_in_list(&s->node));
     list_delete(&s->node);
 
-    mutex_release(&tcp_socket_list_lock);
+    spin_unlock_irqrestore(&s->bucket->lock, state);
+
+    s->bucket = NULL;
 }
 
 static void inc_socket_ref(tcp_socket_t *s)
@@ -324,8 +513,13 @@ static bool dec_socket_ref(tcp_socket_t *s)
         event_destroy(&s->tx_event);
         event_destroy(&s->rx_event);
 
-        free(s->rx_buffer_raw);
-        free(s->tx_buffer);
+        tcp_ooo_flush(s);
+
+        pktbuf_t *p;
+        while ((p = list_remove_head_type(&s->rx_queue, pktbuf_t, list)) != NULL)
+            pktbuf_free(p, true);
+        while ((p = list_remove_head_type(&s->tx_queue, pktbuf_t, list)) != NULL)
+            pktbuf_free(p, true);
 
         free(s);
     }
@@ -351,6 +545,80 @@ static void tcp_timer_cancel(tcp_socket_t *s, net_timer_t *timer)
         dec_socket_ref(s);
 }
 
+static inline uint32_t get_be32(const uint8_t *p)
+{
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return ntohl(val);
+}
+
+static void parse_options(const uint8_t *opt, size_t len, tcp_options_t *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+
+    while (len > 0) {
+        uint8_t kind = opt[0];
+        if (kind == TCP_OPTION_EOL)
+            break;
+        if (kind == TCP_OPTION_NOP) {
+            opt++;
+            len--;
+            continue;
+        }
+
+        /* everything else is kind, length, payload */
+        if (len < 2 || opt[1] < 2 || opt[1] > len)
+            break;
+        uint8_t olen = opt[1];
+
+        switch (kind) {
+            case TCP_OPTION_MSS:
+                if (olen == 4)
+                    opts->mss = (opt[2] << 8) | opt[3];
+                break;
+            case TCP_OPTION_WSCALE:
+                if (olen == 3) {
+                    opts->wscale_present = true;
+                    opts->wscale = MIN(opt[2], TCP_MAX_WSCALE);
+                }
+                break;
+            case TCP_OPTION_SACK_PERMITTED:
+                if (olen == 2)
+                    opts->sack_permitted = true;
+                break;
+            case TCP_OPTION_SACK:
+                for (size_t i = 2; i + 8 <= olen && opts->sack_count < TCP_SACK_MAX_BLOCKS; i += 8) {
+                    opts->sack[opts->sack_count].start = get_be32(opt + i);
+                    opts->sack[opts->sack_count].end = get_be32(opt + i + 4);
+                    opts->sack_count++;
+                }
+                break;
+        }
+
+        opt += olen;
+        len -= olen;
+    }
+}
+
+/* RFC 5681 initial window */
+static uint32_t tcp_initial_cwnd(uint32_t mss)
+{
+    if (mss > 2190)
+        return 2 * mss;
+    if (mss > 1095)
+        return 3 * mss;
+    return 4 * mss;
+}
+
+/* smallest shift that lets the whole window fit in the 16 bit header field */
+static uint8_t tcp_wscale_for(uint32_t window)
+{
+    uint8_t shift = 0;
+    while (shift < TCP_MAX_WSCALE && (window >> shift) > 0xffff)
+        shift++;
+    return shift;
+}
+
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 {
     if (unlikely(tcp_debug))
@@ -372,6 +640,10 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         TRACEF("REJECT: packet too large for buffer\n");
         return;
     }
+    if (header_len < sizeof(tcp_header_t)) {
+        TRACEF("REJECT: header length too short\n");
+        return;
+    }
 
     /* checksum */
     if (FORCE_TCP_CHECKSUM || (p->flags & PKTBUF_FLAG_CKSUM_TCP_GOOD) == 0) {
@@ -384,7 +656,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         pheader.protocol = IP_PROTO_TCP;
         pheader.tcp_length = htons(p->dlen);
 
-        uint16_t checksum = cksum_pheader(&pheader, p->data, p->dlen);
+        uint16_t checksum = cksum_pheader(&pheader, p);
         if (checksum != 0) {
             TRACEF("REJECT: failed checksum, header says 0x%x, we got 0x%x\n", header->checksum, checksum);
             return;
@@ -405,6 +677,9 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
     size_t data_len = p->dlen - header_len;
     uint32_t highest_sequence = header->seq_num + ((data_len > 0) ? (data_len - 1) : 0);
 
+    tcp_options_t opts;
+    parse_options((const uint8_t *)(header + 1), header_len - sizeof(tcp_header_t), &opts);
+
     /* see if it matches a socket we have */
     tcp_socket_t *s = lookup_socket(src_ip, dst_ip, header->source_port, header->dest_port);
     if (!s) {
@@ -446,7 +721,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
                 goto done;
 
             /* make a new accept socket */
-            tcp_socket_t *accept_socket = create_tcp_socket(true);
+            tcp_socket_t *accept_socket = create_tcp_socket();
             if (!accept_socket)
                 goto done;
 
@@ -469,14 +744,49 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             s->accepted = accept_socket;
             sem_post(&s->accept_sem, true);
 
-            /* set up a mss option for sending back */
+            /* don't send them segments larger than they asked for */
+            if (opts.mss > 0)
+                accept_socket->mss = MIN(accept_socket->mss, opts.mss);
+            accept_socket->cwnd = tcp_initial_cwnd(accept_socket->mss);
+
+            /* set up a mss option for sending back, plus whatever else they offered */
+            uint8_t syn_options[sizeof(tcp_mss_option_t) + sizeof(tcp_sack_permitted_option_t) +
+                                sizeof(tcp_wscale_option_t)];
+            size_t syn_options_len = 0;
+
             tcp_mss_option_t mss_option;
             mss_option.kind = 0x2;
             mss_option.len = 0x4;
-            mss_option.mss = ntohs(s->mss); // XXX make sure we fit in their mss
+            mss_option.mss = htons(s->mss);
+            memcpy(syn_options, &mss_option, sizeof(mss_option));
+            syn_options_len += sizeof(mss_option);
+
+            if (opts.sack_permitted) {
+                tcp_sack_permitted_option_t sack_option;
+                sack_option.nop[0] = sack_option.nop[1] = TCP_OPTION_NOP;
+                sack_option.kind = TCP_OPTION_SACK_PERMITTED;
+                sack_option.len = 0x2;
+                memcpy(syn_options + syn_options_len, &sack_option, sizeof(sack_option));
+                syn_options_len += sizeof(sack_option);
+
+                accept_socket->sack_ok = true;
+            }
+
+            if (opts.wscale_present) {
+                accept_socket->tx_wscale = opts.wscale;
+                accept_socket->rx_wscale = tcp_wscale_for(accept_socket->rx_win_size);
+
+                tcp_wscale_option_t wscale_option;
+                wscale_option.nop = TCP_OPTION_NOP;
+                wscale_option.kind = TCP_OPTION_WSCALE;
+                wscale_option.len = 0x3;
+                wscale_option.shift = accept_socket->rx_wscale;
+                memcpy(syn_options + syn_options_len, &wscale_option, sizeof(wscale_option));
+                syn_options_len += sizeof(wscale_option);
+            }
 
             /* send a response */
-            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, &mss_option, sizeof(mss_option),
+            tcp_socket_send(accept_socket, 0, PKT_ACK|PKT_SYN, syn_options, syn_options_len,
                             accept_socket->tx_win_low);
 
             /* SYN consumed a sequence */
@@ -498,8 +808,9 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
                     goto send_reset;
                 }
 
-                s->tx_win_high = s->tx_win_low + header->win_size;
+                s->tx_win_high = s->tx_win_low + ((uint32_t)header->win_size << s->tx_wscale);
                 s->tx_highest_seq = s->tx_win_low;
+                s->tx_max_seq = s->tx_win_low;
 
                 s->state = STATE_ESTABLISHED;
             } else {
@@ -511,12 +822,12 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         case STATE_ESTABLISHED:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, header->win_size, &opts, data_len);
             }
 
             if (data_len > 0) {
                 LTRACEF("new data, len %zu\n", data_len);
-                handle_data(s, p->data, p->dlen, header->seq_num);
+                handle_data(s, p, header->seq_num);
             }
 
             if ((packet_flags & PKT_FIN) && SEQUENCE_GTE(s->rx_win_low, highest_sequence)) {
@@ -537,7 +848,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         case STATE_CLOSE_WAIT:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, header->win_size, &opts, data_len);
             }
             if (packet_flags & PKT_FIN) {
                 /* they must have missed our ack, ack them again */
@@ -614,14 +925,168 @@ send_reset:
     }
 }
 
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence)
+/* Out of order segments are copied into a sorted list of non overlapping
+ * pieces, clipped to the receive window. Since the window never extends past
+ * what rx_queue may still take, every byte held here can be queued once the
+ * hole in front of it is filled.
+ */
+static void tcp_ooo_queue(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+    DEBUG_ASSERT(SEQUENCE_GT(sequence, s->rx_win_low));
+
+    uint32_t seq = sequence;
+    uint32_t end = sequence + len;
+    if (SEQUENCE_GT(end, s->rx_win_high))
+        end = s->rx_win_high;
+
+    s->rx_ooo_last = sequence;
+
+    while (SEQUENCE_LT(seq, end)) {
+        /* find the first queued piece that ends past seq */
+        tcp_ooo_segment_t *next = NULL;
+        tcp_ooo_segment_t *e;
+        list_for_every_entry(&s->rx_ooo_list, e, tcp_ooo_segment_t, node) {
+            if (SEQUENCE_GT(e->sequence + e->len, seq)) {
+                next = e;
+                break;
+            }
+        }
+
+        if (next && SEQUENCE_LTE(next->sequence, seq)) {
+            /* we already hold the front of this, skip over it */
+            seq = next->sequence + next->len;
+            continue;
+        }
+
+        if (s->rx_ooo_count >= TCP_OOO_MAX_SEGMENTS)
+            break;
+
+        uint32_t piece_end = end;
+        if (next && SEQUENCE_LT(next->sequence, piece_end))
+            piece_end = next->sequence;
+        uint32_t piece_len = piece_end - seq;
+
+        tcp_ooo_segment_t *piece = malloc(sizeof(tcp_ooo_segment_t) + piece_len);
+        if (!piece)
+            break;
+
+        piece->sequence = seq;
+        piece->len = piece_len;
+        memcpy(piece->data, (const uint8_t *)data + (seq - sequence), piece_len);
+
+        /* adding to the tail of a node inserts in front of it */
+        if (next)
+            list_add_tail(&next->node, &piece->node);
+        else
+            list_add_tail(&s->rx_ooo_list, &piece->node);
+
+        s->rx_ooo_bytes += piece_len;
+        s->rx_ooo_count++;
+        seq = piece_end;
+    }
+
+    LTRACEF("s %p, ooo count %u bytes %u\n", s, s->rx_ooo_count, s->rx_ooo_bytes);
+}
+
+/* Copy received data onto the end of rx_queue, filling the room left in the
+ * last pktbuf before starting another. Returns the bytes queued, which is
+ * short if the pktbuf pool ran dry.
+ */
+static size_t tcp_rx_append(tcp_socket_t *s, const uint8_t *data, size_t len)
 {
+    size_t queued = 0;
+
+    while (queued < len) {
+        pktbuf_t *tail = list_peek_tail_type(&s->rx_queue, pktbuf_t, list);
+        if (!tail || pktbuf_avail_tail(tail) == 0) {
+            /* never wait on the pool here, it is refilled by the same thread */
+            tail = pktbuf_try_alloc();
+            if (!tail)
+                break;
+            list_add_tail(&s->rx_queue, &tail->list);
+        }
+
+        size_t len_to_copy = MIN(len - queued, pktbuf_avail_tail(tail));
+        pktbuf_append_data(tail, data + queued, len_to_copy);
+        queued += len_to_copy;
+    }
+
+    s->rx_queue_bytes += queued;
+    return queued;
+}
+
+/* Queue len bytes of the segment in p, starting at offset. A segment too big
+ * to fit behind what is already queued keeps the buffer it arrived in, taken
+ * from the driver with pktbuf_detach, anything else is copied. Returns the
+ * bytes queued. p->data is not to be used again after this.
+ */
+static size_t tcp_rx_queue(tcp_socket_t *s, pktbuf_t *p, size_t offset, size_t len)
+{
+    pktbuf_t *tail = list_peek_tail_type(&s->rx_queue, pktbuf_t, list);
+
+    if (!tail || len > pktbuf_avail_tail(tail)) {
+        pktbuf_t *np = pktbuf_detach(p);
+        if (np) {
+            pktbuf_consume(np, offset);
+            pktbuf_consume_tail(np, np->dlen - len);
+            list_add_tail(&s->rx_queue, &np->list);
+            s->rx_queue_bytes += len;
+            s->rx_zero_copy++;
+            return len;
+        }
+    }
+
+    return tcp_rx_append(s, p->data + offset, len);
+}
+
+/* move anything the last in order segment made contiguous into rx_queue */
+static void tcp_ooo_drain(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    tcp_ooo_segment_t *e, *temp;
+    list_for_every_entry_safe(&s->rx_ooo_list, e, temp, tcp_ooo_segment_t, node) {
+        if (SEQUENCE_GT(e->sequence, s->rx_win_low))
+            break;
+
+        uint32_t end = e->sequence + e->len;
+        if (SEQUENCE_GT(end, s->rx_win_low)) {
+            uint32_t offset = s->rx_win_low - e->sequence;
+            size_t queued = tcp_rx_append(s, e->data + offset, e->len - offset);
+            s->rx_win_low += queued;
+
+            /* out of pktbufs, pick up from here when the next segment arrives */
+            if (queued < e->len - offset)
+                break;
+        }
+
+        list_delete(&e->node);
+        s->rx_ooo_bytes -= e->len;
+        s->rx_ooo_count--;
+        free(e);
+    }
+}
+
+static void tcp_ooo_flush(tcp_socket_t *s)
+{
+    tcp_ooo_segment_t *e;
+    while ((e = list_remove_head_type(&s->rx_ooo_list, tcp_ooo_segment_t, node)) != NULL)
+        free(e);
+
+    s->rx_ooo_bytes = 0;
+    s->rx_ooo_count = 0;
+}
+
+static void handle_data(tcp_socket_t *s, pktbuf_t *p, uint32_t sequence)
+{
+    size_t len = p->dlen;
+
     if (unlikely(tcp_debug))
-        TRACEF("data %p, len %zu, sequence %u\n", data, len, sequence);
+        TRACEF("p %p, len %zu, sequence %u\n", p, len, sequence);
 
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(data);
     DEBUG_ASSERT(len > 0);
 
     /* see if it matches our current window */
@@ -629,17 +1094,25 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
     if (SEQUENCE_LTE(sequence, s->rx_win_low) && SEQUENCE_GTE(sequence_top, s->rx_win_low)) {
         /* it intersects the bottom of our window, so it's in order */
 
-        /* copy the data we need to our cbuf */
-        size_t offset = sequence - s->rx_win_low;
+        /* queue the part of it we need */
+        size_t offset = s->rx_win_low - sequence;
         size_t copy_len = MIN(s->rx_win_high - s->rx_win_low, len - offset);
 
         DEBUG_ASSERT(offset < len);
 
-        LTRACEF("copying from offset %zu, len %zu\n", offset, copy_len);
+        LTRACEF("queueing from offset %zu, len %zu\n", offset, copy_len);
+
+        /* anything that doesn't make it in for lack of pktbufs is left for them to resend */
+        if (copy_len > 0)
+            copy_len = tcp_rx_queue(s, p, offset, copy_len);
 
         s->rx_win_low += copy_len;
 
-        cbuf_write(&s->rx_buffer, (uint8_t *)data + offset, copy_len, false);
+        /* this may have filled a hole, pull in whatever is now contiguous */
+        bool had_ooo = !list_is_empty(&s->rx_ooo_list);
+        if (had_ooo)
+            tcp_ooo_drain(s);
+
         event_signal(&s->rx_event, true);
 
         /* keep a counter if they've been sending a full mss */
@@ -649,8 +1122,9 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
             s->rx_full_mss_count = 0;
         }
 
-        /* immediately ack if we're more than halfway into our buffer or they've sent 2 or more full packets */
-        if (s->rx_full_mss_count >= 2 ||
+        /* immediately ack if we're more than halfway into our buffer, they've sent 2 or more full packets,
+         * or we just filled a hole and they are waiting to hear about it */
+        if (had_ooo || s->rx_full_mss_count >= 2 ||
                 (int)(s->rx_win_low + s->rx_win_size - s->rx_win_high) > (int)s->rx_win_size / 2) {
             send_ack(s);
             s->rx_full_mss_count = 0;
@@ -658,28 +1132,103 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
             tcp_timer_set(s, &s->ack_delay_timer, &handle_delayed_ack_timeout, DELAYED_ACK_TIMEOUT);
         }
     } else {
-        // either out of order or completely out of our window, drop
-        // duplicately ack the last thing we really got
+        /* if it lands past a hole in our window, hold on to it until the hole is filled */
+        if (SEQUENCE_GT(sequence, s->rx_win_low) && SEQUENCE_LT(sequence, s->rx_win_high)) {
+            tcp_ooo_queue(s, p->data, len, sequence);
+        }
+
+        /* immediately duplicate ack the last thing we really got, with SACK blocks if we can */
         send_ack(s);
     }
 }
 
-static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags,
+/* Build the payload of a segment out of clones of the tx queue, so data is
+ * sent, and resent, straight out of the pktbufs it was queued in.
+ */
+static pktbuf_t *tcp_tx_clone(tcp_socket_t *s, uint32_t sequence, uint32_t len)
+{
+    uint32_t offset = sequence - s->tx_win_low;
+
+    DEBUG_ASSERT(offset + len <= s->tx_queue_bytes);
+
+    pktbuf_t *head = NULL;
+    pktbuf_t *last = NULL;
+    pktbuf_t *q;
+    list_for_every_entry(&s->tx_queue, q, pktbuf_t, list) {
+        if (offset >= q->dlen) {
+            offset -= q->dlen;
+            continue;
+        }
+
+        uint32_t part_len = MIN(q->dlen - offset, len);
+        pktbuf_t *c = pktbuf_clone(q, offset, part_len);
+        if (!c) {
+            pktbuf_free_chain(head, true);
+            return NULL;
+        }
+
+        if (last)
+            pktbuf_link(last, c);
+        else
+            head = c;
+        last = c;
+
+        len -= part_len;
+        if (len == 0)
+            break;
+        offset = 0;
+    }
+
+    return head;
+}
+
+/* drop data they have acked off the front of the tx queue */
+static void tcp_tx_release(tcp_socket_t *s, uint32_t len)
+{
+    DEBUG_ASSERT(len <= s->tx_queue_bytes);
+
+    s->tx_queue_bytes -= len;
+
+    pktbuf_t *q;
+    while (len > 0 && (q = list_peek_head_type(&s->tx_queue, pktbuf_t, list)) != NULL) {
+        if (q->dlen > len) {
+            pktbuf_consume(q, len);
+            break;
+        }
+
+        /* clones of it still in flight hold the buffer until the driver is done with them */
+        len -= q->dlen;
+        list_delete(&q->list);
+        if (q == s->tx_append)
+            s->tx_append = NULL;
+        pktbuf_free(q, true);
+    }
+}
+
+/* send a segment carrying len bytes of the tx queue, starting at sequence. len
+ * may only go past the mss with TSO, see tcp_tx_seg_max */
+static status_t tcp_socket_send(tcp_socket_t *s, uint32_t len, tcp_flags_t flags,
                                 const void *options, size_t options_length, uint32_t sequence)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(len == 0 || data);
     DEBUG_ASSERT(options_length == 0 || options);
     DEBUG_ASSERT((options_length % 4) == 0);
 
+    pktbuf_t *payload = NULL;
+    if (len > 0) {
+        payload = tcp_tx_clone(s, sequence, len);
+        if (!payload)
+            return ERR_NO_MEMORY;
+    }
+
     // calculate the new right edge of the rx window
-    uint32_t rx_win_high = s->rx_win_low + s->rx_win_size - cbuf_space_used(&s->rx_buffer) - 1;
+    uint32_t rx_win_high = s->rx_win_low + s->rx_win_size - s->rx_queue_bytes - 1;
 
-    LTRACEF("rx_win_low %u rx_win_size %u read_buf_len %zu, new win high %u\n",
-            s->rx_win_low, s->rx_win_size, cbuf_space_used(&s->rx_buffer), rx_win_high);
+    LTRACEF("rx_win_low %u rx_win_size %u rx_queue_bytes %u, new win high %u\n",
+            s->rx_win_low, s->rx_win_size, s->rx_queue_bytes, rx_win_high);
 
-    uint16_t win_size;
+    uint32_t win_size;
     if (SEQUENCE_GTE(rx_win_high, s->rx_win_high)) {
         s->rx_win_high = rx_win_high;
         win_size = rx_win_high - s->rx_win_low;
@@ -689,17 +1238,69 @@ static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, t
         win_size = s->rx_win_high - s->rx_win_low;
     }
 
+    /* the window on a SYN is never scaled */
+    if (!(flags & PKT_SYN))
+        win_size >>= s->rx_wscale;
+    win_size = MIN(win_size, 0xffff);
+
     // we are piggybacking a pending ACK, so clear the delayed ACK timer
     if (flags & PKT_ACK) {
         tcp_timer_cancel(s, &s->ack_delay_timer);
     }
 
-    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, len, flags,
+    /* anything bigger than a segment is only asked for when the nic can cut it up */
+    uint16_t gso_size = (len > s->mss) ? s->mss : 0;
+
+    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, payload, gso_size, flags,
                             options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size);
 
     return err;
 }
 
+/* Describe the out of order queue to the sender. The range holding the most
+ * recently received segment goes first, the rest follow in sequence order as
+ * far as they fit. Returns the option length.
+ */
+static size_t build_sack_option(tcp_socket_t *s, tcp_sack_option_t *sack)
+{
+    tcp_sack_block_t ranges[TCP_OOO_MAX_SEGMENTS];
+    uint count = 0;
+    uint recent = 0;
+
+    /* merge the queued pieces into contiguous ranges */
+    tcp_ooo_segment_t *e;
+    list_for_every_entry(&s->rx_ooo_list, e, tcp_ooo_segment_t, node) {
+        if (count > 0 && ranges[count - 1].end == e->sequence) {
+            ranges[count - 1].end += e->len;
+        } else {
+            ranges[count].start = e->sequence;
+            ranges[count].end = e->sequence + e->len;
+            count++;
+        }
+        if (SEQUENCE_GTE(s->rx_ooo_last, ranges[count - 1].start) &&
+                SEQUENCE_LT(s->rx_ooo_last, ranges[count - 1].end))
+            recent = count - 1;
+    }
+
+    sack->nop[0] = sack->nop[1] = TCP_OPTION_NOP;
+    sack->kind = TCP_OPTION_SACK;
+
+    uint blocks = 0;
+    sack->block[blocks].start = htonl(ranges[recent].start);
+    sack->block[blocks].end = htonl(ranges[recent].end);
+    blocks++;
+    for (uint i = 0; i < count && blocks < TCP_SACK_MAX_BLOCKS; i++) {
+        if (i == recent)
+            continue;
+        sack->block[blocks].start = htonl(ranges[i].start);
+        sack->block[blocks].end = htonl(ranges[i].end);
+        blocks++;
+    }
+
+    sack->len = 2 + blocks * sizeof(tcp_sack_block_t);
+    return 2 + sack->len;
+}
+
 static void send_ack(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
@@ -708,21 +1309,33 @@ static void send_ack(tcp_socket_t *s)
     if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT && s->state != STATE_FIN_WAIT_2)
         return;
 
-    tcp_socket_send(s, NULL, 0, PKT_ACK, NULL, 0, s->tx_win_low);
+    tcp_sack_option_t sack;
+    size_t sack_len = 0;
+    if (s->sack_ok && !list_is_empty(&s->rx_ooo_list))
+        sack_len = build_sack_option(s, &sack);
+
+    tcp_socket_send(s, 0, PKT_ACK, sack_len ? &sack : NULL, sack_len, s->tx_win_low);
 }
 
-static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
-                         size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size)
+/* Send a segment, with payload, if any, following the header as further parts
+ * of the packet. The payload is consumed even if sending fails. A nonzero
+ * gso_size hands the nic a segment to cut into pieces of that size.
+ */
+static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, pktbuf_t *payload, uint16_t gso_size,
+                         tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size)
 {
-    DEBUG_ASSERT(len == 0 || buf);
     DEBUG_ASSERT(options_length == 0 || options);
     DEBUG_ASSERT((options_length % 4) == 0);
 
-    pktbuf_t *p = pktbuf_alloc();
-    if (!p)
+    /* this runs with socket locks held and on the rx path, so never wait on the pool */
+    pktbuf_t *p = pktbuf_try_alloc();
+    if (!p) {
+        pktbuf_free_chain(payload, true);
         return ERR_NO_MEMORY;
+    }
 
-    tcp_header_t *header = pktbuf_prepend(p, sizeof(tcp_header_t) + options_length);
+    /* the header goes after the reserved space, all of which is left for the ip and link headers */
+    tcp_header_t *header = pktbuf_append(p, sizeof(tcp_header_t) + options_length);
     DEBUG_ASSERT(header);
 
     /* fill in the header */
@@ -737,21 +1350,27 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     if (options)
         memcpy(header + 1, options, options_length);
 
-    /* append the data */
-    if (len > 0)
-        pktbuf_append_data(p, buf, len);
-
-    /* compute the checksum */
-    /* XXX get the tx ckecksum capability from the nic */
-    if (FORCE_TCP_CHECKSUM || true) {
-        tcp_pseudo_header_t pheader;
-        pheader.source_addr = src_ip;
-        pheader.dest_addr = dest_ip;
-        pheader.zero = 0;
-        pheader.protocol = IP_PROTO_TCP;
-        pheader.tcp_length = htons(p->dlen);
-
-        header->checksum = cksum_pheader(&pheader, p->data, p->dlen);
+    /* chain on the data */
+    if (payload)
+        pktbuf_link(p, payload);
+
+    /* compute the checksum, or just the pseudo header part of it if the nic finishes it */
+    tcp_pseudo_header_t pheader;
+    pheader.source_addr = src_ip;
+    pheader.dest_addr = dest_ip;
+    pheader.zero = 0;
+    pheader.protocol = IP_PROTO_TCP;
+    pheader.tcp_length = htons(pktbuf_chain_len(p));
+
+    if (!FORCE_TCP_CHECKSUM && (minip_get_tx_features() & MINIP_TX_CSUM)) {
+        header->checksum = ones_sum16(0, &pheader, sizeof(pheader));
+        p->flags |= PKTBUF_FLAG_CKSUM_PARTIAL;
+        p->csum_start = 0;
+        p->csum_offset = __offsetof(tcp_header_t, checksum);
+        p->gso_size = gso_size;
+    } else {
+        DEBUG_ASSERT(gso_size == 0);
+        header->checksum = cksum_pheader(&pheader, p);
     }
 
     if (LOCAL_TRACE) {
@@ -764,78 +1383,335 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     return err;
 }
 
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size)
+/* merge a SACKed range into the sender's scoreboard, keeping it sorted and disjoint */
+static void tcp_sack_add(tcp_socket_t *s, uint32_t start, uint32_t end)
+{
+    tcp_sack_block_t *sb = s->tx_sack;
+    uint count = s->tx_sack_count;
+
+    /* skip the blocks entirely below the new one */
+    uint i = 0;
+    while (i < count && SEQUENCE_LT(sb[i].end, start))
+        i++;
+
+    /* swallow every block the new one touches */
+    uint j = i;
+    while (j < count && SEQUENCE_LTE(sb[j].start, end)) {
+        if (SEQUENCE_LT(sb[j].start, start))
+            start = sb[j].start;
+        if (SEQUENCE_GT(sb[j].end, end))
+            end = sb[j].end;
+        j++;
+    }
+
+    if (i == j && count == TCP_SACK_SCOREBOARD) {
+        /* out of room, forget the highest range, they will report it again */
+        if (i == count)
+            return;
+        count--;
+    }
+
+    /* blocks [i, j) collapse into one at i */
+    memmove(&sb[i + 1], &sb[j], (count - j) * sizeof(tcp_sack_block_t));
+    sb[i].start = start;
+    sb[i].end = end;
+    s->tx_sack_count = count - (j - i) + 1;
+}
+
+/* drop whatever the cumulative ack has moved past */
+static void tcp_sack_trim(tcp_socket_t *s)
+{
+    uint i = 0;
+    while (i < s->tx_sack_count && SEQUENCE_LTE(s->tx_sack[i].end, s->tx_win_low))
+        i++;
+
+    memmove(&s->tx_sack[0], &s->tx_sack[i], (s->tx_sack_count - i) * sizeof(tcp_sack_block_t));
+    s->tx_sack_count -= i;
+
+    if (s->tx_sack_count > 0 && SEQUENCE_LT(s->tx_sack[0].start, s->tx_win_low))
+        s->tx_sack[0].start = s->tx_win_low;
+}
+
+/* Resend the holes in the outstanding data, skipping anything they have
+ * SACKed and anything already resent since the last timeout. Only data below
+ * the highest SACKed range is known to be missing, the rest may still be in
+ * flight, except for the first segment which is always a candidate. Without
+ * SACK information this degrades to resending one mss from tx_win_low.
+ */
+static ssize_t tcp_retransmit_holes(tcp_socket_t *s)
+{
+    uint32_t outstanding = s->tx_highest_seq - s->tx_win_low;
+    if (outstanding == 0)
+        return 0;
+
+    uint32_t top = s->tx_win_low + MIN(s->mss, outstanding);
+    if (s->tx_sack_count > 0 && SEQUENCE_GT(s->tx_sack[s->tx_sack_count - 1].start, top))
+        top = s->tx_sack[s->tx_sack_count - 1].start;
+
+    uint32_t seq = s->tx_rexmit_high;
+    if (SEQUENCE_LT(seq, s->tx_win_low))
+        seq = s->tx_win_low;
+
+    ssize_t sent = 0;
+    uint i = 0;
+    while (SEQUENCE_LT(seq, top)) {
+        while (i < s->tx_sack_count && SEQUENCE_LTE(s->tx_sack[i].end, seq))
+            i++;
+        if (i < s->tx_sack_count && SEQUENCE_LTE(s->tx_sack[i].start, seq)) {
+            /* they have this range, skip over it */
+            seq = s->tx_sack[i].end;
+            continue;
+        }
+
+        uint32_t tosend = MIN(s->mss, top - seq);
+        if (i < s->tx_sack_count)
+            tosend = MIN(tosend, s->tx_sack[i].start - seq);
+
+        LTRACEF("s %p, tosend %u seq %u\n", s, tosend, seq);
+        tcp_socket_send(s, tosend, PKT_ACK|PKT_PSH, NULL, 0, seq);
+        s->tx_retransmits++;
+        seq += tosend;
+        sent += tosend;
+    }
+
+    if (SEQUENCE_GT(seq, s->tx_rexmit_high))
+        s->tx_rexmit_high = seq;
+
+    /* Karn: an ack for anything resent says nothing about the round trip */
+    if (sent > 0)
+        s->rtt_start = 0;
+
+    return sent;
+}
+
+/* Jacobson/Karels estimator, in the fixed point form of RFC 6298 */
+static void tcp_rtt_sample(tcp_socket_t *s, uint32_t rtt)
+{
+    if (s->srtt == 0) {
+        s->srtt = rtt << 3;
+        s->rttvar = rtt << 1;
+    } else {
+        int32_t delta = rtt - (s->srtt >> 3);
+        s->srtt += delta;
+        if (delta < 0)
+            delta = -delta;
+        s->rttvar += delta - (s->rttvar >> 2);
+    }
+
+    uint32_t rto_us = (s->srtt >> 3) + MAX(TCP_CLOCK_GRANULARITY_US, s->rttvar);
+    s->rto = MIN(MAX((rto_us + 999) / 1000, TCP_RTO_MIN), TCP_RTO_MAX);
+
+    LTRACEF("s %p, rtt %u us, srtt %u rttvar %u rto %u\n", s, rtt, s->srtt >> 3, s->rttvar >> 2, s->rto);
+}
+
+static void tcp_dup_ack(tcp_socket_t *s)
+{
+    s->tx_dup_acks++;
+
+    if (s->tx_in_recovery) {
+        /* every further duplicate means another segment has left the network */
+        s->cwnd = MIN(s->cwnd + s->mss, TCP_CWND_MAX);
+
+        /* fresh SACK information may have uncovered more holes */
+        tcp_retransmit_holes(s);
+        tcp_write_pending_data(s);
+    } else if (s->tx_dup_acks == TCP_DUP_ACK_THRESHOLD && SEQUENCE_GT(s->tx_win_low, s->tx_recover)) {
+        /* fast retransmit, then stay in recovery until everything sent so far is acked */
+        uint32_t flight = s->tx_max_seq - s->tx_win_low;
+        s->ssthresh = MAX(flight / 2, 2 * s->mss);
+        s->cwnd = s->ssthresh + TCP_DUP_ACK_THRESHOLD * s->mss;
+        s->tx_recover = s->tx_max_seq;
+        s->tx_in_recovery = true;
+        s->tx_recoveries++;
+
+        s->tx_rexmit_high = s->tx_win_low;
+        tcp_retransmit_holes(s);
+        tcp_write_pending_data(s);
+    }
+}
+
+/* open or deflate the congestion window for acked_len newly acked bytes.
+ * cwnd_limited says whether the congestion window was what held data back. */
+static void tcp_cong_ack(tcp_socket_t *s, uint32_t acked_len, bool cwnd_limited)
+{
+    if (s->tx_in_recovery) {
+        if (SEQUENCE_GTE(s->tx_win_low, s->tx_recover)) {
+            /* everything outstanding at the loss is acked, carry on at the reduced rate */
+            s->tx_in_recovery = false;
+            s->cwnd = s->ssthresh;
+        } else {
+            /* a partial ack, the next hole was lost as well. resend it now
+             * and deflate by what left the network */
+            tcp_retransmit_holes(s);
+            s->cwnd -= MIN(s->cwnd, acked_len);
+            if (acked_len >= s->mss)
+                s->cwnd += s->mss;
+            s->cwnd = MAX(s->cwnd, s->mss);
+        }
+    } else if (!cwnd_limited) {
+        /* the window wasn't in use, so there's nothing to learn about the path */
+    } else if (s->cwnd < s->ssthresh) {
+        /* slow start */
+        s->cwnd += MIN(acked_len, s->mss);
+    } else {
+        /* congestion avoidance, roughly one mss per round trip */
+        s->cwnd += MAX(1U, s->mss * s->mss / s->cwnd);
+    }
+
+    s->cwnd = MIN(s->cwnd, TCP_CWND_MAX);
+}
+
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, const tcp_options_t *opts, size_t data_len)
 {
     LTRACEF("socket %p ack sequence %u, win_size %u\n", s, sequence, win_size);
 
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
 
-    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u offset %u\n",
-            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_buffer_offset);
-    if (SEQUENCE_LTE(sequence, s->tx_win_low)) {
+    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u queued %u\n",
+            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_queue_bytes);
+
+    win_size <<= s->tx_wscale;
+
+    /* record what they have told us they hold beyond the cumulative ack */
+    if (s->sack_ok) {
+        for (uint i = 0; i < opts->sack_count; i++) {
+            uint32_t start = opts->sack[i].start;
+            uint32_t end = opts->sack[i].end;
+
+            /* ignore anything malformed or outside the data we have in flight */
+            if (!SEQUENCE_LT(start, end) || SEQUENCE_LT(start, s->tx_win_low) ||
+                    SEQUENCE_GT(end, s->tx_max_seq))
+                continue;
+            tcp_sack_add(s, start, end);
+        }
+    }
+
+    if (SEQUENCE_LT(sequence, s->tx_win_low)) {
         /* they're acking stuff we've already received an ack for */
         return;
-    } else if (SEQUENCE_GT(sequence, s->tx_highest_seq)) {
+    } else if (sequence == s->tx_win_low) {
+        if (s->tx_win_low + win_size != s->tx_win_high) {
+            /* a window update, which may let more data out */
+            s->tx_win_high = s->tx_win_low + win_size;
+            tcp_write_pending_data(s);
+        } else if (data_len == 0 && s->tx_max_seq != s->tx_win_low) {
+            /* a duplicate pure ack means something past tx_win_low arrived */
+            tcp_dup_ack(s);
+        }
+        return;
+    } else if (SEQUENCE_GT(sequence, s->tx_max_seq)) {
         /* they're acking stuff we haven't sent */
         return;
-    } else {
-        /* their ack is somewhere in our window */
-        uint32_t acked_len;
+    }
 
-        acked_len = (sequence - s->tx_win_low);
+    /* their ack is somewhere in our window */
+    uint32_t acked_len;
 
-        LTRACEF("acked len %u\n", acked_len);
+    acked_len = (sequence - s->tx_win_low);
+    bool cwnd_limited = (s->tx_highest_seq - s->tx_win_low) + s->mss > s->cwnd;
 
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_size);
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_offset);
+    LTRACEF("acked len %u\n", acked_len);
 
-        memmove(s->tx_buffer, s->tx_buffer + acked_len, s->tx_buffer_offset - acked_len);
+    DEBUG_ASSERT(acked_len <= s->tx_queue_bytes);
 
-        s->tx_buffer_offset -= acked_len;
-        s->tx_win_low += acked_len;
-        s->tx_win_high = s->tx_win_low + win_size;
+    tcp_tx_release(s, acked_len);
 
-        /* cancel or reset our retransmit timer */
-        if (s->tx_win_low == s->tx_highest_seq) {
-            tcp_timer_cancel(s, &s->retransmit_timer);
-        } else {
-            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
-        }
+    s->tx_win_low += acked_len;
+    s->tx_win_high = s->tx_win_low + win_size;
+    s->tx_dup_acks = 0;
+
+    /* after a timeout pulled tx_highest_seq back, the ack may cover data sent before it */
+    if (SEQUENCE_LT(s->tx_highest_seq, s->tx_win_low))
+        s->tx_highest_seq = s->tx_win_low;
+
+    tcp_sack_trim(s);
 
-        /* we have opened the transmit buffer */
-        event_signal(&s->tx_event, true);
+    if (s->rtt_start != 0 && SEQUENCE_GT(sequence, s->rtt_seq)) {
+        tcp_rtt_sample(s, current_time_hires() - s->rtt_start);
+        s->rtt_start = 0;
     }
+
+    tcp_cong_ack(s, acked_len, cwnd_limited);
+
+    /* cancel or reset our retransmit timer */
+    if (s->tx_win_low == s->tx_max_seq) {
+        tcp_timer_cancel(s, &s->retransmit_timer);
+    } else {
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+    }
+
+    /* the windows have moved, send what they allow */
+    tcp_write_pending_data(s);
+
+    /* we have opened the transmit buffer */
+    event_signal(&s->tx_event, true);
+}
+
+/* the most new data to put in one segment. with TSO that is as many full
+ * segments as fit in an ip packet, the nic cuts them back down to the mss */
+static uint32_t tcp_tx_seg_max(tcp_socket_t *s)
+{
+    if (!(minip_get_tx_features() & MINIP_TX_TSO4))
+        return s->mss;
+
+    uint32_t max = TCP_TSO_MAX / s->mss * s->mss;
+    return MAX(max, s->mss);
 }
 
 static ssize_t tcp_write_pending_data(tcp_socket_t *s)
 {
-    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u offset %u\n",
-            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_buffer_offset);
+    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u queued %u\n",
+            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_queue_bytes);
 
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(s->tx_buffer_size > 0);
-    DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
 
     /* do we have any new data to send? */
     uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
-    uint32_t pending = s->tx_buffer_offset - outstanding;
+    uint32_t pending = s->tx_queue_bytes - outstanding;
     LTRACEF("outstanding %u, pending %u\n", outstanding, pending);
 
+    /* what may be in flight is bounded by both their window and the congestion window */
+    uint32_t window = MIN(s->tx_win_high - s->tx_win_low, s->cwnd);
+    uint32_t avail = (window > outstanding) ? window - outstanding : 0;
+
     /* send packets that cover the pending area of the window */
+    uint32_t seg_max = tcp_tx_seg_max(s);
     uint32_t offset = 0;
-    while (offset < pending) {
-        uint32_t tosend = MIN(s->mss, pending - offset);
+    while (offset < pending && offset < avail) {
+        uint32_t tosend = MIN(seg_max, pending - offset);
+        if (tosend > avail - offset) {
+            /* trim to the whole segments that fit */
+            tosend = (avail - offset) / s->mss * s->mss;
+            if (tosend == 0) {
+                /* don't chop the stream into runts to fit the window, unless nothing else is in flight */
+                if (outstanding + offset > 0)
+                    break;
+                tosend = avail - offset;
+            }
+        }
+
+        /* time one segment per round trip, and never a resent one */
+        if (s->rtt_start == 0 && s->tx_highest_seq == s->tx_max_seq) {
+            s->rtt_seq = s->tx_highest_seq;
+            s->rtt_start = current_time_hires();
+        }
 
-        tcp_socket_send(s, s->tx_buffer + outstanding + offset, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_highest_seq);
+        /* out of pktbufs, the retransmit timer picks it up again */
+        if (tcp_socket_send(s, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_highest_seq) == ERR_NO_MEMORY)
+            break;
         s->tx_highest_seq += tosend;
         offset += tosend;
     }
 
-    /* reset the retransmit timer if we sent anything */
-    if (offset > 0) {
-        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    if (SEQUENCE_GT(s->tx_highest_seq, s->tx_max_seq))
+        s->tx_max_seq = s->tx_highest_seq;
+
+    /* reset the retransmit timer if we sent anything. if their window is
+     * closed with nothing in flight, the same timer probes it later */
+    if (offset > 0 || (pending > 0 && outstanding == 0)) {
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
     }
 
     return offset;
@@ -849,17 +1725,45 @@ static ssize_t tcp_retransmit(tcp_socket_t *s)
     if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT)
         return 0;
 
-    /* how much data have we sent but not gotten an ack for? */
+    s->rto = MIN(s->rto * 2, TCP_RTO_MAX);
+    s->rtt_start = 0;
+
     uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
-    if (outstanding == 0)
-        return 0;
+    if (outstanding == 0) {
+        if (s->tx_queue_bytes == 0)
+            return 0;
+
+        /* their window is closed and data is waiting, probe it with a byte */
+        LTRACEF("s %p, window probe seq %u\n", s, s->tx_highest_seq);
+        tcp_socket_send(s, 1, PKT_ACK|PKT_PSH, NULL, 0, s->tx_highest_seq);
+        s->tx_highest_seq++;
+        if (SEQUENCE_GT(s->tx_highest_seq, s->tx_max_seq))
+            s->tx_max_seq = s->tx_highest_seq;
+        return 1;
+    }
+
+    s->tx_timeouts++;
 
-    uint32_t tosend = MIN(s->mss, outstanding);
+    /* a timeout is a strong sign of congestion, unless their window is simply closed */
+    if (s->tx_win_high != s->tx_win_low) {
+        uint32_t flight = s->tx_max_seq - s->tx_win_low;
+        s->ssthresh = MAX(flight / 2, 2 * s->mss);
+        s->cwnd = s->mss;
+    }
+    s->tx_in_recovery = false;
+    s->tx_recover = s->tx_max_seq;
+    s->tx_dup_acks = 0;
+
+    /* the receiver may have discarded what it SACKed, so forget the scoreboard,
+     * go back to tx_win_low and send everything again as the window allows */
+    s->tx_sack_count = 0;
+    s->tx_rexmit_high = s->tx_win_low;
+    s->tx_highest_seq = s->tx_win_low;
 
-    LTRACEF("s %p, tosend %u seq %u\n", s, tosend, s->tx_win_low);
-    tcp_socket_send(s, s->tx_buffer, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_win_low);
+    ssize_t sent = tcp_write_pending_data(s);
+    s->tx_retransmits++;
 
-    return tosend;
+    return sent;
 }
 
 static void handle_retransmit_timeout(void *_s)
@@ -875,7 +1779,7 @@ static void handle_retransmit_timeout(void *_s)
     if (tcp_retransmit(s) == 0)
         goto done;
 
-    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
 
 done:
     mutex_release(&s->lock);
@@ -945,7 +1849,7 @@ static void tcp_remote_close(tcp_socket_t *s)
     tcp_wakeup_waiters(s);
 }
 
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
+static tcp_socket_t *create_tcp_socket(void)
 {
     tcp_socket_t *s;
 
@@ -959,23 +1863,24 @@ static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
     s->state = STATE_CLOSED;
     s->rx_win_size = DEFAULT_RX_WINDOW_SIZE;
     event_init(&s->rx_event, false, 0);
+    list_initialize(&s->rx_queue);
+    list_initialize(&s->rx_ooo_list);
 
     s->mss = DEFAULT_MSS;
 
     s->tx_win_low = rand();
     s->tx_win_high = s->tx_win_low;
     s->tx_highest_seq = s->tx_win_low;
+    s->tx_max_seq = s->tx_win_low;
+    s->tx_rexmit_high = s->tx_win_low;
+    s->tx_recover = s->tx_win_low;
+    s->cwnd = tcp_initial_cwnd(s->mss);
+    s->ssthresh = UINT32_MAX;
+    s->rto = TCP_RTO_INITIAL;
+    list_initialize(&s->tx_queue);
+    s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
     event_init(&s->tx_event, true, 0);
 
-    if (alloc_buffers) {
-        // XXX check for error
-        s->rx_buffer_raw = malloc(s->rx_win_size);
-        cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
-
-        s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
-        s->tx_buffer = malloc(s->tx_buffer_size);
-    }
-
     sem_init(&s->accept_sem, 0);
 
     return s;
@@ -990,7 +1895,7 @@ status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port)
     if (!handle)
         return ERR_INVALID_ARGS;
 
-    s = create_tcp_socket(false);
+    s = create_tcp_socket();
     if (!s)
         return ERR_NO_MEMORY;
 
@@ -1035,16 +1940,9 @@ status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_s
     return NO_ERROR;
 }
 
-ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len)
+/* read into buf, or if p is set, lend out the pktbuf at the head of rx_queue */
+static ssize_t tcp_read_etc(tcp_socket_t *socket, void *buf, size_t len, pktbuf_t **p)
 {
-    LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
-    if (!socket)
-        return ERR_INVALID_ARGS;
-    if (len == 0)
-        return 0;
-    if (!buf)
-        return ERR_INVALID_ARGS;
-
     tcp_socket_t *s = socket;
     inc_socket_ref(s);
 
@@ -1055,9 +1953,8 @@ retry:
 
     mutex_acquire(&s->lock);
 
-    /* try to read some data from the receive buffer, even if we're closed */
-    ret = cbuf_read(&s->rx_buffer, buf, len, false);
-    if (ret == 0) {
+    /* try to read some data from the receive queue, even if we're closed */
+    if (list_is_empty(&s->rx_queue)) {
         /* check to see if we've closed */
         if (s->state != STATE_ESTABLISHED) {
             ret = ERR_CHANNEL_CLOSED;
@@ -1070,8 +1967,27 @@ retry:
         goto retry;
     }
 
+    if (p) {
+        *p = list_remove_head_type(&s->rx_queue, pktbuf_t, list);
+        ret = (*p)->dlen;
+    } else {
+        /* copy out of the queued pktbufs, freeing each one as it empties */
+        pktbuf_t *q;
+        while ((size_t)ret < len && (q = list_peek_head_type(&s->rx_queue, pktbuf_t, list)) != NULL) {
+            size_t len_to_copy = MIN(len - ret, q->dlen);
+            memcpy((uint8_t *)buf + ret, pktbuf_consume(q, len_to_copy), len_to_copy);
+            ret += len_to_copy;
+
+            if (q->dlen == 0) {
+                list_delete(&q->list);
+                pktbuf_free(q, true);
+            }
+        }
+    }
+    s->rx_queue_bytes -= ret;
+
     /* if we've used up the last byte in the read buffer, unsignal the read event */
-    size_t remaining_bytes = cbuf_space_used(&s->rx_buffer);
+    size_t remaining_bytes = s->rx_queue_bytes;
     if (s->state == STATE_ESTABLISHED && remaining_bytes == 0) {
         event_unsignal(&s->rx_event);
     }
@@ -1090,7 +2006,7 @@ out:
     return ret;
 }
 
-ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
+ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len)
 {
     LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
     if (!socket)
@@ -1100,12 +2016,36 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
     if (!buf)
         return ERR_INVALID_ARGS;
 
+    return tcp_read_etc(socket, buf, len, NULL);
+}
+
+ssize_t tcp_read_pktbuf(tcp_socket_t *socket, pktbuf_t **p)
+{
+    LTRACEF("socket %p, p %p\n", socket, p);
+    if (!socket || !p)
+        return ERR_INVALID_ARGS;
+
+    return tcp_read_etc(socket, NULL, 0, p);
+}
+
+ssize_t tcp_writev(tcp_socket_t *socket, const iovec_t *iov, uint iov_cnt)
+{
+    LTRACEF("socket %p, iov %p, iov_cnt %u\n", socket, iov, iov_cnt);
+    if (!socket || !iov)
+        return ERR_INVALID_ARGS;
+
+    ssize_t len = iovec_size(iov, iov_cnt);
+    if (len <= 0)
+        return len;
+
     tcp_socket_t *s = socket;
     inc_socket_ref(s);
 
+    ssize_t ret = len;
+    pktbuf_t *p = NULL;
     size_t off = 0;
-    while (off < len) {
-        LTRACEF("off %zu, len %zu\n", off, len);
+    while (off < (size_t)len) {
+        LTRACEF("off %zu, len %zd\n", off, len);
 
         /* wait for the tx buffer to open up */
         event_wait(&s->tx_event);
@@ -1116,26 +2056,43 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
         /* check to see if we've closed */
         if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT) {
             mutex_release(&s->lock);
-            dec_socket_ref(s);
-            return ERR_CHANNEL_CLOSED;
+            ret = ERR_CHANNEL_CLOSED;
+            break;
         }
 
-        DEBUG_ASSERT(s->tx_buffer_size > 0);
-        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
-
-        /* figure out how much data to copy in */
-        size_t to_copy = MIN(s->tx_buffer_size - s->tx_buffer_offset, len - off);
-        if (to_copy == 0) {
+        if (s->tx_queue_bytes >= s->tx_buffer_size) {
             mutex_release(&s->lock);
             continue;
         }
 
-        memcpy(s->tx_buffer + s->tx_buffer_offset, (uint8_t *)buf + off, to_copy);
-        s->tx_buffer_offset += to_copy;
+        /* copy into the last pktbuf until it holds a full segment, then start another */
+        pktbuf_t *tail = s->tx_append;
+        if (!tail || tail->dlen >= s->mss || pktbuf_avail_tail(tail) == 0) {
+            if (!p) {
+                /* acks free pktbufs with the lock held, so wait on the pool without it */
+                mutex_release(&s->lock);
+                p = pktbuf_alloc();
+                if (!p) {
+                    ret = ERR_NO_MEMORY;
+                    break;
+                }
+                continue;
+            }
+
+            list_add_tail(&s->tx_queue, &p->list);
+            s->tx_append = tail = p;
+            p = NULL;
+        }
+
+        /* figure out how much data to copy in */
+        size_t to_copy = MIN(s->tx_buffer_size - s->tx_queue_bytes, len - off);
+        to_copy = MIN(to_copy, MIN(s->mss - tail->dlen, pktbuf_avail_tail(tail)));
+
+        iovec_to_membuf(pktbuf_append(tail, to_copy), to_copy, iov, iov_cnt, off);
+        s->tx_queue_bytes += to_copy;
 
         /* if this has completely filled it, unsignal the event */
-        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
-        if (s->tx_buffer_offset == s->tx_buffer_size) {
+        if (s->tx_queue_bytes >= s->tx_buffer_size) {
             event_unsignal(&s->tx_event);
         }
 
@@ -1147,8 +2104,89 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
         mutex_release(&s->lock);
     }
 
+    if (p)
+        pktbuf_free(p, true);
+
+    dec_socket_ref(s);
+    return ret;
+}
+
+ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
+{
+    LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
+    if (!socket)
+        return ERR_INVALID_ARGS;
+    if (len == 0)
+        return 0;
+    if (!buf)
+        return ERR_INVALID_ARGS;
+
+    iovec_t iov = { .iov_base = (void *)buf, .iov_len = len };
+    return tcp_writev(socket, &iov, 1);
+}
+
+ssize_t tcp_write_pktbuf(tcp_socket_t *socket, pktbuf_t *p)
+{
+    LTRACEF("socket %p, p %p\n", socket, p);
+    if (!p)
+        return ERR_INVALID_ARGS;
+    if (!socket) {
+        pktbuf_free_chain(p, true);
+        return ERR_INVALID_ARGS;
+    }
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+
+    ssize_t ret = 0;
+    while (p) {
+        /* wait for the tx buffer to open up */
+        event_wait(&s->tx_event);
+
+        mutex_acquire(&s->lock);
+
+        /* check to see if we've closed */
+        if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT) {
+            mutex_release(&s->lock);
+            ret = ERR_CHANNEL_CLOSED;
+            break;
+        }
+
+        /* queue parts as they are while there is room, the last may take
+         * the queue past tx_buffer_size */
+        while (p && s->tx_queue_bytes < s->tx_buffer_size) {
+            pktbuf_t *next = p->next;
+            p->next = NULL;
+            p->flags |= PKTBUF_FLAG_EOF;
+
+            if (p->dlen > 0) {
+                list_add_tail(&s->tx_queue, &p->list);
+                s->tx_queue_bytes += p->dlen;
+                ret += p->dlen;
+
+                /* copies must go in behind it, not into an earlier pktbuf */
+                s->tx_append = NULL;
+            } else {
+                pktbuf_free(p, true);
+            }
+            p = next;
+        }
+
+        if (s->tx_queue_bytes >= s->tx_buffer_size) {
+            event_unsignal(&s->tx_event);
+        }
+
+        /* send as much data as we can */
+        tcp_write_pending_data(s);
+
+        mutex_release(&s->lock);
+    }
+
+    /* anything not queued is ours to free */
+    pktbuf_free_chain(p, true);
+
     dec_socket_ref(s);
-    return len;
+    return ret;
 }
 
 status_t tcp_close(tcp_socket_t *socket)
@@ -1182,14 +2220,14 @@ status_t tcp_close(tcp_socket_t *socket)
         case STATE_SYN_RCVD:
         case STATE_ESTABLISHED:
             s->state = STATE_FIN_WAIT_1;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
+            tcp_socket_send(s, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
             s->tx_win_low++;
 
             /* stick around and wait for them to FIN us */
             break;
         case STATE_CLOSE_WAIT:
             s->state = STATE_LAST_ACK;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
+            tcp_socket_send(s, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
             s->tx_win_low++;
 
             // XXX set up fin retransmit timer here
@@ -1221,6 +2259,110 @@ out:
 }
 
 /* debug stuff */
+static void dump_socket_table(struct tcp_hash_bucket *table, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&table[i].lock, state);
+        tcp_socket_t *s = NULL;
+        list_for_every_entry(&table[i].list, s, tcp_socket_t, node) {
+            dump_socket(s);
+        }
+        spin_unlock_irqrestore(&table[i].lock, state);
+    }
+}
+
+#define TCP_BENCH_BUFSIZE 16384
+
+/* Bulk throughput against a host. Under qemu with user networking, forward a
+ * port in with -netdev user,id=n0,hostfwd=tcp::5001-:5001 and then:
+ *   tcp bench 5001 rx        host: dd if=/dev/zero bs=1M count=256 | nc -N localhost 5001
+ *   tcp bench 5001 tx 256    host: nc localhost 5001 > /dev/null
+ * zc swaps tcp_read/tcp_write for tcp_read_pktbuf/tcp_write_pktbuf. The zero
+ * copy sender queues clones of one pktbuf, so nothing is copied on the way out.
+ */
+static void tcp_bench(uint16_t port, bool tx, uint32_t megabytes, bool zc)
+{
+    tcp_socket_t *listen_socket;
+    status_t err = tcp_open_listen(&listen_socket, port);
+    if (err < 0) {
+        printf("tcp_open_listen returns %d\n", err);
+        return;
+    }
+
+    printf("waiting for a connection on port %u\n", port);
+
+    tcp_socket_t *s;
+    err = tcp_accept(listen_socket, &s);
+    if (err < 0) {
+        printf("tcp_accept returns %d\n", err);
+        tcp_close(listen_socket);
+        return;
+    }
+
+    uint8_t *buf = NULL;
+    pktbuf_t *src = NULL;
+    if (tx && zc) {
+        src = pktbuf_alloc();
+        if (src)
+            memset(pktbuf_append(src, PKTBUF_MAX_DATA), 0x5a, PKTBUF_MAX_DATA);
+    } else {
+        buf = malloc(TCP_BENCH_BUFSIZE);
+        if (buf)
+            memset(buf, 0x5a, TCP_BENCH_BUFSIZE);
+    }
+    if (!src && !buf) {
+        printf("out of memory\n");
+        goto done;
+    }
+
+    uint64_t goal = (uint64_t)megabytes * 1024 * 1024;
+    uint64_t total = 0;
+    lk_bigtime_t start = current_time_hires();
+    for (;;) {
+        ssize_t ret;
+        if (tx) {
+            if (total >= goal)
+                break;
+
+            if (zc) {
+                pktbuf_t *p = pktbuf_clone(src, 0, MIN(src->dlen, goal - total));
+                if (!p) {
+                    thread_yield();
+                    continue;
+                }
+                ret = tcp_write_pktbuf(s, p);
+            } else {
+                ret = tcp_write(s, buf, MIN(TCP_BENCH_BUFSIZE, goal - total));
+            }
+        } else {
+            if (zc) {
+                pktbuf_t *p;
+                ret = tcp_read_pktbuf(s, &p);
+                if (ret >= 0)
+                    pktbuf_free(p, true);
+            } else {
+                ret = tcp_read(s, buf, TCP_BENCH_BUFSIZE);
+            }
+        }
+        if (ret < 0)
+            break;
+        total += ret;
+    }
+    lk_bigtime_t usecs = current_time_hires() - start;
+
+    printf("%s %llu bytes in %llu usecs (%llu KB/sec)\n", tx ? "wrote" : "read",
+           total, usecs, usecs ? total * 1000000 / usecs / 1024 : 0);
+
+done:
+    tcp_close(s);
+    tcp_close(listen_socket);
+
+    free(buf);
+    if (src)
+        pktbuf_free(src, true);
+}
+
 static int cmd_tcp(int argc, const cmd_args *argv)
 {
     status_t err;
@@ -1232,18 +2374,16 @@ usage:
         printf("usage: %s sockets\n", argv[0].str);
         printf("usage: %s listenclose <port>\n", argv[0].str);
         printf("usage: %s listen <port>\n", argv[0].str);
+        printf("usage: %s bench <port> rx [zc]\n", argv[0].str);
+        printf("usage: %s bench <port> tx <megabytes> [zc]\n", argv[0].str);
         printf("usage: %s debug\n", argv[0].str);
         return ERR_INVALID_ARGS;
     }
 
     if (!strcmp(argv[1].str, "sockets")) {
 
-        mutex_acquire(&tcp_socket_list_lock);
-        tcp_socket_t *s = NULL;
-        list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-            dump_socket(s);
-        }
-        mutex_release(&tcp_socket_list_lock);
+        dump_socket_table(tcp_listen_hash, countof(tcp_listen_hash));
+        dump_socket_table(tcp_conn_hash, countof(tcp_conn_hash));
     } else if (!strcmp(argv[1].str, "listenclose")) {
         /* listen for a connection, accept it, then immediately close it */
         if (argc < 3) goto notenoughargs;
@@ -1296,6 +2436,17 @@ usage:
 
         err = tcp_close(handle);
         printf("tcp_close returns %d\n", err);
+    } else if (!strcmp(argv[1].str, "bench")) {
+        if (argc < 4) goto notenoughargs;
+
+        bool tx = !strcmp(argv[3].str, "tx");
+        if (!tx && strcmp(argv[3].str, "rx")) goto usage;
+        if (tx && argc < 5) goto notenoughargs;
+
+        int zc_arg = tx ? 5 : 4;
+        bool zc = argc > zc_arg && !strcmp(argv[zc_arg].str, "zc");
+
+        tcp_bench(argv[2].u, tx, tx ? argv[4].u : 0, zc);
     } else if (!strcmp(argv[1].str, "debug")) {
         tcp_debug = !tcp_debug;
         printf("tcp debug now %u\n", tcp_debug);
@@ -25,6 +25,7 @@
 
 #include "minip-internal.h"
 
+#include <compiler.h>
 #include <err.h>
 #include <errno.h>
 #include <iovec.h>
@@ -32,11 +33,10 @@
 #include <malloc.h>
 #include <stdint.h>
 #include <trace.h>
+#include <kernel/spinlock.h>
 
 #define LOCAL_TRACE 0
 
-static struct list_node udp_list = LIST_INITIAL_VALUE(udp_list);
-
 struct udp_listener {
     struct list_node list;
     uint16_t port;
@@ -44,6 +44,16 @@ struct udp_listener {
     void *arg;
 };
 
+/* listeners hashed on their port, each chain with its own spinlock */
+#define UDP_HASH_BITS 4
+
+struct udp_hash_bucket {
+    spin_lock_t lock;
+    struct list_node list;
+};
+
+static struct udp_hash_bucket udp_hash[1 << UDP_HASH_BITS];
+
 typedef struct udp_socket {
     uint32_t host;
     uint16_t sport;
@@ -59,31 +69,63 @@ typedef struct udp_hdr {
 } __PACKED udp_hdr_t;
 
 
+static struct udp_hash_bucket *udp_bucket(uint16_t port)
+{
+    return &udp_hash[((uint32_t)port * 0x9e3779b1) >> (32 - UDP_HASH_BITS)];
+}
+
+void udp_init(void)
+{
+    for (uint i = 0; i < countof(udp_hash); i++) {
+        spin_lock_init(&udp_hash[i].lock);
+        list_initialize(&udp_hash[i].list);
+    }
+}
+
 int udp_listen(uint16_t port, udp_callback_t cb, void *arg)
 {
-    struct udp_listener *entry, *temp;
+    struct udp_listener *entry, *new_entry = NULL;
+    struct udp_hash_bucket *b = udp_bucket(port);
+    spin_lock_saved_state_t state;
+    int ret = 0;
+
+    if (cb) {
+        if ((new_entry = malloc(sizeof(struct udp_listener))) == NULL) {
+            return -1;
+        }
+
+        new_entry->port = port;
+        new_entry->callback = cb;
+        new_entry->arg = arg;
+    }
 
-    list_for_every_entry_safe(&udp_list, entry, temp, struct udp_listener, list) {
+    spin_lock_irqsave(&b->lock, state);
+    list_for_every_entry(&b->list, entry, struct udp_listener, list) {
         if (entry->port == port) {
             if (cb == NULL) {
+                /* removing it, free it below */
                 list_delete(&entry->list);
-                return 0;
+                new_entry = entry;
+            } else {
+                ret = -1;
             }
-            return -1;
+            goto done;
         }
     }
 
-    if ((entry = malloc(sizeof(struct udp_listener))) == NULL) {
-        return -1;
+    if (cb) {
+        list_add_tail(&b->list, &new_entry->list);
+        new_entry = NULL;
+    } else {
+        /* nothing to remove */
+        ret = -1;
     }
 
-    entry->port = port;
-    entry->callback = cb;
-    entry->arg = arg;
-
-    list_add_tail(&udp_list, &entry->list);
+done:
+    spin_unlock_irqrestore(&b->lock, state);
 
-    return 0;
+    free(new_entry);
+    return ret;
 }
 
 status_t udp_open(uint32_t host, uint16_t sport, uint16_t dport, udp_socket_t **handle)
@@ -200,10 +242,22 @@ void udp_input(pktbuf_t *p, uint32_t src_ip)
 
     port = ntohs(udp->dst_port);
 
-    list_for_every_entry(&udp_list, e, struct udp_listener, list) {
+    struct udp_hash_bucket *b = udp_bucket(port);
+    udp_callback_t callback = NULL;
+    void *arg = NULL;
+    spin_lock_saved_state_t state;
+
+    spin_lock_irqsave(&b->lock, state);
+    list_for_every_entry(&b->list, e, struct udp_listener, list) {
         if (e->port == port) {
-            e->callback(p->data, p->dlen, src_ip, ntohs(udp->src_port), e->arg);
-            return;
+            callback = e->callback;
+            arg = e->arg;
+            break;
         }
     }
+    spin_unlock_irqrestore(&b->lock, state);
+
+    /* call out without the lock, the callback may well send */
+    if (callback)
+        callback(p->data, p->dlen, src_ip, ntohs(udp->src_port), arg);
 }
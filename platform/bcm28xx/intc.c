@@ -244,7 +244,7 @@ decoded:
         *REG32(INTC_LOCAL_MAILBOX0_CLR0 + 0x10 * cpu) = pend;
 
         if (pend & (1 << MP_IPI_GENERIC)) {
-            PANIC_UNIMPLEMENTED;
+            ret = mp_mbx_generic_irq();
         }
         if (pend & (1 << MP_IPI_RESCHEDULE)) {
             ret = mp_mbx_reschedule_irq();
@@ -172,6 +172,8 @@ void platform_init(void)
         __UNUSED uint32_t ip_mask = IPV4(255, 255, 255, 0);
         __UNUSED uint32_t ip_gateway = IPV4_NONE;
 
+        minip_set_tx_features(virtio_net_minip_tx_features());
+
         //minip_init(virtio_net_send_minip_pkt, NULL, ip_addr, ip_mask, ip_gateway);
         minip_init_dhcp(virtio_net_send_minip_pkt, NULL);
 